@@ -0,0 +1,236 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "scheduler.h"
+#include "shards.h"
+
+#define BENCH_REQUESTS_PER_CORO 20
+#define BENCH_WORK_NS 20000ULL
+#define BENCH_TARGET_NS 5000000ULL
+#define BENCH_INTERVAL_NS 20000000ULL
+
+struct bench_payload {
+   unsigned long long max_latency_ns;
+   unsigned long long requests_done;
+   int gave_up;
+};
+
+static int failed_checks = 0;
+
+static void check(bool condition, const char *what)
+{
+   if (!condition)
+   {
+      printf("O >> CHECK FAILED: %s\n", what);
+      failed_checks++;
+   }
+}
+
+static void sleeping_coroutine(void* coro_payload, struct ServerData *server_data)
+{
+   int *refused = (int *)coro_payload;
+   double seconds = 0.002;
+   if (!server_request_inplace(server_data, CoroRequestSleep, &seconds, NULL))
+   {
+      if (RequestStatusOverloaded == server_request_status(server_data))
+      {
+         (*refused)++;
+      }
+   }
+}
+
+// Registrations beyond the limit fail fast and are counted; they work again once coroutines finish
+static void check_max_live_coroutines(bool pipelined)
+{
+   struct ServerData *server_data = server_create();
+   if (pipelined)
+   {
+      server_pipeline_start(server_data);
+   }
+   int refused = 0;
+   server_set_max_live_coroutines(server_data, 10);
+   int registered = 0;
+   for (int i = 0; i < 25; i++)
+   {
+      registered += (0 <= server_register_coro(server_data, sleeping_coroutine, &refused)) ? 1 : 0;
+   }
+   check(10 == registered, "registrations stop at the live coroutine limit");
+   check(15 == server_data->coroutines_rejected_num, "refused registrations are counted");
+   check(server_overloaded(server_data), "a server at its live coroutine limit is overloaded");
+   while (server_loop_iteration(server_data));
+   check(0 <= server_register_coro(server_data, sleeping_coroutine, &refused), "registrations work again below the limit");
+   while (server_loop_iteration(server_data));
+   check(0 == refused, "requests are not refused by the live coroutine limit");
+   server_free(server_data);
+}
+
+// Requests of a type above its pending limit complete right away with RequestStatusOverloaded
+static void check_max_pending_requests(bool pipelined)
+{
+   struct ServerData *server_data = server_create();
+   if (pipelined)
+   {
+      server_pipeline_start(server_data);
+   }
+   int refused = 0;
+   server_set_max_pending_requests(server_data, CoroRequestSleep, 3);
+   for (int i = 0; i < 10; i++)
+   {
+      server_register_coro(server_data, sleeping_coroutine, &refused);
+   }
+   while (server_loop_iteration(server_data));
+   check(7 == refused, "sleeps above the pending limit are refused as overloaded");
+   check(7 == server_data->requests_shed_num, "refused requests are counted as shed");
+   refused = 0;
+   server_data->requests_shed_num = 0;
+   for (int i = 0; i < 3; i++)
+   {
+      server_register_coro(server_data, sleeping_coroutine, &refused);
+   }
+   while (server_loop_iteration(server_data));
+   check(0 == refused && 0 == server_data->requests_shed_num, "completed requests free their pending slots");
+   server_free(server_data);
+}
+
+struct shard_payload {
+   atomic_int completed;
+   atomic_int refused;
+   atomic_int finished;
+};
+
+static void cross_shard_coroutine(void* coro_payload, struct ServerData *server_data)
+{
+   struct shard_payload *payload = (struct shard_payload *)coro_payload;
+   double seconds = 0.05;
+   if (shard_request(server_data, 1, CoroRequestSleep, &seconds, NULL))
+   {
+      atomic_fetch_add(&payload->completed, 1);
+   }
+   else if (RequestStatusOverloaded == server_request_status(server_data))
+   {
+      atomic_fetch_add(&payload->refused, 1);
+   }
+   atomic_fetch_add(&payload->finished, 1);
+}
+
+// A request refused by the target shard fails on the calling shard as well
+static void check_cross_shard_refusal(void)
+{
+   struct ShardRuntime *runtime = shards_create(2, false);
+   if (!runtime)
+   {
+      return;
+   }
+   server_set_max_pending_requests(shards_server(runtime, 1), CoroRequestSleep, 3);
+   struct shard_payload payload;
+   atomic_init(&payload.completed, 0);
+   atomic_init(&payload.refused, 0);
+   atomic_init(&payload.finished, 0);
+   shards_start(runtime);
+   for (int i = 0; i < 20; i++)
+   {
+      shards_spawn(runtime, 0, cross_shard_coroutine, &payload);
+   }
+   struct timespec pause = {0, 100000};
+   while (atomic_load(&payload.finished) < 20)
+   {
+      nanosleep(&pause, NULL);
+   }
+   shards_stop(runtime);
+   shards_free(runtime);
+   check(3 == atomic_load(&payload.completed) && 17 == atomic_load(&payload.refused),
+         "cross-shard requests refused by the target shard fail as overloaded");
+}
+
+static void busy_work(unsigned long long work_ns)
+{
+   unsigned long long start_ns = server_monotonic_ns();
+   while (server_monotonic_ns() - start_ns < work_ns);
+}
+
+// Works for a while on every resume; gives up once a request is shed
+static void bench_coroutine(void* coro_payload, struct ServerData *server_data)
+{
+   struct bench_payload *payload = (struct bench_payload *)coro_payload;
+   for (int i = 0; i < BENCH_REQUESTS_PER_CORO; i++)
+   {
+      busy_work(BENCH_WORK_NS);
+      int request = i;
+      int response = 0;
+      unsigned long long start_ns = server_monotonic_ns();
+      bool completed = server_request_inplace(server_data, CoroRequestRevertSign, &request, &response);
+      unsigned long long latency_ns = server_monotonic_ns() - start_ns;
+      if (latency_ns > payload->max_latency_ns)
+      {
+         payload->max_latency_ns = latency_ns;
+      }
+      if (!completed)
+      {
+         payload->gave_up++;
+         return;
+      }
+      payload->requests_done++;
+   }
+}
+
+static void run_benchmark(int coro_num, bool shedding, bool pipelined)
+{
+   struct ServerData *server_data = server_create();
+   if (pipelined)
+   {
+      server_pipeline_start(server_data);
+   }
+   if (shedding)
+   {
+      server_set_sojourn_shedding(server_data, BENCH_TARGET_NS, BENCH_INTERVAL_NS);
+   }
+   struct bench_payload payload = {0, 0, 0};
+   for (int i = 0; i < coro_num; i++)
+   {
+      server_register_coro(server_data, bench_coroutine, &payload);
+   }
+   unsigned long long start_ns = server_monotonic_ns();
+   while (server_loop_iteration(server_data));
+   unsigned long long elapsed_ns = server_monotonic_ns() - start_ns;
+   printf("O >> %s %s: COROUTINES: %d; REQUESTS DONE: %llu; SHED: %llu; GAVE UP: %d; WORST LATENCY: %.1f ms; TIME: %.1f ms\n",
+          pipelined ? "PIPELINED" : "SEQUENTIAL", shedding ? "SHEDDING" : "NO SHEDDING", coro_num, payload.requests_done,
+          server_data->requests_shed_num, payload.gave_up, payload.max_latency_ns / 1e6, elapsed_ns / 1e6);
+   check(payload.gave_up == (int)server_data->requests_shed_num, "every shed request fails in its coroutine");
+   // An iteration which resumes every coroutine once takes longer than the target
+   if (shedding && coro_num * BENCH_WORK_NS > 2 * BENCH_TARGET_NS)
+   {
+      check(0 < server_data->requests_shed_num, "an overloaded loop sheds requests by their sojourn time");
+   }
+   else if (!shedding)
+   {
+      check(0 == server_data->requests_shed_num, "nothing is shed without the sojourn shedding");
+   }
+   server_free(server_data);
+}
+
+int main(int argc, char **argv)
+{
+   int coro_num = (1 < argc) ? atoi(argv[1]) : 1000;
+   printf("O >> START\n");
+   for (int pipelined = 0; pipelined < 2; pipelined++)
+   {
+      check_max_live_coroutines(pipelined);
+      check_max_pending_requests(pipelined);
+   }
+   check_cross_shard_refusal();
+   for (int pipelined = 0; pipelined < 2; pipelined++)
+   {
+      run_benchmark(coro_num, false, pipelined);
+      run_benchmark(coro_num, true, pipelined);
+   }
+   printf("O >> END; FAILED CHECKS: %d\n", failed_checks);
+   return failed_checks ? 1 : 0;
+}
@@ -0,0 +1,60 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#ifndef C_ALIGNED_MEMORY_H
+#define C_ALIGNED_MEMORY_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined COROUTINE_HAVE_WIN32API
+   #include <malloc.h>
+#endif
+
+// Zeroed memory for objects with _Alignas members: malloc() and calloc() only align to max_align_t.
+// The alignment is a power of two; free the memory with aligned_free().
+static inline void *aligned_calloc(size_t alignment, size_t num, size_t size)
+{
+   if (size && (num > ((size_t)-1 - alignment) / size))
+   {
+      return NULL;
+   }
+   // aligned_alloc() wants a multiple of the alignment
+   size_t bytes = (num * size + alignment - 1) & ~(alignment - 1);
+   if (!bytes)
+   {
+      bytes = alignment;
+   }
+   void *memory = NULL;
+#if defined COROUTINE_HAVE_WIN32API
+   memory = _aligned_malloc(bytes, alignment);
+#elif defined COROUTINE_HAVE_ALIGNED_ALLOC
+   memory = aligned_alloc(alignment, bytes);
+#elif defined COROUTINE_HAVE_POSIX_MEMALIGN
+   if (posix_memalign(&memory, alignment, bytes))
+   {
+      memory = NULL;
+   }
+#else
+   #pragma GCC warning "memory can not be aligned beyond max_align_t"
+   memory = malloc(bytes);
+#endif
+   if (memory)
+   {
+      memset(memory, 0, bytes);
+   }
+   return memory;
+}
+
+static inline void aligned_free(void *memory)
+{
+#if defined COROUTINE_HAVE_WIN32API
+   _aligned_free(memory);
+#else
+   free(memory);
+#endif
+}
+
+#endif
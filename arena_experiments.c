@@ -0,0 +1,300 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "scheduler.h"
+#include "coro_arena.h"
+#include "server_metrics.h"
+
+#define BENCH_BLOCKS_PER_CORO 8
+#define BENCH_WAVES 20
+#define BENCH_REQUESTS_PER_CORO 50
+
+struct bench_payload {
+   bool use_arena;
+   size_t block_size;
+};
+
+static volatile unsigned long long sink = 0;
+
+static int failed_checks = 0;
+
+static void check(bool condition, const char *what)
+{
+   if (!condition)
+   {
+      printf("A >> CHECK FAILED: %s\n", what);
+      failed_checks++;
+   }
+}
+
+static int arena_chunks_num(struct Arena *arena)
+{
+   int chunks_num = 0;
+   for (struct ArenaChunk *chunk = arena->chunks; chunk; chunk = chunk->next)
+   {
+      chunks_num++;
+   }
+   return chunks_num;
+}
+
+// An oversized block gets a chunk of its own behind the current one, which stays in use
+static void check_oversized_splice(void)
+{
+   struct ArenaPool pool;
+   arena_pool_init(&pool, ARENA_POOL_DEFAULT_MAX_FREE);
+   struct Arena arena;
+   arena_init(&arena);
+   unsigned char *first = (unsigned char *)arena_alloc(&pool, &arena, 64);
+   struct ArenaChunk *current = arena.chunks;
+   unsigned char *oversized = (unsigned char *)arena_alloc(&pool, &arena, 2 * ARENA_CHUNK_SIZE);
+   unsigned char *second = (unsigned char *)arena_alloc(&pool, &arena, 64);
+   check(oversized && 0 == ((size_t)oversized % ARENA_ALIGNMENT), "an oversized block is aligned");
+   check(arena.chunks == current, "an oversized block does not replace the current chunk");
+   check(second == first + 64, "the current chunk keeps serving small blocks after an oversized one");
+   check(2 == arena_chunks_num(&arena) && !current->next->pooled, "the oversized chunk is linked behind the current one");
+   check(2 == pool.chunks_allocated, "one standard and one oversized chunk were allocated");
+   arena_release(&pool, &arena);
+   check(1 == pool.free_chunks_num, "the oversized chunk is freed, not pooled");
+
+   // Into an empty arena the oversized chunk goes first; the next small block takes a standard chunk
+   arena_alloc(&pool, &arena, 3 * ARENA_CHUNK_SIZE);
+   check(1 == arena_chunks_num(&arena) && !arena.chunks->pooled, "an oversized block starts an empty arena");
+   arena_alloc(&pool, &arena, 64);
+   check(2 == arena_chunks_num(&arena) && arena.chunks->pooled, "a small block after it takes a standard chunk");
+   check(1 == pool.chunks_reused && 0 == pool.free_chunks_num, "the standard chunk comes from the pool");
+   arena_release(&pool, &arena);
+   arena_pool_clear(&pool);
+}
+
+// arena_reset() keeps exactly one standard chunk and gives the others back
+static void check_reset(void)
+{
+   struct ArenaPool pool;
+   arena_pool_init(&pool, ARENA_POOL_DEFAULT_MAX_FREE);
+   struct Arena arena;
+   arena_init(&arena);
+   for (int i = 0; i < 3; i++)
+   {
+      arena_alloc(&pool, &arena, ARENA_CHUNK_SIZE / 2);
+   }
+   arena_alloc(&pool, &arena, 2 * ARENA_CHUNK_SIZE);
+   check(4 == arena_chunks_num(&arena), "three standard chunks and an oversized one");
+   arena_reset(&pool, &arena);
+   check(1 == arena_chunks_num(&arena), "arena_reset() keeps one chunk");
+   check(arena.chunks && arena.chunks->pooled && 0 == arena.chunks->used, "the kept chunk is a standard empty one");
+   check(2 == pool.free_chunks_num, "the other standard chunks go to the pool");
+   check(0 == arena.allocated, "arena_reset() clears the allocated bytes");
+   unsigned long long chunks_allocated = pool.chunks_allocated;
+   unsigned long long chunks_reused = pool.chunks_reused;
+   for (int i = 0; i < 100; i++)
+   {
+      arena_alloc(&pool, &arena, 256);
+      arena_reset(&pool, &arena);
+   }
+   check(chunks_allocated == pool.chunks_allocated && chunks_reused == pool.chunks_reused,
+         "an arena which is reset over and over again does not touch the pool");
+   arena_release(&pool, &arena);
+   check(3 == pool.free_chunks_num, "arena_release() pools the kept chunk as well");
+
+   // An arena of oversized chunks only keeps nothing
+   arena_alloc(&pool, &arena, 2 * ARENA_CHUNK_SIZE);
+   arena_reset(&pool, &arena);
+   check(!arena.chunks, "arena_reset() keeps no oversized chunk");
+   arena_pool_clear(&pool);
+}
+
+// The pool keeps as many chunks as were in use at once, even beyond its max_free_chunks
+static void check_peak_pool(void)
+{
+   struct ArenaPool pool;
+   arena_pool_init(&pool, 2);
+   struct Arena arenas[8];
+   int arenas_num = (int)(sizeof(arenas) / sizeof(arenas[0]));
+   for (int round = 0; round < 3; round++)
+   {
+      for (int i = 0; i < arenas_num; i++)
+      {
+         arena_init(&(arenas[i]));
+         arena_alloc(&pool, &(arenas[i]), 64);
+      }
+      check(arenas_num == pool.chunks_used, "every live arena holds one standard chunk");
+      for (int i = 0; i < arenas_num; i++)
+      {
+         arena_release(&pool, &(arenas[i]));
+      }
+   }
+   check(arenas_num == pool.peak_chunks_used && arenas_num == pool.free_chunks_num, "the pool keeps the peak of chunks in use");
+   check(arenas_num == (int)pool.chunks_allocated, "later rounds of the same size do not call malloc()");
+   // Oversized chunks do not count
+   struct Arena arena;
+   arena_init(&arena);
+   arena_alloc(&pool, &arena, 2 * ARENA_CHUNK_SIZE);
+   check(0 == pool.chunks_used, "oversized chunks are not counted as pooled ones");
+   arena_release(&pool, &arena);
+   arena_pool_clear(&pool);
+}
+
+struct sleeper_payload {
+   int index;
+   int late; // resumed before its sleep was over
+   int wrong; // wrong responses of the requests made while the sleepers are held
+};
+
+// A held request outlives the scratch arena it was created in: the sleep service keeps a heap copy
+static void sleeper_coroutine(void* coro_payload, struct ServerData *server_data)
+{
+   struct sleeper_payload *payload = (struct sleeper_payload *)coro_payload;
+   double *seconds = (double *)malloc(sizeof(double));
+   *seconds = 0.001 * (1 + payload->index++ % 5);
+   unsigned long long min_ns = (unsigned long long)(*seconds * 1e9);
+   unsigned long long start_ns = server_monotonic_ns();
+   server_request(server_data, CoroRequestSleep, seconds);
+   if (server_monotonic_ns() - start_ns < min_ns)
+   {
+      payload->late++;
+   }
+}
+
+// Fills the scratch arena with records of requests completed in the same iteration
+static void churn_coroutine(void* coro_payload, struct ServerData *server_data)
+{
+   struct sleeper_payload *payload = (struct sleeper_payload *)coro_payload;
+   for (int i = 0; i < BENCH_REQUESTS_PER_CORO; i++)
+   {
+      int *request = (int *)malloc(sizeof(int));
+      *request = i + 1;
+      int *response = (int *)server_request(server_data, CoroRequestRevertSign, request);
+      if (!response || -(i + 1) != *response)
+      {
+         payload->wrong++;
+      }
+   }
+}
+
+static void check_scratch(bool pipelined)
+{
+   struct ServerData *server_data = server_create();
+   if (pipelined)
+   {
+      server_pipeline_start(server_data);
+   }
+   struct sleeper_payload payload = {0, 0, 0};
+   int sleepers_num = 200;
+   int churners_num = 100;
+   for (int i = 0; i < sleepers_num; i++)
+   {
+      server_register_coro(server_data, sleeper_coroutine, &payload);
+   }
+   for (int i = 0; i < churners_num; i++)
+   {
+      server_register_coro(server_data, churn_coroutine, &payload);
+   }
+   while (server_loop_iteration(server_data));
+   check(0 == payload.late, "held requests copied out of the scratch arena keep their deadlines");
+   check(0 == payload.wrong, "requests completed within their iteration get their responses");
+   // One request per coroutine and iteration, whatever the number of iterations
+   size_t per_iteration = (size_t)(sleepers_num + churners_num) * sizeof(struct RequestData);
+   check(server_data->scratch_high_water <= per_iteration + ARENA_CHUNK_SIZE,
+         "the scratch arena is reset every iteration");
+   for (int i = 0; i < 2; i++)
+   {
+      check(arena_chunks_num(&(server_data->scratch[i])) <= 1, "a reset scratch arena keeps at most one chunk");
+   }
+   server_free(server_data);
+}
+
+static void run_requests_benchmark(int coro_num)
+{
+   struct ServerData *server_data = server_create();
+   struct sleeper_payload payload = {0, 0, 0};
+   unsigned long long start_ns = server_monotonic_ns();
+   for (int i = 0; i < coro_num; i++)
+   {
+      server_register_coro(server_data, churn_coroutine, &payload);
+   }
+   while (server_loop_iteration(server_data));
+   unsigned long long elapsed_ns = server_monotonic_ns() - start_ns;
+   struct ServerMetrics metrics;
+   server_metrics_snapshot(server_data, &metrics);
+   unsigned long long requests_num = (unsigned long long)coro_num * BENCH_REQUESTS_PER_CORO;
+   printf("A >> REQUESTS: %d x %d; TIME: %.3f ms; PER REQUEST: %.0f ns; LOOP ALLOCATIONS: %llu\n",
+          coro_num, BENCH_REQUESTS_PER_CORO, elapsed_ns / 1e6, (double)elapsed_ns / requests_num, metrics.allocations);
+   server_free(server_data);
+}
+
+static void bench_coroutine(void* coro_payload, struct ServerData *server_data)
+{
+   struct bench_payload *payload = (struct bench_payload *)coro_payload;
+   unsigned char *blocks[BENCH_BLOCKS_PER_CORO];
+   for (int i = 0; i < BENCH_BLOCKS_PER_CORO; i++)
+   {
+      blocks[i] = payload->use_arena ? (unsigned char *)server_coro_alloc(server_data, payload->block_size)
+                                     : (unsigned char *)malloc(payload->block_size);
+      blocks[i][0] = (unsigned char)i;
+   }
+   // All of the coroutines are alive at once
+   server_request_inplace(server_data, CoroRequestYield, NULL, NULL);
+   for (int i = 0; i < BENCH_BLOCKS_PER_CORO; i++)
+   {
+      sink += blocks[i][0];
+      if (!payload->use_arena)
+      {
+         free(blocks[i]);
+      }
+   }
+}
+
+// Waves of coroutines which are all alive at once; later waves find the chunks of the earlier ones in the pool
+static void run_benchmark(int waves_num, int coro_num, size_t block_size, bool use_arena)
+{
+   struct ServerData *server_data = server_create();
+   struct bench_payload payload;
+   payload.use_arena = use_arena;
+   payload.block_size = block_size;
+   unsigned long long start_ns = server_monotonic_ns();
+   for (int wave = 0; wave < waves_num; wave++)
+   {
+      for (int i = 0; i < coro_num; i++)
+      {
+         server_register_coro(server_data, bench_coroutine, &payload);
+      }
+      while (server_loop_iteration(server_data));
+   }
+   unsigned long long elapsed_ns = server_monotonic_ns() - start_ns;
+   printf("A >> %s: COROUTINES: %d x %d; BLOCKS: %d x %zu bytes; TIME: %.3f ms; PER COROUTINE: %.0f ns; CHUNKS ALLOCATED: %llu; REUSED: %llu\n",
+          use_arena ? "ARENA" : "MALLOC", waves_num, coro_num, BENCH_BLOCKS_PER_CORO, block_size, elapsed_ns / 1e6,
+          (double)elapsed_ns / ((double)waves_num * coro_num), server_data->arena_pool.chunks_allocated,
+          server_data->arena_pool.chunks_reused);
+   server_free(server_data);
+}
+
+int main(int argc, char **argv)
+{
+   int max_alive = (1 < argc) ? atoi(argv[1]) : 5000;
+   size_t block_sizes[] = {64, 256};
+   printf("A >> START\n");
+   check_oversized_splice();
+   check_reset();
+   check_peak_pool();
+   check_scratch(false);
+   check_scratch(true);
+   run_requests_benchmark(1000);
+   run_requests_benchmark(300);
+   int alive_nums[] = {ARENA_POOL_DEFAULT_MAX_FREE, max_alive};
+   for (size_t a = 0; a < sizeof(alive_nums) / sizeof(alive_nums[0]); a++)
+   {
+      for (size_t b = 0; b < sizeof(block_sizes) / sizeof(block_sizes[0]); b++)
+      {
+         run_benchmark(BENCH_WAVES, alive_nums[a], block_sizes[b], true);
+         run_benchmark(BENCH_WAVES, alive_nums[a], block_sizes[b], false);
+      }
+   }
+   printf("A >> END; FAILED CHECKS: %d\n", failed_checks);
+   return failed_checks ? 1 : 0;
+}
@@ -0,0 +1,199 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "body_stats.h"
+#include "cycle_clock.h"
+
+#define BODY_STATS_INITIAL_CAPACITY 64
+
+struct BodyStatsTable *body_stats_create(void)
+{
+   struct BodyStatsTable *table = (struct BodyStatsTable *)malloc(sizeof(*table));
+   if (!table)
+   {
+      return NULL;
+   }
+   table->capacity = BODY_STATS_INITIAL_CAPACITY;
+   table->num = 0;
+   table->slots = (struct CoroBodyStats *)calloc(table->capacity, sizeof(struct CoroBodyStats));
+   if (!table->slots)
+   {
+      free(table);
+      return NULL;
+   }
+   return table;
+}
+
+void body_stats_free(struct BodyStatsTable *table)
+{
+   if (!table)
+   {
+      return;
+   }
+   free(table->slots);
+   free(table);
+}
+
+static size_t body_stats_hash(coroutine_callable coroutine_body)
+{
+   uint64_t key = (uint64_t)(uintptr_t)coroutine_body;
+   key ^= key >> 33;
+   key *= 0xff51afd7ed558ccdULL;
+   key ^= key >> 33;
+   return (size_t)key;
+}
+
+static struct CoroBodyStats *body_stats_slot(struct CoroBodyStats *slots, size_t capacity, coroutine_callable coroutine_body)
+{
+   size_t mask = capacity - 1;
+   size_t i = body_stats_hash(coroutine_body) & mask;
+   while (slots[i].coroutine_body && (slots[i].coroutine_body != coroutine_body))
+   {
+      i = (i + 1) & mask;
+   }
+   return &(slots[i]);
+}
+
+static bool body_stats_grow(struct BodyStatsTable *table)
+{
+   size_t new_capacity = table->capacity * 2;
+   struct CoroBodyStats *new_slots = (struct CoroBodyStats *)calloc(new_capacity, sizeof(struct CoroBodyStats));
+   if (!new_slots)
+   {
+      return false;
+   }
+   for (size_t i = 0; i < table->capacity; i++)
+   {
+      if (table->slots[i].coroutine_body)
+      {
+         *body_stats_slot(new_slots, new_capacity, table->slots[i].coroutine_body) = table->slots[i];
+      }
+   }
+   free(table->slots);
+   table->slots = new_slots;
+   table->capacity = new_capacity;
+   return true;
+}
+
+// Returns the record of the entry function, adding a zeroed one if needed. NULL if out of memory.
+struct CoroBodyStats *body_stats_get(struct BodyStatsTable *table, coroutine_callable coroutine_body)
+{
+   if (!table || !coroutine_body)
+   {
+      return NULL;
+   }
+   struct CoroBodyStats *stats = body_stats_slot(table->slots, table->capacity, coroutine_body);
+   if (stats->coroutine_body)
+   {
+      return stats;
+   }
+   // Keep the load factor under 1/2
+   if ((table->num + 1) * 2 > table->capacity)
+   {
+      if (!body_stats_grow(table))
+      {
+         return NULL;
+      }
+      stats = body_stats_slot(table->slots, table->capacity, coroutine_body);
+   }
+   memset(stats, 0, sizeof(*stats));
+   stats->coroutine_body = coroutine_body;
+   table->num++;
+   return stats;
+}
+
+static unsigned long long body_stats_value(const struct CoroBodyStats *stats, enum CoroBodyStatsKey key)
+{
+   switch (key)
+   {
+   case CoroBodyStatsByRunTime:
+      return stats->run_ticks;
+   case CoroBodyStatsByResumes:
+      return stats->resumes;
+   case CoroBodyStatsByBytesCopied:
+      return stats->bytes_saved + stats->bytes_restored;
+   case CoroBodyStatsByPeakHolderSize:
+      return stats->peak_holder_size;
+   case CoroBodyStatsBySliceOverruns:
+      return stats->slice_overruns;
+   case CoroBodyStatsByMaxOverrun:
+      return stats->max_overrun_ns;
+   default:
+      return 0;
+   }
+}
+
+// Copies up to top_len records with the largest values of the key to top, the largest first.
+// Records with a zero value are skipped. Returns the number of copied records.
+int body_stats_top(struct BodyStatsTable *table, enum CoroBodyStatsKey key, struct CoroBodyStats *top, int top_len)
+{
+   if (!table || !top || (0 >= top_len))
+   {
+      return 0;
+   }
+   int top_num = 0;
+   for (size_t i = 0; i < table->capacity; i++)
+   {
+      const struct CoroBodyStats *stats = &(table->slots[i]);
+      unsigned long long value = body_stats_value(stats, key);
+      if (!stats->coroutine_body || !value)
+      {
+         continue;
+      }
+      if ((top_num == top_len) && (body_stats_value(&(top[top_num - 1]), key) >= value))
+      {
+         continue;
+      }
+      // Insertion into the sorted prefix; top_len is expected to be small
+      int j = (top_num < top_len) ? top_num++ : (top_len - 1);
+      while ((0 < j) && (body_stats_value(&(top[j - 1]), key) < value))
+      {
+         top[j] = top[j - 1];
+         j--;
+      }
+      top[j] = *stats;
+   }
+   for (int i = 0; i < top_num; i++)
+   {
+      top[i].run_ns = cycle_clock_ns_from_ticks(top[i].run_ticks);
+   }
+   return top_num;
+}
+
+// Adds the latest resume of a coroutine to the totals of its entry function
+void body_stats_add_resume(struct BodyStatsTable *table, coroutine_callable coroutine_body,
+                           const struct coroutine_stats *coro_stats)
+{
+   struct CoroBodyStats *stats = body_stats_get(table, coroutine_body);
+   if (!stats)
+   {
+      return;
+   }
+   if (1 == coro_stats->resumes)
+   {
+      stats->coroutines++;
+   }
+   stats->resumes++;
+   stats->run_ticks += coro_stats->last_run_ticks;
+   stats->bytes_saved += coro_stats->last_bytes_saved;
+   stats->bytes_restored += coro_stats->last_bytes_restored;
+   if (coro_stats->peak_holder_size > stats->peak_holder_size)
+   {
+      stats->peak_holder_size = coro_stats->peak_holder_size;
+   }
+}
+
+// Top-N report over the entry functions of the server's coroutines
+int server_body_stats_top(struct ServerData *server_data, enum CoroBodyStatsKey key, struct CoroBodyStats *top, int top_len)
+{
+   if (!server_data)
+   {
+      return 0;
+   }
+   return body_stats_top(server_data->body_stats, key, top, top_len);
+}
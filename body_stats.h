@@ -0,0 +1,62 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#ifndef C_BODY_STATS_H
+#define C_BODY_STATS_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "coroutine.h"
+#include "scheduler.h"
+
+// Statistics aggregated per coroutine entry function (CoroArgs.coroutine_body)
+struct CoroBodyStats
+{
+   coroutine_callable coroutine_body; // NULL in an empty slot
+   unsigned long long coroutines; // started ones
+   unsigned long long resumes;
+   unsigned long long run_ticks; // see cycle_clock.h
+   unsigned long long run_ns; // filled by body_stats_top()
+   unsigned long long bytes_saved;
+   unsigned long long bytes_restored;
+   unsigned long long peak_holder_size; // the largest saved stack of a single coroutine
+   unsigned long long slice_overruns; // runs longer than the time slice
+   unsigned long long max_overrun_ns; // the longest of such runs
+};
+
+enum CoroBodyStatsKey
+{
+   CoroBodyStatsByRunTime,
+   CoroBodyStatsByResumes,
+   CoroBodyStatsByBytesCopied,
+   CoroBodyStatsByPeakHolderSize,
+   CoroBodyStatsBySliceOverruns,
+   CoroBodyStatsByMaxOverrun,
+};
+
+// Open addressing hash table keyed by the entry function
+struct BodyStatsTable
+{
+   size_t capacity; // power of two
+   size_t num;
+   struct CoroBodyStats *slots;
+};
+
+#ifdef __cplusplus
+extern "C"{
+#endif 
+struct BodyStatsTable *body_stats_create(void);
+void body_stats_free(struct BodyStatsTable *table);
+struct CoroBodyStats *body_stats_get(struct BodyStatsTable *table, coroutine_callable coroutine_body);
+int body_stats_top(struct BodyStatsTable *table, enum CoroBodyStatsKey key, struct CoroBodyStats *top, int top_len);
+void body_stats_add_resume(struct BodyStatsTable *table, coroutine_callable coroutine_body,
+                           const struct coroutine_stats *coro_stats);
+
+int server_body_stats_top(struct ServerData *server_data, enum CoroBodyStatsKey key, struct CoroBodyStats *top, int top_len);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,262 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "scheduler.h"
+#include "coro_cache.h"
+#include "server_metrics.h"
+
+#define BUDGET_BYTES 4096
+#define BUDGET_VALUE_LEN 100
+#define GROWTH_KEYS_NUM (16 * CACHE_MIN_CAPACITY)
+#define TTL_NS 2000000ULL
+#define BENCH_KEYS_NUM 1000
+#define BENCH_ROUNDS 1000
+
+struct cache_payload {
+   bool pipelined;
+   size_t max_bytes;
+};
+
+static int failed_checks = 0;
+
+static void check(bool condition, const char *what)
+{
+   if (!condition)
+   {
+      printf("H >> CHECK FAILED: %s\n", what);
+      failed_checks++;
+   }
+}
+
+static int key_of(char *key, size_t key_size, const char *prefix, int index)
+{
+   return snprintf(key, key_size, "%s-%d", prefix, index);
+}
+
+static void run_cache(bool pipelined, size_t max_bytes, coroutine_callable body)
+{
+   struct ServerData *server_data = server_create();
+   if (pipelined)
+   {
+      server_pipeline_start(server_data);
+   }
+   check(server_cache_start(server_data, max_bytes), "the cache starts");
+   struct cache_payload payload = {pipelined, max_bytes};
+   server_register_coro(server_data, body, &payload);
+   while (server_loop_iteration(server_data));
+   server_free(server_data);
+}
+
+static void basics(void* coro_payload, struct ServerData *server_data)
+{
+   int value = 42;
+   int out = 0;
+   size_t stored_len = 0;
+   check(!server_cache_get(server_data, "answer", 6, &out, sizeof(out), &stored_len) && 0 == stored_len,
+         "a missing key is a miss");
+   check(server_cache_put(server_data, "answer", 6, &value, sizeof(value), 0), "a put stores the value");
+   check(server_cache_get(server_data, "answer", 6, &out, sizeof(out), &stored_len) && 42 == out && sizeof(value) == stored_len,
+         "a get copies the value out");
+   value = 43;
+   check(42 == out, "the cache keeps a copy of the value");
+
+   const char long_value[] = "a value longer than the buffer";
+   check(server_cache_put(server_data, "answer", 6, long_value, sizeof(long_value), 0), "a put overwrites the value");
+   char short_buffer[8] = {0};
+   check(server_cache_get(server_data, "answer", 6, short_buffer, sizeof(short_buffer), &stored_len) &&
+         sizeof(long_value) == stored_len && 0 == memcmp(short_buffer, long_value, sizeof(short_buffer)),
+         "a get into a short buffer copies its part and reports the whole length");
+   struct CacheStats stats;
+   server_cache_stats(server_data, &stats);
+   check(1 == stats.entries, "an overwrite does not add an entry");
+
+   check(server_cache_delete(server_data, "answer", 6), "a delete finds the key");
+   check(!server_cache_delete(server_data, "answer", 6), "a second delete does not");
+   check(!server_cache_get(server_data, "answer", 6, &out, sizeof(out), &stored_len), "a deleted key is a miss");
+   // Keys are byte strings: a prefix is another key
+   server_cache_put(server_data, "answer", 6, &value, sizeof(value), 0);
+   check(!server_cache_get(server_data, "answe", 5, &out, sizeof(out), &stored_len), "keys are compared as a whole");
+
+   char *huge = (char *)calloc(1, 2 * BUDGET_BYTES);
+   check(!server_cache_put(server_data, "huge", 4, huge, 2 * BUDGET_BYTES, 0), "a value over the budget is not stored");
+   free(huge);
+   server_cache_stats(server_data, &stats);
+   check(1 == stats.entries && stats.bytes <= stats.max_bytes, "a refused put leaves the cache as it was");
+   check(2 == stats.hits && 3 == stats.misses, "hits and misses are counted");
+
+   // A cache request which reaches the service in a group of server_request_many()
+   int group_value = 7;
+   int group_out = 0;
+   struct CacheRequest requests[2] = {{CacheOpPut, "group", 5, &group_value, sizeof(group_value), 0, 0, false},
+                                      {CacheOpGet, "group", 5, &group_out, sizeof(group_out), 0, 0, false}};
+   struct RequestData request_data[2];
+   for (int i = 0; i < 2; i++)
+   {
+      server_request_data_init(&(request_data[i]), CoroRequestCache, &(requests[i]), NULL, true);
+   }
+   server_request_many(server_data, request_data, 2, RequestWaitAll);
+   check(requests[0].found && requests[1].found && 7 == group_out, "cache requests work in a request group");
+}
+
+// The entries never exceed the byte budget; a key which is hit between the puts survives CLOCK
+static void budget(void* coro_payload, struct ServerData *server_data)
+{
+   struct cache_payload *payload = (struct cache_payload *)coro_payload;
+   char value[BUDGET_VALUE_LEN];
+   int hot = 1;
+   int out = 0;
+   size_t stored_len = 0;
+   server_cache_put(server_data, "hot", 3, &hot, sizeof(hot), 0);
+   bool within_budget = true;
+   bool hot_kept = true;
+   for (int i = 0; i < 1000; i++)
+   {
+      char key[32];
+      int key_len = key_of(key, sizeof(key), "cold", i);
+      memset(value, 'a' + i % 26, sizeof(value));
+      check(server_cache_put(server_data, key, (size_t)key_len, value, sizeof(value), 0), "a put within the budget succeeds");
+      hot_kept = hot_kept && server_cache_get(server_data, "hot", 3, &out, sizeof(out), &stored_len);
+      struct CacheStats stats;
+      server_cache_stats(server_data, &stats);
+      within_budget = within_budget && (stats.bytes <= payload->max_bytes);
+   }
+   check(within_budget, "the entries stay within the byte budget");
+   check(hot_kept, "a key which is hit again and again is not evicted");
+   char key[32];
+   int key_len = key_of(key, sizeof(key), "cold", 999);
+   check(server_cache_get(server_data, key, (size_t)key_len, value, sizeof(value), &stored_len) && 'a' + 999 % 26 == value[0],
+         "the last put is there");
+   key_len = key_of(key, sizeof(key), "cold", 0);
+   check(!server_cache_get(server_data, key, (size_t)key_len, value, sizeof(value), &stored_len), "the oldest cold key is evicted");
+   struct CacheStats stats;
+   server_cache_stats(server_data, &stats);
+   check(0 < stats.evictions && 0 == stats.expirations, "evictions are counted");
+   if (!payload->pipelined)
+   {
+      // The metrics are published by the loop at the end of the iteration
+      server_request_inplace(server_data, CoroRequestYield, NULL, NULL);
+      struct ServerMetrics metrics;
+      server_metrics_snapshot(server_data, &metrics);
+      check(stats.evictions == metrics.cache_evictions, "the metrics report the evictions");
+   }
+}
+
+// Expired entries are dropped when they are looked up; the loop clock moves once per iteration
+static void expiry(void* coro_payload, struct ServerData *server_data)
+{
+   int value = 5;
+   int out = 0;
+   size_t stored_len = 0;
+   server_cache_put(server_data, "short", 5, &value, sizeof(value), TTL_NS);
+   server_cache_put(server_data, "forever", 7, &value, sizeof(value), 0);
+   server_cache_put(server_data, "deleted", 7, &value, sizeof(value), TTL_NS);
+   check(server_cache_get(server_data, "short", 5, &out, sizeof(out), &stored_len), "an entry is there before its TTL");
+   double seconds = 4 * TTL_NS / 1e9;
+   server_request_inplace(server_data, CoroRequestSleep, &seconds, NULL);
+   check(!server_cache_get(server_data, "short", 5, &out, sizeof(out), &stored_len), "an entry is gone after its TTL");
+   check(!server_cache_delete(server_data, "deleted", 7), "deleting an expired entry reports a miss");
+   check(server_cache_get(server_data, "forever", 7, &out, sizeof(out), &stored_len), "an entry without a TTL stays");
+   struct CacheStats stats;
+   server_cache_stats(server_data, &stats);
+   check(1 == stats.expirations && 1 == stats.entries, "the expired entries are dropped and counted");
+   // A put renews the TTL of a key
+   server_cache_put(server_data, "short", 5, &value, sizeof(value), 1000 * TTL_NS);
+   server_request_inplace(server_data, CoroRequestSleep, &seconds, NULL);
+   check(server_cache_get(server_data, "short", 5, &out, sizeof(out), &stored_len), "an overwrite sets a new TTL");
+}
+
+// The table grows past its initial capacity and keeps every entry through the rehashes
+static void growth(void* coro_payload, struct ServerData *server_data)
+{
+   struct CacheStats stats;
+   server_cache_stats(server_data, &stats);
+   check(CACHE_MIN_CAPACITY == stats.capacity, "the table starts at CACHE_MIN_CAPACITY slots");
+   for (int i = 0; i < GROWTH_KEYS_NUM; i++)
+   {
+      char key[32];
+      int key_len = key_of(key, sizeof(key), "grow", i);
+      server_cache_put(server_data, key, (size_t)key_len, &i, sizeof(i), 0);
+   }
+   server_cache_stats(server_data, &stats);
+   check(GROWTH_KEYS_NUM == stats.entries && 0 == stats.evictions, "every entry fits into the budget");
+   check(GROWTH_KEYS_NUM < stats.capacity, "the table grows with its entries");
+   // Deleted slots are reused or cleaned up by the next rehash
+   for (int i = 0; i < GROWTH_KEYS_NUM; i += 2)
+   {
+      char key[32];
+      int key_len = key_of(key, sizeof(key), "grow", i);
+      server_cache_delete(server_data, key, (size_t)key_len);
+   }
+   for (int i = 0; i < GROWTH_KEYS_NUM; i++)
+   {
+      char key[32];
+      int key_len = key_of(key, sizeof(key), "again", i);
+      server_cache_put(server_data, key, (size_t)key_len, &i, sizeof(i), 0);
+   }
+   int wrong = 0;
+   for (int i = 0; i < GROWTH_KEYS_NUM; i++)
+   {
+      char key[32];
+      int key_len = key_of(key, sizeof(key), "grow", i);
+      int out = -1;
+      size_t stored_len = 0;
+      bool found = server_cache_get(server_data, key, (size_t)key_len, &out, sizeof(out), &stored_len);
+      wrong += (found != (i % 2 == 1) || (found && out != i)) ? 1 : 0;
+      key_len = key_of(key, sizeof(key), "again", i);
+      found = server_cache_get(server_data, key, (size_t)key_len, &out, sizeof(out), &stored_len);
+      wrong += (!found || out != i) ? 1 : 0;
+   }
+   check(0 == wrong, "every entry is found with its value after the rehashes");
+   server_cache_stats(server_data, &stats);
+   check(GROWTH_KEYS_NUM / 2 + GROWTH_KEYS_NUM == stats.entries, "deletes and puts are counted in the entries");
+}
+
+static void bench(void* coro_payload, struct ServerData *server_data)
+{
+   char keys[BENCH_KEYS_NUM][16];
+   int key_lens[BENCH_KEYS_NUM];
+   for (int i = 0; i < BENCH_KEYS_NUM; i++)
+   {
+      key_lens[i] = key_of(keys[i], sizeof(keys[i]), "hot", i);
+      server_cache_put(server_data, keys[i], (size_t)key_lens[i], &i, sizeof(i), 0);
+   }
+   unsigned long long hits = 0;
+   unsigned long long start_ns = server_monotonic_ns();
+   for (int round = 0; round < BENCH_ROUNDS; round++)
+   {
+      for (int i = 0; i < BENCH_KEYS_NUM; i++)
+      {
+         int out;
+         size_t stored_len;
+         hits += server_cache_get(server_data, keys[i], (size_t)key_lens[i], &out, sizeof(out), &stored_len) ? 1 : 0;
+      }
+   }
+   unsigned long long elapsed_ns = server_monotonic_ns() - start_ns;
+   unsigned long long gets_num = (unsigned long long)BENCH_ROUNDS * BENCH_KEYS_NUM;
+   check(gets_num == hits, "every get of the benchmark hits");
+   printf("H >> %s: GETS: %llu; TIME: %.3f ms; PER HIT: %.1f ns\n",
+          ((struct cache_payload *)coro_payload)->pipelined ? "PIPELINED" : "SEQUENTIAL",
+          gets_num, elapsed_ns / 1e6, (double)elapsed_ns / gets_num);
+}
+
+int main(int argc, char **argv)
+{
+   printf("H >> START\n");
+   for (int pipelined = 0; pipelined < 2; pipelined++)
+   {
+      run_cache(pipelined, BUDGET_BYTES, basics);
+      run_cache(pipelined, BUDGET_BYTES, budget);
+      run_cache(pipelined, BUDGET_BYTES, expiry);
+      run_cache(pipelined, 64 << 20, growth);
+      run_cache(pipelined, 64 << 20, bench);
+   }
+   printf("H >> END; FAILED CHECKS: %d\n", failed_checks);
+   return failed_checks ? 1 : 0;
+}
@@ -0,0 +1,338 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "scheduler.h"
+#include "coro_sync.h"
+#include "coro_join.h"
+
+#define LONG_SLEEP 10.0
+#define PROMPT_NS 1000000000ULL // a cancelled or timed out coroutine is resumed well before LONG_SLEEP
+
+struct cancel_payload {
+   coroutine_t coro; // of the victim
+   coro_join_handle_t handle;
+   struct CoroMutex mutex;
+   bool started;
+   bool resumed;
+   bool response_ok;
+   bool later_request_ok;
+   bool cancelled[2];
+   enum RequestStatus status;
+   unsigned long long elapsed_ns;
+   int cancels_accepted;
+};
+
+struct mass_payload {
+   coroutine_t *coros;
+   int coro_num;
+   int started_num;
+   int resumed_num;
+   unsigned long long cancel_ns;
+};
+
+static int failed_checks = 0;
+
+static void check(bool condition, const char *what)
+{
+   if (!condition)
+   {
+      printf("K >> CHECK FAILED: %s\n", what);
+      failed_checks++;
+   }
+}
+
+static void yield(struct ServerData *server_data)
+{
+   server_request_inplace(server_data, CoroRequestYield, NULL, NULL);
+}
+
+static struct ServerData *create_server(bool pipelined)
+{
+   struct ServerData *server_data = server_create();
+   if (pipelined)
+   {
+      server_pipeline_start(server_data);
+   }
+   return server_data;
+}
+
+static void run_server(struct ServerData *server_data)
+{
+   while (server_loop_iteration(server_data));
+}
+
+static void sleeper(void* coro_payload, struct ServerData *server_data)
+{
+   struct cancel_payload *payload = (struct cancel_payload *)coro_payload;
+   payload->coro = server_current_coro(server_data);
+   payload->started = true;
+   double seconds = LONG_SLEEP;
+   unsigned long long start_ns = server_monotonic_ns();
+   payload->response_ok = server_request_inplace(server_data, CoroRequestSleep, &seconds, NULL);
+   payload->elapsed_ns = server_monotonic_ns() - start_ns;
+   payload->status = server_request_status(server_data);
+   payload->resumed = true;
+   payload->later_request_ok = server_request_inplace(server_data, CoroRequestYield, NULL, NULL);
+}
+
+static void sleeper_canceller(void* coro_payload, struct ServerData *server_data)
+{
+   struct cancel_payload *payload = (struct cancel_payload *)coro_payload;
+   while (!payload->started)
+   {
+      yield(server_data);
+   }
+   // The sleep reaches its service first
+   yield(server_data);
+   yield(server_data);
+   payload->cancels_accepted += server_cancel_coro(server_data, payload->coro) ? 1 : 0;
+   payload->cancels_accepted += server_cancel_coro(server_data, payload->coro) ? 1 : 0;
+}
+
+// A held sleep is dropped at once, and every later request of the coroutine fails as cancelled
+static void check_cancel_sleeper(bool pipelined)
+{
+   struct ServerData *server_data = create_server(pipelined);
+   struct cancel_payload payload = {0};
+   server_register_coro(server_data, sleeper, &payload);
+   server_register_coro(server_data, sleeper_canceller, &payload);
+   run_server(server_data);
+   check(payload.resumed && PROMPT_NS > payload.elapsed_ns, "a cancelled sleeper is resumed right away");
+   check(!payload.response_ok && RequestStatusCancelled == payload.status, "the cancelled sleep fails as cancelled");
+   check(!payload.later_request_ok, "requests made after the cancellation fail");
+   check(1 == payload.cancels_accepted, "a coroutine is cancelled only once");
+   check(0 == server_data->sleep_timers_num && 0 == server_data->held_requests_num, "the sleep timer is gone");
+   check(1 == server_data->coroutines_cancelled_num, "the cancellation is counted");
+   server_free(server_data);
+}
+
+static void group_sleeper(void* coro_payload, struct ServerData *server_data)
+{
+   struct cancel_payload *payload = (struct cancel_payload *)coro_payload;
+   payload->coro = server_current_coro(server_data);
+   payload->started = true;
+   double seconds[2] = {LONG_SLEEP, 2 * LONG_SLEEP};
+   struct RequestData requests[2];
+   for (int i = 0; i < 2; i++)
+   {
+      server_request_data_init(&(requests[i]), CoroRequestSleep, &(seconds[i]), NULL, true);
+   }
+   unsigned long long start_ns = server_monotonic_ns();
+   server_request_many(server_data, requests, 2, RequestWaitAll);
+   payload->elapsed_ns = server_monotonic_ns() - start_ns;
+   for (int i = 0; i < 2; i++)
+   {
+      payload->cancelled[i] = requests[i].cancelled;
+   }
+   payload->resumed = true;
+}
+
+// Every request of the group is dropped; the last one completes the group
+static void check_cancel_group(bool pipelined)
+{
+   struct ServerData *server_data = create_server(pipelined);
+   struct cancel_payload payload = {0};
+   server_register_coro(server_data, group_sleeper, &payload);
+   server_register_coro(server_data, sleeper_canceller, &payload);
+   run_server(server_data);
+   check(payload.resumed && PROMPT_NS > payload.elapsed_ns, "a cancelled group is completed right away");
+   check(payload.cancelled[0] && payload.cancelled[1], "both sleeps of the group are cancelled");
+   check(0 == server_data->sleep_timers_num && 0 == server_data->held_requests_num, "the timers of the group are gone");
+   server_free(server_data);
+}
+
+static void spawner(void* coro_payload, struct ServerData *server_data)
+{
+   struct cancel_payload *payload = (struct cancel_payload *)coro_payload;
+   payload->handle = server_spawn(server_data, sleeper, payload);
+   while (!payload->started)
+   {
+      yield(server_data);
+   }
+   // The sleep reaches its service first
+   yield(server_data);
+   yield(server_data);
+   payload->cancels_accepted += server_cancel(server_data, payload->handle) ? 1 : 0;
+   check(server_join(server_data, payload->handle, NULL), "a cancelled coroutine can still be joined");
+   check(!server_cancel(server_data, payload->handle), "a joined handle can not be cancelled");
+}
+
+static void blocked_locker(void* coro_payload, struct ServerData *server_data)
+{
+   struct cancel_payload *payload = (struct cancel_payload *)coro_payload;
+   payload->coro = server_current_coro(server_data);
+   bool locked = coro_mutex_lock(server_data, &(payload->mutex));
+   payload->resumed = true;
+   check(!locked, "a cancelled lock() returns false");
+   if (locked)
+   {
+      coro_mutex_unlock(server_data, &(payload->mutex));
+   }
+}
+
+static void lock_canceller(void* coro_payload, struct ServerData *server_data)
+{
+   struct cancel_payload *payload = (struct cancel_payload *)coro_payload;
+   coro_mutex_lock(server_data, &(payload->mutex));
+   server_register_coro(server_data, blocked_locker, payload);
+   int waiters_num = 0;
+   while (!waiters_num)
+   {
+      yield(server_data);
+      server_services_enter(server_data);
+      waiters_num = payload->mutex.waiters.waiters_num;
+      server_services_leave(server_data);
+   }
+   server_cancel_coro(server_data, payload->coro);
+   while (!payload->resumed)
+   {
+      yield(server_data);
+   }
+   check(0 == payload->mutex.waiters.waiters_num && payload->mutex.locked, "the cancelled waiter leaves the mutex to its owner");
+   coro_mutex_unlock(server_data, &(payload->mutex));
+}
+
+// server_cancel() goes through the join handle; a parked coroutine leaves the wait queue
+static void check_cancel_handle_and_park(bool pipelined)
+{
+   struct ServerData *server_data = create_server(pipelined);
+   struct cancel_payload payload = {0};
+   server_register_coro(server_data, spawner, &payload);
+   run_server(server_data);
+   check(1 == payload.cancels_accepted && RequestStatusCancelled == payload.status, "server_cancel() cancels through the handle");
+   server_free(server_data);
+
+   server_data = create_server(pipelined);
+   struct cancel_payload parked = {0};
+   coro_mutex_init(&(parked.mutex));
+   server_register_coro(server_data, lock_canceller, &parked);
+   run_server(server_data);
+   check(parked.resumed && !parked.mutex.locked, "the parked coroutine was resumed");
+   server_free(server_data);
+}
+
+static void unstarted(void* coro_payload, struct ServerData *server_data)
+{
+   struct cancel_payload *payload = (struct cancel_payload *)coro_payload;
+   payload->started = true;
+}
+
+static void spawn_and_cancel(void* coro_payload, struct ServerData *server_data)
+{
+   struct cancel_payload *payload = (struct cancel_payload *)coro_payload;
+   payload->handle = server_spawn(server_data, unstarted, payload);
+   payload->cancels_accepted += server_cancel(server_data, payload->handle) ? 1 : 0;
+   check(server_join(server_data, payload->handle, NULL), "an unstarted cancelled coroutine is finished right away");
+}
+
+static void check_cancel_unstarted(bool pipelined)
+{
+   struct ServerData *server_data = create_server(pipelined);
+   struct cancel_payload payload = {0};
+   server_register_coro(server_data, spawn_and_cancel, &payload);
+   run_server(server_data);
+   check(1 == payload.cancels_accepted && !payload.started, "a coroutine cancelled before it starts never runs");
+   server_free(server_data);
+}
+
+static void timed_sleeper(void* coro_payload, struct ServerData *server_data)
+{
+   struct cancel_payload *payload = (struct cancel_payload *)coro_payload;
+   double seconds = LONG_SLEEP;
+   unsigned long long start_ns = server_monotonic_ns();
+   payload->response_ok = server_request_inplace_timeout(server_data, CoroRequestSleep, &seconds, NULL, 10000000ULL);
+   payload->elapsed_ns = server_monotonic_ns() - start_ns;
+   payload->status = server_request_status(server_data);
+   // Within its deadline the request completes as usual and its timeout timer goes with it
+   seconds = 0.001;
+   payload->later_request_ok = server_request_inplace_timeout(server_data, CoroRequestSleep, &seconds, NULL, PROMPT_NS) &&
+                               (RequestStatusOk == server_request_status(server_data));
+   payload->resumed = true;
+}
+
+static void check_inplace_timeout(bool pipelined)
+{
+   struct ServerData *server_data = create_server(pipelined);
+   struct cancel_payload payload = {0};
+   server_register_coro(server_data, timed_sleeper, &payload);
+   run_server(server_data);
+   check(!payload.response_ok && RequestStatusTimedOut == payload.status, "a request past its deadline times out");
+   check(10000000ULL <= payload.elapsed_ns && PROMPT_NS > payload.elapsed_ns, "the timeout fires at its deadline");
+   check(payload.later_request_ok, "a request within its deadline completes");
+   check(1 == server_data->requests_timed_out_num, "the timeout is counted");
+   check(0 == server_data->sleep_timers_num && 0 == server_data->held_requests_num, "no timer is left behind");
+   server_free(server_data);
+}
+
+static void mass_sleeper(void* coro_payload, struct ServerData *server_data)
+{
+   struct mass_payload *payload = (struct mass_payload *)coro_payload;
+   payload->coros[payload->started_num++] = server_current_coro(server_data);
+   double seconds = LONG_SLEEP;
+   server_request_inplace(server_data, CoroRequestSleep, &seconds, NULL);
+   payload->resumed_num++;
+}
+
+static void mass_canceller(void* coro_payload, struct ServerData *server_data)
+{
+   struct mass_payload *payload = (struct mass_payload *)coro_payload;
+   while (payload->started_num < payload->coro_num)
+   {
+      yield(server_data);
+   }
+   yield(server_data);
+   yield(server_data);
+   unsigned long long start_ns = server_monotonic_ns();
+   // In the order of registration, which is not the order of the timer heap
+   for (int i = 0; i < payload->coro_num; i++)
+   {
+      server_cancel_coro(server_data, payload->coros[i]);
+   }
+   payload->cancel_ns = server_monotonic_ns() - start_ns;
+}
+
+// The cost of one cancellation does not grow with the number of sleepers
+static void run_benchmark(int coro_num, bool pipelined)
+{
+   struct ServerData *server_data = create_server(pipelined);
+   struct mass_payload payload = {0};
+   payload.coros = (coroutine_t *)malloc(sizeof(coroutine_t) * coro_num);
+   payload.coro_num = coro_num;
+   for (int i = 0; i < coro_num; i++)
+   {
+      server_register_coro(server_data, mass_sleeper, &payload);
+   }
+   server_register_coro(server_data, mass_canceller, &payload);
+   unsigned long long start_ns = server_monotonic_ns();
+   run_server(server_data);
+   unsigned long long elapsed_ns = server_monotonic_ns() - start_ns;
+   check(coro_num == payload.resumed_num && 0 == server_data->sleep_timers_num, "every sleeper was cancelled");
+   printf("K >> %s: CANCELLED SLEEPERS: %d; TIME: %.3f ms; PER CANCEL: %.0f ns\n", pipelined ? "PIPELINED" : "SEQUENTIAL",
+          coro_num, elapsed_ns / 1e6, (double)payload.cancel_ns / coro_num);
+   free(payload.coros);
+   server_free(server_data);
+}
+
+int main(int argc, char **argv)
+{
+   int coro_num = (1 < argc) ? atoi(argv[1]) : 20000;
+   printf("K >> START\n");
+   for (int pipelined = 0; pipelined < 2; pipelined++)
+   {
+      check_cancel_sleeper(pipelined);
+      check_cancel_group(pipelined);
+      check_cancel_handle_and_park(pipelined);
+      check_cancel_unstarted(pipelined);
+      check_inplace_timeout(pipelined);
+      run_benchmark(coro_num / 10, pipelined);
+      run_benchmark(coro_num, pipelined);
+   }
+   printf("K >> END; FAILED CHECKS: %d\n", failed_checks);
+   return failed_checks ? 1 : 0;
+}
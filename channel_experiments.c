@@ -0,0 +1,139 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "scheduler.h"
+#include "coro_channel.h"
+
+#define BENCH_MAX_BATCH 256
+
+struct bench_message {
+   unsigned long long sequence;
+   unsigned long long value;
+};
+
+CORO_CHANNEL_TYPED(bench_channel, struct bench_message)
+
+struct bench_payload {
+   struct CoroChannel *channel;
+   int messages_num; // per producer
+   int batch;
+   int producers_left;
+   unsigned long long received;
+   unsigned long long checksum;
+};
+
+static void producer_coroutine(void* coro_payload, struct ServerData *server_data)
+{
+   struct bench_payload *payload = (struct bench_payload *)coro_payload;
+   struct bench_message messages[BENCH_MAX_BATCH];
+   for (int i = 0; i < payload->messages_num; i += payload->batch)
+   {
+      int batch = (payload->messages_num - i) < payload->batch ? (payload->messages_num - i) : payload->batch;
+      for (int k = 0; k < batch; k++)
+      {
+         messages[k].sequence = i + k;
+         messages[k].value = i + k;
+      }
+      if (1 == batch)
+      {
+         bench_channel_send(server_data, payload->channel, messages[0]);
+      }
+      else
+      {
+         coro_channel_send_n(server_data, payload->channel, messages, batch);
+      }
+   }
+   if (0 == --payload->producers_left)
+   {
+      coro_channel_close(server_data, payload->channel);
+   }
+}
+
+static void consumer_coroutine(void* coro_payload, struct ServerData *server_data)
+{
+   struct bench_payload *payload = (struct bench_payload *)coro_payload;
+   struct bench_message messages[BENCH_MAX_BATCH];
+   while (true)
+   {
+      size_t received = 0;
+      if (1 == payload->batch)
+      {
+         received = bench_channel_recv(server_data, payload->channel, &messages[0]) ? 1 : 0;
+      }
+      else
+      {
+         received = coro_channel_recv_n(server_data, payload->channel, messages, payload->batch);
+      }
+      if (!received)
+      {
+         break;
+      }
+      for (size_t k = 0; k < received; k++)
+      {
+         payload->checksum += messages[k].value;
+      }
+      payload->received += received;
+   }
+}
+
+static void run_benchmark(int producers_num, int consumers_num, size_t capacity, int batch, int messages_num)
+{
+   struct ServerData *server_data = server_create();
+   struct bench_payload payload;
+   payload.channel = bench_channel_create(capacity);
+   payload.messages_num = messages_num;
+   payload.batch = batch;
+   payload.producers_left = producers_num;
+   payload.received = 0;
+   payload.checksum = 0;
+   for (int i = 0; i < consumers_num; i++)
+   {
+      server_register_coro(server_data, consumer_coroutine, &payload);
+   }
+   for (int i = 0; i < producers_num; i++)
+   {
+      server_register_coro(server_data, producer_coroutine, &payload);
+   }
+   unsigned long long iterations = 0;
+   unsigned long long start_ns = server_monotonic_ns();
+   while (server_loop_iteration(server_data))
+   {
+      iterations++;
+   }
+   unsigned long long elapsed_ns = server_monotonic_ns() - start_ns;
+   unsigned long long expected = (unsigned long long)producers_num * messages_num;
+   unsigned long long expected_checksum = (unsigned long long)producers_num * messages_num * (messages_num - 1) / 2;
+   if (payload.received != expected || payload.checksum != expected_checksum)
+   {
+      printf("C >> WRONG RESULT: received %llu of %llu\n", payload.received, expected);
+   }
+   printf("C >> PRODUCERS: %d; CONSUMERS: %d; CAPACITY: %zu; BATCH: %d; MESSAGES: %llu; ITERATIONS: %llu; TIME: %.3f ms; THROUGHPUT: %.0f messages/s\n",
+          producers_num, consumers_num, capacity, batch, payload.received, iterations, elapsed_ns / 1e6,
+          payload.received * 1e9 / elapsed_ns);
+   coro_channel_free(payload.channel);
+   server_free(server_data);
+}
+
+int main(int argc, char **argv)
+{
+   int messages_num = (1 < argc) ? atoi(argv[1]) : 1000000;
+   size_t capacities[] = {0, 1, 64, 1024};
+   int batches[] = {1, 16, BENCH_MAX_BATCH};
+   printf("C >> SERVER START\n");
+   for (size_t c = 0; c < sizeof(capacities) / sizeof(capacities[0]); c++)
+   {
+      for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++)
+      {
+         run_benchmark(1, 1, capacities[c], batches[b], messages_num);
+         run_benchmark(4, 4, capacities[c], batches[b], messages_num / 4);
+      }
+   }
+   printf("C >> SERVER END\n");
+   return 0;
+}
@@ -0,0 +1,164 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "coro_arena.h"
+
+#define ARENA_ROUND_UP(size) (((size) + (ARENA_ALIGNMENT - 1)) & ~(size_t)(ARENA_ALIGNMENT - 1))
+#define ARENA_HEADER_SIZE ARENA_ROUND_UP(sizeof(struct ArenaChunk))
+#define ARENA_CHUNK_DATA_SIZE (ARENA_CHUNK_SIZE - ARENA_HEADER_SIZE)
+
+void arena_pool_init(struct ArenaPool *pool, int max_free_chunks)
+{
+   pool->free_chunks = NULL;
+   pool->free_chunks_num = 0;
+   pool->max_free_chunks = max_free_chunks;
+   pool->chunks_used = 0;
+   pool->peak_chunks_used = 0;
+   pool->chunks_allocated = 0;
+   pool->chunks_reused = 0;
+   pool->bytes_allocated = 0;
+}
+
+void arena_pool_clear(struct ArenaPool *pool)
+{
+   while (pool->free_chunks)
+   {
+      struct ArenaChunk *chunk = pool->free_chunks;
+      pool->free_chunks = chunk->next;
+      free(chunk);
+   }
+   pool->free_chunks_num = 0;
+}
+
+void arena_init(struct Arena *arena)
+{
+   arena->chunks = NULL;
+   arena->allocated = 0;
+}
+
+static struct ArenaChunk *arena_new_chunk(struct ArenaPool *pool, size_t data_size)
+{
+   bool pooled = data_size <= ARENA_CHUNK_DATA_SIZE;
+   struct ArenaChunk *chunk = NULL;
+   if (pooled && pool->free_chunks)
+   {
+      chunk = pool->free_chunks;
+      pool->free_chunks = chunk->next;
+      pool->free_chunks_num--;
+      pool->chunks_reused++;
+   }
+   else
+   {
+      chunk = (struct ArenaChunk *)malloc(ARENA_HEADER_SIZE + (pooled ? ARENA_CHUNK_DATA_SIZE : data_size));
+      if (!chunk)
+      {
+         return NULL;
+      }
+      pool->chunks_allocated++;
+   }
+   if (pooled && ++pool->chunks_used > pool->peak_chunks_used)
+   {
+      pool->peak_chunks_used = pool->chunks_used;
+   }
+   chunk->next = NULL;
+   chunk->size = pooled ? ARENA_CHUNK_DATA_SIZE : data_size;
+   chunk->used = 0;
+   chunk->pooled = pooled;
+   return chunk;
+}
+
+// 16 byte aligned; valid until arena_release()
+void *arena_alloc(struct ArenaPool *pool, struct Arena *arena, size_t size)
+{
+   size = ARENA_ROUND_UP(size ? size : 1);
+   struct ArenaChunk *chunk = arena->chunks;
+   if (!chunk || chunk->size - chunk->used < size)
+   {
+      struct ArenaChunk *new_chunk = arena_new_chunk(pool, size);
+      if (!new_chunk)
+      {
+         return NULL;
+      }
+      if (chunk && !new_chunk->pooled)
+      {
+         // An oversized block does not take the place of the current chunk: its rest stays in use
+         new_chunk->next = chunk->next;
+         chunk->next = new_chunk;
+      }
+      else
+      {
+         new_chunk->next = chunk;
+         arena->chunks = new_chunk;
+      }
+      chunk = new_chunk;
+   }
+   void *block = (unsigned char *)chunk + ARENA_HEADER_SIZE + chunk->used;
+   chunk->used += size;
+   arena->allocated += size;
+   pool->bytes_allocated += size;
+   return block;
+}
+
+static void arena_release_chunk(struct ArenaPool *pool, struct ArenaChunk *chunk)
+{
+   if (chunk->pooled)
+   {
+      pool->chunks_used--;
+   }
+   if (chunk->pooled && (pool->free_chunks_num < pool->max_free_chunks || pool->free_chunks_num < pool->peak_chunks_used))
+   {
+      chunk->next = pool->free_chunks;
+      pool->free_chunks = chunk;
+      pool->free_chunks_num++;
+   }
+   else
+   {
+      free(chunk);
+   }
+}
+
+void arena_release(struct ArenaPool *pool, struct Arena *arena)
+{
+   struct ArenaChunk *chunk = arena->chunks;
+   while (chunk)
+   {
+      struct ArenaChunk *next = chunk->next;
+      arena_release_chunk(pool, chunk);
+      chunk = next;
+   }
+   arena->chunks = NULL;
+   arena->allocated = 0;
+}
+
+// Same as arena_release() but keeps one standard chunk, so an arena which is reset over and over
+// again does not go through the pool at all
+void arena_reset(struct ArenaPool *pool, struct Arena *arena)
+{
+   struct ArenaChunk *kept = NULL;
+   struct ArenaChunk *chunk = arena->chunks;
+   while (chunk)
+   {
+      struct ArenaChunk *next = chunk->next;
+      if (!kept && chunk->pooled)
+      {
+         kept = chunk;
+      }
+      else
+      {
+         arena_release_chunk(pool, chunk);
+      }
+      chunk = next;
+   }
+   if (kept)
+   {
+      kept->next = NULL;
+      kept->used = 0;
+   }
+   arena->chunks = kept;
+   arena->allocated = 0;
+}
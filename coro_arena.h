@@ -0,0 +1,58 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#ifndef C_CORO_ARENA_H
+#define C_CORO_ARENA_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Bump allocation arenas. Memory is released all at once with arena_release(): standard chunks go back
+// to the pool for the next arena, oversized ones are freed. The pool keeps as many chunks as were in use
+// at the peak, at least max_free_chunks, so a steady number of live arenas does not go back to malloc().
+
+#define ARENA_CHUNK_SIZE (4 * 1024) // including the header
+#define ARENA_ALIGNMENT 16
+#define ARENA_POOL_DEFAULT_MAX_FREE 1024
+
+struct ArenaChunk
+{
+   struct ArenaChunk *next;
+   size_t size; // of the data
+   size_t used;
+   bool pooled; // ARENA_CHUNK_SIZE sized
+};
+
+struct Arena
+{
+   struct ArenaChunk *chunks; // the first one is the current one
+   size_t allocated; // bytes handed out since arena_init(), arena_release() or arena_reset()
+};
+
+struct ArenaPool
+{
+   struct ArenaChunk *free_chunks;
+   int free_chunks_num;
+   int max_free_chunks; // the pool keeps more while more chunks were in use at once, see peak_chunks_used
+   int chunks_used; // standard chunks held by arenas
+   int peak_chunks_used;
+   unsigned long long chunks_allocated; // by malloc
+   unsigned long long chunks_reused; // taken from the pool
+   unsigned long long bytes_allocated; // handed out by arena_alloc()
+};
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+void arena_pool_init(struct ArenaPool *pool, int max_free_chunks);
+void arena_pool_clear(struct ArenaPool *pool);
+void arena_init(struct Arena *arena);
+void *arena_alloc(struct ArenaPool *pool, struct Arena *arena, size_t size);
+void arena_release(struct ArenaPool *pool, struct Arena *arena);
+void arena_reset(struct ArenaPool *pool, struct Arena *arena);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,569 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && 2 <= _M_IX86_FP)
+   #define CACHE_HAVE_SSE2
+   #include <emmintrin.h>
+#endif
+#if defined _MSC_VER
+   #include <intrin.h>
+#endif
+
+#include "coroutine.h"
+#include "scheduler.h"
+#include "cycle_clock.h"
+#include "server_metrics.h"
+#include "coro_cache.h"
+
+// Full slots keep the low 7 bits of the hash, so only the special control bytes are negative
+#define CACHE_CTRL_EMPTY ((signed char)-128)
+#define CACHE_CTRL_DELETED ((signed char)-2)
+#define CACHE_NO_SLOT ((size_t)-1)
+
+struct CacheEntry
+{
+   unsigned long long hash;
+   unsigned long long expires_ticks; // cycle_clock; 0 if the entry does not expire
+   size_t key_len;
+   size_t value_len;
+   bool referenced; // by a hit since the CLOCK hand passed it
+};
+
+// The key and then the value follow the header
+#define CACHE_ENTRY_KEY(entry) ((unsigned char *)(entry) + sizeof(struct CacheEntry))
+#define CACHE_ENTRY_VALUE(entry) (CACHE_ENTRY_KEY(entry) + (entry)->key_len)
+
+struct CoroCache
+{
+   signed char *ctrl;
+   struct CacheEntry **slots;
+   size_t capacity; // a power of two, CACHE_GROUP_WIDTH at least
+   size_t entries_num;
+   size_t deleted_num;
+   size_t bytes; // of the entries, headers included
+   size_t max_bytes;
+   size_t clock_hand;
+   unsigned long long now_ticks; // the loop clock
+   unsigned long long hits;
+   unsigned long long misses;
+   unsigned long long evictions;
+   unsigned long long expirations;
+};
+
+static unsigned int cache_group_match(const signed char *group, signed char value)
+{
+#if defined CACHE_HAVE_SSE2
+   __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+   return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(value)));
+#else
+   unsigned int mask = 0;
+   for (int i = 0; i < CACHE_GROUP_WIDTH; i++)
+   {
+      mask |= (unsigned int)(group[i] == value) << i;
+   }
+   return mask;
+#endif
+}
+
+// Empty and deleted slots
+static unsigned int cache_group_match_free(const signed char *group)
+{
+#if defined CACHE_HAVE_SSE2
+   return (unsigned int)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+   unsigned int mask = 0;
+   for (int i = 0; i < CACHE_GROUP_WIDTH; i++)
+   {
+      mask |= (unsigned int)(0 > group[i]) << i;
+   }
+   return mask;
+#endif
+}
+
+static int cache_lowest_bit(unsigned int mask)
+{
+#if defined _MSC_VER
+   unsigned long index;
+   _BitScanForward(&index, mask);
+   return (int)index;
+#else
+   return __builtin_ctz(mask);
+#endif
+}
+
+static unsigned long long cache_hash(const void *key, size_t key_len)
+{
+   const unsigned char *bytes = (const unsigned char *)key;
+   unsigned long long hash = 0x9e3779b97f4a7c15ULL ^ ((unsigned long long)key_len * 0xff51afd7ed558ccdULL);
+   while (8 <= key_len)
+   {
+      unsigned long long word;
+      memcpy(&word, bytes, sizeof(word));
+      hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+      hash ^= hash >> 32;
+      bytes += 8;
+      key_len -= 8;
+   }
+   if (key_len)
+   {
+      unsigned long long word = 0;
+      memcpy(&word, bytes, key_len);
+      hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+   }
+   // The finalizer of MurmurHash3: the control bytes take the low bits, the probing the high ones
+   hash ^= hash >> 33;
+   hash *= 0xff51afd7ed558ccdULL;
+   hash ^= hash >> 33;
+   hash *= 0xc4ceb9fe1a85ec53ULL;
+   hash ^= hash >> 33;
+   return hash;
+}
+
+static signed char cache_hash_ctrl(unsigned long long hash)
+{
+   return (signed char)(hash & 0x7f);
+}
+
+static size_t cache_entry_size(const struct CacheEntry *entry)
+{
+   return sizeof(struct CacheEntry) + entry->key_len + entry->value_len;
+}
+
+static bool cache_entry_expired(const struct CoroCache *cache, const struct CacheEntry *entry)
+{
+   return entry->expires_ticks && (entry->expires_ticks <= cache->now_ticks);
+}
+
+static bool cache_alloc_slots(struct CoroCache *cache, size_t capacity)
+{
+   signed char *ctrl = (signed char *)malloc(capacity);
+   struct CacheEntry **slots = (struct CacheEntry **)calloc(capacity, sizeof(struct CacheEntry *));
+   if (!ctrl || !slots)
+   {
+      free(ctrl);
+      free(slots);
+      return false;
+   }
+   memset(ctrl, CACHE_CTRL_EMPTY, capacity);
+   cache->ctrl = ctrl;
+   cache->slots = slots;
+   cache->capacity = capacity;
+   cache->deleted_num = 0;
+   cache->clock_hand = 0;
+   return true;
+}
+
+struct CoroCache *coro_cache_create(size_t max_bytes)
+{
+   struct CoroCache *cache = (struct CoroCache *)malloc(sizeof(struct CoroCache));
+   if (!cache)
+   {
+      return NULL;
+   }
+   if (!cache_alloc_slots(cache, CACHE_MIN_CAPACITY))
+   {
+      free(cache);
+      return NULL;
+   }
+   cache->entries_num = 0;
+   cache->bytes = 0;
+   cache->max_bytes = max_bytes;
+   cache->now_ticks = cycle_clock_now();
+   cache->hits = 0;
+   cache->misses = 0;
+   cache->evictions = 0;
+   cache->expirations = 0;
+   return cache;
+}
+
+void coro_cache_free(struct CoroCache *cache)
+{
+   if (!cache)
+   {
+      return;
+   }
+   for (size_t i = 0; i < cache->capacity; i++)
+   {
+      if (0 <= cache->ctrl[i])
+      {
+         free(cache->slots[i]);
+      }
+   }
+   free(cache->ctrl);
+   free(cache->slots);
+   free(cache);
+}
+
+// Groups are probed in the triangular order, which visits every group of a power of two table once
+static size_t cache_find(const struct CoroCache *cache, unsigned long long hash, const void *key, size_t key_len)
+{
+   size_t groups_mask = cache->capacity / CACHE_GROUP_WIDTH - 1;
+   size_t group = (size_t)(hash >> 7) & groups_mask;
+   signed char ctrl = cache_hash_ctrl(hash);
+   for (size_t step = 1; step <= groups_mask + 1; step++)
+   {
+      const signed char *group_ctrl = cache->ctrl + group * CACHE_GROUP_WIDTH;
+      unsigned int mask = cache_group_match(group_ctrl, ctrl);
+      while (mask)
+      {
+         size_t slot = group * CACHE_GROUP_WIDTH + cache_lowest_bit(mask);
+         const struct CacheEntry *entry = cache->slots[slot];
+         if ((entry->hash == hash) && (entry->key_len == key_len) && !memcmp(CACHE_ENTRY_KEY(entry), key, key_len))
+         {
+            return slot;
+         }
+         mask &= mask - 1;
+      }
+      // A key is never placed past a group with an empty slot
+      if (cache_group_match(group_ctrl, CACHE_CTRL_EMPTY))
+      {
+         return CACHE_NO_SLOT;
+      }
+      group = (group + step) & groups_mask;
+   }
+   return CACHE_NO_SLOT;
+}
+
+// There is always one: the table is kept at most 7/8 full
+static size_t cache_find_free(const struct CoroCache *cache, unsigned long long hash)
+{
+   size_t groups_mask = cache->capacity / CACHE_GROUP_WIDTH - 1;
+   size_t group = (size_t)(hash >> 7) & groups_mask;
+   for (size_t step = 1;; step++)
+   {
+      unsigned int mask = cache_group_match_free(cache->ctrl + group * CACHE_GROUP_WIDTH);
+      if (mask)
+      {
+         return group * CACHE_GROUP_WIDTH + cache_lowest_bit(mask);
+      }
+      group = (group + step) & groups_mask;
+   }
+}
+
+static void cache_place(struct CoroCache *cache, struct CacheEntry *entry)
+{
+   size_t slot = cache_find_free(cache, entry->hash);
+   if (CACHE_CTRL_DELETED == cache->ctrl[slot])
+   {
+      cache->deleted_num--;
+   }
+   cache->ctrl[slot] = cache_hash_ctrl(entry->hash);
+   cache->slots[slot] = entry;
+}
+
+static void cache_remove_slot(struct CoroCache *cache, size_t slot)
+{
+   struct CacheEntry *entry = cache->slots[slot];
+   cache->bytes -= cache_entry_size(entry);
+   cache->entries_num--;
+   free(entry);
+   cache->slots[slot] = NULL;
+   // Lookups stop at a group with an empty slot, so no probe sequence goes through this one
+   if (cache_group_match(cache->ctrl + (slot & ~(size_t)(CACHE_GROUP_WIDTH - 1)), CACHE_CTRL_EMPTY))
+   {
+      cache->ctrl[slot] = CACHE_CTRL_EMPTY;
+   }
+   else
+   {
+      cache->ctrl[slot] = CACHE_CTRL_DELETED;
+      cache->deleted_num++;
+   }
+}
+
+// Doubles the table, or only drops the tombstones if they take the room
+static bool cache_rehash(struct CoroCache *cache)
+{
+   size_t capacity = (cache->entries_num + 1 > cache->capacity / 2) ? 2 * cache->capacity : cache->capacity;
+   signed char *old_ctrl = cache->ctrl;
+   struct CacheEntry **old_slots = cache->slots;
+   size_t old_capacity = cache->capacity;
+   if (!cache_alloc_slots(cache, capacity))
+   {
+      return false;
+   }
+   for (size_t i = 0; i < old_capacity; i++)
+   {
+      if (0 <= old_ctrl[i])
+      {
+         cache_place(cache, old_slots[i]);
+      }
+   }
+   free(old_ctrl);
+   free(old_slots);
+   return true;
+}
+
+// CLOCK: the hand clears the reference bits of the entries it passes and takes the first expired entry
+// or the first one which was not hit since the previous pass
+static void cache_evict_one(struct CoroCache *cache)
+{
+   for (size_t steps = 0; steps <= 2 * cache->capacity; steps++)
+   {
+      size_t slot = cache->clock_hand;
+      cache->clock_hand = (slot + 1) & (cache->capacity - 1);
+      if (0 > cache->ctrl[slot])
+      {
+         continue;
+      }
+      struct CacheEntry *entry = cache->slots[slot];
+      if (cache_entry_expired(cache, entry))
+      {
+         cache->expirations++;
+      }
+      else if (entry->referenced)
+      {
+         entry->referenced = false;
+         continue;
+      }
+      else
+      {
+         cache->evictions++;
+      }
+      cache_remove_slot(cache, slot);
+      return;
+   }
+}
+
+static bool cache_get(struct CoroCache *cache, const void *key, size_t key_len, void *value, size_t value_len,
+                      size_t *stored_len)
+{
+   size_t slot = cache_find(cache, cache_hash(key, key_len), key, key_len);
+   if ((CACHE_NO_SLOT != slot) && cache_entry_expired(cache, cache->slots[slot]))
+   {
+      cache_remove_slot(cache, slot);
+      cache->expirations++;
+      slot = CACHE_NO_SLOT;
+   }
+   if (CACHE_NO_SLOT == slot)
+   {
+      cache->misses++;
+      *stored_len = 0;
+      return false;
+   }
+   struct CacheEntry *entry = cache->slots[slot];
+   entry->referenced = true;
+   cache->hits++;
+   memcpy(value, CACHE_ENTRY_VALUE(entry), (entry->value_len < value_len) ? entry->value_len : value_len);
+   *stored_len = entry->value_len;
+   return true;
+}
+
+static bool cache_put(struct CoroCache *cache, const void *key, size_t key_len, const void *value, size_t value_len,
+                      unsigned long long ttl_ns)
+{
+   size_t size = sizeof(struct CacheEntry) + key_len + value_len;
+   if (size > cache->max_bytes)
+   {
+      return false;
+   }
+   unsigned long long hash = cache_hash(key, key_len);
+   size_t slot = cache_find(cache, hash, key, key_len);
+   // Everything which can fail comes first: a failed put leaves the old value in place
+   if (cache->entries_num + cache->deleted_num + 1 > cache->capacity - cache->capacity / 8)
+   {
+      if (!cache_rehash(cache))
+      {
+         return false;
+      }
+      // The entries moved
+      slot = (CACHE_NO_SLOT != slot) ? cache_find(cache, hash, key, key_len) : CACHE_NO_SLOT;
+   }
+   struct CacheEntry *entry = (struct CacheEntry *)malloc(size);
+   if (!entry)
+   {
+      return false;
+   }
+   entry->hash = hash;
+   entry->expires_ticks = ttl_ns ? cache->now_ticks + cycle_clock_ticks_from_ns(ttl_ns) : 0;
+   entry->key_len = key_len;
+   entry->value_len = value_len;
+   entry->referenced = false;
+   memcpy(CACHE_ENTRY_KEY(entry), key, key_len);
+   memcpy(CACHE_ENTRY_VALUE(entry), value, value_len);
+   size_t replaced_size = (CACHE_NO_SLOT != slot) ? cache_entry_size(cache->slots[slot]) : 0;
+   while (cache->bytes - replaced_size + size > cache->max_bytes)
+   {
+      cache_evict_one(cache);
+      // The hand may take the old entry as well
+      if ((CACHE_NO_SLOT != slot) && (0 > cache->ctrl[slot]))
+      {
+         slot = CACHE_NO_SLOT;
+         replaced_size = 0;
+      }
+   }
+   if (CACHE_NO_SLOT != slot)
+   {
+      // The same key has the same control byte
+      free(cache->slots[slot]);
+      cache->slots[slot] = entry;
+      cache->bytes -= replaced_size;
+   }
+   else
+   {
+      cache_place(cache, entry);
+      cache->entries_num++;
+   }
+   cache->bytes += size;
+   return true;
+}
+
+static bool cache_delete(struct CoroCache *cache, const void *key, size_t key_len)
+{
+   size_t slot = cache_find(cache, cache_hash(key, key_len), key, key_len);
+   if (CACHE_NO_SLOT == slot)
+   {
+      return false;
+   }
+   bool expired = cache_entry_expired(cache, cache->slots[slot]);
+   cache_remove_slot(cache, slot);
+   return !expired;
+}
+
+// The key and the value buffer are passed separately: the service reaches them through the saved stack
+static bool cache_run_request(struct ServerData *server_data, struct CacheRequest *request, const void *key, void *value)
+{
+   server_services_enter(server_data);
+   struct CoroCache *cache = server_data->cache;
+   request->found = false;
+   request->stored_len = 0;
+   if (cache)
+   {
+      switch (request->op)
+      {
+      case CacheOpGet:
+         request->found = cache_get(cache, key, request->key_len, value, request->value_len, &(request->stored_len));
+         break;
+      case CacheOpPut:
+         request->found = cache_put(cache, key, request->key_len, value, request->value_len, request->ttl_ns);
+         break;
+      case CacheOpDelete:
+         request->found = cache_delete(cache, key, request->key_len);
+         break;
+      }
+   }
+   server_services_leave(server_data);
+   return NULL != cache;
+}
+
+// The inline path of server_request_inplace(); false if the cache is not started
+bool coro_cache_request(struct ServerData *server_data, struct CacheRequest *request)
+{
+   return cache_run_request(server_data, request, request->key, request->value);
+}
+
+void coro_cache_service(struct ServerData *server_data, struct RequestData *request_data)
+{
+   // Points into the saved frame already; the buffers may be in the frame as well
+   struct CacheRequest *request = (struct CacheRequest *)request_data->request;
+   cache_run_request(server_data, request, coroutine_saved_address(request_data->coro, (void *)request->key),
+                     coroutine_saved_address(request_data->coro, request->value));
+   server_complete(server_data, request_data, NULL);
+}
+
+// Called by the loop once per iteration
+void coro_cache_tick(struct ServerData *server_data, unsigned long long now_ticks)
+{
+   server_services_enter(server_data);
+   struct CoroCache *cache = server_data->cache;
+   if (cache)
+   {
+      cache->now_ticks = now_ticks;
+      struct ServerMetricsState *metrics = server_data->metrics;
+      if (metrics)
+      {
+         metric_set(&(metrics->cache_hits), cache->hits);
+         metric_set(&(metrics->cache_misses), cache->misses);
+         metric_set(&(metrics->cache_evictions), cache->evictions);
+         metric_set(&(metrics->cache_expirations), cache->expirations);
+         metric_set(&(metrics->cache_bytes), cache->bytes);
+      }
+   }
+   server_services_leave(server_data);
+}
+
+// max_bytes: the budget of the entries, their headers included
+bool server_cache_start(struct ServerData *server_data, size_t max_bytes)
+{
+   if (!server_data)
+   {
+      return false;
+   }
+   server_services_enter(server_data);
+   if (!server_data->cache)
+   {
+      server_data->cache = coro_cache_create(max_bytes);
+   }
+   bool started = NULL != server_data->cache;
+   server_services_leave(server_data);
+   return started;
+}
+
+void server_cache_stop(struct ServerData *server_data)
+{
+   if (!server_data)
+   {
+      return;
+   }
+   server_services_enter(server_data);
+   coro_cache_free(server_data->cache);
+   server_data->cache = NULL;
+   server_services_leave(server_data);
+}
+
+// Copies at most value_len bytes of a hit; stored_len receives the whole length of the value
+bool server_cache_get(struct ServerData *server_data, const void *key, size_t key_len, void *value, size_t value_len,
+                      size_t *stored_len)
+{
+   struct CacheRequest request = {CacheOpGet, key, key_len, value, value_len, 0, 0, false};
+   server_request_inplace(server_data, CoroRequestCache, &request, NULL);
+   if (stored_len)
+   {
+      *stored_len = request.stored_len;
+   }
+   return request.found;
+}
+
+// A value which does not fit into the budget on its own is not stored
+bool server_cache_put(struct ServerData *server_data, const void *key, size_t key_len, const void *value, size_t value_len,
+                      unsigned long long ttl_ns)
+{
+   struct CacheRequest request = {CacheOpPut, key, key_len, (void *)value, value_len, ttl_ns, 0, false};
+   server_request_inplace(server_data, CoroRequestCache, &request, NULL);
+   return request.found;
+}
+
+bool server_cache_delete(struct ServerData *server_data, const void *key, size_t key_len)
+{
+   struct CacheRequest request = {CacheOpDelete, key, key_len, NULL, 0, 0, 0, false};
+   server_request_inplace(server_data, CoroRequestCache, &request, NULL);
+   return request.found;
+}
+
+bool server_cache_stats(struct ServerData *server_data, struct CacheStats *stats)
+{
+   if (!server_data || !stats)
+   {
+      return false;
+   }
+   server_services_enter(server_data);
+   struct CoroCache *cache = server_data->cache;
+   if (cache)
+   {
+      stats->entries = cache->entries_num;
+      stats->bytes = cache->bytes;
+      stats->max_bytes = cache->max_bytes;
+      stats->capacity = cache->capacity;
+      stats->hits = cache->hits;
+      stats->misses = cache->misses;
+      stats->evictions = cache->evictions;
+      stats->expirations = cache->expirations;
+   }
+   server_services_leave(server_data);
+   return NULL != cache;
+}
@@ -0,0 +1,80 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#ifndef C_CORO_CACHE_H
+#define C_CORO_CACHE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "scheduler.h"
+
+// In-process cache service. Values are copied in and out under byte string keys. The table is open
+// addressing in the SwissTable style: one control byte per slot with 7 bits of the hash, probed 16
+// slots at a time (SSE2 where available). Entries expire by the loop clock, which is read once per
+// iteration, and are evicted with CLOCK once the byte budget is exceeded.
+//
+// Cache requests (CoroRequestCache) never wait for anything, so server_request_inplace() completes
+// them right in the coroutine without suspending it; the service only sees the ones dispatched by
+// other means (e.g. in a group of server_request_many()).
+
+#define CACHE_GROUP_WIDTH 16
+#define CACHE_MIN_CAPACITY 64
+
+enum CacheOp
+{
+   CacheOpGet,
+   CacheOpPut,
+   CacheOpDelete
+};
+
+// Request of CoroRequestCache; it and its buffers may live in the frame of the coroutine
+struct CacheRequest
+{
+   enum CacheOp op;
+   const void *key;
+   size_t key_len;
+   void *value; // get: the buffer; put: the value
+   size_t value_len;
+   unsigned long long ttl_ns; // put: 0 if the entry does not expire
+   size_t stored_len; // get: the length of the cached value, which may be more than value_len
+   bool found; // get and delete: the key was there; put: the value was stored
+};
+
+struct CacheStats
+{
+   unsigned long long entries;
+   unsigned long long bytes;
+   unsigned long long max_bytes;
+   unsigned long long capacity; // slots
+   unsigned long long hits;
+   unsigned long long misses;
+   unsigned long long evictions; // by the byte budget
+   unsigned long long expirations;
+};
+
+struct CoroCache;
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+bool server_cache_start(struct ServerData *server_data, size_t max_bytes);
+void server_cache_stop(struct ServerData *server_data);
+bool server_cache_get(struct ServerData *server_data, const void *key, size_t key_len, void *value, size_t value_len,
+                      size_t *stored_len);
+bool server_cache_put(struct ServerData *server_data, const void *key, size_t key_len, const void *value, size_t value_len,
+                      unsigned long long ttl_ns);
+bool server_cache_delete(struct ServerData *server_data, const void *key, size_t key_len);
+bool server_cache_stats(struct ServerData *server_data, struct CacheStats *stats);
+
+struct CoroCache *coro_cache_create(size_t max_bytes);
+void coro_cache_free(struct CoroCache *cache);
+void coro_cache_tick(struct ServerData *server_data, unsigned long long now_ticks);
+bool coro_cache_request(struct ServerData *server_data, struct CacheRequest *request);
+void coro_cache_service(struct ServerData *server_data, struct RequestData *request_data);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,274 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scheduler.h"
+#include "coro_sync.h"
+#include "coro_channel.h"
+
+struct CoroChannel *coro_channel_create(size_t elem_size, size_t capacity)
+{
+   if (!elem_size)
+   {
+      return NULL;
+   }
+   struct CoroChannel *channel = (struct CoroChannel *)malloc(sizeof(struct CoroChannel));
+   if (!channel)
+   {
+      return NULL;
+   }
+   channel->elem_size = elem_size;
+   channel->capacity = capacity;
+   channel->head = 0;
+   channel->count = 0;
+   channel->buffer = NULL;
+   if (capacity)
+   {
+      channel->buffer = (unsigned char *)malloc(elem_size * capacity);
+      if (!channel->buffer)
+      {
+         free(channel);
+         return NULL;
+      }
+   }
+   channel->closed = false;
+   coro_wait_queue_init(&(channel->senders));
+   coro_wait_queue_init(&(channel->receivers));
+   return channel;
+}
+
+// Parked coroutines must be gone: close the channel and let them run first
+void coro_channel_free(struct CoroChannel *channel)
+{
+   if (!channel)
+   {
+      return;
+   }
+   free(channel->buffer);
+   free(channel);
+}
+
+// Copies up to elems_num elements into the ring; returns the number copied
+static size_t coro_channel_ring_put(struct CoroChannel *channel, const unsigned char *elems, size_t elems_num)
+{
+   size_t room = channel->capacity - channel->count;
+   size_t num = elems_num < room ? elems_num : room;
+   if (!num)
+   {
+      return 0;
+   }
+   size_t tail = (channel->head + channel->count) % channel->capacity;
+   size_t first = channel->capacity - tail;
+   if (first > num)
+   {
+      first = num;
+   }
+   memcpy(channel->buffer + tail * channel->elem_size, elems, first * channel->elem_size);
+   memcpy(channel->buffer, elems + first * channel->elem_size, (num - first) * channel->elem_size);
+   channel->count += num;
+   return num;
+}
+
+static size_t coro_channel_ring_take(struct CoroChannel *channel, unsigned char *elems, size_t elems_num)
+{
+   size_t num = elems_num < channel->count ? elems_num : channel->count;
+   if (!num)
+   {
+      return 0;
+   }
+   size_t first = channel->capacity - channel->head;
+   if (first > num)
+   {
+      first = num;
+   }
+   memcpy(elems, channel->buffer + channel->head * channel->elem_size, first * channel->elem_size);
+   memcpy(elems + first * channel->elem_size, channel->buffer, (num - first) * channel->elem_size);
+   channel->head = (channel->head + num) % channel->capacity;
+   channel->count -= num;
+   return num;
+}
+
+// Hands the elements to the waiting receivers first (the ring is empty while any receiver waits),
+// then to the ring. Each served receiver is completed with what it got.
+static size_t coro_channel_put(struct ServerData *server_data, struct CoroChannel *channel,
+                               const unsigned char *elems, size_t elems_num)
+{
+   size_t sent = 0;
+   while (sent < elems_num && channel->receivers.head)
+   {
+      struct CoroWaiter *receiver = channel->receivers.head;
+      size_t num = receiver->data_len - receiver->data_done;
+      if (num > elems_num - sent)
+      {
+         num = elems_num - sent;
+      }
+      memcpy((unsigned char *)receiver->data + receiver->data_done * channel->elem_size,
+             elems + sent * channel->elem_size, num * channel->elem_size);
+      receiver->data_done += num;
+      sent += num;
+      coro_wait_queue_wake_one(server_data, &(channel->receivers));
+   }
+   sent += coro_channel_ring_put(channel, elems + sent * channel->elem_size, elems_num - sent);
+   return sent;
+}
+
+// Takes the ring first, then the elements of the waiting senders in their order, and refills the ring
+// from the senders which are still waiting. Each sender is completed once all of its elements are taken.
+static size_t coro_channel_take(struct ServerData *server_data, struct CoroChannel *channel,
+                                unsigned char *elems, size_t elems_num)
+{
+   size_t received = coro_channel_ring_take(channel, elems, elems_num);
+   while (channel->senders.head && (received < elems_num || channel->count < channel->capacity))
+   {
+      struct CoroWaiter *sender = channel->senders.head;
+      const unsigned char *data = (const unsigned char *)sender->data + sender->data_done * channel->elem_size;
+      size_t left = sender->data_len - sender->data_done;
+      size_t num = 0;
+      if (received < elems_num)
+      {
+         num = left < elems_num - received ? left : elems_num - received;
+         memcpy(elems + received * channel->elem_size, data, num * channel->elem_size);
+         received += num;
+      }
+      else
+      {
+         num = coro_channel_ring_put(channel, data, left);
+      }
+      sender->data_done += num;
+      if (sender->data_done == sender->data_len)
+      {
+         coro_wait_queue_wake_one(server_data, &(channel->senders));
+      }
+   }
+   return received;
+}
+
+static bool coro_channel_try_park_send(struct ServerData *server_data, void *primitive, struct CoroWaiter *waiter)
+{
+   struct CoroChannel *channel = (struct CoroChannel *)primitive;
+   if (channel->closed)
+   {
+      return true;
+   }
+   waiter->data_done += coro_channel_put(server_data, channel,
+                                         (const unsigned char *)waiter->data + waiter->data_done * channel->elem_size,
+                                         waiter->data_len - waiter->data_done);
+   return waiter->data_done == waiter->data_len;
+}
+
+static bool coro_channel_try_park_recv(struct ServerData *server_data, void *primitive, struct CoroWaiter *waiter)
+{
+   struct CoroChannel *channel = (struct CoroChannel *)primitive;
+   waiter->data_done += coro_channel_take(server_data, channel,
+                                          (unsigned char *)waiter->data + waiter->data_done * channel->elem_size,
+                                          waiter->data_len - waiter->data_done);
+   return waiter->data_done || channel->closed;
+}
+
+// Sends all of the elements unless the channel gets closed; returns the number sent
+size_t coro_channel_send_n(struct ServerData *server_data, struct CoroChannel *channel, const void *elems, size_t elems_num)
+{
+   if (!channel || !elems_num)
+   {
+      return 0;
+   }
+   server_services_enter(server_data);
+   size_t sent = 0;
+   if (!channel->closed)
+   {
+      sent = coro_channel_put(server_data, channel, (const unsigned char *)elems, elems_num);
+   }
+   bool done = channel->closed || sent == elems_num;
+   server_services_leave(server_data);
+   if (done)
+   {
+      return sent;
+   }
+   struct CoroParkRequest park;
+   coro_park_init(&park, channel, &(channel->senders), coro_channel_try_park_send);
+   park.waiter.data = (void *)((const unsigned char *)elems + sent * channel->elem_size);
+   park.waiter.data_len = elems_num - sent;
+   coro_park(server_data, &park);
+   return sent + park.waiter.data_done;
+}
+
+// Waits for at least one element; returns the number received, 0 once the channel is closed and drained
+size_t coro_channel_recv_n(struct ServerData *server_data, struct CoroChannel *channel, void *elems, size_t elems_num)
+{
+   if (!channel || !elems_num)
+   {
+      return 0;
+   }
+   server_services_enter(server_data);
+   size_t received = coro_channel_take(server_data, channel, (unsigned char *)elems, elems_num);
+   bool done = received || channel->closed;
+   server_services_leave(server_data);
+   if (done)
+   {
+      return received;
+   }
+   struct CoroParkRequest park;
+   coro_park_init(&park, channel, &(channel->receivers), coro_channel_try_park_recv);
+   park.waiter.data = elems;
+   park.waiter.data_len = elems_num;
+   coro_park(server_data, &park);
+   return park.waiter.data_done;
+}
+
+size_t coro_channel_try_send_n(struct ServerData *server_data, struct CoroChannel *channel, const void *elems, size_t elems_num)
+{
+   if (!channel)
+   {
+      return 0;
+   }
+   server_services_enter(server_data);
+   size_t sent = 0;
+   if (!channel->closed)
+   {
+      sent = coro_channel_put(server_data, channel, (const unsigned char *)elems, elems_num);
+   }
+   server_services_leave(server_data);
+   return sent;
+}
+
+size_t coro_channel_try_recv_n(struct ServerData *server_data, struct CoroChannel *channel, void *elems, size_t elems_num)
+{
+   if (!channel)
+   {
+      return 0;
+   }
+   server_services_enter(server_data);
+   size_t received = coro_channel_take(server_data, channel, (unsigned char *)elems, elems_num);
+   server_services_leave(server_data);
+   return received;
+}
+
+bool coro_channel_send(struct ServerData *server_data, struct CoroChannel *channel, const void *elem)
+{
+   return 1 == coro_channel_send_n(server_data, channel, elem, 1);
+}
+
+bool coro_channel_recv(struct ServerData *server_data, struct CoroChannel *channel, void *elem)
+{
+   return 1 == coro_channel_recv_n(server_data, channel, elem, 1);
+}
+
+// Wakes all of the waiting coroutines: senders return what they managed to send, receivers what they got.
+// Elements already in the ring can still be received.
+void coro_channel_close(struct ServerData *server_data, struct CoroChannel *channel)
+{
+   if (!channel)
+   {
+      return;
+   }
+   server_services_enter(server_data);
+   channel->closed = true;
+   coro_wait_queue_wake_all(server_data, &(channel->senders));
+   coro_wait_queue_wake_all(server_data, &(channel->receivers));
+   server_services_leave(server_data);
+}
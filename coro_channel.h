@@ -0,0 +1,65 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#ifndef C_CORO_CHANNEL_H
+#define C_CORO_CHANNEL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "scheduler.h"
+#include "coro_sync.h"
+
+// Bounded FIFO channel between the coroutines of one server; any number of senders and receivers.
+// Elements are copied by value into a ring buffer of `capacity` elements (0: every send waits for a
+// receiver). A sender which meets a waiting receiver copies straight into the receiver's buffer, and a
+// receiver which drains a full channel takes the elements of the waiting senders as well, so parked
+// coroutines are only resumed once their transfer is done. Like the coro_sync.h primitives, a channel
+// must not live on the coroutine stack.
+
+struct CoroChannel
+{
+   size_t elem_size;
+   size_t capacity;
+   size_t head; // index of the oldest element
+   size_t count;
+   unsigned char *buffer;
+   bool closed;
+   struct CoroWaitQueue senders; // data: elements left to send
+   struct CoroWaitQueue receivers; // data: room for the received elements; waiting only while count is 0
+};
+
+// Declares type checked wrappers: prefix##_create(capacity), prefix##_send(server_data, channel, value)
+// and prefix##_recv(server_data, channel, value_ptr).
+#define CORO_CHANNEL_TYPED(prefix, type) \
+   static inline struct CoroChannel *prefix##_create(size_t capacity) \
+   { \
+      return coro_channel_create(sizeof(type), capacity); \
+   } \
+   static inline bool prefix##_send(struct ServerData *server_data, struct CoroChannel *channel, type value) \
+   { \
+      return coro_channel_send(server_data, channel, &value); \
+   } \
+   static inline bool prefix##_recv(struct ServerData *server_data, struct CoroChannel *channel, type *value) \
+   { \
+      return coro_channel_recv(server_data, channel, value); \
+   }
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+struct CoroChannel *coro_channel_create(size_t elem_size, size_t capacity);
+void coro_channel_free(struct CoroChannel *channel);
+void coro_channel_close(struct ServerData *server_data, struct CoroChannel *channel);
+bool coro_channel_send(struct ServerData *server_data, struct CoroChannel *channel, const void *elem);
+bool coro_channel_recv(struct ServerData *server_data, struct CoroChannel *channel, void *elem);
+size_t coro_channel_send_n(struct ServerData *server_data, struct CoroChannel *channel, const void *elems, size_t elems_num);
+size_t coro_channel_recv_n(struct ServerData *server_data, struct CoroChannel *channel, void *elems, size_t elems_num);
+size_t coro_channel_try_send_n(struct ServerData *server_data, struct CoroChannel *channel, const void *elems, size_t elems_num);
+size_t coro_channel_try_recv_n(struct ServerData *server_data, struct CoroChannel *channel, void *elems, size_t elems_num);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
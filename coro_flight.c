@@ -0,0 +1,344 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "coroutine.h"
+#include "scheduler.h"
+#include "server_metrics.h"
+#include "coro_flight.h"
+
+#define FLIGHT_TABLE_MIN_BUCKETS 64
+
+struct Flight
+{
+   enum CoroRequests coro_request_type;
+   unsigned long long key;
+   struct Flight *next; // in the bucket
+   struct FlightRequest *waiters; // in the saved frames of the waiting coroutines
+   int waiters_num;
+};
+
+struct FlightTable
+{
+   struct Flight **buckets;
+   int buckets_len; // a power of two
+   int flights_num;
+};
+
+static struct FlightTable *flight_table_create(void)
+{
+   struct FlightTable *table = (struct FlightTable *)malloc(sizeof(struct FlightTable));
+   if (!table)
+   {
+      return NULL;
+   }
+   table->buckets = (struct Flight **)calloc(FLIGHT_TABLE_MIN_BUCKETS, sizeof(struct Flight *));
+   if (!table->buckets)
+   {
+      free(table);
+      return NULL;
+   }
+   table->buckets_len = FLIGHT_TABLE_MIN_BUCKETS;
+   table->flights_num = 0;
+   return table;
+}
+
+// Called by server_free() after the held requests are gone; the requests of unfinished flights are dropped
+void flight_table_free(struct FlightTable *table)
+{
+   if (!table)
+   {
+      return;
+   }
+   for (int i = 0; i < table->buckets_len; i++)
+   {
+      struct Flight *flight = table->buckets[i];
+      while (flight)
+      {
+         struct Flight *next = flight->next;
+         free(flight);
+         flight = next;
+      }
+   }
+   free(table->buckets);
+   free(table);
+}
+
+static unsigned int flight_hash(enum CoroRequests coro_request_type, unsigned long long key)
+{
+   unsigned long long hash = (key ^ ((unsigned long long)coro_request_type << 56)) * 0x9e3779b97f4a7c15ULL;
+   return (unsigned int)(hash >> 32);
+}
+
+static struct Flight **flight_table_bucket(struct FlightTable *table, enum CoroRequests coro_request_type, unsigned long long key)
+{
+   return &(table->buckets[flight_hash(coro_request_type, key) & (unsigned int)(table->buckets_len - 1)]);
+}
+
+static struct Flight *flight_table_find(struct FlightTable *table, enum CoroRequests coro_request_type, unsigned long long key)
+{
+   struct Flight *flight = *flight_table_bucket(table, coro_request_type, key);
+   while (flight && ((flight->key != key) || (flight->coro_request_type != coro_request_type)))
+   {
+      flight = flight->next;
+   }
+   return flight;
+}
+
+// Keeps at most one flight per bucket on average; a table which can not grow just gets longer chains
+static void flight_table_grow(struct FlightTable *table)
+{
+   int new_buckets_len = 2 * table->buckets_len;
+   struct Flight **new_buckets = (struct Flight **)calloc(new_buckets_len, sizeof(struct Flight *));
+   if (!new_buckets)
+   {
+      return;
+   }
+   struct Flight **old_buckets = table->buckets;
+   int old_buckets_len = table->buckets_len;
+   table->buckets = new_buckets;
+   table->buckets_len = new_buckets_len;
+   for (int i = 0; i < old_buckets_len; i++)
+   {
+      struct Flight *flight = old_buckets[i];
+      while (flight)
+      {
+         struct Flight *next = flight->next;
+         struct Flight **bucket = flight_table_bucket(table, flight->coro_request_type, flight->key);
+         flight->next = *bucket;
+         *bucket = flight;
+         flight = next;
+      }
+   }
+   free(old_buckets);
+}
+
+static struct Flight *flight_table_add(struct FlightTable *table, enum CoroRequests coro_request_type, unsigned long long key)
+{
+   struct Flight *flight = (struct Flight *)malloc(sizeof(struct Flight));
+   if (!flight)
+   {
+      return NULL;
+   }
+   if (table->flights_num >= table->buckets_len)
+   {
+      flight_table_grow(table);
+   }
+   flight->coro_request_type = coro_request_type;
+   flight->key = key;
+   flight->waiters = NULL;
+   flight->waiters_num = 0;
+   struct Flight **bucket = flight_table_bucket(table, coro_request_type, key);
+   flight->next = *bucket;
+   *bucket = flight;
+   table->flights_num++;
+   return flight;
+}
+
+static void flight_table_remove(struct FlightTable *table, struct Flight *flight)
+{
+   struct Flight **link = flight_table_bucket(table, flight->coro_request_type, flight->key);
+   while (*link != flight)
+   {
+      link = &((*link)->next);
+   }
+   *link = flight->next;
+   table->flights_num--;
+}
+
+static void flight_add_waiter(struct Flight *flight, struct FlightRequest *waiter)
+{
+   waiter->flight = flight;
+   waiter->prev = NULL;
+   waiter->next = flight->waiters;
+   if (flight->waiters)
+   {
+      flight->waiters->prev = waiter;
+   }
+   flight->waiters = waiter;
+   flight->waiters_num++;
+}
+
+static void flight_remove_waiter(struct Flight *flight, struct FlightRequest *waiter)
+{
+   if (waiter->prev)
+   {
+      waiter->prev->next = waiter->next;
+   }
+   else
+   {
+      flight->waiters = waiter->next;
+   }
+   if (waiter->next)
+   {
+      waiter->next->prev = waiter->prev;
+   }
+   flight->waiters_num--;
+   waiter->flight = NULL;
+   waiter->prev = NULL;
+   waiter->next = NULL;
+}
+
+// on_complete of the dispatched request: the response is shared by the waiters which are still there
+static void coro_flight_complete(struct ServerData *server_data, struct RequestData *request_data, void *response)
+{
+   struct Flight *flight = (struct Flight *)request_data->on_complete_arg;
+   flight_table_remove(server_data->flights, flight);
+   struct SharedResponse *shared = NULL;
+   if (flight->waiters_num)
+   {
+      shared = (struct SharedResponse *)malloc(sizeof(struct SharedResponse));
+   }
+   if (shared)
+   {
+      shared->refs = flight->waiters_num;
+      shared->status = request_data->status;
+      shared->data = response;
+      shared->request = request_data->request;
+   }
+   else
+   {
+      free(response);
+      free(request_data->request);
+   }
+   enum RequestStatus status = request_data->status;
+   free(request_data);
+   struct FlightRequest *waiter = flight->waiters;
+   while (waiter)
+   {
+      struct FlightRequest *next = waiter->next;
+      waiter->response = shared;
+      waiter->flight = NULL;
+      if (shared)
+      {
+         server_complete(server_data, waiter->handle, NULL);
+      }
+      else
+      {
+         // The response is lost: the waiters must not take it for a NULL one
+         server_complete_failed(server_data, waiter->handle,
+                                (RequestStatusOk == status) ? RequestStatusOverloaded : status);
+      }
+      waiter = next;
+   }
+   free(flight);
+}
+
+// A cancelled waiter leaves the flight; the dispatched request still runs to completion
+static void coro_flight_cancel(struct ServerData *server_data, struct RequestData *request_data)
+{
+   struct FlightRequest *waiter = (struct FlightRequest *)request_data->request;
+   if (waiter->flight)
+   {
+      flight_remove_waiter(waiter->flight, waiter);
+   }
+}
+
+void coro_flight_service(struct ServerData *server_data, struct RequestData *request_data)
+{
+   // Points into the saved frame of the waiting coroutine already
+   struct FlightRequest *waiter = (struct FlightRequest *)request_data->request;
+   server_services_enter(server_data);
+   if (!server_data->flights)
+   {
+      server_data->flights = flight_table_create();
+   }
+   struct FlightTable *table = server_data->flights;
+   struct Flight *flight = table ? flight_table_find(table, waiter->coro_request_type, waiter->key) : NULL;
+   struct RequestData *dispatched = NULL;
+   if (flight)
+   {
+      // Only the dispatched request is looked at by the service
+      free(waiter->request);
+      waiter->request = NULL;
+      if (server_data->metrics)
+      {
+         metric_add(&(server_data->metrics->requests_coalesced), 1);
+      }
+   }
+   else if (table)
+   {
+      dispatched = (struct RequestData *)malloc(sizeof(struct RequestData));
+      flight = dispatched ? flight_table_add(table, waiter->coro_request_type, waiter->key) : NULL;
+      if (flight)
+      {
+         server_request_data_init(dispatched, waiter->coro_request_type, waiter->request, NULL, false);
+         dispatched->on_complete = coro_flight_complete;
+         dispatched->on_complete_arg = flight;
+         waiter->request = NULL;
+      }
+   }
+   if (!flight)
+   {
+      // Out of memory: the request stays with the coroutine, which fails
+      free(dispatched);
+      server_services_leave(server_data);
+      server_complete_failed(server_data, request_data, RequestStatusOverloaded);
+      return;
+   }
+   waiter->handle = server_hold_request(server_data, request_data);
+   flight_add_waiter(flight, waiter);
+   waiter->handle->on_cancel = coro_flight_cancel;
+   server_services_leave(server_data);
+   if (dispatched)
+   {
+      // May complete the flight, this waiter included, right away
+      server_dispatch_request(server_data, dispatched);
+   }
+}
+
+// Returns the shared response of the request with the key which is in flight, or of this request if none
+// is. The request is taken over and is freed by the loop; a coalesced one is never looked at. Returns NULL
+// if the request failed (see server_request_status()). The response must be released with
+// shared_response_release().
+struct SharedResponse *server_request_coalesced(struct ServerData *server_data, enum CoroRequests coro_request_type,
+                                                unsigned long long key, void *request)
+{
+   struct FlightRequest waiter;
+   waiter.coro_request_type = coro_request_type;
+   waiter.key = key;
+   waiter.request = request;
+   waiter.response = NULL;
+   waiter.handle = NULL;
+   waiter.flight = NULL;
+   waiter.prev = NULL;
+   waiter.next = NULL;
+   bool completed = server_request_inplace(server_data, CoroRequestCoalesced, &waiter, NULL);
+   // Still here if the request was refused before it got to the flight table
+   free(waiter.request);
+   if (!completed || !waiter.response)
+   {
+      return NULL;
+   }
+   if (RequestStatusOk != waiter.response->status)
+   {
+      ((struct CoroArgs *)coroutine_payload(server_current_coro(server_data)))->request_status = waiter.response->status;
+      shared_response_release(waiter.response);
+      return NULL;
+   }
+   return waiter.response;
+}
+
+// For a coroutine which passes the response on to another coroutine of the same server
+void shared_response_retain(struct SharedResponse *response)
+{
+   if (response)
+   {
+      response->refs++;
+   }
+}
+
+void shared_response_release(struct SharedResponse *response)
+{
+   if (!response || (0 < --response->refs))
+   {
+      return;
+   }
+   free(response->data);
+   free(response->request);
+   free(response);
+}
@@ -0,0 +1,59 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#ifndef C_CORO_FLIGHT_H
+#define C_CORO_FLIGHT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "scheduler.h"
+
+// Single-flight request coalescing. Requests of one type tagged with the same key share one service
+// call while it is in flight: the first one is dispatched, the ones that arrive before it completes only
+// join its waiter list. All waiters get the same refcounted response, so a burst of identical requests
+// costs one service call and one response buffer instead of one per coroutine.
+//
+// Only the dispatched request is seen by the service. A request which would have returned a different
+// response for one of the waiters must not be coalesced.
+
+// Response of a flight; read-only for the waiters. Released on the loop thread only.
+struct SharedResponse
+{
+   int refs;
+   enum RequestStatus status; // of the dispatched request
+   void *data; // the response of the service; NULL if the request failed
+   void *request; // the dispatched request, for services which write their result into it (e.g. offload)
+};
+
+// Request of CoroRequestCoalesced; lives in the frame of the waiting coroutine
+struct FlightRequest
+{
+   enum CoroRequests coro_request_type;
+   unsigned long long key;
+   void *request; // heap; taken over by the flight table
+   struct SharedResponse *response;
+   request_handle_t handle;
+   struct Flight *flight;
+   struct FlightRequest *prev; // waiters of one flight
+   struct FlightRequest *next;
+};
+
+struct FlightTable;
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+struct SharedResponse *server_request_coalesced(struct ServerData *server_data, enum CoroRequests coro_request_type,
+                                                unsigned long long key, void *request);
+void shared_response_retain(struct SharedResponse *response);
+void shared_response_release(struct SharedResponse *response);
+
+void coro_flight_service(struct ServerData *server_data, struct RequestData *request_data);
+void flight_table_free(struct FlightTable *table);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
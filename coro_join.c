@@ -0,0 +1,395 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coroutine.h"
+#include "scheduler.h"
+#include "coro_sync.h"
+#include "coro_join.h"
+
+// Slots are allocated in chunks which never move: parked joiners point to the wait queues inside them
+#define JOIN_CHUNK_BITS 8
+#define JOIN_CHUNK_SLOTS (1 << JOIN_CHUNK_BITS)
+
+struct JoinSlot
+{
+   unsigned int generation; // odd while the slot is taken
+   bool finished;
+   bool detached;
+   void *result;
+   coroutine_t coro; // NULL once finished
+   int next_free;
+   struct CoroWaitQueue joiners;
+};
+
+struct JoinTable
+{
+   struct JoinSlot **chunks;
+   int chunks_num;
+   int free_slot; // -1 if none
+   struct CoroWaitQueue any_joiners; // data: the handles of server_join_any()
+};
+
+struct JoinTable *join_table_create(void)
+{
+   struct JoinTable *table = (struct JoinTable *)malloc(sizeof(struct JoinTable));
+   if (!table)
+   {
+      return NULL;
+   }
+   table->chunks = NULL;
+   table->chunks_num = 0;
+   table->free_slot = -1;
+   coro_wait_queue_init(&(table->any_joiners));
+   return table;
+}
+
+void join_table_free(struct JoinTable *table)
+{
+   if (!table)
+   {
+      return;
+   }
+   for (int i = 0; i < table->chunks_num; i++)
+   {
+      free(table->chunks[i]);
+   }
+   free(table->chunks);
+   free(table);
+}
+
+static struct JoinSlot *join_table_slot(struct JoinTable *table, int slot_index)
+{
+   return &(table->chunks[slot_index >> JOIN_CHUNK_BITS][slot_index & (JOIN_CHUNK_SLOTS - 1)]);
+}
+
+static int join_table_take_slot(struct JoinTable *table)
+{
+   if (0 > table->free_slot)
+   {
+      struct JoinSlot **chunks = (struct JoinSlot **)realloc(table->chunks, sizeof(struct JoinSlot *) * (table->chunks_num + 1));
+      if (!chunks)
+      {
+         return -1;
+      }
+      table->chunks = chunks;
+      struct JoinSlot *chunk = (struct JoinSlot *)malloc(sizeof(struct JoinSlot) * JOIN_CHUNK_SLOTS);
+      if (!chunk)
+      {
+         return -1;
+      }
+      int first = table->chunks_num * JOIN_CHUNK_SLOTS;
+      for (int i = 0; i < JOIN_CHUNK_SLOTS; i++)
+      {
+         chunk[i].generation = 0;
+         chunk[i].next_free = (JOIN_CHUNK_SLOTS - 1 > i) ? first + i + 1 : -1;
+         coro_wait_queue_init(&(chunk[i].joiners));
+      }
+      table->chunks[table->chunks_num++] = chunk;
+      table->free_slot = first;
+   }
+   int slot_index = table->free_slot;
+   struct JoinSlot *slot = join_table_slot(table, slot_index);
+   table->free_slot = slot->next_free;
+   slot->generation++;
+   slot->finished = false;
+   slot->detached = false;
+   slot->result = NULL;
+   slot->coro = NULL;
+   return slot_index;
+}
+
+static void join_table_release_slot(struct JoinTable *table, int slot_index)
+{
+   struct JoinSlot *slot = join_table_slot(table, slot_index);
+   slot->generation++;
+   slot->next_free = table->free_slot;
+   table->free_slot = slot_index;
+}
+
+static coro_join_handle_t join_handle(struct JoinTable *table, int slot_index)
+{
+   return ((coro_join_handle_t)join_table_slot(table, slot_index)->generation << 32) | (unsigned int)slot_index;
+}
+
+// NULL for stale and foreign handles
+static struct JoinSlot *join_table_find(struct JoinTable *table, coro_join_handle_t handle)
+{
+   if (!table)
+   {
+      return NULL;
+   }
+   int slot_index = (int)(handle & 0xffffffffu);
+   unsigned int generation = (unsigned int)(handle >> 32);
+   if (0 > slot_index || slot_index >= table->chunks_num * JOIN_CHUNK_SLOTS || !(generation & 1))
+   {
+      return NULL;
+   }
+   struct JoinSlot *slot = join_table_slot(table, slot_index);
+   return (slot->generation == generation) ? slot : NULL;
+}
+
+coro_join_handle_t server_spawn_priority(struct ServerData *server_data, coroutine_callable coroutine_body, void* coro_payload,
+                                         enum CoroPriority priority)
+{
+   if (!server_data)
+   {
+      return 0;
+   }
+   server_services_enter(server_data);
+   if (!server_data->joins)
+   {
+      server_data->joins = join_table_create();
+   }
+   int slot_index = server_data->joins ? join_table_take_slot(server_data->joins) : -1;
+   coro_join_handle_t handle = 0;
+   if (0 <= slot_index)
+   {
+      if (0 > server_register_coro_joinable(server_data, coroutine_body, coro_payload, priority, slot_index))
+      {
+         join_table_release_slot(server_data->joins, slot_index);
+      }
+      else
+      {
+         handle = join_handle(server_data->joins, slot_index);
+      }
+   }
+   server_services_leave(server_data);
+   return handle;
+}
+
+coro_join_handle_t server_spawn(struct ServerData *server_data, coroutine_callable coroutine_body, void* coro_payload)
+{
+   return server_spawn_priority(server_data, coroutine_body, coro_payload, CoroPriorityNormal);
+}
+
+// Called by a spawned coroutine
+void server_set_join_result(struct ServerData *server_data, void *result)
+{
+   coroutine_t coro = server_current_coro(server_data);
+   if (!coro)
+   {
+      return;
+   }
+   struct CoroArgs *coro_args = (struct CoroArgs *)coroutine_payload(coro);
+   if (0 > coro_args->join_slot)
+   {
+      return;
+   }
+   server_services_enter(server_data);
+   join_table_slot(server_data->joins, coro_args->join_slot)->result = result;
+   server_services_leave(server_data);
+}
+
+static bool join_handles_finished(struct JoinTable *table, struct CoroWaiter *waiter)
+{
+   const coro_join_handle_t *handles = (const coro_join_handle_t *)waiter->data;
+   for (size_t i = 0; i < waiter->data_len; i++)
+   {
+      struct JoinSlot *slot = join_table_find(table, handles[i]);
+      if (slot && slot->finished)
+      {
+         return true;
+      }
+   }
+   return false;
+}
+
+// Called by server_register_coro_joinable() once the coroutine exists
+void join_table_set_coro(struct JoinTable *table, int slot_index, coroutine_t coro)
+{
+   join_table_slot(table, slot_index)->coro = coro;
+}
+
+// Called by a spawned coroutine right before it returns, or when it is cancelled before it started
+void join_table_finish(struct ServerData *server_data, int slot_index)
+{
+   server_services_enter(server_data);
+   struct JoinTable *table = server_data->joins;
+   struct JoinSlot *slot = join_table_slot(table, slot_index);
+   slot->finished = true;
+   slot->coro = NULL;
+   // Joiners of a handle detached while they were waiting are woken as well: their join fails
+   coro_wait_queue_wake_all(server_data, &(slot->joiners));
+   struct CoroWaiter *waiter = table->any_joiners.head;
+   while (waiter)
+   {
+      struct CoroWaiter *next = waiter->next;
+      if (join_handles_finished(table, waiter))
+      {
+         coro_wait_queue_remove(&(table->any_joiners), waiter);
+         server_complete(server_data, waiter->handle, NULL);
+      }
+      waiter = next;
+   }
+   if (slot->detached)
+   {
+      join_table_release_slot(table, slot_index);
+   }
+   server_services_leave(server_data);
+}
+
+static bool join_try_park_one(struct ServerData *server_data, void *primitive, struct CoroWaiter *waiter)
+{
+   struct JoinSlot *slot = join_table_find((struct JoinTable *)primitive, waiter->ticket);
+   return !slot || slot->finished;
+}
+
+static bool join_try_park_any(struct ServerData *server_data, void *primitive, struct CoroWaiter *waiter)
+{
+   return join_handles_finished((struct JoinTable *)primitive, waiter);
+}
+
+// Collects a finished coroutine: its slot becomes free for the next spawn
+static bool join_collect(struct ServerData *server_data, coro_join_handle_t handle, void **result)
+{
+   struct JoinSlot *slot = join_table_find(server_data->joins, handle);
+   if (!slot || !slot->finished)
+   {
+      return false;
+   }
+   if (result)
+   {
+      *result = slot->result;
+   }
+   join_table_release_slot(server_data->joins, (int)(handle & 0xffffffffu));
+   return true;
+}
+
+// Waits for the coroutine and takes its result. Fails for stale or detached handles and when another
+// coroutine joined the same handle first.
+bool server_join(struct ServerData *server_data, coro_join_handle_t handle, void **result)
+{
+   if (!server_data)
+   {
+      return false;
+   }
+   server_services_enter(server_data);
+   struct JoinSlot *slot = join_table_find(server_data->joins, handle);
+   if (!slot || slot->detached)
+   {
+      server_services_leave(server_data);
+      return false;
+   }
+   if (!slot->finished)
+   {
+      server_services_leave(server_data);
+      struct CoroParkRequest park;
+      coro_park_init(&park, server_data->joins, &(slot->joiners), join_try_park_one);
+      park.waiter.ticket = handle;
+      coro_park(server_data, &park);
+      server_services_enter(server_data);
+   }
+   bool joined = join_collect(server_data, handle, result);
+   server_services_leave(server_data);
+   return joined;
+}
+
+// Joins each of the handles; the caller is resumed at most once per coroutine still running.
+// Returns the number of coroutines joined; results may be NULL.
+int server_join_all(struct ServerData *server_data, const coro_join_handle_t *handles, int handles_num, void **results)
+{
+   int joined_num = 0;
+   for (int i = 0; i < handles_num; i++)
+   {
+      void *result = NULL;
+      if (server_join(server_data, handles[i], &result))
+      {
+         joined_num++;
+      }
+      if (results)
+      {
+         results[i] = result;
+      }
+   }
+   return joined_num;
+}
+
+// Waits until any of the coroutines finishes and joins it. Returns its index in handles,
+// -1 if none of the handles can be joined.
+int server_join_any(struct ServerData *server_data, const coro_join_handle_t *handles, int handles_num, void **result)
+{
+   if (!server_data || !handles)
+   {
+      return -1;
+   }
+   while (true)
+   {
+      server_services_enter(server_data);
+      bool waitable = false;
+      for (int i = 0; i < handles_num; i++)
+      {
+         struct JoinSlot *slot = join_table_find(server_data->joins, handles[i]);
+         if (!slot || slot->detached)
+         {
+            continue;
+         }
+         if (join_collect(server_data, handles[i], result))
+         {
+            server_services_leave(server_data);
+            return i;
+         }
+         waitable = true;
+      }
+      server_services_leave(server_data);
+      if (!waitable)
+      {
+         return -1;
+      }
+      struct CoroParkRequest park;
+      coro_park_init(&park, server_data->joins, &(server_data->joins->any_joiners), join_try_park_any);
+      park.waiter.data = (void *)handles;
+      park.waiter.data_len = (size_t)handles_num;
+      if (!coro_park(server_data, &park))
+      {
+         // The joiner was cancelled
+         return -1;
+      }
+   }
+}
+
+// The coroutine releases its slot when it returns; its result is dropped
+bool server_detach(struct ServerData *server_data, coro_join_handle_t handle)
+{
+   if (!server_data)
+   {
+      return false;
+   }
+   server_services_enter(server_data);
+   struct JoinSlot *slot = join_table_find(server_data->joins, handle);
+   bool detached = false;
+   if (slot && !slot->detached)
+   {
+      detached = true;
+      if (slot->finished)
+      {
+         join_table_release_slot(server_data->joins, (int)(handle & 0xffffffffu));
+      }
+      else
+      {
+         slot->detached = true;
+      }
+   }
+   server_services_leave(server_data);
+   return detached;
+}
+
+// See server_cancel_coro(). The coroutine can still be joined; its result is whatever it set while unwinding.
+bool server_cancel(struct ServerData *server_data, coro_join_handle_t handle)
+{
+   if (!server_data)
+   {
+      return false;
+   }
+   server_services_enter(server_data);
+   struct JoinSlot *slot = join_table_find(server_data->joins, handle);
+   coroutine_t coro = (slot && !slot->finished) ? slot->coro : NULL;
+   bool cancelled = coro && server_cancel_coro(server_data, coro);
+   server_services_leave(server_data);
+   return cancelled;
+}
@@ -0,0 +1,41 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#ifndef C_CORO_JOIN_H
+#define C_CORO_JOIN_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "scheduler.h"
+
+// Join handles for spawned coroutines. A handle is a slot of the server's join table tagged with the
+// slot's generation, so a handle of a collected coroutine never matches a later one. Joiners park on
+// the slot (see coro_sync.h) until the coroutine returns. A finished coroutine keeps its slot and its
+// result until it is joined once; detached coroutines release the slot when they return.
+
+typedef unsigned long long coro_join_handle_t; // 0 is never a valid handle
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+coro_join_handle_t server_spawn(struct ServerData *server_data, coroutine_callable coroutine_body, void* coro_payload);
+coro_join_handle_t server_spawn_priority(struct ServerData *server_data, coroutine_callable coroutine_body, void* coro_payload,
+                                         enum CoroPriority priority);
+void server_set_join_result(struct ServerData *server_data, void *result);
+bool server_join(struct ServerData *server_data, coro_join_handle_t handle, void **result);
+int server_join_all(struct ServerData *server_data, const coro_join_handle_t *handles, int handles_num, void **results);
+int server_join_any(struct ServerData *server_data, const coro_join_handle_t *handles, int handles_num, void **result);
+bool server_detach(struct ServerData *server_data, coro_join_handle_t handle);
+bool server_cancel(struct ServerData *server_data, coro_join_handle_t handle);
+
+struct JoinTable *join_table_create(void);
+void join_table_free(struct JoinTable *table);
+void join_table_set_coro(struct JoinTable *table, int slot_index, coroutine_t coro);
+void join_table_finish(struct ServerData *server_data, int slot_index);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
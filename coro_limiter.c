@@ -0,0 +1,388 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coroutine.h"
+#include "scheduler.h"
+#include "coro_sync.h"
+#include "coro_limiter.h"
+
+// Absorbs the rounding of the refill arithmetic, so a timer which fires on time finds the tokens there
+#define LIMITER_EPSILON 1e-9
+
+struct RateBucket
+{
+   char *name;
+   unsigned long long hash;
+   struct RateBucket *next; // in the hash chain
+   double tokens_per_second;
+   double burst;
+   double tokens;
+   unsigned long long refilled_ns;
+   struct CoroWaitQueue waiters; // ticket: the tokens the waiter asked for
+   bool timer_armed;
+   double timer_seconds;
+   double timer_rate; // the tokens_per_second the timer was armed at
+   struct RequestData timer; // CoroRequestSleep completed into rate_bucket_timer_fired()
+};
+
+struct RateLimiter
+{
+   struct RateBucket **buckets;
+   int buckets_len; // a power of two
+   int buckets_num;
+};
+
+static struct RateLimiter *rate_limiter_create(void)
+{
+   struct RateLimiter *limiter = (struct RateLimiter *)malloc(sizeof(struct RateLimiter));
+   if (!limiter)
+   {
+      return NULL;
+   }
+   limiter->buckets = (struct RateBucket **)calloc(LIMITER_MIN_BUCKETS, sizeof(struct RateBucket *));
+   if (!limiter->buckets)
+   {
+      free(limiter);
+      return NULL;
+   }
+   limiter->buckets_len = LIMITER_MIN_BUCKETS;
+   limiter->buckets_num = 0;
+   return limiter;
+}
+
+// Called by server_free() after the parked coroutines and the held timers are gone
+void rate_limiter_free(struct RateLimiter *limiter)
+{
+   if (!limiter)
+   {
+      return;
+   }
+   for (int i = 0; i < limiter->buckets_len; i++)
+   {
+      struct RateBucket *bucket = limiter->buckets[i];
+      while (bucket)
+      {
+         struct RateBucket *next = bucket->next;
+         free(bucket->name);
+         free(bucket);
+         bucket = next;
+      }
+   }
+   free(limiter->buckets);
+   free(limiter);
+}
+
+// FNV-1a
+static unsigned long long rate_limiter_hash(const char *name)
+{
+   unsigned long long hash = 0xcbf29ce484222325ULL;
+   for (const unsigned char *c = (const unsigned char *)name; *c; c++)
+   {
+      hash = (hash ^ *c) * 0x100000001b3ULL;
+   }
+   return hash;
+}
+
+static struct RateBucket *rate_limiter_find(struct RateLimiter *limiter, const char *name)
+{
+   if (!limiter || !name)
+   {
+      return NULL;
+   }
+   unsigned long long hash = rate_limiter_hash(name);
+   struct RateBucket *bucket = limiter->buckets[hash & (unsigned long long)(limiter->buckets_len - 1)];
+   while (bucket && ((bucket->hash != hash) || strcmp(bucket->name, name)))
+   {
+      bucket = bucket->next;
+   }
+   return bucket;
+}
+
+// Buckets never move: parked waiters and the sleep service point to them
+static void rate_limiter_grow(struct RateLimiter *limiter)
+{
+   int new_buckets_len = 2 * limiter->buckets_len;
+   struct RateBucket **new_buckets = (struct RateBucket **)calloc(new_buckets_len, sizeof(struct RateBucket *));
+   if (!new_buckets)
+   {
+      return;
+   }
+   for (int i = 0; i < limiter->buckets_len; i++)
+   {
+      struct RateBucket *bucket = limiter->buckets[i];
+      while (bucket)
+      {
+         struct RateBucket *next = bucket->next;
+         int index = (int)(bucket->hash & (unsigned long long)(new_buckets_len - 1));
+         bucket->next = new_buckets[index];
+         new_buckets[index] = bucket;
+         bucket = next;
+      }
+   }
+   free(limiter->buckets);
+   limiter->buckets = new_buckets;
+   limiter->buckets_len = new_buckets_len;
+}
+
+static struct RateBucket *rate_limiter_add(struct RateLimiter *limiter, const char *name)
+{
+   struct RateBucket *bucket = (struct RateBucket *)malloc(sizeof(struct RateBucket));
+   size_t name_len = strlen(name);
+   char *bucket_name = (char *)malloc(name_len + 1);
+   if (!bucket || !bucket_name)
+   {
+      free(bucket);
+      free(bucket_name);
+      return NULL;
+   }
+   if (limiter->buckets_num >= limiter->buckets_len)
+   {
+      rate_limiter_grow(limiter);
+   }
+   memcpy(bucket_name, name, name_len + 1);
+   bucket->name = bucket_name;
+   bucket->hash = rate_limiter_hash(name);
+   bucket->tokens_per_second = 0.0;
+   bucket->burst = 0.0;
+   bucket->tokens = 0.0;
+   bucket->refilled_ns = server_monotonic_ns();
+   coro_wait_queue_init(&(bucket->waiters));
+   bucket->timer_armed = false;
+   bucket->timer_seconds = 0.0;
+   bucket->timer_rate = 0.0;
+   int index = (int)(bucket->hash & (unsigned long long)(limiter->buckets_len - 1));
+   bucket->next = limiter->buckets[index];
+   limiter->buckets[index] = bucket;
+   limiter->buckets_num++;
+   return bucket;
+}
+
+static void rate_bucket_refill(struct RateBucket *bucket, unsigned long long now_ns)
+{
+   if (now_ns > bucket->refilled_ns)
+   {
+      bucket->tokens += (double)(now_ns - bucket->refilled_ns) * bucket->tokens_per_second / 1000000000.0;
+      if (bucket->tokens > bucket->burst)
+      {
+         bucket->tokens = bucket->burst;
+      }
+   }
+   bucket->refilled_ns = now_ns;
+}
+
+static bool rate_bucket_take(struct RateBucket *bucket, unsigned long long tokens)
+{
+   if (bucket->tokens + LIMITER_EPSILON < (double)tokens)
+   {
+      return false;
+   }
+   bucket->tokens -= (double)tokens;
+   if (0.0 > bucket->tokens)
+   {
+      bucket->tokens = 0.0;
+   }
+   return true;
+}
+
+static void rate_bucket_timer_fired(struct ServerData *server_data, struct RequestData *request_data, void *response);
+
+// Resumes the first waiter without the tokens; its server_rate_acquire() returns false
+static void rate_bucket_fail_first(struct ServerData *server_data, struct RateBucket *bucket, enum RequestStatus status)
+{
+   request_handle_t handle = bucket->waiters.head->handle;
+   handle->status = status;
+   // The coroutine is suspended, nobody else looks at its arguments
+   ((struct CoroArgs *)coroutine_payload(handle->coro))->request_status = status;
+   coro_wait_queue_wake_one(server_data, &(bucket->waiters));
+}
+
+// One timer per bucket, for the moment the first waiter can be served. It is a sleep request of the
+// loop's own, so the waiters cost nothing until then. A timer armed at an older rate is dropped.
+static void rate_bucket_arm_timer(struct ServerData *server_data, struct RateBucket *bucket, unsigned long long first_tokens)
+{
+   if (0.0 >= bucket->tokens_per_second)
+   {
+      return;
+   }
+   double missing = (double)first_tokens - bucket->tokens;
+   double seconds = (0.0 < missing) ? missing / bucket->tokens_per_second + 1e-9 : 0.0;
+   if (bucket->timer_armed)
+   {
+      if ((bucket->timer_rate == bucket->tokens_per_second) ||
+          !server_cancel_request(server_data, &(bucket->timer), RequestStatusCancelled))
+      {
+         return;
+      }
+   }
+   bucket->timer_seconds = seconds;
+   bucket->timer_rate = bucket->tokens_per_second;
+   bucket->timer_armed = true;
+   server_request_data_init(&(bucket->timer), CoroRequestSleep, &(bucket->timer_seconds), NULL, true);
+   bucket->timer.on_complete = rate_bucket_timer_fired;
+   bucket->timer.on_complete_arg = bucket;
+   server_dispatch_request(server_data, &(bucket->timer));
+}
+
+// Hands the tokens to the waiters in order. A waiter which asked for more than the burst (after the
+// bucket was reconfigured) can never be served and fails.
+static void rate_bucket_serve(struct ServerData *server_data, struct RateBucket *bucket)
+{
+   rate_bucket_refill(bucket, server_monotonic_ns());
+   struct CoroWaiter *waiter = bucket->waiters.head;
+   while (waiter)
+   {
+      if ((double)waiter->ticket > bucket->burst)
+      {
+         rate_bucket_fail_first(server_data, bucket, RequestStatusOverloaded);
+      }
+      else if (rate_bucket_take(bucket, waiter->ticket))
+      {
+         coro_wait_queue_wake_one(server_data, &(bucket->waiters));
+      }
+      else
+      {
+         break;
+      }
+      waiter = bucket->waiters.head;
+   }
+   if (waiter)
+   {
+      rate_bucket_arm_timer(server_data, bucket, waiter->ticket);
+   }
+}
+
+static void rate_bucket_timer_fired(struct ServerData *server_data, struct RequestData *request_data, void *response)
+{
+   struct RateBucket *bucket = (struct RateBucket *)request_data->on_complete_arg;
+   bucket->timer_armed = false;
+   if (request_data->cancelled)
+   {
+      // Dropped by rate_bucket_arm_timer(), which arms the new one right away
+      return;
+   }
+   if (RequestStatusOk == request_data->status)
+   {
+      rate_bucket_serve(server_data, bucket);
+      return;
+   }
+   // The loop refused the timer (see server_set_max_pending_requests()): nobody would wake the waiters
+   while (bucket->waiters.head)
+   {
+      rate_bucket_fail_first(server_data, bucket, request_data->status);
+   }
+}
+
+// Called by the park service before the waiter is queued
+static bool rate_bucket_try_park(struct ServerData *server_data, void *primitive, struct CoroWaiter *waiter)
+{
+   struct RateBucket *bucket = (struct RateBucket *)primitive;
+   // The tokens belong to the first waiter, later ones do not take them over
+   if (!bucket->waiters.head)
+   {
+      rate_bucket_refill(bucket, server_monotonic_ns());
+      if (rate_bucket_take(bucket, waiter->ticket))
+      {
+         return true;
+      }
+      rate_bucket_arm_timer(server_data, bucket, waiter->ticket);
+   }
+   return false;
+}
+
+// Creates the bucket full or changes its rate and burst; waiters are served at the new rate
+bool server_rate_limit(struct ServerData *server_data, const char *name, double tokens_per_second, unsigned long long burst)
+{
+   if (!server_data || !name)
+   {
+      return false;
+   }
+   server_services_enter(server_data);
+   if (!server_data->limiter)
+   {
+      server_data->limiter = rate_limiter_create();
+   }
+   struct RateBucket *bucket = rate_limiter_find(server_data->limiter, name);
+   bool created = false;
+   if (!bucket && server_data->limiter)
+   {
+      bucket = rate_limiter_add(server_data->limiter, name);
+      created = true;
+   }
+   if (bucket)
+   {
+      rate_bucket_refill(bucket, server_monotonic_ns());
+      bucket->tokens_per_second = tokens_per_second;
+      bucket->burst = (double)burst;
+      bucket->tokens = (created || bucket->tokens > bucket->burst) ? bucket->burst : bucket->tokens;
+      rate_bucket_serve(server_data, bucket);
+   }
+   server_services_leave(server_data);
+   return NULL != bucket;
+}
+
+// Takes the tokens right away if no other coroutine waits for the bucket
+bool server_rate_try_acquire(struct ServerData *server_data, const char *name, unsigned long long tokens)
+{
+   if (!server_data)
+   {
+      return false;
+   }
+   server_services_enter(server_data);
+   struct RateBucket *bucket = rate_limiter_find(server_data->limiter, name);
+   bool acquired = false;
+   if (bucket && !bucket->waiters.head)
+   {
+      rate_bucket_refill(bucket, server_monotonic_ns());
+      acquired = rate_bucket_take(bucket, tokens);
+   }
+   server_services_leave(server_data);
+   return acquired;
+}
+
+// Parks the coroutine until the tokens are there. False for unknown buckets, for more tokens than the
+// burst and when the wait was cancelled.
+bool server_rate_acquire(struct ServerData *server_data, const char *name, unsigned long long tokens)
+{
+   if (!server_data)
+   {
+      return false;
+   }
+   server_services_enter(server_data);
+   struct RateBucket *bucket = rate_limiter_find(server_data->limiter, name);
+   bool acquired = false;
+   bool possible = bucket && ((double)tokens <= bucket->burst);
+   if (possible && !bucket->waiters.head)
+   {
+      rate_bucket_refill(bucket, server_monotonic_ns());
+      acquired = rate_bucket_take(bucket, tokens);
+   }
+   server_services_leave(server_data);
+   if (acquired || !possible)
+   {
+      return acquired;
+   }
+   struct CoroParkRequest park;
+   coro_park_init(&park, bucket, &(bucket->waiters), rate_bucket_try_park);
+   park.waiter.ticket = tokens;
+   return coro_park(server_data, &park);
+}
+
+// -1 for unknown buckets
+int server_rate_waiters_num(struct ServerData *server_data, const char *name)
+{
+   if (!server_data)
+   {
+      return -1;
+   }
+   server_services_enter(server_data);
+   struct RateBucket *bucket = rate_limiter_find(server_data->limiter, name);
+   int waiters_num = bucket ? bucket->waiters.waiters_num : -1;
+   server_services_leave(server_data);
+   return waiters_num;
+}
@@ -0,0 +1,35 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#ifndef C_CORO_LIMITER_H
+#define C_CORO_LIMITER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "scheduler.h"
+
+// Token bucket rate limiters, looked up by name. A coroutine which asks for more tokens than its bucket
+// holds parks on the bucket (see coro_sync.h). Waiters are served in FIFO order by a single timer per
+// bucket, which is armed for the moment the first waiter's tokens are refilled: a throttled coroutine
+// is resumed once, when it may proceed, and a refill costs O(1) per woken waiter.
+
+#define LIMITER_MIN_BUCKETS 16
+
+struct RateLimiter;
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+bool server_rate_limit(struct ServerData *server_data, const char *name, double tokens_per_second, unsigned long long burst);
+bool server_rate_acquire(struct ServerData *server_data, const char *name, unsigned long long tokens);
+bool server_rate_try_acquire(struct ServerData *server_data, const char *name, unsigned long long tokens);
+int server_rate_waiters_num(struct ServerData *server_data, const char *name);
+
+void rate_limiter_free(struct RateLimiter *limiter);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
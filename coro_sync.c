@@ -0,0 +1,389 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "coroutine.h"
+#include "scheduler.h"
+#include "coro_sync.h"
+
+void coro_wait_queue_init(struct CoroWaitQueue *queue)
+{
+   queue->head = NULL;
+   queue->tail = NULL;
+   queue->waiters_num = 0;
+}
+
+static void coro_wait_queue_push(struct CoroWaitQueue *queue, struct CoroWaiter *waiter)
+{
+   waiter->queue = queue;
+   waiter->next = NULL;
+   waiter->prev = queue->tail;
+   if (queue->tail)
+   {
+      queue->tail->next = waiter;
+   }
+   else
+   {
+      queue->head = waiter;
+   }
+   queue->tail = waiter;
+   queue->waiters_num++;
+}
+
+static struct CoroWaiter *coro_wait_queue_pop(struct CoroWaitQueue *queue)
+{
+   struct CoroWaiter *waiter = queue->head;
+   if (!waiter)
+   {
+      return NULL;
+   }
+   queue->head = waiter->next;
+   if (queue->head)
+   {
+      queue->head->prev = NULL;
+   }
+   else
+   {
+      queue->tail = NULL;
+   }
+   queue->waiters_num--;
+   waiter->queue = NULL;
+   waiter->next = NULL;
+   return waiter;
+}
+
+void coro_wait_queue_remove(struct CoroWaitQueue *queue, struct CoroWaiter *waiter)
+{
+   if (waiter->queue != queue)
+   {
+      return;
+   }
+   if (waiter->prev)
+   {
+      waiter->prev->next = waiter->next;
+   }
+   else
+   {
+      queue->head = waiter->next;
+   }
+   if (waiter->next)
+   {
+      waiter->next->prev = waiter->prev;
+   }
+   else
+   {
+      queue->tail = waiter->prev;
+   }
+   queue->waiters_num--;
+   waiter->queue = NULL;
+   waiter->prev = NULL;
+   waiter->next = NULL;
+}
+
+// The waiter lives in the saved frame of its coroutine, which is released on the next resume:
+// it is unlinked before its request is completed.
+bool coro_wait_queue_wake_one(struct ServerData *server_data, struct CoroWaitQueue *queue)
+{
+   struct CoroWaiter *waiter = coro_wait_queue_pop(queue);
+   if (!waiter)
+   {
+      return false;
+   }
+   server_complete(server_data, waiter->handle, NULL);
+   return true;
+}
+
+int coro_wait_queue_wake_all(struct ServerData *server_data, struct CoroWaitQueue *queue)
+{
+   int woken_num = 0;
+   while (coro_wait_queue_wake_one(server_data, queue))
+   {
+      woken_num++;
+   }
+   return woken_num;
+}
+
+void coro_park_init(struct CoroParkRequest *park, void *primitive, struct CoroWaitQueue *queue, coro_try_acquire try_acquire)
+{
+   park->primitive = primitive;
+   park->queue = queue;
+   park->try_acquire = try_acquire;
+   park->waiter.queue = NULL;
+   park->waiter.prev = NULL;
+   park->waiter.next = NULL;
+   park->waiter.handle = NULL;
+   park->waiter.ticket = 0;
+   park->waiter.data = NULL;
+   park->waiter.data_len = 0;
+   park->waiter.data_done = 0;
+}
+
+// Suspends the current coroutine until a release completes its park request. The primitive must be
+// checked before the call; try_acquire repeats the check in the service because the primitive could
+// have been released by other coroutines in the meantime. The park request has to be in the frame
+// of the current coroutine. Returns false if the wait was cancelled (see server_cancel_coro()): nothing
+// was acquired then.
+bool coro_park(struct ServerData *server_data, struct CoroParkRequest *park)
+{
+   return server_request_inplace(server_data, CoroRequestPark, park, NULL);
+}
+
+// The request of a parked coroutine may be cancelled (see server_request_many() and server_cancel_coro());
+// nothing was acquired
+static void coro_park_cancel(struct ServerData *server_data, struct RequestData *request_data)
+{
+   struct CoroParkRequest *park = (struct CoroParkRequest *)request_data->request;
+   coro_wait_queue_remove(park->queue, &(park->waiter));
+}
+
+void coro_park_service(struct ServerData *server_data, struct RequestData *request_data)
+{
+   // Points into the saved frame of the parked coroutine already
+   struct CoroParkRequest *park = (struct CoroParkRequest *)request_data->request;
+   park->waiter.data = coroutine_saved_address(request_data->coro, park->waiter.data);
+   server_services_enter(server_data);
+   if (park->try_acquire(server_data, park->primitive, &(park->waiter)))
+   {
+      server_services_leave(server_data);
+      server_complete(server_data, request_data, NULL);
+      return;
+   }
+   park->waiter.handle = server_hold_request(server_data, request_data);
+   coro_wait_queue_push(park->queue, &(park->waiter));
+   park->waiter.handle->on_cancel = coro_park_cancel;
+   server_services_leave(server_data);
+}
+
+void coro_mutex_init(struct CoroMutex *mutex)
+{
+   mutex->locked = false;
+   coro_wait_queue_init(&(mutex->waiters));
+}
+
+static bool coro_mutex_try_park(struct ServerData *server_data, void *primitive, struct CoroWaiter *waiter)
+{
+   struct CoroMutex *mutex = (struct CoroMutex *)primitive;
+   if (mutex->locked)
+   {
+      return false;
+   }
+   mutex->locked = true;
+   return true;
+}
+
+bool coro_mutex_try_lock(struct ServerData *server_data, struct CoroMutex *mutex)
+{
+   server_services_enter(server_data);
+   bool locked = coro_mutex_try_park(server_data, mutex, NULL);
+   server_services_leave(server_data);
+   return locked;
+}
+
+// False if the coroutine was cancelled while waiting; the mutex is not locked then
+bool coro_mutex_lock(struct ServerData *server_data, struct CoroMutex *mutex)
+{
+   if (coro_mutex_try_lock(server_data, mutex))
+   {
+      return true;
+   }
+   // Resumed as the owner: the unlock hands the mutex over without releasing it
+   struct CoroParkRequest park;
+   coro_park_init(&park, mutex, &(mutex->waiters), coro_mutex_try_park);
+   return coro_park(server_data, &park);
+}
+
+void coro_mutex_unlock(struct ServerData *server_data, struct CoroMutex *mutex)
+{
+   server_services_enter(server_data);
+   if (!coro_wait_queue_wake_one(server_data, &(mutex->waiters)))
+   {
+      mutex->locked = false;
+   }
+   server_services_leave(server_data);
+}
+
+void coro_semaphore_init(struct CoroSemaphore *semaphore, long permits)
+{
+   semaphore->permits = permits;
+   coro_wait_queue_init(&(semaphore->waiters));
+}
+
+static bool coro_semaphore_try_park(struct ServerData *server_data, void *primitive, struct CoroWaiter *waiter)
+{
+   struct CoroSemaphore *semaphore = (struct CoroSemaphore *)primitive;
+   if (0 >= semaphore->permits)
+   {
+      return false;
+   }
+   semaphore->permits--;
+   return true;
+}
+
+bool coro_semaphore_try_acquire(struct ServerData *server_data, struct CoroSemaphore *semaphore)
+{
+   server_services_enter(server_data);
+   bool acquired = coro_semaphore_try_park(server_data, semaphore, NULL);
+   server_services_leave(server_data);
+   return acquired;
+}
+
+bool coro_semaphore_acquire(struct ServerData *server_data, struct CoroSemaphore *semaphore)
+{
+   if (coro_semaphore_try_acquire(server_data, semaphore))
+   {
+      return true;
+   }
+   struct CoroParkRequest park;
+   coro_park_init(&park, semaphore, &(semaphore->waiters), coro_semaphore_try_park);
+   return coro_park(server_data, &park);
+}
+
+// Permits go to the waiters first, in their arrival order
+void coro_semaphore_release(struct ServerData *server_data, struct CoroSemaphore *semaphore, long permits)
+{
+   server_services_enter(server_data);
+   while (0 < permits && coro_wait_queue_wake_one(server_data, &(semaphore->waiters)))
+   {
+      permits--;
+   }
+   semaphore->permits += permits;
+   server_services_leave(server_data);
+}
+
+void coro_event_init(struct CoroEvent *event, bool set)
+{
+   event->set = set;
+   coro_wait_queue_init(&(event->waiters));
+}
+
+static bool coro_event_try_park(struct ServerData *server_data, void *primitive, struct CoroWaiter *waiter)
+{
+   return ((struct CoroEvent *)primitive)->set;
+}
+
+bool coro_event_wait(struct ServerData *server_data, struct CoroEvent *event)
+{
+   server_services_enter(server_data);
+   bool set = event->set;
+   server_services_leave(server_data);
+   if (set)
+   {
+      return true;
+   }
+   struct CoroParkRequest park;
+   coro_park_init(&park, event, &(event->waiters), coro_event_try_park);
+   return coro_park(server_data, &park);
+}
+
+void coro_event_set(struct ServerData *server_data, struct CoroEvent *event)
+{
+   server_services_enter(server_data);
+   event->set = true;
+   coro_wait_queue_wake_all(server_data, &(event->waiters));
+   server_services_leave(server_data);
+}
+
+void coro_event_reset(struct ServerData *server_data, struct CoroEvent *event)
+{
+   server_services_enter(server_data);
+   event->set = false;
+   server_services_leave(server_data);
+}
+
+void coro_condition_init(struct CoroCondition *condition)
+{
+   condition->signals = 0;
+   coro_wait_queue_init(&(condition->waiters));
+}
+
+static bool coro_condition_try_park(struct ServerData *server_data, void *primitive, struct CoroWaiter *waiter)
+{
+   return ((struct CoroCondition *)primitive)->signals != waiter->ticket;
+}
+
+// Wakeups may be spurious: the predicate has to be checked again after the call. The mutex is locked
+// again even when the wait is cancelled; false is returned then.
+bool coro_condition_wait(struct ServerData *server_data, struct CoroCondition *condition, struct CoroMutex *mutex)
+{
+   server_services_enter(server_data);
+   unsigned long long ticket = condition->signals;
+   server_services_leave(server_data);
+   coro_mutex_unlock(server_data, mutex);
+   struct CoroParkRequest park;
+   coro_park_init(&park, condition, &(condition->waiters), coro_condition_try_park);
+   park.waiter.ticket = ticket;
+   bool woken = coro_park(server_data, &park);
+   // Parking is not cancelled twice, so this one waits for the mutex
+   return coro_mutex_lock(server_data, mutex) && woken;
+}
+
+void coro_condition_signal(struct ServerData *server_data, struct CoroCondition *condition)
+{
+   server_services_enter(server_data);
+   if (!coro_wait_queue_wake_one(server_data, &(condition->waiters)))
+   {
+      // Nobody is queued yet: a waiter on its way to the park service will see the new value
+      condition->signals++;
+   }
+   server_services_leave(server_data);
+}
+
+void coro_condition_broadcast(struct ServerData *server_data, struct CoroCondition *condition)
+{
+   server_services_enter(server_data);
+   condition->signals++;
+   coro_wait_queue_wake_all(server_data, &(condition->waiters));
+   server_services_leave(server_data);
+}
+
+void coro_waitgroup_init(struct CoroWaitGroup *waitgroup)
+{
+   waitgroup->count = 0;
+   coro_wait_queue_init(&(waitgroup->waiters));
+}
+
+static bool coro_waitgroup_try_park(struct ServerData *server_data, void *primitive, struct CoroWaiter *waiter)
+{
+   return 0 >= ((struct CoroWaitGroup *)primitive)->count;
+}
+
+// Returns false without changing the count if it would go below zero: more done() than add() is a bug
+// of the caller
+bool coro_waitgroup_add(struct ServerData *server_data, struct CoroWaitGroup *waitgroup, long delta)
+{
+   server_services_enter(server_data);
+   if (0 > waitgroup->count + delta)
+   {
+      server_services_leave(server_data);
+      return false;
+   }
+   waitgroup->count += delta;
+   if (0 == waitgroup->count)
+   {
+      coro_wait_queue_wake_all(server_data, &(waitgroup->waiters));
+   }
+   server_services_leave(server_data);
+   return true;
+}
+
+bool coro_waitgroup_done(struct ServerData *server_data, struct CoroWaitGroup *waitgroup)
+{
+   return coro_waitgroup_add(server_data, waitgroup, -1);
+}
+
+bool coro_waitgroup_wait(struct ServerData *server_data, struct CoroWaitGroup *waitgroup)
+{
+   server_services_enter(server_data);
+   bool done = 0 >= waitgroup->count;
+   server_services_leave(server_data);
+   if (done)
+   {
+      return true;
+   }
+   struct CoroParkRequest park;
+   coro_park_init(&park, waitgroup, &(waitgroup->waiters), coro_waitgroup_try_park);
+   return coro_park(server_data, &park);
+}
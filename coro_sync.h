@@ -0,0 +1,127 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#ifndef C_CORO_SYNC_H
+#define C_CORO_SYNC_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "scheduler.h"
+
+// Synchronization primitives for the coroutines of one server. A coroutine which can not proceed sends a
+// CoroRequestPark request and stays suspended on the primitive's wait queue: it is not resumed again
+// until a release hands the primitive over to it and completes its request, so a contended lock costs
+// no context switches for its waiters. The waiter node lives in the parked coroutine's frame and is
+// linked through the saved copy of that frame.
+//
+// Primitives are shared between coroutines and therefore must not live on a coroutine stack: the
+// stack is shared by all coroutines of the server. Use globals, the heap or the coroutine payloads.
+// In the pipelined mode the primitives are guarded with server_services_enter()/server_services_leave().
+
+struct CoroWaitQueue;
+
+struct CoroWaiter
+{
+   struct CoroWaitQueue *queue; // NULL while not linked
+   struct CoroWaiter *prev;
+   struct CoroWaiter *next;
+   request_handle_t handle;
+   unsigned long long ticket; // primitive specific value taken before parking
+   void *data; // primitive specific buffer; points into the saved frame once the waiter is parked
+   size_t data_len;
+   size_t data_done;
+};
+
+struct CoroWaitQueue
+{
+   struct CoroWaiter *head;
+   struct CoroWaiter *tail;
+   int waiters_num;
+};
+
+// Called by the park service before the waiter is queued; takes the primitive if it became available
+// between the coroutine's check and the service.
+typedef bool (*coro_try_acquire)(struct ServerData *server_data, void *primitive, struct CoroWaiter *waiter);
+
+// Request of CoroRequestPark; lives in the frame of the parked coroutine
+struct CoroParkRequest
+{
+   void *primitive;
+   struct CoroWaitQueue *queue;
+   coro_try_acquire try_acquire;
+   struct CoroWaiter waiter;
+};
+
+struct CoroMutex
+{
+   bool locked;
+   struct CoroWaitQueue waiters;
+};
+
+struct CoroSemaphore
+{
+   long permits;
+   struct CoroWaitQueue waiters;
+};
+
+// Manual reset event
+struct CoroEvent
+{
+   bool set;
+   struct CoroWaitQueue waiters;
+};
+
+struct CoroCondition
+{
+   unsigned long long signals; // wakes the waiters which were in flight to the park service
+   struct CoroWaitQueue waiters;
+};
+
+struct CoroWaitGroup
+{
+   long count;
+   struct CoroWaitQueue waiters;
+};
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+void coro_wait_queue_init(struct CoroWaitQueue *queue);
+bool coro_wait_queue_wake_one(struct ServerData *server_data, struct CoroWaitQueue *queue);
+int coro_wait_queue_wake_all(struct ServerData *server_data, struct CoroWaitQueue *queue);
+void coro_wait_queue_remove(struct CoroWaitQueue *queue, struct CoroWaiter *waiter);
+void coro_park_init(struct CoroParkRequest *park, void *primitive, struct CoroWaitQueue *queue, coro_try_acquire try_acquire);
+bool coro_park(struct ServerData *server_data, struct CoroParkRequest *park);
+void coro_park_service(struct ServerData *server_data, struct RequestData *request_data);
+
+void coro_mutex_init(struct CoroMutex *mutex);
+bool coro_mutex_lock(struct ServerData *server_data, struct CoroMutex *mutex);
+bool coro_mutex_try_lock(struct ServerData *server_data, struct CoroMutex *mutex);
+void coro_mutex_unlock(struct ServerData *server_data, struct CoroMutex *mutex);
+
+void coro_semaphore_init(struct CoroSemaphore *semaphore, long permits);
+bool coro_semaphore_acquire(struct ServerData *server_data, struct CoroSemaphore *semaphore);
+bool coro_semaphore_try_acquire(struct ServerData *server_data, struct CoroSemaphore *semaphore);
+void coro_semaphore_release(struct ServerData *server_data, struct CoroSemaphore *semaphore, long permits);
+
+void coro_event_init(struct CoroEvent *event, bool set);
+bool coro_event_wait(struct ServerData *server_data, struct CoroEvent *event);
+void coro_event_set(struct ServerData *server_data, struct CoroEvent *event);
+void coro_event_reset(struct ServerData *server_data, struct CoroEvent *event);
+
+void coro_condition_init(struct CoroCondition *condition);
+bool coro_condition_wait(struct ServerData *server_data, struct CoroCondition *condition, struct CoroMutex *mutex);
+void coro_condition_signal(struct ServerData *server_data, struct CoroCondition *condition);
+void coro_condition_broadcast(struct ServerData *server_data, struct CoroCondition *condition);
+
+void coro_waitgroup_init(struct CoroWaitGroup *waitgroup);
+bool coro_waitgroup_add(struct ServerData *server_data, struct CoroWaitGroup *waitgroup, long delta);
+bool coro_waitgroup_done(struct ServerData *server_data, struct CoroWaitGroup *waitgroup);
+bool coro_waitgroup_wait(struct ServerData *server_data, struct CoroWaitGroup *waitgroup);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
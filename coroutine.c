@@ -12,6 +12,8 @@
 
 #include "fcontext.h"
 #include "stack_alloc.h"
+#include "cycle_clock.h"
+#include "coroutine_probes.h"
 
 #define STACK_SIZE (1024 * 1024)
 #define DEFAULT_COROUTINE 16
@@ -44,6 +46,7 @@ struct coroutine
 	void *context_holder;
 	coro_ptr_diff_t context_holder_size;
 	void *current_stack_ptr;
+	struct coroutine_stats stats;
 };
 
 struct StackTrackingStruct
@@ -140,6 +143,7 @@ _co_new(schedule_t S, coroutine_func func, void *payload, coro_id id)
 	co->context_holder = NULL;
 	co->context_holder_size = 0;
 	co->current_stack_ptr = NULL;
+	memset(&co->stats, 0, sizeof(co->stats));
 	DEBUG_PRINTF(("\tc >> _co_new end = id:%llu\n", S->running));
 	return co;
 }
@@ -195,15 +199,25 @@ void coro_server_close(schedule_t S)
 coroutine_t coroutine_new(schedule_t S, coroutine_func func, void *payload, coro_id id)
 {
 	struct coroutine *co = _co_new(S, func, payload, id);
+	COROUTINE_PROBE2(create, co, payload);
 	return co;
 }
 
 static void
 fcontext_entry(transfer_t t)
 {
+#if defined __GCC_HAVE_DWARF2_CFI_ASM && defined __x86_64__
+	// This is the outermost frame of the coroutine stack: the trampoline has no caller to unwind to.
+	// Marking the return address undefined makes perf and gdb stop here instead of walking into garbage.
+	__asm__ volatile(".cfi_undefined rip");
+#elif defined __GCC_HAVE_DWARF2_CFI_ASM && defined __aarch64__
+	__asm__ volatile(".cfi_undefined x30");
+#endif
 	schedule_t S = (schedule_t )(t.data);
 	S->current_coro->wayback_fctx = t.fctx;
+#if defined COROUTINE_DEBUG_PRINTF
 	int id = S->running;
+#endif
 	DEBUG_PRINTF(("\tc >> fcontext_entry start = id:%llu\n", id));
 	struct coroutine *C = S->current_coro;
 
@@ -217,6 +231,7 @@ fcontext_entry(transfer_t t)
 
 	S->sp = get_stack_pointer();
 	C->status = COROUTINE_DEAD;
+	COROUTINE_PROBE1(death, C);
 
 	DEBUG_PRINTF(("\tc >> fcontext_entry before jump_fcontext 1 = id:%llu\n", id));
 	jump_fcontext(S->current_coro->wayback_fctx, NULL);
@@ -239,6 +254,11 @@ void coroutine_resume(schedule_t S, coroutine_t co)
 	DEBUG_PRINTF(("\tc >> coroutine_resume start = id:%llu\n", id));
 	S->running = id;
 	S->current_coro = C;
+	COROUTINE_PROBE1(resume, C);
+	C->stats.resumes++;
+	C->stats.last_bytes_saved = 0;
+	C->stats.last_bytes_restored = 0;
+	unsigned long long started_ticks;
 
 	int status = C->status;
 	switch (status)
@@ -251,12 +271,16 @@ void coroutine_resume(schedule_t S, coroutine_t co)
 		C->fctx = make_fcontext(S->stack_top, S->stack_size, &fcontext_entry);
 
 		DEBUG_PRINTF(("\tc >> coroutine_resume before jump_fcontext = id:%llu\n", id));
+		started_ticks = cycle_clock_now();
 		C->fctx = jump_fcontext(C->fctx, (void *)S).fctx;
+		C->stats.last_run_ticks = cycle_clock_now() - started_ticks;
+		C->stats.run_ticks += C->stats.last_run_ticks;
 
 		DEBUG_PRINTF(("\tc >> coroutine_resume after jump_fcontext = id:%llu\n", id));
 		C->context_holder_size = calc_stack_size((void *)(C->fctx), S->stack_top);
 		C->context_holder = malloc(C->context_holder_size);
 		memcpy(C->context_holder, (void *)(C->fctx), C->context_holder_size);
+		C->stats.last_bytes_saved = C->context_holder_size;
 		DEBUG_PRINTF(("\tc >> coroutine_resume saving stack. context_holder: %p; C->fctx: %p; context_holder_size: %d; = id:%d\n", C->context_holder, (void *)(C->fctx), C->context_holder_size, id));
 		DEBUG_PRINTF(("\tc >> coroutine_resume COROUTINE_READY end = id:%llu\n", id));
 		break;
@@ -265,6 +289,7 @@ void coroutine_resume(schedule_t S, coroutine_t co)
 		// void *sp = (void*)((coro_ptr_diff_t)(S->stack_top) - (coro_ptr_diff_t)(C->context_holder_size) + 1);
 		// memcpy(sp, C->context_holder, C->context_holder_size);
 		memcpy((void *)(C->fctx), C->context_holder, C->context_holder_size);
+		C->stats.last_bytes_restored = C->context_holder_size;
 		free(C->context_holder);
 		C->context_holder = NULL;
 		C->context_holder_size = 0;
@@ -272,13 +297,18 @@ void coroutine_resume(schedule_t S, coroutine_t co)
 		C->status = COROUTINE_RUNNING;
 
 		DEBUG_PRINTF(("\tc >> coroutine_resume before jump_fcontext = id:%llu\n", id));
+		started_ticks = cycle_clock_now();
 		C->fctx = jump_fcontext(C->fctx, (void *)S).fctx;
+		C->stats.last_run_ticks = cycle_clock_now() - started_ticks;
+		C->stats.run_ticks += C->stats.last_run_ticks;
 		DEBUG_PRINTF(("\tc >> coroutine_resume after jump_fcontext = id:%llu\n", id));
 
 		if (COROUTINE_DEAD == C->status)
 		{
 			DEBUG_PRINTF(("\tc >> coroutine_resume COROUTINE_DEAD = id:%llu\n", id));
+#if defined COROUTINE_DEBUG_PRINTF
 			coro_ptr_diff_t real_stack_size = calc_stack_size((void *)(C->fctx), S->stack_top);
+#endif
 			DEBUG_PRINTF(("\tc >> coroutine_resume real stack size. context_holder_size: %d; = id:%d\n", real_stack_size, id));
 		}
 		else
@@ -287,6 +317,7 @@ void coroutine_resume(schedule_t S, coroutine_t co)
 			C->context_holder_size = calc_stack_size((void *)(C->fctx), S->stack_top);
 			C->context_holder = malloc(C->context_holder_size);
 			memcpy(C->context_holder, (void *)(C->fctx), C->context_holder_size);
+			C->stats.last_bytes_saved = C->context_holder_size;
 			DEBUG_PRINTF(("\tc >> coroutine_resume saving stack. context_holder: %p; C->fctx: %p; context_holder_size: %d; = id:%llu\n", C->context_holder, (void *)(C->fctx), C->context_holder_size, id));
 		}
 		DEBUG_PRINTF(("\tc >> coroutine_resume COROUTINE_SUSPEND end = id:%llu\n", id));
@@ -294,6 +325,12 @@ void coroutine_resume(schedule_t S, coroutine_t co)
 	default:
 		assert(0);
 	}
+	C->stats.bytes_saved += C->stats.last_bytes_saved;
+	C->stats.bytes_restored += C->stats.last_bytes_restored;
+	if (C->stats.last_bytes_saved > C->stats.peak_holder_size)
+	{
+		C->stats.peak_holder_size = C->stats.last_bytes_saved;
+	}
 
 	S->running = 0;
 	S->current_coro = NULL;
@@ -305,6 +342,11 @@ coro_id coroutine_id(coroutine_t co)
 	return co->id;
 }
 
+void *coroutine_payload(coroutine_t co)
+{
+	return co->payload;
+}
+
 int coroutine_status(coroutine_t co)
 {
 	return co->status;
@@ -323,6 +365,7 @@ void coroutine_yield(schedule_t S)
 	coro_id id = S->running;
 	assert(id > 0);
 	struct coroutine *C = S->current_coro;
+	COROUTINE_PROBE1(yield, C);
 	C->status = COROUTINE_SUSPEND;
 	S->sp = get_stack_pointer();
 	DEBUG_PRINTF(("\tc >> coroutine_yield before jump_fcontext = id:%llu\n", S->running));
@@ -330,6 +373,49 @@ void coroutine_yield(schedule_t S)
 	DEBUG_PRINTF(("\tc >> coroutine_yield end = id:%llu\n", S->running));
 }
 
+// While a coroutine is suspended its frames live in context_holder, not on the shared stack.
+// Translates an address of the coroutine's stack to the address of the same byte in the saved copy.
+// Addresses outside of the saved region (heap, globals) are returned as is.
+void *coroutine_saved_address(coroutine_t co, void *stack_address)
+{
+	struct coroutine *C = co;
+	if (!C || !C->context_holder || !stack_address)
+	{
+		return stack_address;
+	}
+	coro_ptr_diff_t address = (coro_ptr_diff_t)stack_address;
+	coro_ptr_diff_t bottom = (coro_ptr_diff_t)(C->fctx);
+	if ((address < bottom) || (address >= (bottom + C->context_holder_size)))
+	{
+		return stack_address;
+	}
+	return (void *)((coro_ptr_diff_t)(C->context_holder) + (address - bottom));
+}
+
+// Inverse of coroutine_saved_address(): the address a byte of the saved copy has on the stack, which is
+// valid again once the coroutine is resumed. Addresses outside of the saved copy are returned as is.
+void *coroutine_stack_address(coroutine_t co, void *saved_address)
+{
+	struct coroutine *C = co;
+	if (!C || !C->context_holder || !saved_address)
+	{
+		return saved_address;
+	}
+	coro_ptr_diff_t address = (coro_ptr_diff_t)saved_address;
+	coro_ptr_diff_t holder = (coro_ptr_diff_t)(C->context_holder);
+	if ((address < holder) || (address >= (holder + C->context_holder_size)))
+	{
+		return saved_address;
+	}
+	return (void *)((coro_ptr_diff_t)(C->fctx) + (address - holder));
+}
+
+// Valid until coroutine_delete()
+const struct coroutine_stats *coroutine_get_stats(coroutine_t co)
+{
+	return &co->stats;
+}
+
 void coroutine_delete(struct coroutine *co) 
 {
 	_co_delete(co);
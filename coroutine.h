@@ -5,7 +5,7 @@
 #ifndef C_COROUTINE_H
 #define C_COROUTINE_H
 
-#if 1
+#if defined COROUTINE_DEBUG_PRINTF
 #define DEBUG_PRINTF(a) printf a
 #else
 #define DEBUG_PRINTF(a) (void)0
@@ -24,6 +24,19 @@ typedef unsigned long long coro_id;
 
 typedef void (*coroutine_func)(schedule_t *S, void *payload);
 
+// Accounted by coroutine_resume()
+struct coroutine_stats
+{
+	unsigned long long resumes;
+	unsigned long long run_ticks; // cycle_clock ticks spent running, see cycle_clock.h
+	unsigned long long bytes_saved; // copied from the shared stack to context_holder
+	unsigned long long bytes_restored; // copied back
+	unsigned long long peak_holder_size;
+	unsigned long long last_run_ticks; // of the latest resume
+	unsigned long long last_bytes_saved;
+	unsigned long long last_bytes_restored;
+};
+
 #ifdef __cplusplus
 extern "C"{
 #endif 
@@ -33,9 +46,13 @@ void coro_server_close(schedule_t);
 coroutine_t coroutine_new(schedule_t S, coroutine_func func, void *payload, coro_id id);
 void coroutine_resume(schedule_t , coroutine_t);
 coro_id coroutine_id(coroutine_t co);
+void *coroutine_payload(coroutine_t co);
 int coroutine_status(coroutine_t);
 coroutine_t coroutine_running(schedule_t );
 void coroutine_yield(schedule_t );
+void *coroutine_saved_address(coroutine_t co, void *stack_address);
+void *coroutine_stack_address(coroutine_t co, void *saved_address);
+const struct coroutine_stats *coroutine_get_stats(coroutine_t co);
 void coroutine_delete(struct coroutine *);
 #ifdef __cplusplus
 }
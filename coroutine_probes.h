@@ -0,0 +1,36 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#ifndef C_COROUTINE_PROBES_H
+#define C_COROUTINE_PROBES_H
+
+// USDT probes of the "coroutine" provider for perf, bpftrace and SystemTap. With <sys/sdt.h> a probe
+// is a single nop plus an ELF note; without it (or with COROUTINE_DISABLE_PROBES) probes compile to
+// nothing and their arguments are not evaluated.
+//
+//   coroutine:create(coro, payload)            coroutine_new()
+//   coroutine:resume(coro)                     coroutine_resume(), before the switch
+//   coroutine:yield(coro)                      coroutine_yield(), before the switch
+//   coroutine:death(coro)                      the coroutine function returned
+//   coroutine:request_submit(coro, type, req)  a request reached the services
+//   coroutine:request_complete(coro, type, req) server_complete()
+//   coroutine:iteration_start(server)
+//   coroutine:iteration_end(server, resumed, live)
+//
+// Example: bpftrace -e 'usdt:./app:coroutine:resume { @[arg0] = count(); }'
+
+#if defined COROUTINE_HAVE_SYS_SDT_H && !defined COROUTINE_DISABLE_PROBES
+   #include <sys/sdt.h>
+   #define COROUTINE_PROBE(name) DTRACE_PROBE(coroutine, name)
+   #define COROUTINE_PROBE1(name, arg1) DTRACE_PROBE1(coroutine, name, arg1)
+   #define COROUTINE_PROBE2(name, arg1, arg2) DTRACE_PROBE2(coroutine, name, arg1, arg2)
+   #define COROUTINE_PROBE3(name, arg1, arg2, arg3) DTRACE_PROBE3(coroutine, name, arg1, arg2, arg3)
+#else
+   #define COROUTINE_PROBE(name) ((void)0)
+   #define COROUTINE_PROBE1(name, arg1) ((void)0)
+   #define COROUTINE_PROBE2(name, arg1, arg2) ((void)0)
+   #define COROUTINE_PROBE3(name, arg1, arg2, arg3) ((void)0)
+#endif
+
+#endif
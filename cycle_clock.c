@@ -0,0 +1,101 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#if defined COROUTINE_HAVE_WIN32API
+   #define WIN32_LEAN_AND_MEAN
+   #include <windows.h>
+#else
+   #include <time.h>
+   #if defined COROUTINE_HAVE_PTHREAD
+      #include <pthread.h>
+   #endif
+#endif
+
+#include "cycle_clock.h"
+
+#define CYCLE_CLOCK_CALIBRATION_NS 2000000ULL
+
+// Written once, by the calibration; the once primitive orders the write before every read
+static double cycle_clock_factor = 1.0;
+
+#if defined COROUTINE_HAVE_WIN32API
+static INIT_ONCE cycle_clock_once = INIT_ONCE_STATIC_INIT;
+#elif defined COROUTINE_HAVE_PTHREAD
+static pthread_once_t cycle_clock_once = PTHREAD_ONCE_INIT;
+#else
+static int cycle_clock_calibrated = 0;
+#endif
+
+// Monotonic nanoseconds. Kept apart from server_monotonic_ns() since the coroutine library uses it too.
+unsigned long long cycle_clock_fallback_now(void)
+{
+#if defined COROUTINE_HAVE_WIN32API
+   LARGE_INTEGER frequency;
+   LARGE_INTEGER counter;
+   QueryPerformanceFrequency(&frequency);
+   QueryPerformanceCounter(&counter);
+   return (unsigned long long)((double)counter.QuadPart * 1000000000.0 / (double)frequency.QuadPart);
+#else
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+#endif
+}
+
+static void cycle_clock_calibrate_now(void)
+{
+#if defined COROUTINE_HAVE_RDTSC
+   unsigned long long start_ns = cycle_clock_fallback_now();
+   unsigned long long start_ticks = cycle_clock_now();
+   unsigned long long now_ns = start_ns;
+   while (now_ns - start_ns < CYCLE_CLOCK_CALIBRATION_NS)
+   {
+      now_ns = cycle_clock_fallback_now();
+   }
+   unsigned long long ticks = cycle_clock_now() - start_ticks;
+   cycle_clock_factor = ticks ? (double)(now_ns - start_ns) / (double)ticks : 1.0;
+#endif
+}
+
+#if defined COROUTINE_HAVE_WIN32API
+static BOOL CALLBACK cycle_clock_calibrate_once(PINIT_ONCE once, PVOID parameter, PVOID *context)
+{
+   cycle_clock_calibrate_now();
+   return TRUE;
+}
+#endif
+
+// Busy-waits for a couple of milliseconds the first time, on one thread only; the other callers wait
+// for it. server_create() calls it, so the calibration does not land on a hot path.
+void cycle_clock_calibrate(void)
+{
+#if defined COROUTINE_HAVE_WIN32API
+   InitOnceExecuteOnce(&cycle_clock_once, cycle_clock_calibrate_once, NULL, NULL);
+#elif defined COROUTINE_HAVE_PTHREAD
+   pthread_once(&cycle_clock_once, cycle_clock_calibrate_now);
+#else
+   // Builds without threads
+   if (!cycle_clock_calibrated)
+   {
+      cycle_clock_calibrate_now();
+      cycle_clock_calibrated = 1;
+   }
+#endif
+}
+
+double cycle_clock_ns_per_tick(void)
+{
+   cycle_clock_calibrate();
+   return cycle_clock_factor;
+}
+
+unsigned long long cycle_clock_ticks_from_ns(unsigned long long ns)
+{
+   return (unsigned long long)((double)ns / cycle_clock_ns_per_tick());
+}
+
+unsigned long long cycle_clock_ns_from_ticks(unsigned long long ticks)
+{
+   return (unsigned long long)((double)ticks * cycle_clock_ns_per_tick());
+}
@@ -0,0 +1,41 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#ifndef C_CYCLE_CLOCK_H
+#define C_CYCLE_CLOCK_H
+
+#if defined COROUTINE_HAVE_RDTSC
+   #if defined _MSC_VER
+      #include <intrin.h>
+   #else
+      #include <x86intrin.h>
+   #endif
+#endif
+
+// Cheap monotonic clock for the hot paths: the TSC where it is available,
+// the monotonic clock otherwise. Ticks are converted to nanoseconds with a factor calibrated
+// once per process (1.0 without the TSC).
+
+#ifdef __cplusplus
+extern "C"{
+#endif 
+unsigned long long cycle_clock_fallback_now(void);
+void cycle_clock_calibrate(void);
+double cycle_clock_ns_per_tick(void);
+unsigned long long cycle_clock_ticks_from_ns(unsigned long long ns);
+unsigned long long cycle_clock_ns_from_ticks(unsigned long long ticks);
+#ifdef __cplusplus
+}
+#endif
+
+static inline unsigned long long cycle_clock_now(void)
+{
+#if defined COROUTINE_HAVE_RDTSC
+   return (unsigned long long)__rdtsc();
+#else
+   return cycle_clock_fallback_now();
+#endif
+}
+
+#endif
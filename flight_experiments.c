@@ -0,0 +1,244 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "scheduler.h"
+#include "offload.h"
+#include "coro_flight.h"
+#include "server_metrics.h"
+
+#if defined COROUTINE_HAVE_STDATOMIC
+   #include <stdatomic.h>
+#endif
+
+#define KEYS_NUM 3
+#define WAITERS_NUM 300
+#define VICTIM_SLEEP 0.020
+
+struct flight_payload {
+   unsigned long long key;
+   double seconds;
+   coroutine_t coro;
+   struct SharedResponse *shared; // kept for the identity checks, not dereferenced after the release
+   bool resumed;
+   bool wrong;
+   enum RequestStatus status;
+   unsigned long long elapsed_ns;
+};
+
+static int failed_checks = 0;
+
+#if defined COROUTINE_HAVE_STDATOMIC
+static atomic_int service_calls;
+#else
+static volatile int service_calls;
+#endif
+
+static void check(bool condition, const char *what)
+{
+   if (!condition)
+   {
+      printf("F >> CHECK FAILED: %s\n", what);
+      failed_checks++;
+   }
+}
+
+#if defined __GLIBC__
+// Fails the next allocation of the armed size, which reaches the out of memory paths of the flight table.
+// Armed only while the loop runs without a companion thread or offload workers.
+extern void *__libc_malloc(size_t size);
+static size_t failing_malloc_size = 0;
+static int failed_mallocs = 0;
+
+void *malloc(size_t size)
+{
+   if (failing_malloc_size && (size == failing_malloc_size))
+   {
+      failing_malloc_size = 0;
+      failed_mallocs++;
+      return NULL;
+   }
+   return __libc_malloc(size);
+}
+#define FLIGHT_FAILING_MALLOC
+#endif
+
+static struct ServerData *create_server(bool pipelined)
+{
+   struct ServerData *server_data = server_create();
+   if (pipelined)
+   {
+      server_pipeline_start(server_data);
+   }
+   return server_data;
+}
+
+// The result of a shared job is read by every waiter, so it is not theirs to free
+static unsigned long long fill_results[KEYS_NUM];
+
+static void *fill(void *arg)
+{
+#if defined COROUTINE_HAVE_STDATOMIC
+   atomic_fetch_add(&service_calls, 1);
+#else
+   service_calls++;
+#endif
+   unsigned long long key = (unsigned long long)(uintptr_t)arg;
+   fill_results[key] = 10 * key;
+   return &(fill_results[key]);
+}
+
+static void offload_getter(void* coro_payload, struct ServerData *server_data)
+{
+   struct flight_payload *payload = (struct flight_payload *)coro_payload;
+   struct OffloadJob *job = (struct OffloadJob *)calloc(1, sizeof(struct OffloadJob));
+   job->func = fill;
+   job->arg = (void *)(uintptr_t)payload->key;
+   payload->shared = server_request_coalesced(server_data, CoroRequestOffload, payload->key, job);
+   payload->status = server_request_status(server_data);
+   payload->resumed = true;
+   if (!payload->shared)
+   {
+      return;
+   }
+   // Offload writes its result into the dispatched job, which all of the waiters share
+   unsigned long long *value = (unsigned long long *)((struct OffloadJob *)payload->shared->request)->result;
+   payload->wrong = !value || (10 * payload->key != *value);
+   shared_response_release(payload->shared);
+}
+
+// A burst of identical requests costs one service call per key, and the waiters of a key share its response
+static void check_coalescing(bool pipelined)
+{
+   struct ServerData *server_data = create_server(pipelined);
+   server_offload_start(server_data, 2);
+   service_calls = 0;
+   struct flight_payload payloads[WAITERS_NUM] = {0};
+   for (int i = 0; i < WAITERS_NUM; i++)
+   {
+      payloads[i].key = (unsigned long long)(i % KEYS_NUM);
+      server_register_coro(server_data, offload_getter, &(payloads[i]));
+   }
+   while (server_loop_iteration(server_data));
+   int served_num = 0;
+   bool shared = true;
+   for (int i = 0; i < WAITERS_NUM; i++)
+   {
+      served_num += (payloads[i].shared && !payloads[i].wrong) ? 1 : 0;
+      shared = shared && (payloads[i].shared == payloads[i % KEYS_NUM].shared);
+   }
+   check(WAITERS_NUM == served_num, "every waiter gets the response of its key");
+   check(shared, "the waiters of a key share one response");
+   check(KEYS_NUM == service_calls, "each key reaches the service once");
+   struct ServerMetrics metrics;
+   server_metrics_snapshot(server_data, &metrics);
+   check(WAITERS_NUM - KEYS_NUM == metrics.requests_coalesced, "the coalesced requests are counted");
+   server_free(server_data);
+}
+
+static void sleep_getter(void* coro_payload, struct ServerData *server_data)
+{
+   struct flight_payload *payload = (struct flight_payload *)coro_payload;
+   payload->coro = server_current_coro(server_data);
+   double *seconds = (double *)malloc(sizeof(double));
+   *seconds = payload->seconds;
+   unsigned long long start_ns = server_monotonic_ns();
+   payload->shared = server_request_coalesced(server_data, CoroRequestSleep, payload->key, seconds);
+   payload->elapsed_ns = server_monotonic_ns() - start_ns;
+   payload->status = server_request_status(server_data);
+   payload->resumed = true;
+   shared_response_release(payload->shared);
+}
+
+static void canceller(void* coro_payload, struct ServerData *server_data)
+{
+   struct flight_payload *victim = (struct flight_payload *)coro_payload;
+   // Both waiters are in the flight by now
+   for (int i = 0; i < 3; i++)
+   {
+      server_request_inplace(server_data, CoroRequestYield, NULL, NULL);
+   }
+   server_cancel_coro(server_data, victim->coro);
+}
+
+// A cancelled waiter leaves the flight at once; the other one still gets the response
+static void check_cancelled_waiter(bool pipelined)
+{
+   struct ServerData *server_data = create_server(pipelined);
+   struct flight_payload victim = {0};
+   struct flight_payload survivor = {0};
+   victim.key = survivor.key = 7;
+   victim.seconds = survivor.seconds = VICTIM_SLEEP;
+   server_register_coro(server_data, sleep_getter, &victim);
+   server_register_coro(server_data, sleep_getter, &survivor);
+   server_register_coro(server_data, canceller, &victim);
+   while (server_loop_iteration(server_data));
+   check(victim.resumed && !victim.shared && RequestStatusCancelled == victim.status, "the cancelled waiter fails as cancelled");
+   check(victim.elapsed_ns < (unsigned long long)(VICTIM_SLEEP * 1e9), "the cancelled waiter does not wait for the flight");
+   check(survivor.resumed && survivor.shared && RequestStatusOk == survivor.status, "the other waiter gets the response");
+   check(survivor.elapsed_ns >= (unsigned long long)(VICTIM_SLEEP * 1e9), "the dispatched request runs to completion");
+   server_free(server_data);
+}
+
+#if defined FLIGHT_FAILING_MALLOC
+static void arm_failing_malloc(void* coro_payload, struct ServerData *server_data)
+{
+   failing_malloc_size = (size_t)(uintptr_t)coro_payload;
+}
+
+// Waiters of a flight whose shared response can not be allocated, or whose flight can not be created,
+// fail as overloaded instead of taking a NULL response for a valid one
+static void check_out_of_memory(void)
+{
+   struct ServerData *server_data = create_server(false);
+   struct flight_payload payloads[KEYS_NUM] = {0};
+   for (int i = 0; i < KEYS_NUM; i++)
+   {
+      payloads[i].key = 1;
+      payloads[i].seconds = 0.001;
+      server_register_coro(server_data, sleep_getter, &(payloads[i]));
+   }
+   server_register_coro(server_data, arm_failing_malloc, (void *)(uintptr_t)sizeof(struct SharedResponse));
+   failed_mallocs = 0;
+   while (server_loop_iteration(server_data));
+   check(1 == failed_mallocs, "the shared response was not allocated");
+   bool overloaded = true;
+   for (int i = 0; i < KEYS_NUM; i++)
+   {
+      overloaded = overloaded && payloads[i].resumed && !payloads[i].shared && (RequestStatusOverloaded == payloads[i].status);
+   }
+   check(overloaded, "the waiters of a response which was not allocated fail as overloaded");
+
+   // The flight table exists now, so the next allocation of a request record is the dispatched one
+   struct flight_payload first = {0};
+   first.key = 2;
+   first.seconds = 0.001;
+   server_register_coro(server_data, arm_failing_malloc, (void *)(uintptr_t)sizeof(struct RequestData));
+   server_register_coro(server_data, sleep_getter, &first);
+   while (server_loop_iteration(server_data));
+   check(2 == failed_mallocs, "the dispatched request was not allocated");
+   check(first.resumed && !first.shared && RequestStatusOverloaded == first.status, "a flight which can not start fails as overloaded");
+   server_free(server_data);
+}
+#endif
+
+int main(int argc, char **argv)
+{
+   printf("F >> START\n");
+   for (int pipelined = 0; pipelined < 2; pipelined++)
+   {
+      check_coalescing(pipelined);
+      check_cancelled_waiter(pipelined);
+   }
+#if defined FLIGHT_FAILING_MALLOC
+   check_out_of_memory();
+#endif
+   printf("F >> END; FAILED CHECKS: %d\n", failed_checks);
+   return failed_checks ? 1 : 0;
+}
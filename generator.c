@@ -0,0 +1,128 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fcontext.h"
+#include "stack_alloc.h"
+#include "generator.h"
+
+struct generator
+{
+   generator_func func;
+   void *payload;
+   size_t elem_size;
+   void *stack;
+   size_t stack_size;
+   fcontext_t fctx; // the suspended generator; NULL before the first generator_next_n()
+   fcontext_t caller; // valid while the generator runs
+   bool done;
+   unsigned char *out; // caller buffer of the current generator_next_n()
+   size_t out_len;
+   size_t out_num;
+};
+
+generator_t generator_new(generator_func func, void *payload, size_t elem_size, size_t stack_size)
+{
+   if (!func || !elem_size)
+   {
+      return NULL;
+   }
+   struct generator *gen = (struct generator *)malloc(sizeof(struct generator));
+   if (!gen)
+   {
+      return NULL;
+   }
+   gen->stack = alloc_stack(stack_size ? stack_size : GENERATOR_DEFAULT_STACK_SIZE, &(gen->stack_size));
+   if (!gen->stack)
+   {
+      free(gen);
+      return NULL;
+   }
+   gen->func = func;
+   gen->payload = payload;
+   gen->elem_size = elem_size;
+   gen->fctx = NULL;
+   gen->caller = NULL;
+   gen->done = false;
+   gen->out = NULL;
+   gen->out_len = 0;
+   gen->out_num = 0;
+   return gen;
+}
+
+static void generator_entry(transfer_t t)
+{
+#if defined __GCC_HAVE_DWARF2_CFI_ASM && defined __x86_64__
+   // Outermost frame of the generator stack, see fcontext_entry() in coroutine.c
+   __asm__ volatile(".cfi_undefined rip");
+#elif defined __GCC_HAVE_DWARF2_CFI_ASM && defined __aarch64__
+   __asm__ volatile(".cfi_undefined x30");
+#endif
+   struct generator *gen = (struct generator *)t.data;
+   gen->caller = t.fctx;
+   gen->func(gen, gen->payload);
+   gen->done = true;
+   jump_fcontext(gen->caller, NULL);
+}
+
+// Runs the generator until it has produced values_num values or returned.
+// Returns the number of values written to the buffer; 0 once the generator is done.
+size_t generator_next_n(generator_t gen, void *values, size_t values_num)
+{
+   if (!gen || gen->done || !values_num)
+   {
+      return 0;
+   }
+   gen->out = (unsigned char *)values;
+   gen->out_len = values_num;
+   gen->out_num = 0;
+   if (!gen->fctx)
+   {
+      gen->fctx = make_fcontext((void *)((unsigned char *)gen->stack + gen->stack_size), gen->stack_size, &generator_entry);
+   }
+   gen->fctx = jump_fcontext(gen->fctx, (void *)gen).fctx;
+   gen->out = NULL;
+   return gen->out_num;
+}
+
+bool generator_next(generator_t gen, void *value)
+{
+   return 1 == generator_next_n(gen, value, 1);
+}
+
+// Called by the generator body. Switches back to the caller once its buffer is full.
+void generator_yield(generator_t gen, const void *value)
+{
+   memcpy(gen->out + gen->out_num * gen->elem_size, value, gen->elem_size);
+   if (++gen->out_num < gen->out_len)
+   {
+      return;
+   }
+   gen->caller = jump_fcontext(gen->caller, NULL).fctx;
+}
+
+bool generator_done(generator_t gen)
+{
+   return !gen || gen->done;
+}
+
+void *generator_payload(generator_t gen)
+{
+   return gen->payload;
+}
+
+// A generator may be freed before it is done; its body is abandoned without unwinding
+void generator_free(generator_t gen)
+{
+   if (!gen)
+   {
+      return;
+   }
+   free_stack(gen->stack, gen->stack_size);
+   free(gen);
+}
@@ -0,0 +1,40 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#ifndef C_GENERATOR_H
+#define C_GENERATOR_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Generators: lazily produced sequences of fixed size values. Unlike scheduler coroutines a generator
+// has its own small stack, so switching into it and back is a pair of jump_fcontext() calls without
+// any stack copying and without going through a ServerData loop.
+//
+// generator_next_n() lets the body fill a whole caller buffer before switching back: generator_yield()
+// only switches when the buffer is full. A generator body must not suspend the coroutine which drives
+// it (e.g. with server_request()); it runs on its own stack, not on the shared coroutine stack.
+
+#define GENERATOR_DEFAULT_STACK_SIZE (64 * 1024)
+
+struct generator;
+typedef struct generator *generator_t;
+
+typedef void (*generator_func)(generator_t gen, void *payload);
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+generator_t generator_new(generator_func func, void *payload, size_t elem_size, size_t stack_size);
+bool generator_next(generator_t gen, void *value);
+size_t generator_next_n(generator_t gen, void *values, size_t values_num);
+void generator_yield(generator_t gen, const void *value);
+bool generator_done(generator_t gen);
+void *generator_payload(generator_t gen);
+void generator_free(generator_t gen);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,125 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "scheduler.h"
+#include "generator.h"
+
+#define BENCH_MAX_BATCH 256
+
+struct counter_payload {
+   unsigned long long limit;
+   unsigned long long produced;
+   bool finished;
+};
+
+static void counter_generator(generator_t gen, void *payload)
+{
+   struct counter_payload *counter = (struct counter_payload *)payload;
+   for (unsigned long long i = 0; i < counter->limit; i++)
+   {
+      counter->produced++;
+      generator_yield(gen, &i);
+   }
+   counter->finished = true;
+}
+
+static int failed_checks = 0;
+
+static void check(bool condition, const char *what)
+{
+   if (!condition)
+   {
+      printf("G >> CHECK FAILED: %s\n", what);
+      failed_checks++;
+   }
+}
+
+// The body returns in the middle of a batch: the batch is partial, and the generator is done afterwards
+static void check_partial_batch(void)
+{
+   struct counter_payload counter = {10, 0, false};
+   generator_t gen = generator_new(counter_generator, &counter, sizeof(unsigned long long), 0);
+   unsigned long long values[4];
+   size_t sizes[4];
+   unsigned long long expected = 0;
+   bool in_order = true;
+   for (int i = 0; i < 4; i++)
+   {
+      sizes[i] = generator_next_n(gen, values, 4);
+      for (size_t k = 0; k < sizes[i]; k++)
+      {
+         in_order = in_order && (values[k] == expected++);
+      }
+   }
+   check(4 == sizes[0] && 4 == sizes[1] && 2 == sizes[2], "batches of 4 out of 10 values are 4, 4, 2");
+   check(0 == sizes[3], "generator_next_n() returns 0 once the body returned");
+   check(in_order, "batched values come in order");
+   check(generator_done(gen) && counter.finished, "the generator is done after a partial batch");
+   check(!generator_next(gen, values), "generator_next() fails once the generator is done");
+   generator_free(gen);
+}
+
+// Unfinished generators are freed without running the rest of their bodies
+static void check_free_unfinished(void)
+{
+   struct counter_payload counter = {1000, 0, false};
+   generator_t gen = generator_new(counter_generator, &counter, sizeof(unsigned long long), 0);
+   unsigned long long values[3];
+   check(3 == generator_next_n(gen, values, 3), "a suspended generator yields a full batch");
+   check(!generator_done(gen), "a suspended generator is not done");
+   generator_free(gen);
+   check(3 == counter.produced && !counter.finished, "freeing a suspended generator does not resume it");
+
+   counter.produced = 0;
+   gen = generator_new(counter_generator, &counter, sizeof(unsigned long long), 0);
+   generator_free(gen);
+   check(0 == counter.produced, "freeing an unstarted generator does not start it");
+}
+
+static void run_benchmark(unsigned long long values_num, size_t batch)
+{
+   struct counter_payload counter = {values_num, 0, false};
+   generator_t gen = generator_new(counter_generator, &counter, sizeof(unsigned long long), 0);
+   unsigned long long values[BENCH_MAX_BATCH];
+   unsigned long long received = 0;
+   unsigned long long checksum = 0;
+   unsigned long long start_ns = server_monotonic_ns();
+   size_t received_num;
+   while ((received_num = (1 == batch) ? (generator_next(gen, values) ? 1 : 0) : generator_next_n(gen, values, batch)))
+   {
+      for (size_t k = 0; k < received_num; k++)
+      {
+         checksum += values[k];
+      }
+      received += received_num;
+   }
+   unsigned long long elapsed_ns = server_monotonic_ns() - start_ns;
+   if (received != values_num || checksum != values_num * (values_num - 1) / 2)
+   {
+      printf("G >> WRONG RESULT: received %llu of %llu\n", received, values_num);
+   }
+   printf("G >> BATCH: %zu; VALUES: %llu; TIME: %.3f ms; PER VALUE: %.1f ns\n",
+          batch, received, elapsed_ns / 1e6, (double)elapsed_ns / received);
+   generator_free(gen);
+}
+
+int main(int argc, char **argv)
+{
+   unsigned long long values_num = (1 < argc) ? strtoull(argv[1], NULL, 10) : 10000000ULL;
+   size_t batches[] = {1, 16, BENCH_MAX_BATCH};
+   printf("G >> START\n");
+   check_partial_batch();
+   check_free_unfinished();
+   for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++)
+   {
+      run_benchmark(values_num, batches[b]);
+   }
+   printf("G >> END; FAILED CHECKS: %d\n", failed_checks);
+   return failed_checks ? 1 : 0;
+}
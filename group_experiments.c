@@ -0,0 +1,145 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "scheduler.h"
+
+#define GROUP_SIZE 2
+
+struct group_payload {
+   double seconds[GROUP_SIZE];
+   enum RequestWaitMode wait_mode;
+   int result;
+   bool cancelled[GROUP_SIZE];
+   unsigned long long elapsed_ns;
+   int finished_num;
+};
+
+static int failed_checks = 0;
+
+static void check(bool condition, const char *what)
+{
+   if (!condition)
+   {
+      printf("M >> CHECK FAILED: %s\n", what);
+      failed_checks++;
+   }
+}
+
+static struct ServerData *create_server(bool pipelined)
+{
+   struct ServerData *server_data = server_create();
+   if (pipelined)
+   {
+      server_pipeline_start(server_data);
+   }
+   return server_data;
+}
+
+// The held records may be touched by the companion thread of a pipelined loop
+static int held_num(struct ServerData *server_data)
+{
+   server_services_enter(server_data);
+   int held_requests_num = server_data->held_requests_num;
+   server_services_leave(server_data);
+   return held_requests_num;
+}
+
+static void sleeper_group(void* coro_payload, struct ServerData *server_data)
+{
+   struct group_payload *payload = (struct group_payload *)coro_payload;
+   // The records, their requests and their responses are in the frame of the coroutine
+   double seconds[GROUP_SIZE];
+   struct RequestData requests[GROUP_SIZE];
+   for (int i = 0; i < GROUP_SIZE; i++)
+   {
+      seconds[i] = payload->seconds[i];
+      server_request_data_init(&(requests[i]), CoroRequestSleep, &(seconds[i]), NULL, true);
+   }
+   unsigned long long start_ns = server_monotonic_ns();
+   payload->result = server_request_many(server_data, requests, GROUP_SIZE, payload->wait_mode);
+   payload->elapsed_ns = server_monotonic_ns() - start_ns;
+   for (int i = 0; i < GROUP_SIZE; i++)
+   {
+      payload->cancelled[i] = requests[i].cancelled;
+   }
+   payload->finished_num++;
+}
+
+static struct group_payload run_group(bool pipelined, enum RequestWaitMode wait_mode, double first, double second)
+{
+   struct ServerData *server_data = create_server(pipelined);
+   struct group_payload payload = {0};
+   payload.seconds[0] = first;
+   payload.seconds[1] = second;
+   payload.wait_mode = wait_mode;
+   server_register_coro(server_data, sleeper_group, &payload);
+   while (server_loop_iteration(server_data));
+   server_free(server_data);
+   return payload;
+}
+
+static void check_wait_all(bool pipelined)
+{
+   struct group_payload payload = run_group(pipelined, RequestWaitAll, 0.010, 0.020);
+   check(1 == payload.finished_num && GROUP_SIZE == payload.result, "RequestWaitAll returns the number of requests");
+   check(20000000ULL <= payload.elapsed_ns, "RequestWaitAll waits for the longest request");
+   check(!payload.cancelled[0] && !payload.cancelled[1], "RequestWaitAll cancels nothing");
+}
+
+static void check_wait_any(bool pipelined)
+{
+   struct group_payload payload = run_group(pipelined, RequestWaitAny, 1.0, 0.010);
+   check(1 == payload.finished_num && 1 == payload.result, "RequestWaitAny returns the index of the first completion");
+   check(500000000ULL > payload.elapsed_ns, "RequestWaitAny does not wait for the other requests");
+   check(payload.cancelled[0] && !payload.cancelled[1], "RequestWaitAny cancels the other sleep");
+}
+
+static void yielder(void* coro_payload, struct ServerData *server_data)
+{
+   struct group_payload *payload = (struct group_payload *)coro_payload;
+   while (true)
+   {
+      server_request_inplace(server_data, CoroRequestYield, NULL, NULL);
+   }
+   payload->finished_num++;
+}
+
+// The group record and the records of both sleeps are held at once, all of them by the same
+// coroutine: server_free() deletes it once. Unstarted and suspended coroutines go with their arguments.
+static void check_free_with_group(bool pipelined)
+{
+   struct ServerData *server_data = create_server(pipelined);
+   struct group_payload payload = {0};
+   payload.seconds[0] = 10.0;
+   payload.seconds[1] = 20.0;
+   payload.wait_mode = RequestWaitAll;
+   server_register_coro(server_data, sleeper_group, &payload);
+   server_register_coro(server_data, yielder, &payload);
+   for (int i = 0; (i < 1000) && (1 + GROUP_SIZE > held_num(server_data)); i++)
+   {
+      server_loop_iteration(server_data);
+   }
+   check(1 + GROUP_SIZE == held_num(server_data), "the group and both of its sleeps are held");
+   server_register_coro(server_data, yielder, &payload);
+   server_free(server_data);
+   check(0 == payload.finished_num, "server_free() does not resume the coroutines");
+}
+
+int main(int argc, char **argv)
+{
+   printf("M >> START\n");
+   for (int pipelined = 0; pipelined < 2; pipelined++)
+   {
+      check_wait_all(pipelined);
+      check_wait_any(pipelined);
+      check_free_with_group(pipelined);
+   }
+   printf("M >> END; FAILED CHECKS: %d\n", failed_checks);
+   return failed_checks ? 1 : 0;
+}
@@ -0,0 +1,265 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "scheduler.h"
+#include "coro_join.h"
+
+#define CHILDREN_NUM 4
+
+struct child_payload {
+   int index;
+   double seconds; // how long the child sleeps before it returns
+   int *finished_num;
+};
+
+struct join_payload {
+   struct child_payload children[CHILDREN_NUM];
+   int finished_num;
+   unsigned long long counter;
+   int fan_out;
+   coro_join_handle_t detached; // handles must not live on the shared coroutine stack either
+};
+
+static int failed_checks = 0;
+
+static void check(bool condition, const char *what)
+{
+   if (!condition)
+   {
+      printf("J >> CHECK FAILED: %s\n", what);
+      failed_checks++;
+   }
+}
+
+static struct ServerData *create_server(bool pipelined)
+{
+   struct ServerData *server_data = server_create();
+   if (pipelined)
+   {
+      server_pipeline_start(server_data);
+   }
+   return server_data;
+}
+
+static void *child_result(int index)
+{
+   return (void *)(intptr_t)(index + 1);
+}
+
+static void child(void* coro_payload, struct ServerData *server_data)
+{
+   struct child_payload *payload = (struct child_payload *)coro_payload;
+   if (0 < payload->seconds)
+   {
+      server_request_inplace(server_data, CoroRequestSleep, &(payload->seconds), NULL);
+   }
+   server_set_join_result(server_data, child_result(payload->index));
+   server_services_enter(server_data);
+   (*(payload->finished_num))++;
+   server_services_leave(server_data);
+}
+
+static void init_children(struct join_payload *payload, const double *seconds)
+{
+   for (int i = 0; i < CHILDREN_NUM; i++)
+   {
+      payload->children[i].index = i;
+      payload->children[i].seconds = seconds[i];
+      payload->children[i].finished_num = &(payload->finished_num);
+   }
+}
+
+static void join_parent(void* coro_payload, struct ServerData *server_data)
+{
+   struct join_payload *payload = (struct join_payload *)coro_payload;
+   coro_join_handle_t handles[CHILDREN_NUM];
+   for (int i = 0; i < CHILDREN_NUM; i++)
+   {
+      handles[i] = server_spawn(server_data, child, &(payload->children[i]));
+   }
+   check(0 != handles[0], "server_spawn() returns a handle");
+   void *result = NULL;
+   check(server_join(server_data, handles[0], &result) && child_result(0) == result,
+         "server_join() waits for the coroutine and takes its result");
+   check(!server_join(server_data, handles[0], &result), "a handle is joined only once");
+   void *results[CHILDREN_NUM - 1] = {0};
+   check(CHILDREN_NUM - 1 == server_join_all(server_data, handles + 1, CHILDREN_NUM - 1, results),
+         "server_join_all() joins every coroutine");
+   bool in_place = true;
+   for (int i = 1; i < CHILDREN_NUM; i++)
+   {
+      in_place = in_place && (child_result(i) == results[i - 1]);
+   }
+   check(in_place, "server_join_all() puts each result at the index of its handle");
+   check(CHILDREN_NUM == payload->finished_num, "every joined coroutine has returned");
+}
+
+static void check_join(bool pipelined)
+{
+   struct ServerData *server_data = create_server(pipelined);
+   struct join_payload payload = {0};
+   const double seconds[CHILDREN_NUM] = {0.002, 0.0, 0.001, 0.003};
+   init_children(&payload, seconds);
+   server_register_coro(server_data, join_parent, &payload);
+   while (server_loop_iteration(server_data));
+   server_free(server_data);
+}
+
+static void join_any_parent(void* coro_payload, struct ServerData *server_data)
+{
+   struct join_payload *payload = (struct join_payload *)coro_payload;
+   coro_join_handle_t handles[CHILDREN_NUM];
+   for (int i = 0; i < CHILDREN_NUM; i++)
+   {
+      handles[i] = server_spawn(server_data, child, &(payload->children[i]));
+   }
+   void *result = NULL;
+   int first = server_join_any(server_data, handles, CHILDREN_NUM, &result);
+   check(2 == first && child_result(2) == result, "server_join_any() joins the coroutine which finishes first");
+   check(1 == payload->finished_num, "server_join_any() does not wait for the others");
+   int joined_num = 1;
+   while (0 <= (first = server_join_any(server_data, handles, CHILDREN_NUM, &result)))
+   {
+      check(child_result(first) == result, "server_join_any() returns the result of the joined coroutine");
+      joined_num++;
+   }
+   check(CHILDREN_NUM == joined_num, "server_join_any() skips the handles joined already");
+}
+
+static void check_join_any(bool pipelined)
+{
+   struct ServerData *server_data = create_server(pipelined);
+   struct join_payload payload = {0};
+   const double seconds[CHILDREN_NUM] = {0.030, 0.020, 0.001, 0.040};
+   init_children(&payload, seconds);
+   server_register_coro(server_data, join_any_parent, &payload);
+   while (server_loop_iteration(server_data));
+   server_free(server_data);
+}
+
+static void detach_parent(void* coro_payload, struct ServerData *server_data)
+{
+   struct join_payload *payload = (struct join_payload *)coro_payload;
+   coro_join_handle_t running = server_spawn(server_data, child, &(payload->children[0]));
+   check(server_detach(server_data, running), "a running coroutine can be detached");
+   check(!server_detach(server_data, running), "a coroutine is detached only once");
+   check(!server_join(server_data, running, NULL), "a detached coroutine can not be joined");
+   coro_join_handle_t finished = server_spawn(server_data, child, &(payload->children[1]));
+   while (2 > payload->finished_num)
+   {
+      server_request_inplace(server_data, CoroRequestYield, NULL, NULL);
+   }
+   check(server_detach(server_data, finished), "a finished coroutine can be detached");
+   check(!server_join(server_data, finished, NULL), "detaching a finished coroutine drops its result");
+   // Both slots are free again: the next spawns reuse them under new generations
+   coro_join_handle_t reused = server_spawn(server_data, child, &(payload->children[2]));
+   check((reused & 0xffffffffu) == (running & 0xffffffffu) || (reused & 0xffffffffu) == (finished & 0xffffffffu),
+         "the slot of a detached coroutine is reused");
+   check(reused != running && reused != finished, "a reused slot gets a new generation");
+   check(!server_join(server_data, running, NULL) && !server_join(server_data, finished, NULL) &&
+         !server_detach(server_data, running) && !server_cancel(server_data, finished),
+         "stale handles do not refer to the coroutine in the reused slot");
+   check(!server_join(server_data, 0, NULL) && !server_detach(server_data, 0), "0 is never a valid handle");
+   void *result = NULL;
+   check(server_join(server_data, reused, &result) && child_result(2) == result, "the new handle joins the new coroutine");
+}
+
+static void check_detach(bool pipelined)
+{
+   struct ServerData *server_data = create_server(pipelined);
+   struct join_payload payload = {0};
+   const double seconds[CHILDREN_NUM] = {0.001, 0.0, 0.001, 0.0};
+   init_children(&payload, seconds);
+   server_register_coro(server_data, detach_parent, &payload);
+   while (server_loop_iteration(server_data));
+   check(3 == payload.finished_num, "detached coroutines run to their end");
+   server_free(server_data);
+}
+
+static void detacher(void* coro_payload, struct ServerData *server_data)
+{
+   struct join_payload *payload = (struct join_payload *)coro_payload;
+   server_detach(server_data, payload->detached);
+}
+
+static void waiting_joiner(void* coro_payload, struct ServerData *server_data)
+{
+   struct join_payload *payload = (struct join_payload *)coro_payload;
+   payload->detached = server_spawn(server_data, child, &(payload->children[0]));
+   server_register_coro(server_data, detacher, payload);
+   check(!server_join(server_data, payload->detached, NULL), "a joiner of a handle detached meanwhile is woken and fails");
+   check(1 == payload->finished_num, "the joiner was woken when the coroutine returned");
+}
+
+static void check_detach_while_joined(bool pipelined)
+{
+   struct ServerData *server_data = create_server(pipelined);
+   struct join_payload payload = {0};
+   const double seconds[CHILDREN_NUM] = {0.002, 0.0, 0.0, 0.0};
+   init_children(&payload, seconds);
+   server_register_coro(server_data, waiting_joiner, &payload);
+   while (server_loop_iteration(server_data));
+   server_free(server_data);
+}
+
+static void bench_child(void* coro_payload, struct ServerData *server_data)
+{
+   struct join_payload *payload = (struct join_payload *)coro_payload;
+   server_services_enter(server_data);
+   payload->counter++;
+   server_services_leave(server_data);
+}
+
+static void bench_parent(void* coro_payload, struct ServerData *server_data)
+{
+   struct join_payload *payload = (struct join_payload *)coro_payload;
+   coro_join_handle_t *handles = (coro_join_handle_t *)malloc(sizeof(coro_join_handle_t) * payload->fan_out);
+   if (!handles)
+   {
+      return;
+   }
+   for (int i = 0; i < payload->fan_out; i++)
+   {
+      handles[i] = server_spawn(server_data, bench_child, payload);
+   }
+   check(payload->fan_out == server_join_all(server_data, handles, payload->fan_out, NULL), "every spawned coroutine is joined");
+   free(handles);
+}
+
+static void run_benchmark(int fan_out, bool pipelined)
+{
+   struct ServerData *server_data = create_server(pipelined);
+   struct join_payload payload = {0};
+   payload.fan_out = fan_out;
+   unsigned long long start_ns = server_monotonic_ns();
+   server_register_coro(server_data, bench_parent, &payload);
+   while (server_loop_iteration(server_data));
+   unsigned long long elapsed_ns = server_monotonic_ns() - start_ns;
+   check((unsigned long long)fan_out == payload.counter, "every spawned coroutine ran");
+   printf("J >> %s: SPAWN AND JOIN: %d; TIME: %.3f ms; PER COROUTINE: %.0f ns\n", pipelined ? "PIPELINED" : "SEQUENTIAL",
+          fan_out, elapsed_ns / 1e6, (double)elapsed_ns / fan_out);
+   server_free(server_data);
+}
+
+int main(int argc, char **argv)
+{
+   int fan_out = (1 < argc) ? atoi(argv[1]) : 10000;
+   printf("J >> START\n");
+   for (int pipelined = 0; pipelined < 2; pipelined++)
+   {
+      check_join(pipelined);
+      check_join_any(pipelined);
+      check_detach(pipelined);
+      check_detach_while_joined(pipelined);
+      run_benchmark(fan_out, pipelined);
+   }
+   printf("J >> END; FAILED CHECKS: %d\n", failed_checks);
+   return failed_checks ? 1 : 0;
+}
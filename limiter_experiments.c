@@ -0,0 +1,243 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "scheduler.h"
+#include "coro_limiter.h"
+
+#define WORKERS_NUM 20
+#define FIFO_RATE 200.0
+#define FIFO_BURST 5
+
+struct limiter_payload {
+   const char *name;
+   unsigned long long tokens[WORKERS_NUM];
+   int workers_num;
+   unsigned long long start_ns;
+   int order[WORKERS_NUM];
+   unsigned long long granted_ns[WORKERS_NUM];
+   int granted_num;
+   bool acquired[WORKERS_NUM];
+   enum RequestStatus status[WORKERS_NUM];
+   unsigned long long finished_ns[WORKERS_NUM];
+   int finished_num;
+   coroutine_t victim;
+   int waiters_num; // seen right before the bucket was reconfigured or the victim was cancelled
+   double new_rate;
+   unsigned long long new_burst;
+   bool reconfigured;
+};
+
+struct worker_payload {
+   struct limiter_payload *limiter;
+   int index;
+};
+
+static int failed_checks = 0;
+
+static void check(bool condition, const char *what)
+{
+   if (!condition)
+   {
+      printf("L >> CHECK FAILED: %s\n", what);
+      failed_checks++;
+   }
+}
+
+static struct ServerData *create_server(bool pipelined)
+{
+   struct ServerData *server_data = server_create();
+   if (pipelined)
+   {
+      server_pipeline_start(server_data);
+   }
+   return server_data;
+}
+
+static void worker(void* coro_payload, struct ServerData *server_data)
+{
+   struct worker_payload *worker_payload = (struct worker_payload *)coro_payload;
+   struct limiter_payload *payload = worker_payload->limiter;
+   int index = worker_payload->index;
+   if (0 == index)
+   {
+      payload->victim = server_current_coro(server_data);
+   }
+   bool acquired = server_rate_acquire(server_data, payload->name, payload->tokens[index]);
+   unsigned long long now_ns = server_monotonic_ns();
+   server_services_enter(server_data);
+   payload->acquired[index] = acquired;
+   payload->status[index] = server_request_status(server_data);
+   payload->finished_ns[index] = now_ns - payload->start_ns;
+   payload->finished_num++;
+   if (acquired)
+   {
+      payload->order[payload->granted_num] = index;
+      payload->granted_ns[payload->granted_num] = now_ns - payload->start_ns;
+      payload->granted_num++;
+   }
+   server_services_leave(server_data);
+}
+
+static void run_workers(bool pipelined, struct limiter_payload *payload, double rate, unsigned long long burst,
+                        bool drained, coroutine_callable other, void *other_payload)
+{
+   struct ServerData *server_data = create_server(pipelined);
+   server_rate_limit(server_data, payload->name, rate, burst);
+   if (drained)
+   {
+      server_rate_try_acquire(server_data, payload->name, burst);
+   }
+   struct worker_payload workers[WORKERS_NUM];
+   payload->start_ns = server_monotonic_ns();
+   for (int i = 0; i < payload->workers_num; i++)
+   {
+      workers[i].limiter = payload;
+      workers[i].index = i;
+      server_register_coro(server_data, worker, &(workers[i]));
+   }
+   if (other)
+   {
+      server_register_coro(server_data, other, other_payload);
+   }
+   while (server_loop_iteration(server_data));
+   server_free(server_data);
+}
+
+static void latecomer(void* coro_payload, struct ServerData *server_data)
+{
+   struct limiter_payload *payload = (struct limiter_payload *)coro_payload;
+   double seconds = 0.010;
+   server_request_inplace(server_data, CoroRequestSleep, &seconds, NULL);
+   check(0 < server_rate_waiters_num(server_data, payload->name), "the throttled workers are parked");
+   check(!server_rate_try_acquire(server_data, payload->name, 1), "a try does not take the tokens of the waiters");
+   check(-1 == server_rate_waiters_num(server_data, "unknown"), "an unknown bucket has no waiters");
+   check(!server_rate_acquire(server_data, "unknown", 1), "an unknown bucket can not be acquired");
+   check(!server_rate_acquire(server_data, payload->name, FIFO_BURST + 1), "more tokens than the burst fail at once");
+}
+
+// The burst is granted at once, then the waiters are served one by one in the order they came at the rate
+static void check_fifo(bool pipelined)
+{
+   struct limiter_payload payload = {0};
+   payload.name = "fifo";
+   payload.workers_num = WORKERS_NUM;
+   for (int i = 0; i < WORKERS_NUM; i++)
+   {
+      payload.tokens[i] = 1;
+   }
+   run_workers(pipelined, &payload, FIFO_RATE, FIFO_BURST, false, latecomer, &payload);
+   check(WORKERS_NUM == payload.granted_num, "every worker gets its token");
+   bool fifo = true;
+   for (int i = 0; i < payload.granted_num; i++)
+   {
+      fifo = fifo && (i == payload.order[i]);
+   }
+   check(fifo, "the waiters are served in FIFO order");
+   unsigned long long paced_ns = (unsigned long long)((WORKERS_NUM - FIFO_BURST) / FIFO_RATE * 1e9);
+   check(payload.granted_ns[FIFO_BURST - 1] < paced_ns / 2, "the burst is granted without waiting");
+   check(paced_ns * 9 / 10 <= payload.granted_ns[WORKERS_NUM - 1], "the waiters are paced by the rate");
+   check(payload.granted_ns[WORKERS_NUM - 1] < 4 * paced_ns, "each waiter is resumed when its tokens are there");
+}
+
+static void reconfigurer(void* coro_payload, struct ServerData *server_data)
+{
+   struct limiter_payload *payload = (struct limiter_payload *)coro_payload;
+   double seconds = 0.010;
+   server_request_inplace(server_data, CoroRequestSleep, &seconds, NULL);
+   payload->waiters_num = server_rate_waiters_num(server_data, payload->name);
+   payload->reconfigured = server_rate_limit(server_data, payload->name, payload->new_rate, payload->new_burst);
+}
+
+// A timer armed for a slow rate is dropped and armed again at the new one
+static void check_rate_change(bool pipelined)
+{
+   struct limiter_payload payload = {0};
+   payload.name = "speedup";
+   payload.workers_num = 3;
+   for (int i = 0; i < payload.workers_num; i++)
+   {
+      payload.tokens[i] = 1;
+   }
+   payload.new_rate = 1000.0;
+   payload.new_burst = 1;
+   // One token per 10 seconds: the timer of the first waiter is 10 seconds away
+   run_workers(pipelined, &payload, 0.1, 1, true, reconfigurer, &payload);
+   check(payload.reconfigured && 3 == payload.waiters_num, "the waiters are parked when the rate changes");
+   check(3 == payload.granted_num, "every waiter is served at the new rate");
+   check(payload.granted_ns[2] < 500000000ULL, "the waiters do not wait for the timer of the old rate");
+
+   // A bucket without a rate has no timer at all until it gets one
+   struct limiter_payload stopped = {0};
+   stopped.name = "stopped";
+   stopped.workers_num = 2;
+   stopped.tokens[0] = stopped.tokens[1] = 1;
+   stopped.new_rate = 1000.0;
+   stopped.new_burst = 1;
+   run_workers(pipelined, &stopped, 0.0, 1, true, reconfigurer, &stopped);
+   check(2 == stopped.granted_num && 2 == stopped.waiters_num, "a stopped bucket serves its waiters once it gets a rate");
+}
+
+// A waiter which asks for more than the burst after it was lowered fails; the others keep their order
+static void check_over_burst(bool pipelined)
+{
+   struct limiter_payload payload = {0};
+   payload.name = "shrunk";
+   payload.workers_num = 3;
+   payload.tokens[0] = 1;
+   payload.tokens[1] = 3;
+   payload.tokens[2] = 2;
+   payload.new_rate = 1000.0;
+   payload.new_burst = 2;
+   run_workers(pipelined, &payload, 0.0, 4, true, reconfigurer, &payload);
+   check(3 == payload.finished_num && 3 == payload.waiters_num, "every waiter is resumed");
+   check(payload.acquired[0] && payload.acquired[2] && 2 == payload.granted_num, "the waiters within the burst are served");
+   check(!payload.acquired[1] && RequestStatusOverloaded == payload.status[1], "a waiter over the new burst fails as overloaded");
+   check(0 == payload.order[0] && 2 == payload.order[1], "the failed waiter does not change the order of the others");
+}
+
+static void head_canceller(void* coro_payload, struct ServerData *server_data)
+{
+   struct limiter_payload *payload = (struct limiter_payload *)coro_payload;
+   double seconds = 0.010;
+   server_request_inplace(server_data, CoroRequestSleep, &seconds, NULL);
+   payload->waiters_num = server_rate_waiters_num(server_data, payload->name);
+   server_cancel_coro(server_data, payload->victim);
+}
+
+// The head waiter leaves while the timer is armed for it; the timer serves the next waiter
+static void check_cancelled_head(bool pipelined)
+{
+   struct limiter_payload payload = {0};
+   payload.name = "cancelled";
+   payload.workers_num = 2;
+   payload.tokens[0] = payload.tokens[1] = 1;
+   // One token per 50 ms
+   run_workers(pipelined, &payload, 20.0, 1, true, head_canceller, &payload);
+   check(2 == payload.waiters_num, "both workers wait when the head is cancelled");
+   check(!payload.acquired[0] && RequestStatusCancelled == payload.status[0], "the cancelled head fails as cancelled");
+   check(payload.finished_ns[0] < 40000000ULL, "the cancelled head does not wait for its tokens");
+   check(payload.acquired[1] && 1 == payload.granted_num && 1 == payload.order[0],
+         "the next waiter is served");
+   check(40000000ULL <= payload.finished_ns[1] && payload.finished_ns[1] < 500000000ULL,
+         "the next waiter gets the token the head was waiting for");
+}
+
+int main(int argc, char **argv)
+{
+   printf("L >> START\n");
+   for (int pipelined = 0; pipelined < 2; pipelined++)
+   {
+      check_fifo(pipelined);
+      check_rate_change(pipelined);
+      check_over_burst(pipelined);
+      check_cancelled_head(pipelined);
+   }
+   printf("L >> END; FAILED CHECKS: %d\n", failed_checks);
+   return failed_checks ? 1 : 0;
+}
@@ -0,0 +1,110 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#if defined COROUTINE_HAVE_WIN32API
+   #define WIN32_LEAN_AND_MEAN
+   #include <windows.h>
+#else
+   #include <unistd.h>
+   #include <fcntl.h>
+   #include <poll.h>
+   #include <errno.h>
+   #if defined COROUTINE_HAVE_EVENTFD
+      #include <sys/eventfd.h>
+   #endif
+#endif
+
+#include "loop_wakeup.h"
+
+
+bool loop_wakeup_open(struct LoopWakeup *wakeup)
+{
+#if defined COROUTINE_HAVE_WIN32API
+   wakeup->event = (void *)CreateEvent(NULL, FALSE, FALSE, NULL);
+   return NULL != wakeup->event;
+#elif defined COROUTINE_HAVE_EVENTFD
+   wakeup->read_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   wakeup->write_fd = wakeup->read_fd;
+   return 0 <= wakeup->read_fd;
+#else
+   int fds[2];
+   if (pipe(fds))
+   {
+      wakeup->read_fd = -1;
+      wakeup->write_fd = -1;
+      return false;
+   }
+   for (int i = 0; i < 2; i++)
+   {
+      fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+      fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+   }
+   wakeup->read_fd = fds[0];
+   wakeup->write_fd = fds[1];
+   return true;
+#endif
+}
+
+void loop_wakeup_close(struct LoopWakeup *wakeup)
+{
+#if defined COROUTINE_HAVE_WIN32API
+   if (wakeup->event)
+   {
+      CloseHandle((HANDLE)wakeup->event);
+      wakeup->event = NULL;
+   }
+#else
+   if (0 <= wakeup->read_fd)
+   {
+      close(wakeup->read_fd);
+   }
+   if ((0 <= wakeup->write_fd) && (wakeup->write_fd != wakeup->read_fd))
+   {
+      close(wakeup->write_fd);
+   }
+   wakeup->read_fd = -1;
+   wakeup->write_fd = -1;
+#endif
+}
+
+// Thread safe
+void loop_wakeup_notify(struct LoopWakeup *wakeup)
+{
+#if defined COROUTINE_HAVE_WIN32API
+   SetEvent((HANDLE)wakeup->event);
+#else
+   uint64_t one = 1;
+   ssize_t written;
+   do
+   {
+      // Full pipe or overflowed eventfd counter means the loop is going to wake up anyway
+      written = write(wakeup->write_fd, &one, sizeof(one));
+   } while ((0 > written) && (EINTR == errno));
+#endif
+}
+
+// Blocks until notified or until timeout_ns passes. Negative timeout_ns waits forever.
+void loop_wakeup_wait(struct LoopWakeup *wakeup, long long timeout_ns)
+{
+#if defined COROUTINE_HAVE_WIN32API
+   DWORD timeout_ms = (0 > timeout_ns) ? INFINITE : (DWORD)((timeout_ns + 999999) / 1000000);
+   WaitForSingleObject((HANDLE)wakeup->event, timeout_ms);
+#else
+   struct pollfd pfd;
+   pfd.fd = wakeup->read_fd;
+   pfd.events = POLLIN;
+   pfd.revents = 0;
+   int timeout_ms = (0 > timeout_ns) ? -1 : (int)((timeout_ns + 999999) / 1000000);
+   if (0 < poll(&pfd, 1, timeout_ms))
+   {
+      uint64_t buf[16];
+      while (0 < read(wakeup->read_fd, buf, sizeof(buf)))
+      {
+      }
+   }
+#endif
+}
@@ -0,0 +1,33 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#ifndef C_LOOP_WAKEUP_H
+#define C_LOOP_WAKEUP_H
+
+#include <stdbool.h>
+
+// Lets other threads wake the main loop from its blocking wait.
+// eventfd is used where it is available, a pipe otherwise.
+struct LoopWakeup
+{
+#if defined COROUTINE_HAVE_WIN32API
+   void *event;
+#else
+   int read_fd;
+   int write_fd;
+#endif
+};
+
+#ifdef __cplusplus
+extern "C"{
+#endif 
+bool loop_wakeup_open(struct LoopWakeup *wakeup);
+void loop_wakeup_close(struct LoopWakeup *wakeup);
+void loop_wakeup_notify(struct LoopWakeup *wakeup);
+void loop_wakeup_wait(struct LoopWakeup *wakeup, long long timeout_ns);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
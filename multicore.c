@@ -0,0 +1,521 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scheduler.h"
+#include "multicore.h"
+
+#if defined COROUTINE_HAVE_PTHREAD
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "aligned_memory.h"
+
+#define MULTICORE_DEQUE_CAPACITY 4096
+#define MULTICORE_REGISTER_BATCH 64
+#define MULTICORE_IDLE_WAIT_NS 1000000
+#define MULTICORE_CACHE_LINE 64
+
+struct MulticoreSlot
+{
+   _Atomic(coroutine_callable) coroutine_body;
+   _Atomic(void *) coro_payload;
+};
+
+// Chase-Lev work stealing deque: the owner pushes and pops at the bottom, thieves take from the top
+struct MulticoreDeque
+{
+   _Alignas(MULTICORE_CACHE_LINE) atomic_llong top;
+   _Alignas(MULTICORE_CACHE_LINE) atomic_llong bottom;
+   long long mask;
+   struct MulticoreSlot *slots;
+};
+
+struct MulticoreWorker
+{
+   struct MulticoreRuntime *runtime;
+   int index;
+   pthread_t thread;
+   bool thread_started;
+   struct ServerData *server_data;
+   struct MulticoreDeque deque;
+   unsigned int rng;
+   unsigned long long finished_seen;
+   atomic_ullong registered;
+   atomic_ullong stolen;
+   atomic_ullong iterations;
+};
+
+struct MulticoreRuntime
+{
+   int workers_num;
+   struct MulticoreWorker *workers;
+
+   pthread_mutex_t injector_mutex; // spawns from threads which are not workers of this runtime
+   int injector_len;
+   int injector_head;
+   atomic_int injector_num;
+   struct MulticoreSlot *injector;
+
+   pthread_mutex_t idle_mutex;
+   pthread_cond_t idle_cond;
+   atomic_int idle_num;
+   atomic_llong outstanding; // spawned, but not finished yet
+   atomic_uint next_wakeup;
+};
+
+static _Thread_local struct MulticoreWorker *multicore_current_worker = NULL;
+
+static bool multicore_deque_init(struct MulticoreDeque *deque, long long capacity)
+{
+   deque->slots = (struct MulticoreSlot *)malloc(sizeof(*deque->slots) * capacity);
+   if (!deque->slots)
+   {
+      return false;
+   }
+   for (long long i = 0; i < capacity; i++)
+   {
+      atomic_init(&deque->slots[i].coroutine_body, NULL);
+      atomic_init(&deque->slots[i].coro_payload, NULL);
+   }
+   deque->mask = capacity - 1;
+   atomic_init(&deque->top, 0);
+   atomic_init(&deque->bottom, 0);
+   return true;
+}
+
+static bool multicore_deque_push(struct MulticoreDeque *deque, coroutine_callable coroutine_body, void *coro_payload)
+{
+   long long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+   long long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+   if ((bottom - top) > deque->mask)
+   {
+      return false;
+   }
+   struct MulticoreSlot *slot = &deque->slots[bottom & deque->mask];
+   atomic_store_explicit(&slot->coroutine_body, coroutine_body, memory_order_relaxed);
+   atomic_store_explicit(&slot->coro_payload, coro_payload, memory_order_relaxed);
+   atomic_thread_fence(memory_order_release);
+   atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+   return true;
+}
+
+static bool multicore_deque_pop(struct MulticoreDeque *deque, coroutine_callable *coroutine_body, void **coro_payload)
+{
+   long long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+   atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+   atomic_thread_fence(memory_order_seq_cst);
+   long long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+   if (top > bottom)
+   {
+      atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+      return false;
+   }
+   struct MulticoreSlot *slot = &deque->slots[bottom & deque->mask];
+   *coroutine_body = atomic_load_explicit(&slot->coroutine_body, memory_order_relaxed);
+   *coro_payload = atomic_load_explicit(&slot->coro_payload, memory_order_relaxed);
+   if (top == bottom)
+   {
+      // The last item: race with the thieves for it
+      bool won = atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed);
+      atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+      return won;
+   }
+   return true;
+}
+
+static bool multicore_deque_steal(struct MulticoreDeque *deque, coroutine_callable *coroutine_body, void **coro_payload)
+{
+   long long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+   atomic_thread_fence(memory_order_seq_cst);
+   long long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+   if (top >= bottom)
+   {
+      return false;
+   }
+   struct MulticoreSlot *slot = &deque->slots[top & deque->mask];
+   *coroutine_body = atomic_load_explicit(&slot->coroutine_body, memory_order_relaxed);
+   *coro_payload = atomic_load_explicit(&slot->coro_payload, memory_order_relaxed);
+   return atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed);
+}
+
+static void multicore_wake_idle(struct MulticoreRuntime *runtime, bool all)
+{
+   if (atomic_load(&runtime->idle_num))
+   {
+      pthread_mutex_lock(&runtime->idle_mutex);
+      if (all)
+      {
+         pthread_cond_broadcast(&runtime->idle_cond);
+      }
+      else
+      {
+         pthread_cond_signal(&runtime->idle_cond);
+      }
+      pthread_mutex_unlock(&runtime->idle_mutex);
+   }
+}
+
+static void multicore_job_finished(struct MulticoreRuntime *runtime, long long jobs_num)
+{
+   if (jobs_num && (atomic_fetch_sub(&runtime->outstanding, jobs_num) == jobs_num))
+   {
+      multicore_wake_idle(runtime, true);
+   }
+}
+
+static bool multicore_register(struct MulticoreWorker *worker, coroutine_callable coroutine_body, void *coro_payload)
+{
+   if (0 > server_register_coro(worker->server_data, coroutine_body, coro_payload))
+   {
+      multicore_job_finished(worker->runtime, 1);
+      return false;
+   }
+   atomic_fetch_add_explicit(&worker->registered, 1, memory_order_relaxed);
+   return true;
+}
+
+static bool multicore_inject(struct MulticoreRuntime *runtime, coroutine_callable coroutine_body, void *coro_payload)
+{
+   pthread_mutex_lock(&runtime->injector_mutex);
+   if (runtime->injector_num == runtime->injector_len)
+   {
+      int new_len = runtime->injector_len ? runtime->injector_len * 2 : 1024;
+      struct MulticoreSlot *new_injector = (struct MulticoreSlot *)malloc(sizeof(*new_injector) * new_len);
+      if (!new_injector)
+      {
+         pthread_mutex_unlock(&runtime->injector_mutex);
+         return false;
+      }
+      for (int i = 0; i < runtime->injector_num; i++)
+      {
+         new_injector[i] = runtime->injector[(runtime->injector_head + i) % runtime->injector_len];
+      }
+      free(runtime->injector);
+      runtime->injector = new_injector;
+      runtime->injector_len = new_len;
+      runtime->injector_head = 0;
+   }
+   struct MulticoreSlot *slot = &runtime->injector[(runtime->injector_head + runtime->injector_num) % runtime->injector_len];
+   atomic_init(&slot->coroutine_body, coroutine_body);
+   atomic_init(&slot->coro_payload, coro_payload);
+   runtime->injector_num++;
+   pthread_mutex_unlock(&runtime->injector_mutex);
+   return true;
+}
+
+static int multicore_take_injected(struct MulticoreWorker *worker)
+{
+   struct MulticoreRuntime *runtime = worker->runtime;
+   if (!runtime->injector_num)
+   {
+      return 0;
+   }
+   struct MulticoreSlot taken[MULTICORE_REGISTER_BATCH];
+   int taken_num = 0;
+   pthread_mutex_lock(&runtime->injector_mutex);
+   // Leave a share of the work for the other workers
+   int share = runtime->injector_num / runtime->workers_num + 1;
+   while (runtime->injector_num && (taken_num < share) && (taken_num < MULTICORE_REGISTER_BATCH))
+   {
+      taken[taken_num++] = runtime->injector[runtime->injector_head];
+      runtime->injector_head = (runtime->injector_head + 1) % runtime->injector_len;
+      runtime->injector_num--;
+   }
+   pthread_mutex_unlock(&runtime->injector_mutex);
+   for (int i = 0; i < taken_num; i++)
+   {
+      multicore_register(worker, atomic_load(&taken[i].coroutine_body), atomic_load(&taken[i].coro_payload));
+   }
+   return taken_num;
+}
+
+static int multicore_steal(struct MulticoreWorker *worker)
+{
+   struct MulticoreRuntime *runtime = worker->runtime;
+   worker->rng ^= worker->rng << 13;
+   worker->rng ^= worker->rng >> 17;
+   worker->rng ^= worker->rng << 5;
+   int start = (int)(worker->rng % (unsigned int)runtime->workers_num);
+   for (int i = 0; i < runtime->workers_num; i++)
+   {
+      struct MulticoreWorker *victim = &runtime->workers[(start + i) % runtime->workers_num];
+      if (victim == worker)
+      {
+         continue;
+      }
+      int stolen = 0;
+      coroutine_callable coroutine_body;
+      void *coro_payload;
+      // Take up to a half of the victim's deque, but not more than a batch
+      long long available = atomic_load(&victim->deque.bottom) - atomic_load(&victim->deque.top);
+      long long wanted = (available + 1) / 2;
+      while ((stolen < wanted) && (stolen < MULTICORE_REGISTER_BATCH)
+             && multicore_deque_steal(&victim->deque, &coroutine_body, &coro_payload))
+      {
+         multicore_register(worker, coroutine_body, coro_payload);
+         stolen++;
+      }
+      if (stolen)
+      {
+         atomic_fetch_add_explicit(&worker->stolen, stolen, memory_order_relaxed);
+         return stolen;
+      }
+   }
+   return 0;
+}
+
+static void multicore_idle_wait(struct MulticoreRuntime *runtime)
+{
+   struct timespec deadline;
+   clock_gettime(CLOCK_REALTIME, &deadline);
+   deadline.tv_nsec += MULTICORE_IDLE_WAIT_NS;
+   if (deadline.tv_nsec >= 1000000000L)
+   {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+   }
+   pthread_mutex_lock(&runtime->idle_mutex);
+   atomic_fetch_add(&runtime->idle_num, 1);
+   // Deques are lock free, so the wait is bounded: a missed signal costs one timeout
+   if (atomic_load(&runtime->outstanding))
+   {
+      pthread_cond_timedwait(&runtime->idle_cond, &runtime->idle_mutex, &deadline);
+   }
+   atomic_fetch_sub(&runtime->idle_num, 1);
+   pthread_mutex_unlock(&runtime->idle_mutex);
+}
+
+static void *multicore_worker_main(void *arg)
+{
+   struct MulticoreWorker *worker = (struct MulticoreWorker *)arg;
+   struct MulticoreRuntime *runtime = worker->runtime;
+   struct ServerData *server_data = worker->server_data;
+   multicore_current_worker = worker;
+   for (;;)
+   {
+      int taken = 0;
+      coroutine_callable coroutine_body;
+      void *coro_payload;
+      while ((taken < MULTICORE_REGISTER_BATCH) && multicore_deque_pop(&worker->deque, &coroutine_body, &coro_payload))
+      {
+         multicore_register(worker, coroutine_body, coro_payload);
+         taken++;
+      }
+      if (!taken)
+      {
+         taken = multicore_take_injected(worker);
+      }
+      if (!taken && !server_data->ready_coroutines_num)
+      {
+         taken = multicore_steal(worker);
+      }
+      if (server_data->ready_coroutines_num || server_data->held_requests_num)
+      {
+         server_loop_iteration(server_data);
+         atomic_fetch_add_explicit(&worker->iterations, 1, memory_order_relaxed);
+         unsigned long long finished = server_data->finished_coroutines_num;
+         multicore_job_finished(runtime, (long long)(finished - worker->finished_seen));
+         worker->finished_seen = finished;
+         continue;
+      }
+      if (taken)
+      {
+         continue;
+      }
+      if (!atomic_load(&runtime->outstanding))
+      {
+         break;
+      }
+      multicore_idle_wait(runtime);
+   }
+   multicore_current_worker = NULL;
+   return NULL;
+}
+
+struct MulticoreRuntime *multicore_create(int workers_num)
+{
+   if (0 >= workers_num)
+   {
+      return NULL;
+   }
+   struct MulticoreRuntime *runtime = (struct MulticoreRuntime *)calloc(1, sizeof(*runtime));
+   if (!runtime)
+   {
+      return NULL;
+   }
+   // The deques have cache line aligned members
+   runtime->workers = (struct MulticoreWorker *)aligned_calloc(_Alignof(struct MulticoreWorker), workers_num,
+                                                               sizeof(*runtime->workers));
+   if (!runtime->workers)
+   {
+      free(runtime);
+      return NULL;
+   }
+   pthread_mutex_init(&runtime->injector_mutex, NULL);
+   atomic_init(&runtime->injector_num, 0);
+   pthread_mutex_init(&runtime->idle_mutex, NULL);
+   pthread_cond_init(&runtime->idle_cond, NULL);
+   atomic_init(&runtime->idle_num, 0);
+   atomic_init(&runtime->outstanding, 0);
+   atomic_init(&runtime->next_wakeup, 0);
+   for (int i = 0; i < workers_num; i++)
+   {
+      struct MulticoreWorker *worker = &runtime->workers[i];
+      worker->runtime = runtime;
+      worker->index = i;
+      worker->rng = 2463534242u + 7919u * (unsigned int)i;
+      atomic_init(&worker->registered, 0);
+      atomic_init(&worker->stolen, 0);
+      atomic_init(&worker->iterations, 0);
+      runtime->workers_num = i + 1;
+      worker->server_data = server_create();
+      if (!worker->server_data || !multicore_deque_init(&worker->deque, MULTICORE_DEQUE_CAPACITY)
+          || !server_wakeup_open(worker->server_data))
+      {
+         multicore_free(runtime);
+         return NULL;
+      }
+      worker->server_data->worker_index = i;
+   }
+   return runtime;
+}
+
+// Thread safe. From inside of a coroutine of this runtime the new coroutine goes to the current worker's deque.
+bool multicore_spawn(struct MulticoreRuntime *runtime, coroutine_callable coroutine_body, void *coro_payload)
+{
+   if (!runtime || !coroutine_body)
+   {
+      return false;
+   }
+   atomic_fetch_add(&runtime->outstanding, 1);
+   struct MulticoreWorker *worker = multicore_current_worker;
+   if (worker && (worker->runtime == runtime))
+   {
+      if (multicore_deque_push(&worker->deque, coroutine_body, coro_payload))
+      {
+         multicore_wake_idle(runtime, false);
+         return true;
+      }
+      return multicore_register(worker, coroutine_body, coro_payload);
+   }
+   if (!multicore_inject(runtime, coroutine_body, coro_payload))
+   {
+      atomic_fetch_sub(&runtime->outstanding, 1);
+      return false;
+   }
+   if (atomic_load(&runtime->idle_num))
+   {
+      multicore_wake_idle(runtime, false);
+   }
+   else
+   {
+      // Everybody may be blocked in the loop's wait for events
+      unsigned int index = atomic_fetch_add(&runtime->next_wakeup, 1) % (unsigned int)runtime->workers_num;
+      server_wakeup(runtime->workers[index].server_data);
+   }
+   return true;
+}
+
+// Runs the workers until every spawned coroutine (including the ones spawned meanwhile) finishes
+void multicore_run(struct MulticoreRuntime *runtime)
+{
+   if (!runtime)
+   {
+      return;
+   }
+   for (int i = 0; i < runtime->workers_num; i++)
+   {
+      struct MulticoreWorker *worker = &runtime->workers[i];
+      worker->thread_started = (0 == pthread_create(&worker->thread, NULL, multicore_worker_main, worker));
+   }
+   for (int i = 0; i < runtime->workers_num; i++)
+   {
+      struct MulticoreWorker *worker = &runtime->workers[i];
+      if (worker->thread_started)
+      {
+         pthread_join(worker->thread, NULL);
+         worker->thread_started = false;
+      }
+   }
+}
+
+int multicore_workers_num(struct MulticoreRuntime *runtime)
+{
+   return runtime ? runtime->workers_num : 0;
+}
+
+bool multicore_worker_stats(struct MulticoreRuntime *runtime, int worker_index, struct MulticoreWorkerStats *stats)
+{
+   if (!runtime || !stats || (0 > worker_index) || (worker_index >= runtime->workers_num))
+   {
+      return false;
+   }
+   struct MulticoreWorker *worker = &runtime->workers[worker_index];
+   stats->registered = atomic_load(&worker->registered);
+   stats->finished = worker->finished_seen;
+   stats->stolen = atomic_load(&worker->stolen);
+   stats->iterations = atomic_load(&worker->iterations);
+   return true;
+}
+
+void multicore_free(struct MulticoreRuntime *runtime)
+{
+   if (!runtime)
+   {
+      return;
+   }
+   for (int i = 0; i < runtime->workers_num; i++)
+   {
+      struct MulticoreWorker *worker = &runtime->workers[i];
+      server_free(worker->server_data);
+      worker->server_data = NULL;
+      free(worker->deque.slots);
+      worker->deque.slots = NULL;
+   }
+   aligned_free(runtime->workers);
+   free(runtime->injector);
+   pthread_mutex_destroy(&runtime->injector_mutex);
+   pthread_mutex_destroy(&runtime->idle_mutex);
+   pthread_cond_destroy(&runtime->idle_cond);
+   free(runtime);
+}
+
+#else
+
+struct MulticoreRuntime *multicore_create(int workers_num)
+{
+   return NULL;
+}
+
+bool multicore_spawn(struct MulticoreRuntime *runtime, coroutine_callable coroutine_body, void *coro_payload)
+{
+   return false;
+}
+
+void multicore_run(struct MulticoreRuntime *runtime)
+{
+}
+
+int multicore_workers_num(struct MulticoreRuntime *runtime)
+{
+   return 0;
+}
+
+bool multicore_worker_stats(struct MulticoreRuntime *runtime, int worker_index, struct MulticoreWorkerStats *stats)
+{
+   return false;
+}
+
+void multicore_free(struct MulticoreRuntime *runtime)
+{
+}
+
+#endif
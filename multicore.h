@@ -0,0 +1,41 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#ifndef C_MULTICORE_H
+#define C_MULTICORE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "scheduler.h"
+
+// Multicore runtime: one ServerData (and so one shared stack) per worker thread.
+// Spawned coroutines wait in the spawning worker's deque until some worker registers them.
+// Until then they have no stack and idle workers may steal them. Once registered a coroutine
+// is pinned to its worker for the whole life: its saved frames hold addresses of that worker's shared stack.
+
+struct MulticoreRuntime;
+
+struct MulticoreWorkerStats
+{
+   unsigned long long registered;
+   unsigned long long finished;
+   unsigned long long stolen;
+   unsigned long long iterations;
+};
+
+#ifdef __cplusplus
+extern "C"{
+#endif 
+struct MulticoreRuntime *multicore_create(int workers_num);
+bool multicore_spawn(struct MulticoreRuntime *runtime, coroutine_callable coroutine_body, void *coro_payload);
+void multicore_run(struct MulticoreRuntime *runtime);
+int multicore_workers_num(struct MulticoreRuntime *runtime);
+bool multicore_worker_stats(struct MulticoreRuntime *runtime, int worker_index, struct MulticoreWorkerStats *stats);
+void multicore_free(struct MulticoreRuntime *runtime);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,87 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "scheduler.h"
+#include "multicore.h"
+
+struct job_payload {
+   struct MulticoreRuntime *runtime;
+   int fan_out;
+   int work;
+};
+
+static volatile unsigned long long sink = 0;
+
+static void short_job(void* coro_payload, struct ServerData *server_data)
+{
+   struct job_payload *payload = (struct job_payload *)coro_payload;
+   unsigned long long acc = 0;
+   for (int i = 0; i < payload->work; i++)
+   {
+      acc = acc * 6364136223846793005ULL + 1442695040888963407ULL;
+   }
+   sink += acc;
+   server_request_inplace(server_data, CoroRequestYield, NULL, NULL);
+}
+
+static void spawner_job(void* coro_payload, struct ServerData *server_data)
+{
+   struct job_payload *payload = (struct job_payload *)coro_payload;
+   for (int i = 0; i < payload->fan_out; i++)
+   {
+      multicore_spawn(payload->runtime, short_job, payload);
+   }
+}
+
+static void run_benchmark(int workers_num, int spawners_num, int fan_out, int work)
+{
+   struct MulticoreRuntime *runtime = multicore_create(workers_num);
+   if (!runtime)
+   {
+      printf("S >> FAILED TO CREATE A RUNTIME WITH %d WORKERS\n", workers_num);
+      return;
+   }
+   struct job_payload payload;
+   payload.runtime = runtime;
+   payload.fan_out = fan_out;
+   payload.work = work;
+   for (int i = 0; i < spawners_num; i++)
+   {
+      multicore_spawn(runtime, spawner_job, &payload);
+   }
+   unsigned long long start_ns = server_monotonic_ns();
+   multicore_run(runtime);
+   unsigned long long elapsed_ns = server_monotonic_ns() - start_ns;
+   unsigned long long jobs_num = (unsigned long long)spawners_num * (fan_out + 1);
+   printf("S >> WORKERS: %d; JOBS: %llu; TIME: %.3f ms; THROUGHPUT: %.0f jobs/s\n",
+          workers_num, jobs_num, elapsed_ns / 1e6, jobs_num * 1e9 / elapsed_ns);
+   for (int i = 0; i < workers_num; i++)
+   {
+      struct MulticoreWorkerStats stats;
+      multicore_worker_stats(runtime, i, &stats);
+      printf("S >>    WORKER %d: registered %llu; stolen %llu; iterations %llu\n",
+             i, stats.registered, stats.stolen, stats.iterations);
+   }
+   multicore_free(runtime);
+}
+
+int main(int argc, char **argv)
+{
+   int max_workers = (1 < argc) ? atoi(argv[1]) : 4;
+   int spawners_num = 64;
+   int fan_out = 4096;
+   int work = 2000;
+   printf("S >> SERVER START\n");
+   for (int workers_num = 1; workers_num <= max_workers; workers_num *= 2)
+   {
+      run_benchmark(workers_num, spawners_num, fan_out, work);
+   }
+   printf("S >> SERVER END\n");
+   return 0;
+}
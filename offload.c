@@ -0,0 +1,474 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined COROUTINE_HAVE_PTHREAD
+   #include <pthread.h>
+   #include <sched.h>
+   #include <stdatomic.h>
+   #include "spsc_ring.h"
+   #include "aligned_memory.h"
+#endif
+
+#include "scheduler.h"
+#include "offload.h"
+
+#define OFFLOAD_DEFAULT_QUEUE_CAPACITY 1024
+#define OFFLOAD_CACHE_LINE 64
+
+#if defined COROUTINE_HAVE_PTHREAD
+
+// Multiple producers (the workers) / single consumer (the loop). Bounded queue with per cell sequence numbers.
+struct OffloadCompletionCell
+{
+   atomic_size_t sequence;
+   struct OffloadJob *job;
+};
+
+struct OffloadCompletionRing
+{
+   _Alignas(OFFLOAD_CACHE_LINE) atomic_size_t head;
+   _Alignas(OFFLOAD_CACHE_LINE) atomic_size_t tail;
+   size_t mask;
+   struct OffloadCompletionCell *cells;
+};
+
+struct OffloadWorker
+{
+   struct OffloadPool *pool;
+   pthread_t thread;
+   bool thread_started;
+   struct SpscRing ring; // single producer (the loop) / single consumer (the worker)
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+   _Alignas(OFFLOAD_CACHE_LINE) atomic_bool sleeping;
+   atomic_ullong jobs_done;
+   atomic_ullong busy_ns;
+};
+
+struct OffloadPool
+{
+   struct ServerData *server_data;
+   int workers_num;
+   struct OffloadWorker *workers;
+   int next_worker;
+   struct OffloadCompletionRing completions;
+   atomic_bool stop;
+   atomic_bool loop_notified;
+   struct OffloadJob *backlog_head;
+   struct OffloadJob *backlog_tail;
+   unsigned long long backlog_depth;
+   unsigned long long submitted;
+   unsigned long long completed;
+   unsigned long long started_ns;
+};
+
+static size_t offload_round_up_pow2(size_t n)
+{
+   size_t result = 1;
+   while (result < n)
+   {
+      result <<= 1;
+   }
+   return result;
+}
+
+static bool offload_completions_init(struct OffloadCompletionRing *ring, size_t capacity)
+{
+   capacity = offload_round_up_pow2(capacity);
+   ring->cells = (struct OffloadCompletionCell *)malloc(sizeof(*ring->cells) * capacity);
+   if (!ring->cells)
+   {
+      return false;
+   }
+   for (size_t i = 0; i < capacity; i++)
+   {
+      atomic_init(&ring->cells[i].sequence, i);
+      ring->cells[i].job = NULL;
+   }
+   ring->mask = capacity - 1;
+   atomic_init(&ring->head, 0);
+   atomic_init(&ring->tail, 0);
+   return true;
+}
+
+static bool offload_completions_push(struct OffloadCompletionRing *ring, struct OffloadJob *job)
+{
+   size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+   for (;;)
+   {
+      struct OffloadCompletionCell *cell = &ring->cells[tail & ring->mask];
+      size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+      if (sequence == tail)
+      {
+         if (atomic_compare_exchange_weak_explicit(&ring->tail, &tail, tail + 1, memory_order_relaxed, memory_order_relaxed))
+         {
+            cell->job = job;
+            atomic_store_explicit(&cell->sequence, tail + 1, memory_order_release);
+            return true;
+         }
+      }
+      else if (sequence < tail)
+      {
+         return false; // full
+      }
+      else
+      {
+         tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+      }
+   }
+}
+
+static struct OffloadJob *offload_completions_pop(struct OffloadCompletionRing *ring)
+{
+   size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+   struct OffloadCompletionCell *cell = &ring->cells[head & ring->mask];
+   size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+   if (sequence != (head + 1))
+   {
+      return NULL;
+   }
+   struct OffloadJob *job = cell->job;
+   atomic_store_explicit(&cell->sequence, head + ring->mask + 1, memory_order_release);
+   atomic_store_explicit(&ring->head, head + 1, memory_order_relaxed);
+   return job;
+}
+
+static void offload_worker_wait(struct OffloadWorker *worker)
+{
+   struct OffloadPool *pool = worker->pool;
+   pthread_mutex_lock(&worker->mutex);
+   atomic_store(&worker->sleeping, true);
+   while (!spsc_ring_depth(&worker->ring) && !atomic_load(&pool->stop))
+   {
+      pthread_cond_wait(&worker->cond, &worker->mutex);
+   }
+   atomic_store(&worker->sleeping, false);
+   pthread_mutex_unlock(&worker->mutex);
+}
+
+static void *offload_worker_main(void *arg)
+{
+   struct OffloadWorker *worker = (struct OffloadWorker *)arg;
+   struct OffloadPool *pool = worker->pool;
+   for (;;)
+   {
+      struct OffloadJob *job = (struct OffloadJob *)spsc_ring_pop(&worker->ring);
+      if (!job)
+      {
+         if (atomic_load(&pool->stop))
+         {
+            break;
+         }
+         offload_worker_wait(worker);
+         continue;
+      }
+      unsigned long long start_ns = server_monotonic_ns();
+      job->result = job->func(job->arg);
+      atomic_fetch_add_explicit(&worker->busy_ns, server_monotonic_ns() - start_ns, memory_order_relaxed);
+      atomic_fetch_add_explicit(&worker->jobs_done, 1, memory_order_relaxed);
+      while (!offload_completions_push(&pool->completions, job))
+      {
+         sched_yield();
+      }
+      if (!atomic_exchange(&pool->loop_notified, true))
+      {
+         server_wakeup(pool->server_data);
+      }
+   }
+   return NULL;
+}
+
+static void offload_worker_notify(struct OffloadWorker *worker)
+{
+   if (atomic_load(&worker->sleeping))
+   {
+      pthread_mutex_lock(&worker->mutex);
+      pthread_cond_signal(&worker->cond);
+      pthread_mutex_unlock(&worker->mutex);
+   }
+}
+
+struct OffloadPool *offload_pool_create(struct ServerData *server_data, int workers_num, int queue_capacity)
+{
+   if (!server_data || (0 >= workers_num))
+   {
+      return NULL;
+   }
+   if (0 >= queue_capacity)
+   {
+      queue_capacity = OFFLOAD_DEFAULT_QUEUE_CAPACITY;
+   }
+   if (!server_wakeup_open(server_data))
+   {
+      return NULL;
+   }
+   // The rings have cache line aligned members
+   struct OffloadPool *pool = (struct OffloadPool *)aligned_calloc(_Alignof(struct OffloadPool), 1, sizeof(*pool));
+   if (!pool)
+   {
+      return NULL;
+   }
+   pool->server_data = server_data;
+   atomic_init(&pool->stop, false);
+   atomic_init(&pool->loop_notified, false);
+   pool->started_ns = server_monotonic_ns();
+   if (!offload_completions_init(&pool->completions, (size_t)queue_capacity * workers_num))
+   {
+      aligned_free(pool);
+      return NULL;
+   }
+   pool->workers = (struct OffloadWorker *)aligned_calloc(_Alignof(struct OffloadWorker), workers_num, sizeof(*pool->workers));
+   if (!pool->workers)
+   {
+      free(pool->completions.cells);
+      aligned_free(pool);
+      return NULL;
+   }
+   for (int i = 0; i < workers_num; i++)
+   {
+      struct OffloadWorker *worker = &pool->workers[i];
+      worker->pool = pool;
+      atomic_init(&worker->sleeping, false);
+      atomic_init(&worker->jobs_done, 0);
+      atomic_init(&worker->busy_ns, 0);
+      pthread_mutex_init(&worker->mutex, NULL);
+      pthread_cond_init(&worker->cond, NULL);
+      pool->workers_num = i + 1;
+      if (!spsc_ring_init(&worker->ring, queue_capacity)
+          || pthread_create(&worker->thread, NULL, offload_worker_main, worker))
+      {
+         offload_pool_destroy(pool);
+         return NULL;
+      }
+      worker->thread_started = true;
+   }
+   return pool;
+}
+
+// Stops and joins the workers. Jobs already queued to the workers are executed, but not completed.
+void offload_pool_destroy(struct OffloadPool *pool)
+{
+   if (!pool)
+   {
+      return;
+   }
+   atomic_store(&pool->stop, true);
+   for (int i = 0; i < pool->workers_num; i++)
+   {
+      struct OffloadWorker *worker = &pool->workers[i];
+      pthread_mutex_lock(&worker->mutex);
+      pthread_cond_signal(&worker->cond);
+      pthread_mutex_unlock(&worker->mutex);
+   }
+   for (int i = 0; i < pool->workers_num; i++)
+   {
+      struct OffloadWorker *worker = &pool->workers[i];
+      if (worker->thread_started)
+      {
+         pthread_join(worker->thread, NULL);
+      }
+      pthread_mutex_destroy(&worker->mutex);
+      pthread_cond_destroy(&worker->cond);
+      spsc_ring_free(&worker->ring);
+   }
+   aligned_free(pool->workers);
+   free(pool->completions.cells);
+   aligned_free(pool);
+}
+
+static bool offload_pool_dispatch(struct OffloadPool *pool, struct OffloadJob *job)
+{
+   int best = -1;
+   size_t best_depth = 0;
+   for (int i = 0; i < pool->workers_num; i++)
+   {
+      int index = (pool->next_worker + i) % pool->workers_num;
+      size_t depth = spsc_ring_depth(&pool->workers[index].ring);
+      if ((0 > best) || (depth < best_depth))
+      {
+         best = index;
+         best_depth = depth;
+         if (!depth)
+         {
+            break;
+         }
+      }
+   }
+   pool->next_worker = (best + 1) % pool->workers_num;
+   struct OffloadWorker *worker = &pool->workers[best];
+   if (!spsc_ring_push(&worker->ring, job))
+   {
+      return false;
+   }
+   offload_worker_notify(worker);
+   return true;
+}
+
+bool offload_pool_submit(struct OffloadPool *pool, struct OffloadJob *job)
+{
+   if (!pool || !job)
+   {
+      return false;
+   }
+   pool->submitted++;
+   job->next_backlog = NULL;
+   if (!pool->backlog_head && offload_pool_dispatch(pool, job))
+   {
+      return true;
+   }
+   if (pool->backlog_tail)
+   {
+      pool->backlog_tail->next_backlog = job;
+   }
+   else
+   {
+      pool->backlog_head = job;
+   }
+   pool->backlog_tail = job;
+   pool->backlog_depth++;
+   return true;
+}
+
+// Called by the loop: completes finished jobs and moves the backlog to the workers. Returns the number of completed jobs.
+int offload_pool_poll(struct OffloadPool *pool)
+{
+   if (!pool)
+   {
+      return 0;
+   }
+   atomic_store(&pool->loop_notified, false);
+   int completed = 0;
+   struct OffloadJob *job;
+   while ((job = offload_completions_pop(&pool->completions)))
+   {
+      server_complete(pool->server_data, job->handle, NULL);
+      completed++;
+   }
+   pool->completed += completed;
+   while (pool->backlog_head)
+   {
+      job = pool->backlog_head;
+      if (!offload_pool_dispatch(pool, job))
+      {
+         break;
+      }
+      pool->backlog_head = job->next_backlog;
+      if (!pool->backlog_head)
+      {
+         pool->backlog_tail = NULL;
+      }
+      pool->backlog_depth--;
+   }
+   return completed;
+}
+
+bool offload_pool_stats(struct OffloadPool *pool, struct OffloadStats *stats,
+                        struct OffloadWorkerStats *worker_stats, int worker_stats_len)
+{
+   if (!pool || !stats)
+   {
+      return false;
+   }
+   unsigned long long lifetime_ns = server_monotonic_ns() - pool->started_ns;
+   if (!lifetime_ns)
+   {
+      lifetime_ns = 1;
+   }
+   stats->workers_num = pool->workers_num;
+   stats->submitted = pool->submitted;
+   stats->completed = pool->completed;
+   stats->in_flight = pool->submitted - pool->completed;
+   stats->backlog_depth = pool->backlog_depth;
+   stats->completion_queue_depth = atomic_load(&pool->completions.tail) - atomic_load(&pool->completions.head);
+   stats->utilization = 0.0;
+   for (int i = 0; i < pool->workers_num; i++)
+   {
+      struct OffloadWorker *worker = &pool->workers[i];
+      unsigned long long busy_ns = atomic_load_explicit(&worker->busy_ns, memory_order_relaxed);
+      double utilization = (double)busy_ns / (double)lifetime_ns;
+      stats->utilization += utilization / pool->workers_num;
+      if (worker_stats && (i < worker_stats_len))
+      {
+         worker_stats[i].queue_depth = spsc_ring_depth(&worker->ring);
+         worker_stats[i].jobs_done = atomic_load_explicit(&worker->jobs_done, memory_order_relaxed);
+         worker_stats[i].busy_ns = busy_ns;
+         worker_stats[i].utilization = utilization;
+      }
+   }
+   return true;
+}
+
+#else
+
+struct OffloadPool *offload_pool_create(struct ServerData *server_data, int workers_num, int queue_capacity)
+{
+   return NULL;
+}
+
+void offload_pool_destroy(struct OffloadPool *pool)
+{
+}
+
+bool offload_pool_submit(struct OffloadPool *pool, struct OffloadJob *job)
+{
+   return false;
+}
+
+int offload_pool_poll(struct OffloadPool *pool)
+{
+   return 0;
+}
+
+bool offload_pool_stats(struct OffloadPool *pool, struct OffloadStats *stats,
+                        struct OffloadWorkerStats *worker_stats, int worker_stats_len)
+{
+   return false;
+}
+
+#endif
+
+bool server_offload_start(struct ServerData *server_data, int workers_num)
+{
+   if (!server_data)
+   {
+      return false;
+   }
+   if (server_data->offload)
+   {
+      return true;
+   }
+   server_data->offload = offload_pool_create(server_data, workers_num, OFFLOAD_DEFAULT_QUEUE_CAPACITY);
+   return NULL != server_data->offload;
+}
+
+void server_offload_stop(struct ServerData *server_data)
+{
+   if (!server_data || !server_data->offload)
+   {
+      return;
+   }
+   offload_pool_destroy(server_data->offload);
+   server_data->offload = NULL;
+}
+
+// Runs func(arg) on the offload pool and returns its result. Without a started pool func is executed by the loop itself.
+void *server_offload(struct ServerData *server_data, offload_func func, void *arg)
+{
+   struct OffloadJob job;
+   job.func = func;
+   job.arg = arg;
+   job.result = NULL;
+   job.handle = NULL;
+   job.next_backlog = NULL;
+   if (!server_request_inplace(server_data, CoroRequestOffload, &job, NULL))
+   {
+      return NULL;
+   }
+   return job.result;
+}
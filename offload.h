@@ -0,0 +1,64 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#ifndef C_OFFLOAD_H
+#define C_OFFLOAD_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "scheduler.h"
+
+// Offload service: runs blocking or CPU heavy functions on a fixed pool of worker threads.
+// Jobs go to the workers through per worker SPSC rings; results come back through one MPSC ring
+// and the loop is woken up with server_wakeup().
+
+typedef void *(*offload_func)(void *arg);
+
+struct OffloadJob
+{
+   offload_func func;
+   void *arg;
+   void *result;
+   request_handle_t handle;
+   struct OffloadJob *next_backlog; // jobs which did not fit into the worker rings
+};
+
+struct OffloadWorkerStats
+{
+   unsigned long long queue_depth;
+   unsigned long long jobs_done;
+   unsigned long long busy_ns;
+   double utilization; // busy time / pool lifetime
+};
+
+struct OffloadStats
+{
+   int workers_num;
+   unsigned long long submitted;
+   unsigned long long completed;
+   unsigned long long in_flight;
+   unsigned long long backlog_depth;
+   unsigned long long completion_queue_depth;
+   double utilization; // average over the workers
+};
+
+#ifdef __cplusplus
+extern "C"{
+#endif 
+struct OffloadPool *offload_pool_create(struct ServerData *server_data, int workers_num, int queue_capacity);
+void offload_pool_destroy(struct OffloadPool *pool);
+bool offload_pool_submit(struct OffloadPool *pool, struct OffloadJob *job);
+int offload_pool_poll(struct OffloadPool *pool);
+bool offload_pool_stats(struct OffloadPool *pool, struct OffloadStats *stats,
+                        struct OffloadWorkerStats *worker_stats, int worker_stats_len);
+
+bool server_offload_start(struct ServerData *server_data, int workers_num);
+void server_offload_stop(struct ServerData *server_data);
+void *server_offload(struct ServerData *server_data, offload_func func, void *arg);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -8,20 +8,56 @@
 #include <string.h>
 #include <assert.h>
 
+#if defined COROUTINE_HAVE_WIN32API
+   #define WIN32_LEAN_AND_MEAN
+   #include <windows.h>
+#else
+   #include <time.h>
+#endif
+
+#if defined COROUTINE_HAVE_PTHREAD
+   #include <pthread.h>
+#endif
+
 #include "coroutine.h"
 #include "scheduler.h"
+#include "loop_wakeup.h"
+#include "offload.h"
+#include "coro_sync.h"
+#include "coro_join.h"
+#include "coro_flight.h"
+#include "coro_cache.h"
+#include "coro_limiter.h"
+#include "server_inbox.h"
+#include "shards.h"
+#include "cycle_clock.h"
+#include "body_stats.h"
+#include "server_metrics.h"
+#include "coroutine_probes.h"
 
 
 static void serv_coro(schedule_t S, void *ud)
 {
    struct CoroArgs *coro_args = (struct CoroArgs *)ud;
    coro_args->coroutine_body(coro_args->coro_payload, coro_args->server_data);
+   if (0 <= coro_args->join_slot)
+   {
+      join_table_finish(coro_args->server_data, coro_args->join_slot);
+   }
+   if (coro_args_prioritized(coro_args))
+   {
+      // The companion thread of a pipelined loop registers coroutines at the same time
+      server_services_lock(coro_args->server_data);
+      coro_args->server_data->prioritized_coroutines_num--;
+      server_services_unlock(coro_args->server_data);
+   }
    server_free_coro_args(coro_args);
 }
 
-static int find_free_cell(struct CoroData *coro_list, int coro_list_len)
+// All the cells before first_free_hint are used
+static int find_free_cell(struct CoroData *coro_list, int coro_list_len, int first_free_hint)
 {
-   for (int i = 0; i < coro_list_len; i++)
+   for (int i = first_free_hint; i < coro_list_len; i++)
    {
       if (CellTypeUsedCell > coro_list[i].cell_type)
       {
@@ -56,10 +92,11 @@ static void *memcp_to_bigger(void *data, long long data_size, long long new_size
    return new_data;
 }
 
-static int put_or_realloc(struct CoroData **coro_list_ptr, int *coro_list_len_ptr, enum CellType cell_type, coroutine_t coro)
+static int put_or_realloc(struct CoroData **coro_list_ptr, int *coro_list_len_ptr, int *free_hint_ptr, enum CellType cell_type, coroutine_t coro)
 {
-   int add_coro_list_len = 1024;
-   int free_cell = find_free_cell(*coro_list_ptr, (*coro_list_len_ptr));
+   // Grow geometrically: a constant step makes registration of many coroutines quadratic
+   int add_coro_list_len = (1024 > (*coro_list_len_ptr)) ? 1024 : (*coro_list_len_ptr);
+   int free_cell = find_free_cell(*coro_list_ptr, (*coro_list_len_ptr), (*free_hint_ptr));
    if (0 <= free_cell)
    {
       server_put_coro_to_list(*coro_list_ptr, free_cell, cell_type, coro, NULL);
@@ -86,7 +123,7 @@ static int put_or_realloc(struct CoroData **coro_list_ptr, int *coro_list_len_pt
             mark_cell_as_unused((*coro_list_ptr), i);
          }
       }
-      free_cell = find_free_cell((*coro_list_ptr), (*coro_list_len_ptr));
+      free_cell = find_free_cell((*coro_list_ptr), (*coro_list_len_ptr), (*free_hint_ptr));
       if (0 <= free_cell)
       {
          server_put_coro_to_list((*coro_list_ptr), free_cell, cell_type, coro, NULL);
@@ -96,6 +133,7 @@ static int put_or_realloc(struct CoroData **coro_list_ptr, int *coro_list_len_pt
          return -1;
       }
    }
+   (*free_hint_ptr) = (CellTypeUsedCell <= cell_type) ? (free_cell + 1) : free_cell;
    return free_cell;
 }
 
@@ -110,6 +148,7 @@ static void server_free_request(struct ServerData *server_data)
       free(server_data->request);
       server_data->request = NULL;
    }
+   server_data->inplace_request = NULL;
    server_data->coro_request_type = CoroRequestNone;
 }
 
@@ -130,18 +169,111 @@ void *server_request(struct ServerData *server_data,
                             enum CoroRequests coro_request_type,
                             void *request)
 {
-   if (!server_data)
+   return server_request_timeout(server_data, coro_request_type, request, 0);
+}
+
+// A request which is not completed within timeout_ns (0: no timeout) returns NULL with RequestStatusTimedOut,
+// provided that its service is able to drop it (see request_cancel_hook). Requests still waiting for
+// their service time out when they are dispatched.
+void *server_request_timeout(struct ServerData *server_data, enum CoroRequests coro_request_type, void *request,
+                             unsigned long long timeout_ns)
+{
+   // A task runs on the loop stack and can not be suspended
+   if (!server_data || server_data->in_task)
    {
       return NULL;
    }
    server_free_request(server_data);
    server_free_response(server_data);
+   server_set_current_request_status(server_data, RequestStatusOk);
    server_data->coro_request_type = coro_request_type;
    server_data->request = request;
+   server_data->request_deadline_ns = timeout_ns ? server_monotonic_ns() + timeout_ns : 0;
    coroutine_yield(server_data->shed);
    return server_data->response;
 }
 
+// Same as server_request() but without heap traffic: the request record, the request and the response
+// may all live in the coroutine's own frame. The service reads the request and writes the response
+// through the coroutine's saved stack while it is suspended.
+bool server_request_inplace(struct ServerData *server_data,
+                            enum CoroRequests coro_request_type,
+                            void *request,
+                            void *response)
+{
+   return server_request_inplace_timeout(server_data, coro_request_type, request, response, 0);
+}
+
+// Returns false if the request failed (see RequestStatus) and the response was not written
+bool server_request_inplace_timeout(struct ServerData *server_data, enum CoroRequests coro_request_type, void *request,
+                                    void *response, unsigned long long timeout_ns)
+{
+   // Cache requests never wait, so they complete without a suspension, tasks included (see coro_cache.h)
+   if (server_data && (CoroRequestCache == coro_request_type))
+   {
+      server_set_current_request_status(server_data, RequestStatusOk);
+      return coro_cache_request(server_data, (struct CacheRequest *)request);
+   }
+   if (!server_data || server_data->in_task)
+   {
+      return false;
+   }
+   server_free_request(server_data);
+   server_free_response(server_data);
+   server_set_current_request_status(server_data, RequestStatusOk);
+   struct RequestData request_data;
+   server_request_data_init(&request_data, coro_request_type, request, response, true);
+   request_data.deadline_ns = timeout_ns ? server_monotonic_ns() + timeout_ns : 0;
+   server_data->coro_request_type = coro_request_type;
+   server_data->inplace_request = &request_data;
+   coroutine_yield(server_data->shed);
+   return RequestStatusOk == request_data.status;
+}
+
+// Submits all of the requests in one suspension. The requests are initialized with
+// server_request_data_init() and are treated as in-place ones: they, their requests and responses
+// may live in the coroutine's frame. RequestWaitAll resumes the coroutine once every request is
+// completed and returns the number of requests. RequestWaitAny returns the index of the first completed
+// request; the others are cancelled (RequestData.cancelled) if their services are able to drop them,
+// otherwise they still run to completion before the coroutine is resumed since their buffers are in its
+// frame. Requests are not nested: a CoroRequestMany request in the group is completed right away.
+int server_request_many(struct ServerData *server_data, struct RequestData *requests, int requests_num,
+                        enum RequestWaitMode wait_mode)
+{
+   if (!server_data || !requests || 0 >= requests_num)
+   {
+      return -1;
+   }
+   struct RequestGroup group;
+   group.requests = requests;
+   group.requests_num = requests_num;
+   group.wait_mode = wait_mode;
+   group.dispatched_num = 0;
+   group.pending_num = 0;
+   group.winner = -1;
+   group.handle = NULL;
+   server_request_inplace(server_data, CoroRequestMany, &group, NULL);
+   return (RequestWaitAny == wait_mode) ? group.winner : requests_num;
+}
+
+unsigned long long server_monotonic_ns(void)
+{
+#if defined COROUTINE_HAVE_WIN32API
+   static LARGE_INTEGER frequency = {0};
+   if (!frequency.QuadPart)
+   {
+      QueryPerformanceFrequency(&frequency);
+   }
+   LARGE_INTEGER counter;
+   QueryPerformanceCounter(&counter);
+   return (unsigned long long)((double)counter.QuadPart * 1000000000.0 / (double)frequency.QuadPart);
+#else
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+#endif
+}
+
 coroutine_t server_current_coro(struct ServerData *server_data)
 {
    coroutine_t result = NULL;
@@ -152,280 +284,2164 @@ coroutine_t server_current_coro(struct ServerData *server_data)
    return result;
 }
 
+int server_current_coro_worker(struct ServerData *server_data)
+{
+   coroutine_t coro = server_current_coro(server_data);
+   if (!coro)
+   {
+      return -1;
+   }
+   struct CoroArgs *coro_args = (struct CoroArgs *)coroutine_payload(coro);
+   return coro_args->pinned_worker;
+}
+
 int server_register_coro(struct ServerData *server_data, coroutine_callable coroutine_body, void* coro_payload)
+{
+   return server_register_coro_priority(server_data, coroutine_body, coro_payload, CoroPriorityNormal);
+}
+
+int server_register_coro_priority(struct ServerData *server_data, coroutine_callable coroutine_body, void* coro_payload,
+                                  enum CoroPriority priority)
+{
+   return server_register_coro_joinable(server_data, coroutine_body, coro_payload, priority, -1);
+}
+
+// join_slot is taken from the join table by server_spawn() (see coro_join.h)
+int server_register_coro_joinable(struct ServerData *server_data, coroutine_callable coroutine_body, void* coro_payload,
+                                  enum CoroPriority priority, int join_slot)
 {
    if (!server_data)
    {
       return -1;
    }
-   int coro_index = put_or_realloc(&(server_data->coro_list), &(server_data->coro_list_len), CellTypeFreeCell, NULL);
-   if (0 > coro_index)
+   // Fails fast under overload instead of growing coro_list without a bound
+   server_services_lock(server_data);
+   if (server_data->max_live_coroutines
+       && server_live_coroutines_num(server_data) >= (unsigned long long)server_data->max_live_coroutines)
    {
+      server_data->coroutines_rejected_num++;
+      if (server_data->metrics)
+      {
+         metric_add(&(server_data->metrics->coroutines_rejected), 1);
+      }
+      server_services_unlock(server_data);
       return -1;
    }
+   server_data->registered_coroutines_num++;
+   server_services_unlock(server_data);
+   // The companion thread of a pipelined loop must not touch coro_list
+   bool deferred = server_on_pipeline_thread(server_data);
+   int coro_index = 0;
+   if (!deferred)
+   {
+      coro_index = put_or_realloc(&(server_data->coro_list), &(server_data->coro_list_len), &(server_data->coro_list_free_hint), CellTypeFreeCell, NULL);
+      if (0 > coro_index)
+      {
+         server_services_lock(server_data);
+         server_data->registered_coroutines_num--;
+         server_services_unlock(server_data);
+         return -1;
+      }
+   }
    struct CoroArgs *coro_args = (struct CoroArgs *)malloc(sizeof(*coro_args));
+   coroutine_t coro = NULL;
    if (coro_args) {
        coro_args->server_data = server_data;
        coro_args->coroutine_body = coroutine_body;
        coro_args->coro_payload = coro_payload;
-   } else {
+       coro_args->pinned_worker = server_data->worker_index;
+       coro_args->priority = priority;
+       coro_args->deadline_ns = 0;
+       coro_args->time_slice_ticks = 0;
+       coro_args->join_slot = join_slot;
+       arena_init(&(coro_args->arena));
+       coro_args->request_status = RequestStatusOk;
+       coro_args->cancelled = false;
+       coro_args->held_request = NULL;
+       coro = coroutine_new(server_data->shed, serv_coro, coro_args, NULL);
+   }
+   if (!coro) {
+       free(coro_args);
+       server_services_lock(server_data);
+       server_data->registered_coroutines_num--;
+       server_services_unlock(server_data);
        return -1;
    }
-   coroutine_t coro = coroutine_new(server_data->shed, serv_coro, coro_args, NULL);
-   coro_index = put_or_realloc(&(server_data->coro_list), &(server_data->coro_list_len), CellTypeUsedCell, coro);
+   server_services_lock(server_data);
+   if (coro_args_prioritized(coro_args))
+   {
+      server_data->prioritized_coroutines_num++;
+   }
+   if (deferred)
+   {
+      coro_index = server_pipeline_defer(server_data, coro, NULL) ? 0 : -1;
+   }
+   else
+   {
+      coro_index = put_or_realloc(&(server_data->coro_list), &(server_data->coro_list_len), &(server_data->coro_list_free_hint), CellTypeUsedCell, coro);
+   }
+   if (0 > coro_index)
+   {
+      // Nobody saw the coroutine: the caller keeps the join slot and releases it
+      server_unregister_coro(server_data, coro);
+      server_services_unlock(server_data);
+      return -1;
+   }
+   if (server_data->metrics)
+   {
+      metric_add(&(server_data->metrics->allocations), 1);
+   }
+   if (0 <= join_slot)
+   {
+      join_table_set_coro(server_data->joins, join_slot, coro);
+   }
+   if (!deferred)
+   {
+      server_data->ready_coroutines_num++;
+   }
+   server_services_unlock(server_data);
    return coro_index;
 }
 
-static void server_free_coro_args(struct CoroArgs *coro_args)
+// Undoes server_register_coro_joinable() for a coroutine which was never queued
+static void server_unregister_coro(struct ServerData *server_data, coroutine_t coro)
 {
-   free(coro_args);
+   struct CoroArgs *coro_args = (struct CoroArgs *)coroutine_payload(coro);
+   if (coro_args_prioritized(coro_args))
+   {
+      server_data->prioritized_coroutines_num--;
+   }
+   server_data->registered_coroutines_num--;
+   server_free_coro_args(coro_args);
+   coroutine_delete(coro);
 }
 
-static void server_free_request_data(struct RequestData *request_data)
+// Queues a function which runs to completion on the loop thread, without a coroutine and a stack copy.
+// A task can not suspend: server_request() fails inside of it. A task which finds out that it has to
+// wait calls server_promote_task() and returns.
+bool server_register_task(struct ServerData *server_data, coroutine_callable task_body, void *task_payload)
 {
-   if (!request_data)
+   if (!server_data || !task_body)
    {
-      return;
+      return false;
    }
-   request_data->coro_request_type = CoroRequestNone;
-   if (request_data->request)
+   server_services_lock(server_data);
+   if (server_data->tasks_num >= server_data->tasks_len)
    {
-      free(request_data->request);
-      request_data->request = NULL;
+      int new_tasks_len = server_data->tasks_len ? 2 * server_data->tasks_len : 1024;
+      struct ServerTask *new_tasks = (struct ServerTask *)malloc(sizeof(struct ServerTask) * new_tasks_len);
+      if (!new_tasks)
+      {
+         server_services_unlock(server_data);
+         return false;
+      }
+      for (int i = 0; i < server_data->tasks_num; i++)
+      {
+         new_tasks[i] = server_data->tasks[(server_data->tasks_head + i) % server_data->tasks_len];
+      }
+      free(server_data->tasks);
+      server_data->tasks = new_tasks;
+      server_data->tasks_len = new_tasks_len;
+      server_data->tasks_head = 0;
    }
-   free(request_data);
+   struct ServerTask *task = &(server_data->tasks[(server_data->tasks_head + server_data->tasks_num) % server_data->tasks_len]);
+   task->body = task_body;
+   task->payload = task_payload;
+   server_data->tasks_num++;
+   server_services_unlock(server_data);
+   return true;
 }
 
-static void server_free_response_data(void *response)
+// Memory of the running coroutine (or task), released all at once when it returns. Chunks are recycled
+// through the server's pool, so short lived coroutines allocate without touching malloc. Each live
+// coroutine holds a whole 4KB chunk though: with thousands of them alive and a few small blocks each,
+// malloc() is faster (see the Coroutine Arenas section of the README).
+void *server_coro_alloc(struct ServerData *server_data, size_t size)
 {
-   if (!response)
+   if (!server_data)
    {
-      return;
+      return NULL;
    }
-   free(response);
-}
-
-static void mark_cell_as_unused(struct CoroData *coro_list, int coro_index)
-{
-   coro_list[coro_index].cell_type = CellTypeUnusedCell;
-   coro_list[coro_index].coro = NULL;
-   coro_list[coro_index].data = NULL;
+   if (server_data->in_task)
+   {
+      return arena_alloc(&(server_data->arena_pool), &(server_data->task_arena), size);
+   }
+   coroutine_t coro = server_current_coro(server_data);
+   if (!coro)
+   {
+      return NULL;
+   }
+   struct CoroArgs *coro_args = (struct CoroArgs *)coroutine_payload(coro);
+   return arena_alloc(&(server_data->arena_pool), &(coro_args->arena), size);
 }
 
-static void mark_cell_as_free(struct CoroData *coro_list, int coro_index)
+bool server_in_task(struct ServerData *server_data)
 {
-   coro_list[coro_index].cell_type = CellTypeFreeCell;
-   coro_list[coro_index].coro = NULL;
-   coro_list[coro_index].data = NULL;
+   return server_data && server_data->in_task;
 }
 
-static void mark_coro_free_or_unused(struct CoroData *coro_list, const int coro_list_len, const int coro_index)
+// Restarts the running task as a full coroutine with the same body and payload. The body runs again from
+// its beginning, so a task promotes itself before its first side effect (or records its progress in the
+// payload) and returns right after the call.
+bool server_promote_task(struct ServerData *server_data)
 {
-   if (coro_index >= coro_list_len) {
-      return;
+   if (!server_in_task(server_data))
+   {
+      return false;
    }
-
-   if ((coro_list_len - 1) == coro_index) {
-      mark_cell_as_unused(coro_list, coro_index);
-   } else if (CellTypeUnusedCell == coro_list[coro_index + 1].cell_type) {
-      mark_cell_as_unused(coro_list, coro_index);
-   } else {
-      mark_cell_as_free(coro_list, coro_index);
+   if (0 > server_register_coro(server_data, server_data->running_task.body, server_data->running_task.payload))
+   {
+      return false;
    }
+   server_data->tasks_promoted_num++;
+   return true;
 }
 
-static void server_remove_coro(struct ServerData *server_data, int coro_index)
+// Runs the tasks queued before the call; the ones queued by them wait for the next iteration
+static int server_run_tasks(struct ServerData *server_data)
 {
-   mark_coro_free_or_unused(server_data->coro_list, server_data->coro_list_len, coro_index);
+   server_services_lock(server_data);
+   int tasks_num = server_data->tasks_num;
+   server_services_unlock(server_data);
+   for (int i = 0; i < tasks_num; i++)
+   {
+      server_services_lock(server_data);
+      server_data->running_task = server_data->tasks[server_data->tasks_head];
+      server_data->tasks_head = (server_data->tasks_head + 1) % server_data->tasks_len;
+      server_data->tasks_num--;
+      server_services_unlock(server_data);
+      server_data->in_task = true;
+      server_data->running_task.body(server_data->running_task.payload, server_data);
+      server_data->in_task = false;
+      arena_release(&(server_data->arena_pool), &(server_data->task_arena));
+   }
+   server_data->tasks_run_num += tasks_num;
+   return tasks_num;
 }
 
-static void server_remove_pending_coro(struct ServerData *server_data, int coro_index)
+static bool coro_args_prioritized(struct CoroArgs *coro_args)
 {
-   mark_coro_free_or_unused(server_data->pending_coro_list, server_data->pending_coro_list_len, coro_index);
+   return CoroPriorityNormal != coro_args->priority || coro_args->deadline_ns;
 }
 
-static int server_loop_coro(struct ServerData *server_data)
+// May be called for the running coroutine as well as for a suspended one
+bool server_set_coro_priority(struct ServerData *server_data, coroutine_t coro, enum CoroPriority priority)
 {
-   if (!server_data)
+   if (!server_data || !coro || 0 > priority || CoroPrioritiesNum <= priority)
    {
-      return -1;
+      return false;
    }
-   int coro_num = 0;
-   for (int i = 0; i < server_data->coro_list_len; i++)
+   struct CoroArgs *coro_args = (struct CoroArgs *)coroutine_payload(coro);
+   bool was_prioritized = coro_args_prioritized(coro_args);
+   coro_args->priority = priority;
+   server_services_lock(server_data);
+   server_data->prioritized_coroutines_num += (int)coro_args_prioritized(coro_args) - (int)was_prioritized;
+   server_services_unlock(server_data);
+   return true;
+}
+
+// Among the ready coroutines of the latency class the one with the earliest deadline is resumed first.
+// Coroutines without a deadline (0) go after the ones with it.
+bool server_set_coro_deadline(struct ServerData *server_data, coroutine_t coro, unsigned long long deadline_ns)
+{
+   if (!server_data || !coro)
    {
-      enum CellType cell_type = server_data->coro_list[i].cell_type;
-      coroutine_t coro = server_data->coro_list[i].coro;
-      void *coro_data = server_data->coro_list[i].data;
-      if (CellTypeUsedCell > cell_type)
-      {
-         if (CellTypeFreeCell == cell_type) {
-            continue;
-         } else if (CellTypeUnusedCell == cell_type){
-            break;
-         } else {
-            assert(0);
-         }
-      }
-      bool need_to_remove_coro = false;
-      if (coroutine_status(coro))
-      {
-         server_free_request(server_data);
-         server_data->response = NULL;
-         if (coro_data)
-         {
-            server_data->response = coro_data;
-         }
-         coroutine_resume(server_data->shed, coro);
-         server_free_response(server_data);
-         if (coroutine_status(coro))
-         {
-            server_move_request_to_services(server_data, i);
-         }
-         else
-         {
-            need_to_remove_coro = true;
-         }
-      }
-      else
-      {
-         need_to_remove_coro = true;
-      }
-      if (need_to_remove_coro)
-      {
-         void* data = server_data->coro_list[i].data;
-         if (data)
-         {
-            free(data);
-            server_data->coro_list[i].data = NULL;
-         }
-         server_remove_coro(server_data, i);
-      } else {
-         coro_num++;
-      }
+      return false;
    }
-   server_free_request(server_data);
-   server_free_response(server_data);
-   return coro_num;
+   struct CoroArgs *coro_args = (struct CoroArgs *)coroutine_payload(coro);
+   bool was_prioritized = coro_args_prioritized(coro_args);
+   coro_args->deadline_ns = deadline_ns;
+   server_services_lock(server_data);
+   server_data->prioritized_coroutines_num += (int)coro_args_prioritized(coro_args) - (int)was_prioritized;
+   server_services_unlock(server_data);
+   return true;
 }
 
-static void server_move_request_to_services(struct ServerData *server_data, int coro_index)
+// Limits the number of coroutines resumed per iteration. The normal and the bulk classes get at least
+// the given percent of the budget (at least one coroutine) whenever they have ready coroutines;
+// the rest goes to the classes in the priority order. Coroutines left out wait for the next iterations.
+void server_set_resume_budget(struct ServerData *server_data, int resume_budget,
+                              int normal_min_share_percent, int bulk_min_share_percent)
 {
-   enum CellType cell_type = server_data->coro_list[coro_index].cell_type;
-   coroutine_t coro = server_data->coro_list[coro_index].coro;
-   enum CoroRequests coro_request_type = server_data->coro_request_type;
-   if (!coro_request_type) {
+   if (!server_data)
+   {
       return;
    }
-   void *request = server_data->request;
+   server_data->resume_budget = 0 < resume_budget ? resume_budget : 0;
+   server_data->min_share_percent[CoroPriorityLatency] = 0;
+   server_data->min_share_percent[CoroPriorityNormal] = normal_min_share_percent;
+   server_data->min_share_percent[CoroPriorityBulk] = bulk_min_share_percent;
+}
 
-   int pending_coro_index = put_or_realloc(&(server_data->pending_coro_list), &(server_data->pending_coro_list_len), cell_type, coro);
-   if (0 <= pending_coro_index)
+// Default budget of CPU time a coroutine may spend between two server_maybe_yield() checkpoints.
+// 0 disables the budget.
+void server_set_time_slice(struct ServerData *server_data, unsigned long long slice_ns)
+{
+   if (!server_data)
    {
-      server_data->coro_request_type = CoroRequestNone;
-      server_data->request = NULL;
-      server_remove_coro(server_data, coro_index);
-   } else {
-      // server_data->pending_coro_list[coro_index].data = NULL;  // this is already done in put_or_realloc
       return;
    }
-
-   struct RequestData *request_data = (struct RequestData *)malloc(sizeof(struct RequestData));
-   request_data->coro_request_type = coro_request_type;
-   request_data->request = request;
-   server_data->pending_coro_list[pending_coro_index].data = (void *)request_data;
+   server_data->time_slice_ticks = slice_ns ? cycle_clock_ticks_from_ns(slice_ns) : 0;
+   server_data->time_slicing = server_data->time_slicing || slice_ns;
 }
 
-static void server_move_response_to_coro(struct ServerData *server_data, coroutine_t coro, void *response)
+bool server_set_coro_time_slice(struct ServerData *server_data, coroutine_t coro, unsigned long long slice_ns)
 {
-   int coro_index = put_or_realloc(&(server_data->coro_list), &(server_data->coro_list_len), coroutine_id(coro), coro);
-   if (0 > coro_index)
+   if (!server_data || !coro)
    {
-      server_free_response_data(response);
-      return;
+      return false;
    }
-   server_data->coro_list[coro_index].data = response;
+   struct CoroArgs *coro_args = (struct CoroArgs *)coroutine_payload(coro);
+   coro_args->time_slice_ticks = slice_ns ? cycle_clock_ticks_from_ns(slice_ns) : 0;
+   server_data->time_slicing = server_data->time_slicing || slice_ns;
+   return true;
 }
 
-static void server_put_request_to_service(struct ServerData *server_data, coroutine_t coro, struct RequestData *request_data)
+void server_set_slice_overrun_hook(struct ServerData *server_data, slice_overrun_hook hook, void *arg)
 {
-   switch (request_data->coro_request_type)
-   {
-   case CoroRequestSocketRead:
+   if (server_data)
    {
-      break;
+      server_data->slice_overrun_hook = hook;
+      server_data->slice_overrun_hook_arg = arg;
    }
-   case CoroRequestSleep:
+}
+
+// Checkpoint for long computations: yields only when the running coroutine has used up its time slice.
+// Returns true if it did yield.
+bool server_maybe_yield(struct ServerData *server_data)
+{
+   if (!server_data || (cycle_clock_now() < server_data->slice_deadline_ticks) || server_data->in_task)
    {
-      break;
+      return false;
    }
-   case CoroRequestRevertSign:
+   server_request_inplace(server_data, CoroRequestYield, NULL, NULL);
+   return true;
+}
+
+// Per entry function totals of the coroutine statistics are kept by default; see server_body_stats_top()
+void server_set_body_accounting(struct ServerData *server_data, bool enabled)
+{
+   if (server_data)
    {
-      int * num = (int*)request_data->request;
-      int *result = (int*)malloc(sizeof(*result));
-      *result = -(*num);
-      server_move_response_to_coro(server_data, coro, result);
-      break;
+      server_data->body_accounting = enabled && server_data->body_stats;
    }
-   case CoroRequestYield:
-   default:
+}
+
+// server_register_coro() and the functions based on it fail while max_live_coroutines are alive; 0 removes the limit
+void server_set_max_live_coroutines(struct ServerData *server_data, int max_live_coroutines)
+{
+   if (server_data)
    {
-      server_move_response_to_coro(server_data, coro, NULL);
-   }
+      server_data->max_live_coroutines = (0 < max_live_coroutines) ? max_live_coroutines : 0;
    }
 }
 
-static void server_run_all_services(struct ServerData *server_data)
+// Requests of the type above max_pending admitted and not yet completed ones are shed; 0 removes the limit
+void server_set_max_pending_requests(struct ServerData *server_data, enum CoroRequests coro_request_type, int max_pending)
 {
+   if (!server_data || !server_request_sheddable(coro_request_type))
+   {
+      return;
+   }
+   server_services_lock(server_data);
+   server_data->max_pending_requests[coro_request_type] = (0 < max_pending) ? max_pending : 0;
+   server_services_unlock(server_data);
 }
 
-static void server_loop_services(struct ServerData *server_data)
+// CoDel style shedding. The pending list is drained by every iteration, so the standing queue is measured
+// by the oldest request of each batch: once it has stayed above target_ns for interval_ns, requests which
+// waited longer than target_ns are shed until a batch is dispatched in time again. 0 turns it off.
+void server_set_sojourn_shedding(struct ServerData *server_data, unsigned long long target_ns, unsigned long long interval_ns)
 {
    if (!server_data)
    {
       return;
    }
-   for (int i = 0; i < server_data->pending_coro_list_len; i++)
-   {
-      enum CellType cell_type = server_data->pending_coro_list[i].cell_type;
-      coroutine_t coro = server_data->pending_coro_list[i].coro;
-      if (CellTypeUsedCell > cell_type)
-      {
-         if (CellTypeFreeCell == cell_type) {
-            continue;
-         } else if (CellTypeUnusedCell == cell_type){
-            break;
-         } else {
-            assert(0);
-         }
-      }
-      struct RequestData *request_data = (struct RequestData *)(server_data->pending_coro_list[i].data);
-      server_data->pending_coro_list[i].data = NULL;
-      server_remove_pending_coro(server_data, i);
-      server_put_request_to_service(server_data, coro, request_data);
-      server_free_request_data(request_data);
-   }
-   server_run_all_services(server_data);
+   server_services_lock(server_data);
+   server_data->sojourn_target_ticks = target_ns ? cycle_clock_ticks_from_ns(target_ns) : 0;
+   server_data->sojourn_interval_ticks = cycle_clock_ticks_from_ns(interval_ns);
+   server_data->sojourn_above_until_ticks = 0;
+   server_data->sojourn_batch_ticks = 0;
+   server_data->sojourn_dropping = false;
+   server_services_unlock(server_data);
 }
 
-bool server_loop_iteration(struct ServerData *server_data)
+// True while requests are being shed by their sojourn time or new coroutines are refused
+bool server_overloaded(struct ServerData *server_data)
 {
-   bool need_to_proceed = false;
    if (!server_data)
    {
-      return;
+      return false;
    }
-   int live_coro_num = server_loop_coro(server_data);
-   server_data->last_live_coroutines_num = live_coro_num;
-   server_loop_services(server_data);
-   if (live_coro_num) {
-      need_to_proceed = true;
+   return server_data->sojourn_dropping
+          || (server_data->max_live_coroutines
+              && server_live_coroutines_num(server_data) >= (unsigned long long)server_data->max_live_coroutines);
+}
+
+// Status of the last request of the calling coroutine
+enum RequestStatus server_request_status(struct ServerData *server_data)
+{
+   coroutine_t coro = server_current_coro(server_data);
+   if (!coro)
+   {
+      return RequestStatusOk;
    }
-   return need_to_proceed;
+   return ((struct CoroArgs *)coroutine_payload(coro))->request_status;
 }
 
-struct ServerData *server_create()
+// Cancels a coroutine of this server. One which has not started yet is destroyed right away. A suspended
+// one is resumed with RequestStatusCancelled as soon as the service of its request is able to drop it
+// (see request_cancel_hook); the service requests it makes afterwards fail as cancelled too, so it only
+// has to unwind. Parking (coro_sync.h) is still allowed while unwinding. Returns false for coroutines
+// which are finished or cancelled already.
+bool server_cancel_coro(struct ServerData *server_data, coroutine_t coro)
 {
-   struct ServerData *server_data = (struct ServerData *)malloc(sizeof(struct ServerData));
+   if (!server_data || !coro || !coroutine_status(coro))
+   {
+      return false;
+   }
+   struct CoroArgs *coro_args = (struct CoroArgs *)coroutine_payload(coro);
+   server_services_lock(server_data);
+   if (coro_args->cancelled)
+   {
+      server_services_unlock(server_data);
+      return false;
+   }
+   coro_args->cancelled = true;
+   server_data->coroutines_cancelled_num++;
+   if (server_data->metrics)
+   {
+      metric_add(&(server_data->metrics->coroutines_cancelled), 1);
+   }
+   if ((COROUTINE_READY == coroutine_status(coro)) && !server_on_pipeline_thread(server_data))
+   {
+      for (int i = 0; i < server_data->coro_list_len; i++)
+      {
+         if (CellTypeUnusedCell == server_data->coro_list[i].cell_type)
+         {
+            break;
+         }
+         if ((CellTypeUsedCell <= server_data->coro_list[i].cell_type) && (coro == server_data->coro_list[i].coro))
+         {
+            server_destroy_unstarted_coro(server_data, i);
+            server_services_unlock(server_data);
+            return true;
+         }
+      }
+   }
+   // A coroutine waits for one request at a time. The requests of a group are dropped one by one: the last
+   // one completes the group, which can not resume the coroutine while the services are locked.
+   struct RequestData *held_request = coro_args->held_request;
+   if (held_request && (CoroRequestMany == held_request->coro_request_type))
+   {
+      struct RequestGroup *group = (struct RequestGroup *)held_request->request;
+      for (int i = 0; i < group->dispatched_num; i++)
+      {
+         server_cancel_held_request(server_data, &(group->requests[i]), RequestStatusCancelled);
+      }
+   }
+   else if (held_request)
+   {
+      server_cancel_held_request(server_data, held_request, RequestStatusCancelled);
+   }
+   server_services_unlock(server_data);
+   return true;
+}
+
+static void server_note_request_timed_out(struct ServerData *server_data)
+{
+   server_data->requests_timed_out_num++;
+   if (server_data->metrics)
+   {
+      metric_add(&(server_data->metrics->requests_timed_out), 1);
+   }
+}
+
+static bool server_coro_cancelled(coroutine_t coro)
+{
+   return coro && ((struct CoroArgs *)coroutine_payload(coro))->cancelled;
+}
+
+// Nothing has run on the coroutine's stack yet, so it can be dropped without resuming it
+static void server_destroy_unstarted_coro(struct ServerData *server_data, int coro_index)
+{
+   coroutine_t coro = server_data->coro_list[coro_index].coro;
+   struct CoroArgs *coro_args = (struct CoroArgs *)coroutine_payload(coro);
+   if (0 <= coro_args->join_slot)
+   {
+      join_table_finish(server_data, coro_args->join_slot);
+   }
+   if (coro_args_prioritized(coro_args))
+   {
+      server_services_lock(server_data);
+      server_data->prioritized_coroutines_num--;
+      server_services_unlock(server_data);
+   }
+   server_free_coro_args(coro_args);
+   void *data = server_data->coro_list[coro_index].data;
+   if (data)
+   {
+      free(data);
+      server_data->coro_list[coro_index].data = NULL;
+   }
+   server_remove_coro(server_data, coro_index);
+   coroutine_delete(coro);
+   server_data->finished_coroutines_num++;
+}
+
+static void server_set_current_request_status(struct ServerData *server_data, enum RequestStatus status)
+{
+   coroutine_t coro = server_current_coro(server_data);
+   if (coro)
+   {
+      ((struct CoroArgs *)coroutine_payload(coro))->request_status = status;
+   }
+}
+
+static unsigned long long server_live_coroutines_num(struct ServerData *server_data)
+{
+   return server_data->registered_coroutines_num - server_data->finished_coroutines_num;
+}
+
+// Parking and request groups wait for the other coroutines rather than for a service: shedding them
+// would break the primitives
+static bool server_request_sheddable(enum CoroRequests coro_request_type)
+{
+   return (CoroRequestNone < coro_request_type) && (CoroRequestsNum > coro_request_type)
+          && (CoroRequestPark != coro_request_type) && (CoroRequestMany != coro_request_type);
+}
+
+// Called once per batch of pending requests before it is dispatched
+static void server_sojourn_update(struct ServerData *server_data, struct CoroData *coro_list, int coro_list_len, unsigned long long now)
+{
+   unsigned long long oldest_ticks = 0;
+   for (int i = 0; i < coro_list_len; i++)
+   {
+      if (CellTypeUnusedCell == coro_list[i].cell_type)
+      {
+         break;
+      }
+      struct RequestData *request_data = (struct RequestData *)(coro_list[i].data);
+      if ((CellTypeUsedCell <= coro_list[i].cell_type) && request_data && request_data->enqueued_ticks
+          && (!oldest_ticks || request_data->enqueued_ticks < oldest_ticks))
+      {
+         oldest_ticks = request_data->enqueued_ticks;
+      }
+   }
+   if (!oldest_ticks)
+   {
+      // Empty batches alternate with full ones in the pipelined mode: only a whole interval without
+      // requests means the queue is idle
+      if (now - server_data->sojourn_batch_ticks >= server_data->sojourn_interval_ticks)
+      {
+         server_data->sojourn_above_until_ticks = 0;
+         server_data->sojourn_dropping = false;
+      }
+      return;
+   }
+   server_data->sojourn_batch_ticks = now;
+   if (now - oldest_ticks < server_data->sojourn_target_ticks)
+   {
+      server_data->sojourn_above_until_ticks = 0;
+      server_data->sojourn_dropping = false;
+      return;
+   }
+   if (!server_data->sojourn_above_until_ticks)
+   {
+      server_data->sojourn_above_until_ticks = now + server_data->sojourn_interval_ticks;
+   }
+   else if (now >= server_data->sojourn_above_until_ticks)
+   {
+      server_data->sojourn_dropping = true;
+   }
+}
+
+// Called under the services lock before the request is handed to its service. A refused request is
+// completed with RequestStatusOverloaded.
+static bool server_admit_request(struct ServerData *server_data, struct RequestData *request_data, unsigned long long now)
+{
+   if (request_data->deadline_ns && server_monotonic_ns() >= request_data->deadline_ns)
+   {
+      server_note_request_timed_out(server_data);
+      server_fail_request(server_data, request_data, RequestStatusTimedOut);
+      return false;
+   }
+   enum CoroRequests coro_request_type = request_data->coro_request_type;
+   if (!server_request_sheddable(coro_request_type))
+   {
+      return true;
+   }
+   int max_pending = server_data->max_pending_requests[coro_request_type];
+   if ((max_pending && server_data->pending_requests_num[coro_request_type] >= max_pending)
+       || (server_data->sojourn_dropping && now && request_data->enqueued_ticks
+           && now - request_data->enqueued_ticks >= server_data->sojourn_target_ticks))
+   {
+      server_shed_request(server_data, request_data);
+      return false;
+   }
+   server_data->pending_requests_num[coro_request_type]++;
+   request_data->admitted = true;
+   return true;
+}
+
+static void server_shed_request(struct ServerData *server_data, struct RequestData *request_data)
+{
+   server_data->requests_shed_num++;
+   if (server_data->metrics)
+   {
+      metric_add(&(server_data->metrics->requests_shed[request_data->coro_request_type]), 1);
+   }
+   server_fail_request(server_data, request_data, RequestStatusOverloaded);
+}
+
+// Completes the request with a NULL response and the status
+static void server_fail_request(struct ServerData *server_data, struct RequestData *request_data, enum RequestStatus status)
+{
+   request_data->status = status;
+   if (!request_data->on_complete && request_data->coro)
+   {
+      // The coroutine is suspended, nobody else looks at its arguments
+      ((struct CoroArgs *)coroutine_payload(request_data->coro))->request_status = status;
+   }
+   server_complete(server_data, request_data, NULL);
+}
+
+static void server_report_slice_overrun(struct ServerData *server_data, coroutine_callable coroutine_body,
+                                        unsigned long long run_ticks, unsigned long long slice_ticks)
+{
+   server_data->slice_overruns_num++;
+   unsigned long long run_ns = cycle_clock_ns_from_ticks(run_ticks);
+   struct CoroBodyStats *stats = body_stats_get(server_data->body_stats, coroutine_body);
+   if (stats)
+   {
+      stats->slice_overruns++;
+      if (run_ns > stats->max_overrun_ns)
+      {
+         stats->max_overrun_ns = run_ns;
+      }
+   }
+   if (server_data->slice_overrun_hook)
+   {
+      server_data->slice_overrun_hook(server_data, coroutine_body, run_ns, cycle_clock_ns_from_ticks(slice_ticks),
+                                      server_data->slice_overrun_hook_arg);
+   }
+}
+
+static void server_free_coro_args(struct CoroArgs *coro_args)
+{
+   arena_release(&(coro_args->server_data->arena_pool), &(coro_args->arena));
+   free(coro_args);
+}
+
+static void server_free_request_data(struct RequestData *request_data)
+{
+   if (!request_data)
+   {
+      return;
+   }
+   request_data->coro_request_type = CoroRequestNone;
+   if (request_data->inplace)
+   {
+      return;
+   }
+   if (request_data->request)
+   {
+      free(request_data->request);
+      request_data->request = NULL;
+   }
+   if (!request_data->scratch)
+   {
+      free(request_data);
+   }
+}
+
+static void server_free_response_data(void *response)
+{
+   if (!response)
+   {
+      return;
+   }
+   free(response);
+}
+
+static void mark_cell_as_unused(struct CoroData *coro_list, int coro_index)
+{
+   coro_list[coro_index].cell_type = CellTypeUnusedCell;
+   coro_list[coro_index].coro = NULL;
+   coro_list[coro_index].data = NULL;
+}
+
+static void mark_cell_as_free(struct CoroData *coro_list, int coro_index)
+{
+   coro_list[coro_index].cell_type = CellTypeFreeCell;
+   coro_list[coro_index].coro = NULL;
+   coro_list[coro_index].data = NULL;
+}
+
+static void mark_coro_free_or_unused(struct CoroData *coro_list, const int coro_list_len, const int coro_index)
+{
+   if (coro_index >= coro_list_len) {
+      return;
+   }
+
+   if ((coro_list_len - 1) == coro_index) {
+      mark_cell_as_unused(coro_list, coro_index);
+   } else if (CellTypeUnusedCell == coro_list[coro_index + 1].cell_type) {
+      mark_cell_as_unused(coro_list, coro_index);
+   } else {
+      mark_cell_as_free(coro_list, coro_index);
+   }
+}
+
+static void server_remove_coro(struct ServerData *server_data, int coro_index)
+{
+   server_data->ready_coroutines_num--;
+   if (coro_index < server_data->coro_list_free_hint)
+   {
+      server_data->coro_list_free_hint = coro_index;
+   }
+   mark_coro_free_or_unused(server_data->coro_list, server_data->coro_list_len, coro_index);
+}
+
+static void server_remove_pending_coro(struct CoroData *coro_list, int coro_list_len, int *free_hint_ptr, int coro_index)
+{
+   if (coro_index < *free_hint_ptr)
+   {
+      *free_hint_ptr = coro_index;
+   }
+   mark_coro_free_or_unused(coro_list, coro_list_len, coro_index);
+}
+
+// Returns false if the coroutine is finished
+static bool server_resume_cell(struct ServerData *server_data, int coro_index, enum CoroPriority priority)
+{
+   coroutine_t coro = server_data->coro_list[coro_index].coro;
+   void *coro_data = server_data->coro_list[coro_index].data;
+   bool need_to_remove_coro = false;
+   if (coroutine_status(coro))
+   {
+      server_free_request(server_data);
+      server_data->response = NULL;
+      if (coro_data)
+      {
+         server_data->response = coro_data;
+         server_data->coro_list[coro_index].data = NULL;
+      }
+      server_data->resumed_per_priority[priority]++;
+      // The arguments are gone once the coroutine finishes
+      struct CoroArgs *coro_args = (struct CoroArgs *)coroutine_payload(coro);
+      coroutine_callable coroutine_body = coro_args->coroutine_body;
+      unsigned long long slice_ticks = 0;
+      if (server_data->time_slicing)
+      {
+         slice_ticks = coro_args->time_slice_ticks ? coro_args->time_slice_ticks : server_data->time_slice_ticks;
+         server_data->slice_deadline_ticks = slice_ticks ? cycle_clock_now() + slice_ticks : ~0ULL;
+      }
+      coroutine_resume(server_data->shed, coro);
+      const struct coroutine_stats *coro_stats = coroutine_get_stats(coro);
+      if (server_data->metrics)
+      {
+         // The response consumed by the coroutine and the saved stack were heap allocations
+         metric_add(&(server_data->metrics->allocations), (coro_data ? 1 : 0) + (coro_stats->last_bytes_saved ? 1 : 0));
+         metric_add(&(server_data->metrics->stack_bytes_saved), coro_stats->last_bytes_saved);
+         metric_add(&(server_data->metrics->stack_bytes_restored), coro_stats->last_bytes_restored);
+      }
+      if (server_data->body_accounting)
+      {
+         body_stats_add_resume(server_data->body_stats, coroutine_body, coro_stats);
+      }
+      if (slice_ticks)
+      {
+         server_data->slice_deadline_ticks = ~0ULL;
+         // A run ending at a checkpoint exceeds the slice a bit anyway; a whole extra slice means a missing checkpoint
+         if (coro_stats->last_run_ticks > 2 * slice_ticks)
+         {
+            server_report_slice_overrun(server_data, coroutine_body, coro_stats->last_run_ticks, slice_ticks);
+         }
+      }
+      server_free_response(server_data);
+      if (coroutine_status(coro))
+      {
+         server_move_request_to_services(server_data, coro_index);
+      }
+      else
+      {
+         need_to_remove_coro = true;
+      }
+   }
+   else
+   {
+      need_to_remove_coro = true;
+   }
+   if (need_to_remove_coro)
+   {
+      void* data = server_data->coro_list[coro_index].data;
+      if (data)
+      {
+         free(data);
+         server_data->coro_list[coro_index].data = NULL;
+      }
+      server_remove_coro(server_data, coro_index);
+      coroutine_delete(coro);
+      server_data->finished_coroutines_num++;
+      return false;
+   }
+   return true;
+}
+
+static int server_loop_coro_in_order(struct ServerData *server_data)
+{
+   int coro_num = 0;
+   for (int i = 0; i < server_data->coro_list_len; i++)
+   {
+      enum CellType cell_type = server_data->coro_list[i].cell_type;
+      if (CellTypeUsedCell > cell_type)
+      {
+         if (CellTypeFreeCell == cell_type) {
+            continue;
+         } else if (CellTypeUnusedCell == cell_type){
+            break;
+         } else {
+            assert(0);
+         }
+      }
+      if (server_resume_cell(server_data, i, CoroPriorityNormal))
+      {
+         coro_num++;
+      }
+   }
+   return coro_num;
+}
+
+static bool server_reserve_priority_order(struct ServerData *server_data)
+{
+   if (server_data->priority_order_len >= server_data->coro_list_len)
+   {
+      return true;
+   }
+   for (int c = 0; c < CoroPrioritiesNum; c++)
+   {
+      struct ReadyCell *order = (struct ReadyCell *)realloc(server_data->priority_order[c],
+                                                            sizeof(struct ReadyCell) * server_data->coro_list_len);
+      if (!order)
+      {
+         return false;
+      }
+      server_data->priority_order[c] = order;
+   }
+   server_data->priority_order_len = server_data->coro_list_len;
+   return true;
+}
+
+static int compare_ready_cells(const void *a, const void *b)
+{
+   const struct ReadyCell *cell_a = (const struct ReadyCell *)a;
+   const struct ReadyCell *cell_b = (const struct ReadyCell *)b;
+   if (cell_a->deadline_ns != cell_b->deadline_ns)
+   {
+      return cell_a->deadline_ns < cell_b->deadline_ns ? -1 : 1;
+   }
+   return cell_a->coro_index - cell_b->coro_index;
+}
+
+static void server_priority_quotas(struct ServerData *server_data, const int ready_num[], int quota[])
+{
+   int budget = server_data->resume_budget;
+   if (!budget)
+   {
+      for (int c = 0; c < CoroPrioritiesNum; c++)
+      {
+         quota[c] = ready_num[c];
+      }
+      return;
+   }
+   int budget_left = budget;
+   for (int c = 0; c < CoroPrioritiesNum; c++)
+   {
+      quota[c] = 0;
+      if (ready_num[c] && 0 < server_data->min_share_percent[c])
+      {
+         int share = (int)((long long)budget * server_data->min_share_percent[c] / 100);
+         share = share ? share : 1;
+         quota[c] = share < ready_num[c] ? share : ready_num[c];
+         budget_left -= quota[c];
+      }
+   }
+   for (int c = 0; (c < CoroPrioritiesNum) && (0 < budget_left); c++)
+   {
+      int extra = ready_num[c] - quota[c];
+      extra = extra < budget_left ? extra : budget_left;
+      quota[c] += extra;
+      budget_left -= extra;
+   }
+}
+
+// Resumes the latency class first (earliest deadline first), then the normal and the bulk ones.
+// Coroutines registered or completed during the pass are resumed on the next iteration.
+static int server_loop_coro_prioritized(struct ServerData *server_data)
+{
+   if (!server_reserve_priority_order(server_data))
+   {
+      return server_loop_coro_in_order(server_data);
+   }
+   int ready_num[CoroPrioritiesNum] = {0};
+   bool has_deadlines = false;
+   for (int i = 0; i < server_data->coro_list_len; i++)
+   {
+      enum CellType cell_type = server_data->coro_list[i].cell_type;
+      if (CellTypeUsedCell > cell_type)
+      {
+         if (CellTypeFreeCell == cell_type) {
+            continue;
+         } else if (CellTypeUnusedCell == cell_type){
+            break;
+         } else {
+            assert(0);
+         }
+      }
+      struct CoroArgs *coro_args = (struct CoroArgs *)coroutine_payload(server_data->coro_list[i].coro);
+      enum CoroPriority priority = coro_args->priority;
+      struct ReadyCell *cell = &(server_data->priority_order[priority][ready_num[priority]++]);
+      cell->coro_index = i;
+      cell->deadline_ns = ~0ULL;
+      if ((CoroPriorityLatency == priority) && coro_args->deadline_ns)
+      {
+         cell->deadline_ns = coro_args->deadline_ns;
+         has_deadlines = true;
+      }
+   }
+   if (has_deadlines && (1 < ready_num[CoroPriorityLatency]))
+   {
+      qsort(server_data->priority_order[CoroPriorityLatency], ready_num[CoroPriorityLatency],
+            sizeof(struct ReadyCell), compare_ready_cells);
+   }
+
+   int quota[CoroPrioritiesNum];
+   server_priority_quotas(server_data, ready_num, quota);
+   int coro_num = 0;
+   for (int c = 0; c < CoroPrioritiesNum; c++)
+   {
+      int n = ready_num[c];
+      struct ReadyCell *order = server_data->priority_order[c];
+      int first = 0;
+      if ((quota[c] < n) && !((CoroPriorityLatency == c) && has_deadlines))
+      {
+         // Round robin: continue from the slot following the last resumed one
+         while ((first < n) && (order[first].coro_index < server_data->priority_cursor[c]))
+         {
+            first++;
+         }
+         first = (first < n) ? first : 0;
+      }
+      for (int k = 0; k < quota[c]; k++)
+      {
+         int coro_index = order[(first + k) % n].coro_index;
+         // Cancelled by a coroutine resumed before it
+         if (CellTypeUsedCell > server_data->coro_list[coro_index].cell_type)
+         {
+            continue;
+         }
+         if (server_resume_cell(server_data, coro_index, (enum CoroPriority)c))
+         {
+            coro_num++;
+         }
+         server_data->priority_cursor[c] = coro_index + 1;
+      }
+      // Still ready: they are live as well
+      coro_num += n - quota[c];
+   }
+   return coro_num;
+}
+
+static int server_loop_coro(struct ServerData *server_data)
+{
+   if (!server_data)
+   {
+      return -1;
+   }
+   int coro_num = 0;
+   if (server_data->tasks_num)
+   {
+      coro_num += server_run_tasks(server_data);
+   }
+   if (server_data->prioritized_coroutines_num || server_data->resume_budget)
+   {
+      coro_num += server_loop_coro_prioritized(server_data);
+   }
+   else
+   {
+      coro_num += server_loop_coro_in_order(server_data);
+   }
+   server_free_request(server_data);
+   server_free_response(server_data);
+   return coro_num;
+}
+
+static void server_move_request_to_services(struct ServerData *server_data, int coro_index)
+{
+   enum CellType cell_type = server_data->coro_list[coro_index].cell_type;
+   coroutine_t coro = server_data->coro_list[coro_index].coro;
+   enum CoroRequests coro_request_type = server_data->coro_request_type;
+   if (!coro_request_type) {
+      return;
+   }
+   void *request = server_data->request;
+   struct RequestData *inplace_request = server_data->inplace_request;
+   unsigned long long deadline_ns = server_data->request_deadline_ns;
+
+   int pending_coro_index = put_or_realloc(&(server_data->pending_coro_list), &(server_data->pending_coro_list_len), &(server_data->pending_coro_list_free_hint), cell_type, coro);
+   if (0 <= pending_coro_index)
+   {
+      server_data->coro_request_type = CoroRequestNone;
+      server_data->request = NULL;
+      server_data->inplace_request = NULL;
+      server_data->request_deadline_ns = 0;
+      server_remove_coro(server_data, coro_index);
+   } else {
+      // server_data->pending_coro_list[coro_index].data = NULL;  // this is already done in put_or_realloc
+      return;
+   }
+
+   if (inplace_request)
+   {
+      // The coroutine is suspended already, so its frame is reachable through the saved stack only
+      struct RequestData *request_data = (struct RequestData *)coroutine_saved_address(coro, inplace_request);
+      request_data->request = coroutine_saved_address(coro, request_data->request);
+      request_data->response = coroutine_saved_address(coro, request_data->response);
+      request_data->coro = coro;
+      if (server_data->sojourn_target_ticks)
+      {
+         request_data->enqueued_ticks = cycle_clock_now();
+      }
+      server_note_request_submitted(server_data, request_data);
+      server_data->pending_coro_list[pending_coro_index].data = (void *)request_data;
+      return;
+   }
+
+   // The services take the request during this iteration (the next one if they are pipelined), so the
+   // record comes from the scratch arena unless a service holds it
+   struct RequestData *request_data = (struct RequestData *)arena_alloc(&(server_data->arena_pool),
+                                                                         &(server_data->scratch[server_data->scratch_current]),
+                                                                         sizeof(struct RequestData));
+   bool scratch = (NULL != request_data);
+   if (!scratch)
+   {
+      request_data = (struct RequestData *)malloc(sizeof(struct RequestData));
+      if (server_data->metrics)
+      {
+         metric_add(&(server_data->metrics->allocations), 1);
+      }
+   }
+   server_request_data_init(request_data, coro_request_type, request, NULL, false);
+   request_data->scratch = scratch;
+   request_data->coro = coro;
+   request_data->deadline_ns = deadline_ns;
+   if (server_data->sojourn_target_ticks)
+   {
+      request_data->enqueued_ticks = cycle_clock_now();
+   }
+   server_note_request_submitted(server_data, request_data);
+   server_data->pending_coro_list[pending_coro_index].data = (void *)request_data;
+}
+
+static void server_note_request_submitted(struct ServerData *server_data, struct RequestData *request_data)
+{
+   COROUTINE_PROBE3(request_submit, request_data->coro, request_data->coro_request_type, request_data);
+   struct ServerMetricsState *metrics = server_data->metrics;
+   enum CoroRequests coro_request_type = request_data->coro_request_type;
+   if (!metrics || (0 > coro_request_type) || (CoroRequestsNum <= coro_request_type))
+   {
+      return;
+   }
+   request_data->submitted_ticks = cycle_clock_now();
+   metric_add(&(metrics->requests_submitted[coro_request_type]), 1);
+}
+
+static void server_note_request_completed(struct ServerData *server_data, struct RequestData *request_data)
+{
+   COROUTINE_PROBE3(request_complete, request_data->coro, request_data->coro_request_type, request_data);
+   struct ServerMetricsState *metrics = server_data->metrics;
+   if (!metrics || !request_data->submitted_ticks)
+   {
+      return;
+   }
+   enum CoroRequests coro_request_type = request_data->coro_request_type;
+   metric_add(&(metrics->requests_completed[coro_request_type]), 1);
+   latency_histogram_record(&(metrics->request_latency[coro_request_type]), cycle_clock_now() - request_data->submitted_ticks);
+   request_data->submitted_ticks = 0;
+}
+
+static void server_move_response_to_coro(struct ServerData *server_data, coroutine_t coro, void *response)
+{
+   if (server_on_pipeline_thread(server_data))
+   {
+      server_pipeline_defer(server_data, coro, response);
+      return;
+   }
+   int coro_index = put_or_realloc(&(server_data->coro_list), &(server_data->coro_list_len), &(server_data->coro_list_free_hint), CellTypeUsedCell, coro);
+   if (0 > coro_index)
+   {
+      server_free_response_data(response);
+      return;
+   }
+   server_data->coro_list[coro_index].data = response;
+   server_data->ready_coroutines_num++;
+}
+
+static void server_unlink_held_request(struct ServerData *server_data, struct RequestData *request_data)
+{
+   if (request_data->prev_held)
+   {
+      request_data->prev_held->next_held = request_data->next_held;
+   }
+   else
+   {
+      server_data->held_requests = request_data->next_held;
+   }
+   if (request_data->next_held)
+   {
+      request_data->next_held->prev_held = request_data->prev_held;
+   }
+   request_data->prev_held = NULL;
+   request_data->next_held = NULL;
+   request_data->held = false;
+   server_data->held_requests_num--;
+   if (request_data->coro && !request_data->on_complete)
+   {
+      ((struct CoroArgs *)coroutine_payload(request_data->coro))->held_request = NULL;
+   }
+}
+
+request_handle_t server_hold_request(struct ServerData *server_data, struct RequestData *request_data)
+{
+   if (!server_data || !request_data)
+   {
+      return NULL;
+   }
+   server_services_lock(server_data);
+   if (request_data->held)
+   {
+      server_services_unlock(server_data);
+      return request_data;
+   }
+   if (request_data->scratch)
+   {
+      // The scratch arena is reset at the end of the iteration: the record moves to the heap together
+      // with its request; the loop drops the scratch copy once the service returns
+      struct RequestData *held_data = (struct RequestData *)malloc(sizeof(struct RequestData));
+      if (!held_data)
+      {
+         server_services_unlock(server_data);
+         return NULL;
+      }
+      *held_data = *request_data;
+      held_data->scratch = false;
+      request_data->request = NULL;
+      request_data = held_data;
+      if (server_data->metrics)
+      {
+         metric_add(&(server_data->metrics->allocations), 1);
+      }
+   }
+   request_data->held = true;
+   request_data->prev_held = NULL;
+   request_data->next_held = server_data->held_requests;
+   if (server_data->held_requests)
+   {
+      server_data->held_requests->prev_held = request_data;
+   }
+   server_data->held_requests = request_data;
+   server_data->held_requests_num++;
+   if (request_data->coro && !request_data->on_complete)
+   {
+      // The records of a group have the group's hook and are reached through the group's record
+      ((struct CoroArgs *)coroutine_payload(request_data->coro))->held_request = request_data;
+   }
+   if (request_data->deadline_ns && (0 > request_data->timeout_timer))
+   {
+      server_add_sleep_timer(server_data, request_data, request_data->deadline_ns, true);
+   }
+   server_services_unlock(server_data);
+   return request_data;
+}
+
+// For services which relay a request that failed elsewhere (e.g. on another shard): completes the handle
+// with a NULL response and the status, which the coroutine reads with server_request_status()
+void server_complete_failed(struct ServerData *server_data, request_handle_t handle, enum RequestStatus status)
+{
+   if (server_data && handle)
+   {
+      server_fail_request(server_data, handle, status);
+   }
+}
+
+void server_complete(struct ServerData *server_data, request_handle_t handle, void *response)
+{
+   if (!server_data || !handle)
+   {
+      server_free_response_data(response);
+      return;
+   }
+   server_services_lock(server_data);
+   server_note_request_completed(server_data, handle);
+   if (handle->admitted)
+   {
+      server_data->pending_requests_num[handle->coro_request_type]--;
+      handle->admitted = false;
+   }
+   if (0 <= handle->timeout_timer)
+   {
+      server_remove_sleep_timer(server_data, handle->timeout_timer);
+      handle->timeout_timer = -1;
+   }
+   if (handle->held)
+   {
+      server_unlink_held_request(server_data, handle);
+   }
+   handle->on_cancel = NULL;
+   if (handle->inplace)
+   {
+      // The response was written to the caller's buffer already
+      if (response != handle->response)
+      {
+         server_free_response_data(response);
+      }
+      response = NULL;
+   }
+   if (handle->on_complete)
+   {
+      // The owner of the hook owns the request data as well
+      handle->on_complete(server_data, handle, response);
+      server_services_unlock(server_data);
+      return;
+   }
+   server_move_response_to_coro(server_data, handle->coro, response);
+   // While the service is still inside server_put_request_to_service() the loop owns the request data.
+   if (handle != server_data->dispatching_request)
+   {
+      server_free_request_data(handle);
+   }
+   server_services_unlock(server_data);
+}
+
+void server_request_data_init(struct RequestData *request_data, enum CoroRequests coro_request_type,
+                              void *request, void *response, bool inplace)
+{
+   request_data->coro_request_type = coro_request_type;
+   request_data->request = request;
+   request_data->response = response;
+   request_data->coro = NULL;
+   request_data->on_complete = NULL;
+   request_data->on_complete_arg = NULL;
+   request_data->inplace = inplace;
+   request_data->scratch = false;
+   request_data->held = false;
+   request_data->prev_held = NULL;
+   request_data->next_held = NULL;
+   request_data->submitted_ticks = 0;
+   request_data->on_cancel = NULL;
+   request_data->cancelled = false;
+   request_data->status = RequestStatusOk;
+   request_data->admitted = false;
+   request_data->enqueued_ticks = 0;
+   request_data->deadline_ns = 0;
+   request_data->timeout_timer = -1;
+   request_data->sleep_timer = -1;
+}
+
+// Hands a request which did not come from a coroutine of this server (it has an on_complete hook)
+// directly to its service
+void server_dispatch_request(struct ServerData *server_data, struct RequestData *request_data)
+{
+   if (!server_data || !request_data)
+   {
+      return;
+   }
+   server_services_lock(server_data);
+   server_note_request_submitted(server_data, request_data);
+   struct RequestData *dispatching_request = server_data->dispatching_request;
+   server_data->dispatching_request = NULL;
+   if (server_admit_request(server_data, request_data, 0))
+   {
+      server_put_request_to_service(server_data, request_data->coro, request_data);
+   }
+   server_data->dispatching_request = dispatching_request;
+   server_services_unlock(server_data);
+}
+
+// Forgets a held request without completing it
+void server_abandon_request(struct ServerData *server_data, request_handle_t handle)
+{
+   if (!server_data || !handle)
+   {
+      return;
+   }
+   server_services_lock(server_data);
+   if (handle->held)
+   {
+      server_unlink_held_request(server_data, handle);
+   }
+   server_services_unlock(server_data);
+}
+
+// Drops a held request from its service (see request_cancel_hook) and completes it with the status.
+// False if the service is not able to drop it.
+bool server_cancel_request(struct ServerData *server_data, request_handle_t handle, enum RequestStatus status)
+{
+   if (!server_data || !handle)
+   {
+      return false;
+   }
+   server_services_lock(server_data);
+   bool cancelled = server_cancel_held_request(server_data, handle, status);
+   server_services_unlock(server_data);
+   return cancelled;
+}
+
+static bool server_cancel_held_request(struct ServerData *server_data, request_handle_t handle, enum RequestStatus status)
+{
+   if (!handle->held || !handle->on_cancel)
+   {
+      return false;
+   }
+   request_cancel_hook on_cancel = handle->on_cancel;
+   handle->on_cancel = NULL;
+   on_cancel(server_data, handle);
+   handle->cancelled = true;
+   server_fail_request(server_data, handle, status);
+   return true;
+}
+
+static void server_dispatch_request_group(struct ServerData *server_data, coroutine_t coro, struct RequestData *request_data)
+{
+   struct RequestGroup *group = (struct RequestGroup *)request_data->request;
+   group->requests = (struct RequestData *)coroutine_saved_address(coro, group->requests);
+   group->handle = server_hold_request(server_data, request_data);
+   // The dispatch holds one count, so the group is not completed before all of its requests are out
+   group->pending_num = group->requests_num + 1;
+   for (int i = 0; i < group->requests_num; i++)
+   {
+      struct RequestData *sub_request = &(group->requests[i]);
+      if ((RequestWaitAny == group->wait_mode && 0 <= group->winner) || server_coro_cancelled(coro))
+      {
+         sub_request->cancelled = true;
+         group->pending_num--;
+         continue;
+      }
+      sub_request->request = coroutine_saved_address(coro, sub_request->request);
+      sub_request->response = coroutine_saved_address(coro, sub_request->response);
+      sub_request->coro = coro;
+      sub_request->inplace = true;
+      sub_request->held = false;
+      sub_request->on_complete = server_request_group_complete;
+      sub_request->on_complete_arg = group;
+      sub_request->on_cancel = NULL;
+      sub_request->cancelled = false;
+      sub_request->status = RequestStatusOk;
+      sub_request->admitted = false;
+      group->dispatched_num = i + 1;
+      if (CoroRequestMany == sub_request->coro_request_type)
+      {
+         server_complete(server_data, sub_request, NULL);
+         continue;
+      }
+      server_dispatch_request(server_data, sub_request);
+   }
+   server_request_group_release(server_data, group);
+}
+
+static void server_request_group_complete(struct ServerData *server_data, struct RequestData *request_data, void *response)
+{
+   struct RequestGroup *group = (struct RequestGroup *)request_data->on_complete_arg;
+   if (!request_data->cancelled && 0 > group->winner)
+   {
+      group->winner = (int)(request_data - group->requests);
+      if (RequestWaitAny == group->wait_mode)
+      {
+         for (int i = 0; i < group->dispatched_num; i++)
+         {
+            server_cancel_held_request(server_data, &(group->requests[i]), RequestStatusCancelled);
+         }
+      }
+   }
+   server_request_group_release(server_data, group);
+}
+
+static void server_request_group_release(struct ServerData *server_data, struct RequestGroup *group)
+{
+   if (0 < --group->pending_num)
+   {
+      return;
+   }
+   // The caller's records get their own buffers back, not the ones in the saved copy of its frame
+   coroutine_t coro = group->handle->coro;
+   for (int i = 0; i < group->dispatched_num; i++)
+   {
+      struct RequestData *sub_request = &(group->requests[i]);
+      sub_request->request = coroutine_stack_address(coro, sub_request->request);
+      sub_request->response = coroutine_stack_address(coro, sub_request->response);
+   }
+   server_complete(server_data, group->handle, NULL);
+}
+
+// Returns the buffer a service has to put its response to: the caller's one for in-place requests
+// or a new heap buffer which will be freed by the loop after the coroutine consumes it.
+void *server_response_buffer(struct RequestData *request_data, size_t size)
+{
+   if (request_data && request_data->inplace)
+   {
+      return request_data->response;
+   }
+   return malloc(size);
+}
+
+// Timers are removed when their request completes or is cancelled, so they keep track of their place in the heap
+static void server_put_sleep_timer(struct SleepTimer *timers, int timer_index, struct SleepTimer timer)
+{
+   timers[timer_index] = timer;
+   if (timer.timeout)
+   {
+      timer.handle->timeout_timer = timer_index;
+   }
+   else
+   {
+      timer.handle->sleep_timer = timer_index;
+   }
+}
+
+static bool server_add_sleep_timer(struct ServerData *server_data, request_handle_t handle, unsigned long long deadline_ns, bool timeout)
+{
+   if (server_data->sleep_timers_num >= server_data->sleep_timers_len)
+   {
+      int new_sleep_timers_len = server_data->sleep_timers_len + 1024;
+      struct SleepTimer *new_sleep_timers = (struct SleepTimer *)memcp_to_bigger(
+          (void *)server_data->sleep_timers,
+          sizeof(struct SleepTimer) * server_data->sleep_timers_len,
+          sizeof(struct SleepTimer) * new_sleep_timers_len,
+          0);
+      if (!new_sleep_timers)
+      {
+         return false;
+      }
+      server_data->sleep_timers = new_sleep_timers;
+      server_data->sleep_timers_len = new_sleep_timers_len;
+   }
+   struct SleepTimer *timers = server_data->sleep_timers;
+   int i = server_data->sleep_timers_num++;
+   while (i > 0)
+   {
+      int parent = (i - 1) / 2;
+      if (timers[parent].deadline_ns <= deadline_ns)
+      {
+         break;
+      }
+      server_put_sleep_timer(timers, i, timers[parent]);
+      i = parent;
+   }
+   struct SleepTimer timer = {deadline_ns, handle, timeout};
+   server_put_sleep_timer(timers, i, timer);
+   return true;
+}
+
+// Moves the last timer into the freed place and restores the heap from there
+static void server_remove_sleep_timer(struct ServerData *server_data, int timer_index)
+{
+   struct SleepTimer *timers = server_data->sleep_timers;
+   struct SleepTimer last = timers[--server_data->sleep_timers_num];
+   int n = server_data->sleep_timers_num;
+   if (timer_index == n)
+   {
+      return;
+   }
+   int i = timer_index;
+   while (i > 0)
+   {
+      int parent = (i - 1) / 2;
+      if (timers[parent].deadline_ns <= last.deadline_ns)
+      {
+         break;
+      }
+      server_put_sleep_timer(timers, i, timers[parent]);
+      i = parent;
+   }
+   for (;;)
+   {
+      int child = 2 * i + 1;
+      if (child >= n)
+      {
+         break;
+      }
+      if ((child + 1 < n) && (timers[child + 1].deadline_ns < timers[child].deadline_ns))
+      {
+         child++;
+      }
+      if (last.deadline_ns <= timers[child].deadline_ns)
+      {
+         break;
+      }
+      server_put_sleep_timer(timers, i, timers[child]);
+      i = child;
+   }
+   server_put_sleep_timer(timers, i, last);
+}
+
+static void server_cancel_sleep_timer(struct ServerData *server_data, struct RequestData *request_data)
+{
+   if (0 <= request_data->sleep_timer)
+   {
+      server_remove_sleep_timer(server_data, request_data->sleep_timer);
+      request_data->sleep_timer = -1;
+   }
+}
+
+static void server_run_sleep_timers(struct ServerData *server_data)
+{
+   if (!server_data->sleep_timers_num)
+   {
+      return;
+   }
+   unsigned long long now = server_monotonic_ns();
+   struct SleepTimer *timers = server_data->sleep_timers;
+   while (server_data->sleep_timers_num && (timers[0].deadline_ns <= now))
+   {
+      request_handle_t handle = timers[0].handle;
+      bool timeout = timers[0].timeout;
+      server_remove_sleep_timer(server_data, 0);
+      if (!timeout)
+      {
+         handle->sleep_timer = -1;
+         server_complete(server_data, handle, NULL);
+         continue;
+      }
+      handle->timeout_timer = -1;
+      // A service which is not able to drop the request (no on_cancel) still completes it later
+      if (server_cancel_held_request(server_data, handle, RequestStatusTimedOut))
+      {
+         server_note_request_timed_out(server_data);
+      }
+   }
+}
+
+static void server_put_request_to_service(struct ServerData *server_data, coroutine_t coro, struct RequestData *request_data)
+{
+   switch (request_data->coro_request_type)
+   {
+   case CoroRequestSocketRead:
+   {
+      break;
+   }
+   case CoroRequestSleep:
+   {
+      // request is a pointer to the number of seconds to sleep
+      double seconds = request_data->request ? *(double *)request_data->request : 0.0;
+      unsigned long long deadline_ns = server_monotonic_ns();
+      if (0.0 < seconds)
+      {
+         deadline_ns += (unsigned long long)(seconds * 1000000000.0);
+      }
+      request_handle_t handle = server_hold_request(server_data, request_data);
+      if (!server_add_sleep_timer(server_data, handle, deadline_ns, false))
+      {
+         server_complete(server_data, handle, NULL);
+         break;
+      }
+      handle->on_cancel = server_cancel_sleep_timer;
+      break;
+   }
+   case CoroRequestRevertSign:
+   {
+      int * num = (int*)request_data->request;
+      int *result = (int*)server_response_buffer(request_data, sizeof(*result));
+      *result = -(*num);
+      server_complete(server_data, request_data, result);
+      break;
+   }
+   case CoroRequestOffload:
+   {
+      struct OffloadJob *job = (struct OffloadJob *)request_data->request;
+      job->arg = coroutine_saved_address(coro, job->arg);
+      if (!server_data->offload)
+      {
+         // No pool was started: the job is executed right here
+         job->result = job->func(job->arg);
+         server_complete(server_data, request_data, NULL);
+         break;
+      }
+      job->handle = server_hold_request(server_data, request_data);
+      offload_pool_submit(server_data->offload, job);
+      break;
+   }
+   case CoroRequestCrossShard:
+   {
+      if (!shards_route_request(server_data, request_data))
+      {
+         server_complete(server_data, request_data, NULL);
+      }
+      break;
+   }
+   case CoroRequestPark:
+   {
+      coro_park_service(server_data, request_data);
+      break;
+   }
+   case CoroRequestMany:
+   {
+      server_dispatch_request_group(server_data, coro, request_data);
+      break;
+   }
+   case CoroRequestCoalesced:
+   {
+      coro_flight_service(server_data, request_data);
+      break;
+   }
+   case CoroRequestCache:
+   {
+      coro_cache_service(server_data, request_data);
+      break;
+   }
+   case CoroRequestYield:
+   default:
+   {
+      server_complete(server_data, request_data, NULL);
+   }
+   }
+}
+
+static void server_run_all_services(struct ServerData *server_data)
+{
+   server_services_lock(server_data);
+   server_inbox_drain(server_data);
+   if (server_data->offload)
+   {
+      offload_pool_poll(server_data->offload);
+   }
+   server_run_sleep_timers(server_data);
+   server_services_unlock(server_data);
+}
+
+bool server_wakeup_open(struct ServerData *server_data)
+{
+   if (!server_data)
+   {
+      return false;
+   }
+   if (server_data->wakeup)
+   {
+      return true;
+   }
+   struct LoopWakeup *wakeup = (struct LoopWakeup *)malloc(sizeof(*wakeup));
+   if (!wakeup)
+   {
+      return false;
+   }
+   if (!loop_wakeup_open(wakeup))
+   {
+      free(wakeup);
+      return false;
+   }
+   server_data->wakeup = wakeup;
+   return true;
+}
+
+// Thread safe. Interrupts the blocking wait of the loop.
+void server_wakeup(struct ServerData *server_data)
+{
+   if (server_data && server_data->wakeup)
+   {
+      loop_wakeup_notify(server_data->wakeup);
+   }
+}
+
+// While set, server_loop_iteration() keeps returning true and blocks waiting for submissions from
+// the other threads when there is nothing to resume
+void server_set_keep_alive(struct ServerData *server_data, bool keep_alive)
+{
+   if (server_data)
+   {
+      server_data->keep_alive = keep_alive;
+   }
+}
+
+// Blocks the loop while there is nothing to resume: until the nearest sleep timer or
+// until some other thread calls server_wakeup()
+static void server_wait_for_events(struct ServerData *server_data, bool has_ready)
+{
+   server_services_lock(server_data);
+   bool has_held = 0 < server_data->held_requests_num;
+   server_services_unlock(server_data);
+   if (has_ready || (!has_held && !server_data->keep_alive))
+   {
+      return;
+   }
+   long long timeout_ns = -1;
+   if (server_data->sleep_timers_num)
+   {
+      unsigned long long now = server_monotonic_ns();
+      if (server_data->sleep_timers[0].deadline_ns <= now)
+      {
+         return;
+      }
+      timeout_ns = (long long)(server_data->sleep_timers[0].deadline_ns - now);
+   }
+   if (server_data->wakeup)
+   {
+      loop_wakeup_wait(server_data->wakeup, timeout_ns);
+   }
+   else if (0 < timeout_ns)
+   {
+#if defined COROUTINE_HAVE_WIN32API
+      Sleep((DWORD)((timeout_ns + 999999) / 1000000));
+#else
+      struct timespec ts;
+      ts.tv_sec = (time_t)(timeout_ns / 1000000000LL);
+      ts.tv_nsec = (long)(timeout_ns % 1000000000LL);
+      nanosleep(&ts, NULL);
+#endif
+   }
+   else
+   {
+      // Nobody is able to wake us up: keep polling the services
+      return;
+   }
+   server_run_all_services(server_data);
+}
+
+static void server_loop_pending_list(struct ServerData *server_data, struct CoroData *coro_list, int coro_list_len, int *free_hint_ptr)
+{
+   unsigned long long now = 0;
+   if (server_data->sojourn_target_ticks)
+   {
+      now = cycle_clock_now();
+      server_services_lock(server_data);
+      server_sojourn_update(server_data, coro_list, coro_list_len, now);
+      server_services_unlock(server_data);
+   }
+   for (int i = 0; i < coro_list_len; i++)
+   {
+      enum CellType cell_type = coro_list[i].cell_type;
+      coroutine_t coro = coro_list[i].coro;
+      if (CellTypeUsedCell > cell_type)
+      {
+         if (CellTypeFreeCell == cell_type) {
+            continue;
+         } else if (CellTypeUnusedCell == cell_type){
+            break;
+         } else {
+            assert(0);
+         }
+      }
+      struct RequestData *request_data = (struct RequestData *)(coro_list[i].data);
+      coro_list[i].data = NULL;
+      server_remove_pending_coro(coro_list, coro_list_len, free_hint_ptr, i);
+      server_services_lock(server_data);
+      server_data->dispatching_request = request_data;
+      if (server_request_sheddable(request_data->coro_request_type) && server_coro_cancelled(coro))
+      {
+         server_fail_request(server_data, request_data, RequestStatusCancelled);
+      }
+      else if (server_admit_request(server_data, request_data, now))
+      {
+         server_put_request_to_service(server_data, coro, request_data);
+      }
+      server_data->dispatching_request = NULL;
+      if (!request_data->held)
+      {
+         server_free_request_data(request_data);
+      }
+      server_services_unlock(server_data);
+   }
+}
+
+static void server_loop_services(struct ServerData *server_data)
+{
+   if (!server_data)
+   {
+      return;
+   }
+   server_loop_pending_list(server_data, server_data->pending_coro_list, server_data->pending_coro_list_len,
+                            &(server_data->pending_coro_list_free_hint));
+   server_run_all_services(server_data);
+}
+
+// Every request allocated from the arena was handed to its service and either dropped or moved to
+// the heap by server_hold_request()
+static void server_reset_scratch(struct ServerData *server_data, int scratch_index)
+{
+   struct Arena *scratch = &(server_data->scratch[scratch_index]);
+   if (scratch->allocated > server_data->scratch_high_water)
+   {
+      server_data->scratch_high_water = scratch->allocated;
+      if (server_data->metrics)
+      {
+         metric_set(&(server_data->metrics->scratch_high_water_bytes), (unsigned long long)scratch->allocated);
+      }
+   }
+   arena_reset(&(server_data->arena_pool), scratch);
+}
+
+#if defined COROUTINE_HAVE_PTHREAD
+
+// Pipelined loop: the services of iteration N run on a companion thread while the main thread
+// resumes the coroutines of iteration N + 1. The pending lists are double-buffered: at the end of
+// each iteration the list collected by the coroutines is swapped with the one the companion thread
+// has just emptied. Anything the services want to put to coro_list (responses, coroutines submitted
+// from the other threads) is deferred to a private buffer and merged by the main thread while the
+// companion thread is parked.
+struct ServerPipeline
+{
+   pthread_t thread;
+   pthread_mutex_t services_mutex; // recursive; serializes the service state with the main thread
+   pthread_mutex_t batch_mutex;
+   pthread_cond_t batch_cond;
+   pthread_cond_t batch_done_cond;
+   bool batch_running;
+   bool stop;
+   bool loop_has_ready;
+
+   int batch_len;
+   struct CoroData *batch; // data is request
+   int batch_free_hint;
+
+   int deferred_len;
+   int deferred_num;
+   struct CoroData *deferred; // data is response
+};
+
+static void server_services_lock(struct ServerData *server_data)
+{
+   if (server_data->pipeline)
+   {
+      pthread_mutex_lock(&(server_data->pipeline->services_mutex));
+   }
+}
+
+static void server_services_unlock(struct ServerData *server_data)
+{
+   if (server_data->pipeline)
+   {
+      pthread_mutex_unlock(&(server_data->pipeline->services_mutex));
+   }
+}
+
+static bool server_on_pipeline_thread(struct ServerData *server_data)
+{
+   return server_data->pipeline && pthread_equal(pthread_self(), server_data->pipeline->thread);
+}
+
+// Called on the companion thread only
+static bool server_pipeline_defer(struct ServerData *server_data, coroutine_t coro, void *data)
+{
+   struct ServerPipeline *pipeline = server_data->pipeline;
+   if (pipeline->deferred_num >= pipeline->deferred_len)
+   {
+      int new_deferred_len = pipeline->deferred_len + (1024 > pipeline->deferred_len ? 1024 : pipeline->deferred_len);
+      struct CoroData *new_deferred = (struct CoroData *)memcp_to_bigger(
+          (void *)pipeline->deferred,
+          sizeof(struct CoroData) * pipeline->deferred_len,
+          sizeof(struct CoroData) * new_deferred_len,
+          0);
+      if (!new_deferred)
+      {
+         server_free_response_data(data);
+         return false;
+      }
+      pipeline->deferred = new_deferred;
+      pipeline->deferred_len = new_deferred_len;
+   }
+   struct CoroData *cell = &(pipeline->deferred[pipeline->deferred_num++]);
+   cell->cell_type = CellTypeUsedCell;
+   cell->coro = coro;
+   cell->data = data;
+   return true;
+}
+
+static void *server_pipeline_thread(void *arg)
+{
+   struct ServerData *server_data = (struct ServerData *)arg;
+   struct ServerPipeline *pipeline = server_data->pipeline;
+   pthread_mutex_lock(&(pipeline->batch_mutex));
+   for (;;)
+   {
+      while (!pipeline->batch_running && !pipeline->stop)
+      {
+         pthread_cond_wait(&(pipeline->batch_cond), &(pipeline->batch_mutex));
+      }
+      if (!pipeline->batch_running)
+      {
+         break;
+      }
+      bool loop_has_ready = pipeline->loop_has_ready;
+      pthread_mutex_unlock(&(pipeline->batch_mutex));
+
+      server_loop_pending_list(server_data, pipeline->batch, pipeline->batch_len, &(pipeline->batch_free_hint));
+      server_run_all_services(server_data);
+      // Nothing to hand back to the main thread yet: wait for the timers or the other threads here
+      server_wait_for_events(server_data, loop_has_ready || pipeline->deferred_num);
+
+      pthread_mutex_lock(&(pipeline->batch_mutex));
+      pipeline->batch_running = false;
+      pthread_cond_signal(&(pipeline->batch_done_cond));
+   }
+   pthread_mutex_unlock(&(pipeline->batch_mutex));
+   return NULL;
+}
+
+// Waits for the companion thread to finish its batch, merges its results into coro_list and,
+// if start_next is set, hands it the requests collected during this iteration
+static void server_pipeline_sync(struct ServerData *server_data, bool start_next)
+{
+   struct ServerPipeline *pipeline = server_data->pipeline;
+   pthread_mutex_lock(&(pipeline->batch_mutex));
+   while (pipeline->batch_running)
+   {
+      pthread_cond_wait(&(pipeline->batch_done_cond), &(pipeline->batch_mutex));
+   }
+   for (int i = 0; i < pipeline->deferred_num; i++)
+   {
+      struct CoroData *cell = &(pipeline->deferred[i]);
+      server_move_response_to_coro(server_data, cell->coro, cell->data);
+      cell->coro = NULL;
+      cell->data = NULL;
+   }
+   pipeline->deferred_num = 0;
+   // The batch which has just finished was allocated from the other arena
+   server_reset_scratch(server_data, 1 - server_data->scratch_current);
+   if (start_next)
+   {
+      int batch_len = pipeline->batch_len;
+      struct CoroData *batch = pipeline->batch;
+      int batch_free_hint = pipeline->batch_free_hint;
+      pipeline->batch_len = server_data->pending_coro_list_len;
+      pipeline->batch = server_data->pending_coro_list;
+      pipeline->batch_free_hint = server_data->pending_coro_list_free_hint;
+      server_data->pending_coro_list_len = batch_len;
+      server_data->pending_coro_list = batch;
+      server_data->pending_coro_list_free_hint = batch_free_hint;
+      server_data->scratch_current = 1 - server_data->scratch_current;
+
+      pipeline->loop_has_ready = 0 < server_data->ready_coroutines_num || 0 < server_data->tasks_num;
+      pipeline->batch_running = true;
+      pthread_cond_signal(&(pipeline->batch_cond));
+   }
+   pthread_mutex_unlock(&(pipeline->batch_mutex));
+}
+
+// Moves the service phase of the loop to a companion thread. Must be called by the loop thread
+// between iterations. The services keep running one iteration behind the coroutines, so the mode
+// pays off when both phases have a lot of work; it is not meant for the servers of a shard runtime.
+bool server_pipeline_start(struct ServerData *server_data)
+{
+   if (!server_data)
+   {
+      return false;
+   }
+   if (server_data->pipeline)
+   {
+      return true;
+   }
+   struct ServerPipeline *pipeline = (struct ServerPipeline *)malloc(sizeof(*pipeline));
+   if (!pipeline)
+   {
+      return false;
+   }
+   pipeline->batch_len = server_data->pending_coro_list_len;
+   pipeline->batch = (struct CoroData *)malloc(sizeof(struct CoroData) * pipeline->batch_len);
+   if (!pipeline->batch)
+   {
+      free(pipeline);
+      return false;
+   }
+   for (int i = 0; i < pipeline->batch_len; i++)
+   {
+      pipeline->batch[i].cell_type = CellTypeUnusedCell;
+      pipeline->batch[i].coro = NULL;
+      pipeline->batch[i].data = NULL;
+   }
+   pipeline->batch_free_hint = 0;
+   pipeline->deferred_len = 0;
+   pipeline->deferred_num = 0;
+   pipeline->deferred = NULL;
+   pipeline->batch_running = false;
+   pipeline->stop = false;
+   pipeline->loop_has_ready = false;
+
+   pthread_mutexattr_t attr;
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+   pthread_mutex_init(&(pipeline->services_mutex), &attr);
+   pthread_mutexattr_destroy(&attr);
+   pthread_mutex_init(&(pipeline->batch_mutex), NULL);
+   pthread_cond_init(&(pipeline->batch_cond), NULL);
+   pthread_cond_init(&(pipeline->batch_done_cond), NULL);
+
+   // The thread only looks at the server after the first batch is handed to it under batch_mutex
+   server_data->pipeline = pipeline;
+   if (0 != pthread_create(&(pipeline->thread), NULL, server_pipeline_thread, server_data))
+   {
+      server_data->pipeline = NULL;
+      pthread_cond_destroy(&(pipeline->batch_done_cond));
+      pthread_cond_destroy(&(pipeline->batch_cond));
+      pthread_mutex_destroy(&(pipeline->batch_mutex));
+      pthread_mutex_destroy(&(pipeline->services_mutex));
+      free(pipeline->batch);
+      free(pipeline);
+      return false;
+   }
+   return true;
+}
+
+// Finishes the batch in flight and returns the service phase to the loop thread. The requests of
+// the last iteration stay in pending_coro_list for the next (sequential) server_loop_iteration().
+void server_pipeline_stop(struct ServerData *server_data)
+{
+   if (!server_data || !server_data->pipeline)
+   {
+      return;
+   }
+   struct ServerPipeline *pipeline = server_data->pipeline;
+   server_pipeline_sync(server_data, false);
+   pthread_mutex_lock(&(pipeline->batch_mutex));
+   pipeline->stop = true;
+   pthread_cond_signal(&(pipeline->batch_cond));
+   pthread_mutex_unlock(&(pipeline->batch_mutex));
+   pthread_join(pipeline->thread, NULL);
+   server_data->pipeline = NULL;
+
+   pthread_cond_destroy(&(pipeline->batch_done_cond));
+   pthread_cond_destroy(&(pipeline->batch_cond));
+   pthread_mutex_destroy(&(pipeline->batch_mutex));
+   pthread_mutex_destroy(&(pipeline->services_mutex));
+   // Every request of the last batch was handed to its service already
+   free(pipeline->batch);
+   free(pipeline->deferred);
+   free(pipeline);
+}
+
+#else
+
+static void server_services_lock(struct ServerData *server_data)
+{
+}
+
+static void server_services_unlock(struct ServerData *server_data)
+{
+}
+
+static bool server_on_pipeline_thread(struct ServerData *server_data)
+{
+   return false;
+}
+
+static bool server_pipeline_defer(struct ServerData *server_data, coroutine_t coro, void *data)
+{
+   return false;
+}
+
+static void server_pipeline_sync(struct ServerData *server_data, bool start_next)
+{
+}
+
+bool server_pipeline_start(struct ServerData *server_data)
+{
+   return false;
+}
+
+void server_pipeline_stop(struct ServerData *server_data)
+{
+}
+
+#endif
+
+// For state shared by the coroutines and the services, such as the coro_sync.h primitives: serializes
+// the caller with the services thread of a pipelined loop. Nested calls are allowed.
+void server_services_enter(struct ServerData *server_data)
+{
+   if (server_data)
+   {
+      server_services_lock(server_data);
+   }
+}
+
+void server_services_leave(struct ServerData *server_data)
+{
+   if (server_data)
+   {
+      server_services_unlock(server_data);
+   }
+}
+
+static unsigned long long server_resumed_num(struct ServerData *server_data)
+{
+   unsigned long long resumed = 0;
+   for (int c = 0; c < CoroPrioritiesNum; c++)
+   {
+      resumed += server_data->resumed_per_priority[c];
+   }
+   return resumed;
+}
+
+bool server_loop_iteration(struct ServerData *server_data)
+{
+   bool need_to_proceed = false;
+   if (!server_data)
+   {
+      return need_to_proceed;
+   }
+   COROUTINE_PROBE1(iteration_start, server_data);
+   unsigned long long started_ticks = cycle_clock_now();
+   unsigned long long resumed_before = server_resumed_num(server_data);
+   if (server_data->cache)
+   {
+      // The loop clock of the cache TTLs
+      coro_cache_tick(server_data, started_ticks);
+   }
+   int live_coro_num = server_loop_coro(server_data);
+   server_data->last_live_coroutines_num = live_coro_num;
+   if (server_data->pipeline)
+   {
+      // The services of the previous iteration were running together with the coroutines above.
+      // Collect their results and hand them the requests of this iteration.
+      server_pipeline_sync(server_data, true);
+      if (live_coro_num || server_data->ready_coroutines_num || server_data->tasks_num || server_data->held_requests_num || server_data->keep_alive) {
+         need_to_proceed = true;
+      }
+   }
+   else
+   {
+      server_loop_services(server_data);
+      server_reset_scratch(server_data, server_data->scratch_current);
+      // Coroutines may complete requests of each other (see coro_sync.h), so the last coroutine
+      // of a pass may leave a ready one behind
+      if (live_coro_num || server_data->ready_coroutines_num || server_data->tasks_num || server_data->held_requests_num || server_data->keep_alive) {
+         need_to_proceed = true;
+      }
+   }
+   unsigned long long resumed = server_resumed_num(server_data) - resumed_before;
+   COROUTINE_PROBE3(iteration_end, server_data, resumed, live_coro_num);
+   if (server_data->metrics)
+   {
+      // The blocking wait below is idle time, not a part of the iteration
+      struct ServerMetricsState *metrics = server_data->metrics;
+      unsigned long long iteration_ticks = cycle_clock_now() - started_ticks;
+      metric_add(&(metrics->iterations), 1);
+      metric_set(&(metrics->last_iteration_ticks), iteration_ticks);
+      latency_histogram_record(&(metrics->iteration_duration), iteration_ticks);
+      metric_add(&(metrics->resumed), resumed);
+      metric_set(&(metrics->last_resumed), resumed);
+      metric_set(&(metrics->live_coroutines), (unsigned long long)live_coro_num);
+   }
+   if (!server_data->pipeline)
+   {
+      server_wait_for_events(server_data, 0 < server_data->ready_coroutines_num || 0 < server_data->tasks_num);
+   }
+   return need_to_proceed;
+}
+
+struct ServerData *server_create()
+{
+   // Before the loop, the offload workers or the shards run: they all convert cycle clock ticks
+   cycle_clock_calibrate();
+   struct ServerData *server_data = (struct ServerData *)malloc(sizeof(struct ServerData));
    server_data->shed = coro_server_open();
 
    server_data->coro_list_len = 1024;
@@ -453,6 +2469,84 @@ struct ServerData *server_create()
    server_data->coro_request_type = CoroRequestNone;
    server_data->request = NULL;
    server_data->response = NULL;
+   server_data->inplace_request = NULL;
+   server_data->request_deadline_ns = 0;
+
+   server_data->held_requests = NULL;
+   server_data->held_requests_num = 0;
+   server_data->dispatching_request = NULL;
+
+   server_data->sleep_timers_len = 0;
+   server_data->sleep_timers_num = 0;
+   server_data->sleep_timers = NULL;
+
+   server_data->wakeup = NULL;
+   server_data->offload = NULL;
+   server_data->keep_alive = false;
+   server_data->pipeline = NULL;
+   server_data->inbox = server_inbox_create();
+   server_data->submit_rejected_hook = NULL;
+   server_data->submit_rejected_hook_arg = NULL;
+   server_wakeup_open(server_data);
+   server_data->ready_coroutines_num = 0;
+   server_data->finished_coroutines_num = 0;
+   server_data->worker_index = -1;
+   server_data->prioritized_coroutines_num = 0;
+   server_data->resume_budget = 0;
+   server_data->priority_order_len = 0;
+   for (int c = 0; c < CoroPrioritiesNum; c++)
+   {
+      server_data->min_share_percent[c] = 0;
+      server_data->priority_cursor[c] = 0;
+      server_data->priority_order[c] = NULL;
+      server_data->resumed_per_priority[c] = 0;
+   }
+   server_data->time_slicing = false;
+   server_data->time_slice_ticks = 0;
+   server_data->slice_deadline_ticks = ~0ULL;
+   server_data->slice_overruns_num = 0;
+   server_data->slice_overrun_hook = NULL;
+   server_data->slice_overrun_hook_arg = NULL;
+   server_data->body_stats = body_stats_create();
+   server_data->body_accounting = NULL != server_data->body_stats;
+   server_data->metrics = server_metrics_create();
+   server_data->joins = NULL;
+   server_data->flights = NULL;
+   server_data->cache = NULL;
+   server_data->limiter = NULL;
+   server_data->tasks = NULL;
+   server_data->tasks_len = 0;
+   server_data->tasks_head = 0;
+   server_data->tasks_num = 0;
+   server_data->in_task = false;
+   server_data->running_task.body = NULL;
+   server_data->running_task.payload = NULL;
+   server_data->tasks_run_num = 0;
+   server_data->tasks_promoted_num = 0;
+   arena_pool_init(&(server_data->arena_pool), ARENA_POOL_DEFAULT_MAX_FREE);
+   arena_init(&(server_data->task_arena));
+   arena_init(&(server_data->scratch[0]));
+   arena_init(&(server_data->scratch[1]));
+   server_data->scratch_current = 0;
+   server_data->scratch_high_water = 0;
+   server_data->registered_coroutines_num = 0;
+   server_data->max_live_coroutines = 0;
+   for (int type = 0; type < CoroRequestsNum; type++)
+   {
+      server_data->max_pending_requests[type] = 0;
+      server_data->pending_requests_num[type] = 0;
+   }
+   server_data->sojourn_target_ticks = 0;
+   server_data->sojourn_interval_ticks = 0;
+   server_data->sojourn_above_until_ticks = 0;
+   server_data->sojourn_batch_ticks = 0;
+   server_data->sojourn_dropping = false;
+   server_data->requests_shed_num = 0;
+   server_data->coroutines_rejected_num = 0;
+   server_data->requests_timed_out_num = 0;
+   server_data->coroutines_cancelled_num = 0;
+   server_data->coro_list_free_hint = 0;
+   server_data->pending_coro_list_free_hint = 0;
    return server_data;
 }
 
@@ -463,12 +2557,18 @@ void server_free(struct ServerData *server_data)
       return;
    }
 
+   server_pipeline_stop(server_data);
+   // Workers may still be writing results into the saved stacks of the held coroutines
+   server_offload_stop(server_data);
+   server_inbox_free(server_data->inbox);
+   server_data->inbox = NULL;
+
    for (int i = 0; i < server_data->coro_list_len; i++)
    {
       enum CellType cell_type = server_data->coro_list[i].cell_type;
       if (CellTypeUsedCell <= cell_type) {
          server_data->coro_list[i].cell_type = CellTypeUnusedCell;
-         coroutine_delete(server_data->coro_list[i].coro);
+         server_unregister_coro(server_data, server_data->coro_list[i].coro);
          server_data->coro_list[i].coro = NULL;
          void *data = server_data->coro_list[i].data;
          if (data)
@@ -497,13 +2597,15 @@ void server_free(struct ServerData *server_data)
       enum CellType cell_type = server_data->pending_coro_list[i].cell_type;
       if (CellTypeUsedCell <= cell_type) {
          server_data->pending_coro_list[i].cell_type = CellTypeUnusedCell;
-         coroutine_delete(server_data->coro_list[i].coro);
          void *data = server_data->pending_coro_list[i].data;
          if (data)
          {
-            free(data);
+            // In-place request data lives in the coroutine's saved stack, so it goes first
+            server_free_request_data((struct RequestData *)data);
             server_data->pending_coro_list[i].data = NULL;
          }
+         server_unregister_coro(server_data, server_data->pending_coro_list[i].coro);
+         server_data->pending_coro_list[i].coro = NULL;
       } else if (CellTypeFreeCell == cell_type) {
          server_data->pending_coro_list[i].cell_type = CellTypeUnusedCell;
          server_data->pending_coro_list[i].coro = NULL;
@@ -519,6 +2621,68 @@ void server_free(struct ServerData *server_data)
    server_data->pending_coro_list_len = 0;
    free(server_data->pending_coro_list);
    server_data->pending_coro_list = NULL;
+
+   // The records of a request group live in the saved stack of the coroutine which holds the group
+   // itself, so they leave the list first and the coroutine is deleted once, with the group's record
+   struct RequestData *held_data = server_data->held_requests;
+   while (held_data)
+   {
+      struct RequestData *next_held = held_data->next_held;
+      if (server_request_group_complete == held_data->on_complete)
+      {
+         server_unlink_held_request(server_data, held_data);
+      }
+      held_data = next_held;
+   }
+   while (server_data->held_requests)
+   {
+      struct RequestData *request_data = server_data->held_requests;
+      coroutine_t coro = request_data->coro;
+      server_unlink_held_request(server_data, request_data);
+      if (coro)
+      {
+         server_free_request_data(request_data);
+         server_unregister_coro(server_data, coro);
+      }
+   }
+   server_data->sleep_timers_len = 0;
+   server_data->sleep_timers_num = 0;
+   free(server_data->sleep_timers);
+   server_data->sleep_timers = NULL;
+
+   server_data->priority_order_len = 0;
+   for (int c = 0; c < CoroPrioritiesNum; c++)
+   {
+      free(server_data->priority_order[c]);
+      server_data->priority_order[c] = NULL;
+   }
+   body_stats_free(server_data->body_stats);
+   server_data->body_stats = NULL;
+   server_metrics_free(server_data->metrics);
+   server_data->metrics = NULL;
+   join_table_free(server_data->joins);
+   server_data->joins = NULL;
+   flight_table_free(server_data->flights);
+   server_data->flights = NULL;
+   coro_cache_free(server_data->cache);
+   server_data->cache = NULL;
+   rate_limiter_free(server_data->limiter);
+   server_data->limiter = NULL;
+   free(server_data->tasks);
+   server_data->tasks = NULL;
+   server_data->tasks_len = 0;
+   server_data->tasks_num = 0;
+   arena_release(&(server_data->arena_pool), &(server_data->scratch[0]));
+   arena_release(&(server_data->arena_pool), &(server_data->scratch[1]));
+   arena_pool_clear(&(server_data->arena_pool));
+
+   if (server_data->wakeup)
+   {
+      loop_wakeup_close(server_data->wakeup);
+      free(server_data->wakeup);
+      server_data->wakeup = NULL;
+   }
+
    coro_server_close(server_data->shed);
    server_data->coro_request_type = CoroRequestNone;
    if (server_data->request)
@@ -9,6 +9,8 @@
 #include <stdbool.h>
 
 #include "coroutine.h"
+#include "loop_wakeup.h"
+#include "coro_arena.h"
 
 
 enum CellType
@@ -19,6 +21,15 @@ enum CellType
 };
 typedef enum CellType corotype_t;
 
+// Classes are resumed in this order; see server_set_resume_budget() for the shares
+enum CoroPriority
+{
+   CoroPriorityLatency,
+   CoroPriorityNormal,
+   CoroPriorityBulk,
+   CoroPrioritiesNum,
+};
+
 enum CoroRequests
 {
    CoroRequestNone,
@@ -26,7 +37,14 @@ enum CoroRequests
    CoroRequestRevertSign,
    CoroRequestSleep,
    CoroRequestSocketRead,
-   CoroRequestSocketWrite
+   CoroRequestSocketWrite,
+   CoroRequestOffload,
+   CoroRequestCrossShard,
+   CoroRequestPark,
+   CoroRequestMany,
+   CoroRequestCoalesced,
+   CoroRequestCache,
+   CoroRequestsNum
 };
 typedef enum CoroRequests cororequest_t;
 
@@ -37,6 +55,109 @@ struct CoroData
    void *data;
 };
 
+struct ServerData;
+struct RequestData;
+
+// Receives the response instead of a coroutine. The request must not be touched by the loop after the call.
+typedef void (*request_complete_hook)(struct ServerData *server_data, struct RequestData *request_data, void *response);
+
+typedef void (*coroutine_callable)(void* coro_payload, struct ServerData *server_data);
+
+// Makes a service forget a held request (e.g. drop its timer); the request is then completed as cancelled
+typedef void (*request_cancel_hook)(struct ServerData *server_data, struct RequestData *request_data);
+
+enum RequestStatus
+{
+   RequestStatusOk,
+   RequestStatusOverloaded, // shed by the admission control; the response is NULL
+   RequestStatusCancelled, // the coroutine was cancelled, see server_cancel_coro(); the response is NULL
+   RequestStatusTimedOut // the deadline passed before the service completed it; the response is NULL
+};
+
+// Reports a coroutine which ran longer than its time slice without reaching a server_maybe_yield() checkpoint
+typedef void (*slice_overrun_hook)(struct ServerData *server_data, coroutine_callable coroutine_body,
+                                   unsigned long long run_ns, unsigned long long slice_ns, void *arg);
+
+// Receives a coroutine submitted with server_submit_coro_threadsafe() which the loop could not register
+// (e.g. because of server_set_max_live_coroutines()); the payload is handed back to its owner
+typedef void (*submit_rejected_hook)(struct ServerData *server_data, coroutine_callable coroutine_body, void *coro_payload,
+                                     void *arg);
+
+struct RequestData
+{
+   enum CoroRequests coro_request_type;
+   void *request;
+   void *response; // caller provided response buffer for in-place requests
+   coroutine_t coro;
+   request_complete_hook on_complete; // NULL: the response goes to coro
+   void *on_complete_arg;
+   bool inplace; // lives in the coroutine's frame; neither the record nor its buffers are freed by the loop
+   bool scratch; // lives in the per-iteration scratch arena; server_hold_request() moves it to the heap
+   bool held; // owned by a service until server_complete()
+   struct RequestData *prev_held;
+   struct RequestData *next_held;
+   unsigned long long submitted_ticks; // cycle_clock; 0 if not accounted in the metrics
+   request_cancel_hook on_cancel; // set by a service which is able to drop the request while holding it
+   bool cancelled;
+   enum RequestStatus status;
+   bool admitted; // counted in pending_requests_num of its type until server_complete()
+   unsigned long long enqueued_ticks; // cycle_clock; set while the sojourn shedding is on
+   unsigned long long deadline_ns; // server_monotonic_ns() based; 0 if none, see server_request_timeout()
+   int timeout_timer; // index in sleep_timers while held with a deadline; -1 if none
+   int sleep_timer; // index in sleep_timers while held by the sleep service; -1 if none
+};
+
+// Handle of a request kept by a service. Valid until server_complete() is called for it.
+typedef struct RequestData *request_handle_t;
+
+enum RequestWaitMode
+{
+   RequestWaitAll,
+   RequestWaitAny // the other requests are cancelled once the first one completes
+};
+
+// Request of CoroRequestMany; lives in the frame of the waiting coroutine
+struct RequestGroup
+{
+   struct RequestData *requests;
+   int requests_num;
+   enum RequestWaitMode wait_mode;
+   int dispatched_num;
+   int pending_num;
+   int winner; // the first request completed without being cancelled
+   request_handle_t handle;
+};
+
+struct SleepTimer
+{
+   unsigned long long deadline_ns;
+   request_handle_t handle;
+   bool timeout; // cancels the held request as timed out instead of completing it
+};
+
+struct ReadyCell
+{
+   unsigned long long deadline_ns;
+   int coro_index;
+};
+
+// Run-to-completion function queued on the ready path; see server_register_task()
+struct ServerTask
+{
+   coroutine_callable body;
+   void *payload;
+};
+
+struct OffloadPool;
+struct ServerInbox;
+struct ServerPipeline;
+struct BodyStatsTable;
+struct ServerMetricsState;
+struct JoinTable;
+struct FlightTable;
+struct CoroCache;
+struct RateLimiter;
+
 struct ServerData
 {
    schedule_t shed;
@@ -44,26 +165,100 @@ struct ServerData
    struct CoroData *coro_list; // data is respone
    int pending_coro_list_len;
    struct CoroData *pending_coro_list; // data is request
+   int coro_list_free_hint;
+   int pending_coro_list_free_hint;
    int last_live_coroutines_num;
+   int ready_coroutines_num; // used cells of coro_list
+   unsigned long long finished_coroutines_num;
+   int worker_index; // -1 unless the server is a worker of a multicore runtime
+
+   int prioritized_coroutines_num; // live coroutines outside of the normal class or with a deadline
+   int resume_budget; // coroutines resumed per iteration at most; 0 if unlimited
+   int min_share_percent[CoroPrioritiesNum]; // part of resume_budget guaranteed to a class with ready coroutines
+   int priority_cursor[CoroPrioritiesNum]; // round robin position of a class which does not fit into the budget
+   int priority_order_len;
+   struct ReadyCell *priority_order[CoroPrioritiesNum];
+   unsigned long long resumed_per_priority[CoroPrioritiesNum];
+
+   bool time_slicing; // set once any time slice is configured
+   unsigned long long time_slice_ticks; // default slice between server_maybe_yield() checkpoints; 0 if none
+   unsigned long long slice_deadline_ticks; // of the running coroutine
+   unsigned long long slice_overruns_num;
+   slice_overrun_hook slice_overrun_hook;
+   void *slice_overrun_hook_arg;
+   bool body_accounting; // aggregate coroutine_get_stats() per coroutine_body on every resume
+   struct BodyStatsTable *body_stats; // per coroutine_body
+   struct ServerMetricsState *metrics; // see server_metrics.h
+   struct JoinTable *joins; // see coro_join.h; created by the first server_spawn()
+   struct FlightTable *flights; // see coro_flight.h; created by the first server_request_coalesced()
+   struct CoroCache *cache; // see coro_cache.h; NULL unless server_cache_start() was called
+   struct RateLimiter *limiter; // see coro_limiter.h; created by the first server_rate_limit()
+   struct ServerTask *tasks; // ring
+   int tasks_len;
+   int tasks_head;
+   int tasks_num;
+   bool in_task; // running_task is being executed on the loop stack
+   struct ServerTask running_task;
+   unsigned long long tasks_run_num;
+   unsigned long long tasks_promoted_num;
+   struct ArenaPool arena_pool; // chunks recycled between the coroutine arenas
+   struct Arena task_arena; // server_coro_alloc() of the running task
+   struct Arena scratch[2]; // request records which do not outlive the iteration; reset when it ends
+   int scratch_current; // the one the coroutines allocate from; the other one belongs to the pipelined services
+   size_t scratch_high_water; // bytes
+
+   // Admission control, see server_set_max_live_coroutines() and server_set_sojourn_shedding()
+   unsigned long long registered_coroutines_num; // live ones: registered_coroutines_num - finished_coroutines_num
+   int max_live_coroutines; // 0 if unlimited
+   int max_pending_requests[CoroRequestsNum]; // admitted and not completed requests per type; 0 if unlimited
+   int pending_requests_num[CoroRequestsNum];
+   unsigned long long sojourn_target_ticks; // 0 if requests are not shed by their time in pending_coro_list
+   unsigned long long sojourn_interval_ticks;
+   unsigned long long sojourn_above_until_ticks; // the oldest requests have to stay above the target until then; 0 if below
+   unsigned long long sojourn_batch_ticks; // when the last batch with requests was dispatched
+   bool sojourn_dropping; // requests above the target are shed
+   unsigned long long requests_shed_num;
+   unsigned long long coroutines_rejected_num;
+   unsigned long long requests_timed_out_num;
+   unsigned long long coroutines_cancelled_num;
 
    enum CoroRequests coro_request_type;
    void *request;
    void *response;
-};
+   struct RequestData *inplace_request;
+   unsigned long long request_deadline_ns; // of the request being submitted; 0 if none
 
-struct RequestData
-{
-   enum CoroRequests coro_request_type;
-   void *request;
-};
+   struct RequestData *held_requests; // requests kept by services for a later completion
+   int held_requests_num;
+   struct RequestData *dispatching_request;
 
-typedef void (*coroutine_callable)(void* coro_payload, struct ServerData *server_data);
+   int sleep_timers_len;
+   int sleep_timers_num;
+   struct SleepTimer *sleep_timers; // min-heap by deadline_ns
+
+   struct LoopWakeup *wakeup; // NULL until some other thread needs to wake the loop up
+   struct OffloadPool *offload;
+   struct ServerInbox *inbox; // submissions from other threads
+   submit_rejected_hook submit_rejected_hook;
+   void *submit_rejected_hook_arg;
+   bool keep_alive; // keep the loop waiting for the other threads even without live coroutines
+   struct ServerPipeline *pipeline; // NULL unless the services run on a companion thread
+};
 
 struct CoroArgs
 {
    struct ServerData *server_data;
    coroutine_callable coroutine_body;
    void* coro_payload;
+   int pinned_worker; // worker thread owning the coroutine's stack; -1 outside of a multicore runtime
+   enum CoroPriority priority;
+   unsigned long long deadline_ns; // server_monotonic_ns() based; 0 if none. Orders the latency class only.
+   unsigned long long time_slice_ticks; // 0 - the server's default
+   int join_slot; // slot in the server's join table; -1 if the coroutine was not spawned joinable
+   struct Arena arena; // server_coro_alloc(); released when the coroutine returns
+   enum RequestStatus request_status; // of the last request
+   bool cancelled; // see server_cancel_coro()
+   struct RequestData *held_request; // its own request (or group) while a service holds it; NULL otherwise
 };
 
 #ifdef __cplusplus
@@ -71,10 +266,61 @@ extern "C"{
 #endif 
 struct ServerData *server_create();
 int server_register_coro(struct ServerData *server_data, coroutine_callable coroutine_body, void* coro_payload);
+int server_register_coro_priority(struct ServerData *server_data, coroutine_callable coroutine_body, void* coro_payload,
+                                  enum CoroPriority priority);
+void *server_coro_alloc(struct ServerData *server_data, size_t size);
+bool server_register_task(struct ServerData *server_data, coroutine_callable task_body, void *task_payload);
+bool server_in_task(struct ServerData *server_data);
+bool server_promote_task(struct ServerData *server_data);
+int server_register_coro_joinable(struct ServerData *server_data, coroutine_callable coroutine_body, void* coro_payload,
+                                  enum CoroPriority priority, int join_slot);
+bool server_set_coro_priority(struct ServerData *server_data, coroutine_t coro, enum CoroPriority priority);
+bool server_set_coro_deadline(struct ServerData *server_data, coroutine_t coro, unsigned long long deadline_ns);
+void server_set_resume_budget(struct ServerData *server_data, int resume_budget,
+                              int normal_min_share_percent, int bulk_min_share_percent);
+void server_set_time_slice(struct ServerData *server_data, unsigned long long slice_ns);
+bool server_set_coro_time_slice(struct ServerData *server_data, coroutine_t coro, unsigned long long slice_ns);
+void server_set_slice_overrun_hook(struct ServerData *server_data, slice_overrun_hook hook, void *arg);
+bool server_maybe_yield(struct ServerData *server_data);
+void server_set_body_accounting(struct ServerData *server_data, bool enabled);
+void server_set_max_live_coroutines(struct ServerData *server_data, int max_live_coroutines);
+void server_set_max_pending_requests(struct ServerData *server_data, enum CoroRequests coro_request_type, int max_pending);
+void server_set_sojourn_shedding(struct ServerData *server_data, unsigned long long target_ns, unsigned long long interval_ns);
+bool server_overloaded(struct ServerData *server_data);
+enum RequestStatus server_request_status(struct ServerData *server_data);
 void *server_request(struct ServerData *server_data,
                             enum CoroRequests coro_request_type,
                             void *request);
+bool server_request_inplace(struct ServerData *server_data,
+                            enum CoroRequests coro_request_type,
+                            void *request,
+                            void *response);
+void *server_request_timeout(struct ServerData *server_data, enum CoroRequests coro_request_type, void *request,
+                             unsigned long long timeout_ns);
+bool server_request_inplace_timeout(struct ServerData *server_data, enum CoroRequests coro_request_type, void *request,
+                                    void *response, unsigned long long timeout_ns);
+bool server_cancel_coro(struct ServerData *server_data, coroutine_t coro);
+int server_request_many(struct ServerData *server_data, struct RequestData *requests, int requests_num,
+                        enum RequestWaitMode wait_mode);
 coroutine_t server_current_coro(struct ServerData *server_data);
+int server_current_coro_worker(struct ServerData *server_data);
+void *server_response_buffer(struct RequestData *request_data, size_t size);
+void server_request_data_init(struct RequestData *request_data, enum CoroRequests coro_request_type,
+                              void *request, void *response, bool inplace);
+void server_dispatch_request(struct ServerData *server_data, struct RequestData *request_data);
+void server_abandon_request(struct ServerData *server_data, request_handle_t handle);
+bool server_cancel_request(struct ServerData *server_data, request_handle_t handle, enum RequestStatus status);
+request_handle_t server_hold_request(struct ServerData *server_data, struct RequestData *request_data);
+void server_complete(struct ServerData *server_data, request_handle_t handle, void *response);
+void server_complete_failed(struct ServerData *server_data, request_handle_t handle, enum RequestStatus status);
+unsigned long long server_monotonic_ns(void);
+bool server_wakeup_open(struct ServerData *server_data);
+void server_wakeup(struct ServerData *server_data);
+void server_set_keep_alive(struct ServerData *server_data, bool keep_alive);
+bool server_pipeline_start(struct ServerData *server_data);
+void server_pipeline_stop(struct ServerData *server_data);
+void server_services_enter(struct ServerData *server_data);
+void server_services_leave(struct ServerData *server_data);
 bool server_loop_iteration(struct ServerData *server_data);
 void server_free(struct ServerData *server_data);
 #ifdef __cplusplus
@@ -82,26 +328,68 @@ void server_free(struct ServerData *server_data);
 #endif
 
 static void serv_coro(schedule_t S, void *ud);
-static int find_free_cell(struct CoroData *coro_list, int coro_list_len);
+static int find_free_cell(struct CoroData *coro_list, int coro_list_len, int first_free_hint);
 static void server_put_coro_to_list(struct CoroData *coro_list,
                                     int coro_index, enum CellType cell_type, coroutine_t coro, void *data);
 static void *memcp_to_bigger(void *data, long long data_size, long long new_size, int default_value);
-static int put_or_realloc(struct CoroData **coro_list_ptr, int *coro_list_len_ptr, enum CellType cell_type, coroutine_t coro);
+static int put_or_realloc(struct CoroData **coro_list_ptr, int *coro_list_len_ptr, int *free_hint_ptr, enum CellType cell_type, coroutine_t coro);
 static void server_free_request(struct ServerData *server_data);
 static void server_free_response(struct ServerData *server_data);
 static void server_free_coro_args(struct CoroArgs *coro_args);
+static void server_unregister_coro(struct ServerData *server_data, coroutine_t coro);
 static void server_free_request_data(struct RequestData *request_data);
 static void server_free_response_data(void *response);
 static void mark_cell_as_unused(struct CoroData *coro_list, int coro_index);
 static void mark_cell_as_free(struct CoroData *coro_list, int coro_index);
 static void mark_coro_free_or_unused(struct CoroData *coro_list, const int coro_list_len, const int coro_index);
 static void server_remove_coro(struct ServerData *server_data, int coro_index);
-static void server_remove_pending_coro(struct ServerData *server_data, int coro_index);
+static void server_remove_pending_coro(struct CoroData *coro_list, int coro_list_len, int *free_hint_ptr, int coro_index);
 static int server_loop_coro(struct ServerData *server_data);
+static int server_run_tasks(struct ServerData *server_data);
+static bool server_resume_cell(struct ServerData *server_data, int coro_index, enum CoroPriority priority);
+static int server_loop_coro_in_order(struct ServerData *server_data);
+static int server_loop_coro_prioritized(struct ServerData *server_data);
+static bool server_reserve_priority_order(struct ServerData *server_data);
+static int compare_ready_cells(const void *a, const void *b);
+static void server_priority_quotas(struct ServerData *server_data, const int ready_num[], int quota[]);
+static bool coro_args_prioritized(struct CoroArgs *coro_args);
+static void server_note_request_submitted(struct ServerData *server_data, struct RequestData *request_data);
+static void server_note_request_completed(struct ServerData *server_data, struct RequestData *request_data);
+static void server_report_slice_overrun(struct ServerData *server_data, coroutine_callable coroutine_body,
+                                        unsigned long long run_ticks, unsigned long long slice_ticks);
 static void server_move_request_to_services(struct ServerData *server_data, int coro_index);
 static void server_move_response_to_coro(struct ServerData *server_data, coroutine_t coro, void *response);
 static void server_put_request_to_service(struct ServerData *server_data, coroutine_t coro, struct RequestData *request_data);
+static void server_unlink_held_request(struct ServerData *server_data, struct RequestData *request_data);
+static void server_put_sleep_timer(struct SleepTimer *timers, int timer_index, struct SleepTimer timer);
+static bool server_add_sleep_timer(struct ServerData *server_data, request_handle_t handle, unsigned long long deadline_ns, bool timeout);
+static void server_remove_sleep_timer(struct ServerData *server_data, int timer_index);
+static void server_cancel_sleep_timer(struct ServerData *server_data, struct RequestData *request_data);
+static bool server_cancel_held_request(struct ServerData *server_data, request_handle_t handle, enum RequestStatus status);
+static void server_fail_request(struct ServerData *server_data, struct RequestData *request_data, enum RequestStatus status);
+static void server_note_request_timed_out(struct ServerData *server_data);
+static bool server_coro_cancelled(coroutine_t coro);
+static void server_destroy_unstarted_coro(struct ServerData *server_data, int coro_index);
+static void server_dispatch_request_group(struct ServerData *server_data, coroutine_t coro, struct RequestData *request_data);
+static void server_request_group_complete(struct ServerData *server_data, struct RequestData *request_data, void *response);
+static void server_request_group_release(struct ServerData *server_data, struct RequestGroup *group);
+static void server_run_sleep_timers(struct ServerData *server_data);
 static void server_run_all_services(struct ServerData *server_data);
+static void server_wait_for_events(struct ServerData *server_data, bool has_ready);
+static void server_loop_pending_list(struct ServerData *server_data, struct CoroData *coro_list, int coro_list_len, int *free_hint_ptr);
 static void server_loop_services(struct ServerData *server_data);
+static void server_reset_scratch(struct ServerData *server_data, int scratch_index);
+static unsigned long long server_live_coroutines_num(struct ServerData *server_data);
+static bool server_request_sheddable(enum CoroRequests coro_request_type);
+static void server_sojourn_update(struct ServerData *server_data, struct CoroData *coro_list, int coro_list_len, unsigned long long now);
+static bool server_admit_request(struct ServerData *server_data, struct RequestData *request_data, unsigned long long now);
+static void server_shed_request(struct ServerData *server_data, struct RequestData *request_data);
+static void server_set_current_request_status(struct ServerData *server_data, enum RequestStatus status);
+static unsigned long long server_resumed_num(struct ServerData *server_data);
+static void server_services_lock(struct ServerData *server_data);
+static void server_services_unlock(struct ServerData *server_data);
+static bool server_on_pipeline_thread(struct ServerData *server_data);
+static bool server_pipeline_defer(struct ServerData *server_data, coroutine_t coro, void *data);
+static void server_pipeline_sync(struct ServerData *server_data, bool start_next);
 
 #endif
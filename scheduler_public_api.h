@@ -30,6 +30,12 @@ int server_register_coro(struct ServerData *server_data, coroutine_callable coro
 void *server_request(struct ServerData *server_data,
                             enum CoroRequests coro_request_type,
                             void *request);
+bool server_request_inplace(struct ServerData *server_data,
+                            enum CoroRequests coro_request_type,
+                            void *request,
+                            void *response);
+request_handle_t server_hold_request(struct ServerData *server_data, struct RequestData *request_data);
+void server_complete(struct ServerData *server_data, request_handle_t handle, void *response);
 bool server_loop_iteration(struct ServerData *server_data);
 void server_free(struct ServerData *server_data);
 
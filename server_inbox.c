@@ -0,0 +1,246 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "scheduler.h"
+#include "server_inbox.h"
+
+#if defined COROUTINE_HAVE_STDATOMIC
+
+#include <stdatomic.h>
+
+#include "aligned_memory.h"
+
+#define SERVER_INBOX_CACHE_LINE 64
+
+enum ServerInboxMessageType
+{
+   ServerInboxMessageStub,
+   ServerInboxMessageSubmitCoro,
+   ServerInboxMessagePostResponse
+};
+
+struct ServerInboxMessage
+{
+   _Atomic(struct ServerInboxMessage *) next;
+   enum ServerInboxMessageType message_type;
+   coroutine_callable coroutine_body;
+   void *coro_payload;
+   request_handle_t handle;
+   void *response;
+};
+
+// Intrusive MPSC queue: producers exchange the tail, the single consumer walks from the head
+struct ServerInbox
+{
+   _Alignas(SERVER_INBOX_CACHE_LINE) _Atomic(struct ServerInboxMessage *) tail;
+   atomic_bool notified;
+   _Alignas(SERVER_INBOX_CACHE_LINE) struct ServerInboxMessage *head;
+   struct ServerInboxMessage stub;
+};
+
+static void server_inbox_push(struct ServerInbox *inbox, struct ServerInboxMessage *message)
+{
+   atomic_store_explicit(&message->next, NULL, memory_order_relaxed);
+   struct ServerInboxMessage *prev = atomic_exchange_explicit(&inbox->tail, message, memory_order_acq_rel);
+   atomic_store_explicit(&prev->next, message, memory_order_release);
+}
+
+// Returns NULL when the queue is empty or a producer is in the middle of a push
+static struct ServerInboxMessage *server_inbox_pop(struct ServerInbox *inbox)
+{
+   struct ServerInboxMessage *head = inbox->head;
+   struct ServerInboxMessage *next = atomic_load_explicit(&head->next, memory_order_acquire);
+   if (head == &inbox->stub)
+   {
+      if (!next)
+      {
+         return NULL;
+      }
+      inbox->head = next;
+      head = next;
+      next = atomic_load_explicit(&next->next, memory_order_acquire);
+   }
+   if (next)
+   {
+      inbox->head = next;
+      return head;
+   }
+   if (head != atomic_load_explicit(&inbox->tail, memory_order_acquire))
+   {
+      return NULL;
+   }
+   server_inbox_push(inbox, &inbox->stub);
+   next = atomic_load_explicit(&head->next, memory_order_acquire);
+   if (next)
+   {
+      inbox->head = next;
+      return head;
+   }
+   return NULL;
+}
+
+struct ServerInbox *server_inbox_create(void)
+{
+   // The head and the tail are on cache lines of their own
+   struct ServerInbox *inbox = (struct ServerInbox *)aligned_calloc(_Alignof(struct ServerInbox), 1, sizeof(*inbox));
+   if (!inbox)
+   {
+      return NULL;
+   }
+   atomic_init(&inbox->stub.next, NULL);
+   inbox->stub.message_type = ServerInboxMessageStub;
+   inbox->head = &inbox->stub;
+   atomic_init(&inbox->tail, &inbox->stub);
+   atomic_init(&inbox->notified, false);
+   return inbox;
+}
+
+// Must not race with producers: messages still in the queue are dropped
+void server_inbox_free(struct ServerInbox *inbox)
+{
+   if (!inbox)
+   {
+      return;
+   }
+   struct ServerInboxMessage *message;
+   while ((message = server_inbox_pop(inbox)))
+   {
+      if (ServerInboxMessagePostResponse == message->message_type)
+      {
+         free(message->response);
+      }
+      free(message);
+   }
+   aligned_free(inbox);
+}
+
+// Called by the loop. Returns the number of handled messages.
+int server_inbox_drain(struct ServerData *server_data)
+{
+   struct ServerInbox *inbox = server_data->inbox;
+   if (!inbox)
+   {
+      return 0;
+   }
+   atomic_store(&inbox->notified, false);
+   int handled = 0;
+   struct ServerInboxMessage *message;
+   while ((message = server_inbox_pop(inbox)))
+   {
+      switch (message->message_type)
+      {
+      case ServerInboxMessageSubmitCoro:
+         if ((0 > server_register_coro(server_data, message->coroutine_body, message->coro_payload))
+             && server_data->submit_rejected_hook)
+         {
+            server_data->submit_rejected_hook(server_data, message->coroutine_body, message->coro_payload,
+                                              server_data->submit_rejected_hook_arg);
+         }
+         break;
+      case ServerInboxMessagePostResponse:
+         server_complete(server_data, message->handle, message->response);
+         break;
+      default:
+         break;
+      }
+      free(message);
+      handled++;
+   }
+   return handled;
+}
+
+static bool server_inbox_post(struct ServerData *server_data, struct ServerInboxMessage *message)
+{
+   struct ServerInbox *inbox = server_data->inbox;
+   server_inbox_push(inbox, message);
+   if (!atomic_exchange(&inbox->notified, true))
+   {
+      server_wakeup(server_data);
+   }
+   return true;
+}
+
+// Thread safe. The coroutine is registered by the loop during its next iteration. If the loop can not
+// register it, the payload stays with the producer: the rejection is reported to the hook of
+// server_set_submit_rejected_hook() and counted in coroutines_rejected when it is due to the admission limit.
+bool server_submit_coro_threadsafe(struct ServerData *server_data, coroutine_callable coroutine_body, void *coro_payload)
+{
+   if (!server_data || !server_data->inbox || !coroutine_body)
+   {
+      return false;
+   }
+   struct ServerInboxMessage *message = (struct ServerInboxMessage *)malloc(sizeof(*message));
+   if (!message)
+   {
+      return false;
+   }
+   message->message_type = ServerInboxMessageSubmitCoro;
+   message->coroutine_body = coroutine_body;
+   message->coro_payload = coro_payload;
+   message->handle = NULL;
+   message->response = NULL;
+   return server_inbox_post(server_data, message);
+}
+
+// Thread safe counterpart of server_complete() for handles given away to other threads
+bool server_post_response_threadsafe(struct ServerData *server_data, request_handle_t handle, void *response)
+{
+   if (!server_data || !server_data->inbox || !handle)
+   {
+      return false;
+   }
+   struct ServerInboxMessage *message = (struct ServerInboxMessage *)malloc(sizeof(*message));
+   if (!message)
+   {
+      return false;
+   }
+   message->message_type = ServerInboxMessagePostResponse;
+   message->coroutine_body = NULL;
+   message->coro_payload = NULL;
+   message->handle = handle;
+   message->response = response;
+   return server_inbox_post(server_data, message);
+}
+
+#else
+
+struct ServerInbox *server_inbox_create(void)
+{
+   return NULL;
+}
+
+void server_inbox_free(struct ServerInbox *inbox)
+{
+}
+
+int server_inbox_drain(struct ServerData *server_data)
+{
+   return 0;
+}
+
+bool server_submit_coro_threadsafe(struct ServerData *server_data, coroutine_callable coroutine_body, void *coro_payload)
+{
+   return false;
+}
+
+bool server_post_response_threadsafe(struct ServerData *server_data, request_handle_t handle, void *response)
+{
+   return false;
+}
+
+#endif
+
+// The hook runs while the inbox is drained, on the thread which runs the services
+void server_set_submit_rejected_hook(struct ServerData *server_data, submit_rejected_hook hook, void *arg)
+{
+   if (server_data)
+   {
+      server_data->submit_rejected_hook = hook;
+      server_data->submit_rejected_hook_arg = arg;
+   }
+}
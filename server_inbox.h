@@ -0,0 +1,32 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#ifndef C_SERVER_INBOX_H
+#define C_SERVER_INBOX_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "scheduler.h"
+
+// Thread safe entry points of a ServerData. Other threads put messages into a lock-free
+// MPSC queue; the loop drains it once per iteration and is woken up from its blocking wait.
+
+struct ServerInbox;
+
+#ifdef __cplusplus
+extern "C"{
+#endif 
+struct ServerInbox *server_inbox_create(void);
+void server_inbox_free(struct ServerInbox *inbox);
+int server_inbox_drain(struct ServerData *server_data);
+
+bool server_submit_coro_threadsafe(struct ServerData *server_data, coroutine_callable coroutine_body, void *coro_payload);
+bool server_post_response_threadsafe(struct ServerData *server_data, request_handle_t handle, void *response);
+void server_set_submit_rejected_hook(struct ServerData *server_data, submit_rejected_hook hook, void *arg);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
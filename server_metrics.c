@@ -0,0 +1,331 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "server_metrics.h"
+#include "cycle_clock.h"
+
+struct ServerMetricsState *server_metrics_create(void)
+{
+   struct ServerMetricsState *metrics = (struct ServerMetricsState *)calloc(1, sizeof(*metrics));
+   return metrics;
+}
+
+void server_metrics_free(struct ServerMetricsState *metrics)
+{
+   free(metrics);
+}
+
+const char *server_request_type_name(enum CoroRequests coro_request_type)
+{
+   switch (coro_request_type)
+   {
+   case CoroRequestNone:
+      return "none";
+   case CoroRequestYield:
+      return "yield";
+   case CoroRequestRevertSign:
+      return "revert_sign";
+   case CoroRequestSleep:
+      return "sleep";
+   case CoroRequestSocketRead:
+      return "socket_read";
+   case CoroRequestSocketWrite:
+      return "socket_write";
+   case CoroRequestOffload:
+      return "offload";
+   case CoroRequestCrossShard:
+      return "cross_shard";
+   case CoroRequestPark:
+      return "park";
+   case CoroRequestMany:
+      return "many";
+   case CoroRequestCoalesced:
+      return "coalesced";
+   case CoroRequestCache:
+      return "cache";
+   default:
+      return "unknown";
+   }
+}
+
+static unsigned long long latency_histogram_bucket_upper_ticks(int bucket)
+{
+   const int sub_bits = LATENCY_HISTOGRAM_SUB_BUCKET_BITS;
+   if (bucket < (1 << sub_bits))
+   {
+      return (unsigned long long)bucket + 1;
+   }
+   int msb = (bucket >> sub_bits) + sub_bits - 1;
+   unsigned long long sub_bucket = (unsigned long long)(bucket & ((1 << sub_bits) - 1));
+   return ((1ULL << sub_bits) + sub_bucket + 1) << (msb - sub_bits);
+}
+
+// Exclusive upper bound of the values counted by the bucket
+unsigned long long latency_histogram_bucket_upper_ns(const struct LatencyHistogramSnapshot *snapshot, int bucket)
+{
+   return (unsigned long long)((double)latency_histogram_bucket_upper_ticks(bucket) * snapshot->ns_per_tick);
+}
+
+// percentile is in [0, 100]. The result is precise up to the bucket width.
+unsigned long long latency_histogram_percentile_ns(const struct LatencyHistogramSnapshot *snapshot, double percentile)
+{
+   if (!snapshot || !snapshot->count)
+   {
+      return 0;
+   }
+   unsigned long long target = (unsigned long long)((double)snapshot->count * percentile / 100.0 + 0.5);
+   target = target ? target : 1;
+   unsigned long long seen = 0;
+   for (int bucket = 0; bucket < LATENCY_HISTOGRAM_BUCKETS; bucket++)
+   {
+      seen += snapshot->buckets[bucket];
+      if (seen >= target)
+      {
+         unsigned long long upper_ns = latency_histogram_bucket_upper_ns(snapshot, bucket);
+         return upper_ns < snapshot->max_ns ? upper_ns : snapshot->max_ns;
+      }
+   }
+   return snapshot->max_ns;
+}
+
+static void latency_histogram_snapshot(struct LatencyHistogram *histogram, struct LatencyHistogramSnapshot *snapshot,
+                                       double ns_per_tick)
+{
+   snapshot->ns_per_tick = ns_per_tick;
+   snapshot->count = metric_read(&(histogram->count));
+   snapshot->sum_ns = (unsigned long long)((double)metric_read(&(histogram->sum_ticks)) * ns_per_tick);
+   snapshot->max_ns = (unsigned long long)((double)metric_read(&(histogram->max_ticks)) * ns_per_tick);
+   for (int bucket = 0; bucket < LATENCY_HISTOGRAM_BUCKETS; bucket++)
+   {
+      snapshot->buckets[bucket] = metric_read(&(histogram->buckets[bucket]));
+   }
+}
+
+// May be called from any thread. The values are read one by one, so they may be off by
+// the requests processed during the copy.
+bool server_metrics_snapshot(struct ServerData *server_data, struct ServerMetrics *metrics)
+{
+   if (!server_data || !server_data->metrics || !metrics)
+   {
+      return false;
+   }
+   struct ServerMetricsState *state = server_data->metrics;
+   double ns_per_tick = cycle_clock_ns_per_tick();
+   metrics->iterations = metric_read(&(state->iterations));
+   metrics->last_iteration_ns = (unsigned long long)((double)metric_read(&(state->last_iteration_ticks)) * ns_per_tick);
+   metrics->resumed = metric_read(&(state->resumed));
+   metrics->last_resumed = metric_read(&(state->last_resumed));
+   metrics->live_coroutines = metric_read(&(state->live_coroutines));
+   metrics->allocations = metric_read(&(state->allocations));
+   metrics->scratch_high_water_bytes = metric_read(&(state->scratch_high_water_bytes));
+   metrics->coroutines_rejected = metric_read(&(state->coroutines_rejected));
+   metrics->requests_timed_out = metric_read(&(state->requests_timed_out));
+   metrics->coroutines_cancelled = metric_read(&(state->coroutines_cancelled));
+   metrics->requests_coalesced = metric_read(&(state->requests_coalesced));
+   metrics->cache_hits = metric_read(&(state->cache_hits));
+   metrics->cache_misses = metric_read(&(state->cache_misses));
+   metrics->cache_evictions = metric_read(&(state->cache_evictions));
+   metrics->cache_expirations = metric_read(&(state->cache_expirations));
+   metrics->cache_bytes = metric_read(&(state->cache_bytes));
+   metrics->stack_bytes_saved = metric_read(&(state->stack_bytes_saved));
+   metrics->stack_bytes_restored = metric_read(&(state->stack_bytes_restored));
+   for (int type = 0; type < CoroRequestsNum; type++)
+   {
+      metrics->requests_submitted[type] = metric_read(&(state->requests_submitted[type]));
+      metrics->requests_completed[type] = metric_read(&(state->requests_completed[type]));
+      metrics->requests_shed[type] = metric_read(&(state->requests_shed[type]));
+      metrics->requests_pending[type] = metrics->requests_submitted[type] > metrics->requests_completed[type] ?
+                                        metrics->requests_submitted[type] - metrics->requests_completed[type] : 0;
+      latency_histogram_snapshot(&(state->request_latency[type]), &(metrics->request_latency[type]), ns_per_tick);
+   }
+   latency_histogram_snapshot(&(state->iteration_duration), &(metrics->iteration_duration), ns_per_tick);
+   return true;
+}
+
+struct MetricsText
+{
+   char *buffer;
+   size_t size;
+   size_t len;
+};
+
+static void metrics_text_printf(struct MetricsText *text, const char *format, ...)
+{
+   size_t left = (text->len < text->size) ? text->size - text->len : 0;
+   va_list args;
+   va_start(args, format);
+   int written = vsnprintf(left ? text->buffer + text->len : NULL, left, format, args);
+   va_end(args);
+   if (0 < written)
+   {
+      text->len += (size_t)written;
+   }
+}
+
+static void metrics_text_header(struct MetricsText *text, const char *name, const char *type, const char *help)
+{
+   metrics_text_printf(text, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void metrics_text_labels(struct MetricsText *text, const char *server_label, const char *labels)
+{
+   if (!server_label && !labels)
+   {
+      return;
+   }
+   metrics_text_printf(text, "{");
+   if (server_label)
+   {
+      metrics_text_printf(text, "server=\"%s\"%s", server_label, labels ? "," : "");
+   }
+   if (labels)
+   {
+      metrics_text_printf(text, "%s", labels);
+   }
+   metrics_text_printf(text, "}");
+}
+
+static void metrics_text_value(struct MetricsText *text, const char *name, const char *server_label, const char *labels,
+                               unsigned long long value)
+{
+   metrics_text_printf(text, "%s", name);
+   metrics_text_labels(text, server_label, labels);
+   metrics_text_printf(text, " %llu\n", value);
+}
+
+static void metrics_text_seconds(struct MetricsText *text, const char *name, const char *server_label, const char *labels,
+                                 unsigned long long ns)
+{
+   metrics_text_printf(text, "%s", name);
+   metrics_text_labels(text, server_label, labels);
+   metrics_text_printf(text, " %.9f\n", (double)ns / 1e9);
+}
+
+// Prometheus needs a fixed set of bounds, so the fine buckets are folded into these
+static const double metrics_le_seconds[] = {
+    1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3,
+    5e-3, 1e-2, 2.5e-2, 5e-2, 1e-1, 2.5e-1, 5e-1, 1.0, 2.5, 5.0, 10.0};
+
+static void metrics_text_histogram(struct MetricsText *text, const char *name, const char *server_label,
+                                   const char *labels, const struct LatencyHistogramSnapshot *snapshot)
+{
+   char sample_name[128];
+   char sample_labels[128];
+   const char *separator = labels ? "," : "";
+   labels = labels ? labels : "";
+   snprintf(sample_name, sizeof(sample_name), "%s_bucket", name);
+   int bucket = 0;
+   unsigned long long cumulative = 0;
+   for (size_t i = 0; i < sizeof(metrics_le_seconds) / sizeof(metrics_le_seconds[0]); i++)
+   {
+      unsigned long long le_ns = (unsigned long long)(metrics_le_seconds[i] * 1e9);
+      while ((bucket < LATENCY_HISTOGRAM_BUCKETS) && (latency_histogram_bucket_upper_ns(snapshot, bucket) <= le_ns))
+      {
+         cumulative += snapshot->buckets[bucket++];
+      }
+      snprintf(sample_labels, sizeof(sample_labels), "%s%sle=\"%g\"", labels, separator, metrics_le_seconds[i]);
+      metrics_text_value(text, sample_name, server_label, sample_labels, cumulative);
+   }
+   snprintf(sample_labels, sizeof(sample_labels), "%s%sle=\"+Inf\"", labels, separator);
+   metrics_text_value(text, sample_name, server_label, sample_labels, snapshot->count);
+   snprintf(sample_name, sizeof(sample_name), "%s_sum", name);
+   metrics_text_seconds(text, sample_name, server_label, *labels ? labels : NULL, snapshot->sum_ns);
+   snprintf(sample_name, sizeof(sample_name), "%s_count", name);
+   metrics_text_value(text, sample_name, server_label, *labels ? labels : NULL, snapshot->count);
+}
+
+// Writes the metrics in the Prometheus text exposition format. server_label (may be NULL) is added as
+// the "server" label to every sample. Works like snprintf(): returns the length of the whole text,
+// which may be larger than buffer_size, and writes as much as fits including the terminating zero.
+size_t server_metrics_prometheus(struct ServerData *server_data, const char *server_label, char *buffer, size_t buffer_size)
+{
+   struct ServerMetrics *metrics = (struct ServerMetrics *)malloc(sizeof(*metrics));
+   if (!metrics)
+   {
+      return 0;
+   }
+   if (!server_metrics_snapshot(server_data, metrics))
+   {
+      free(metrics);
+      return 0;
+   }
+   struct MetricsText text = {buffer, buffer ? buffer_size : 0, 0};
+   if (text.size)
+   {
+      text.buffer[0] = '\0';
+   }
+   char labels[64];
+
+   metrics_text_header(&text, "coroutine_loop_iterations_total", "counter", "Loop iterations.");
+   metrics_text_value(&text, "coroutine_loop_iterations_total", server_label, NULL, metrics->iterations);
+   metrics_text_header(&text, "coroutine_loop_iteration_seconds", "histogram", "Duration of a loop iteration.");
+   metrics_text_histogram(&text, "coroutine_loop_iteration_seconds", server_label, NULL, &(metrics->iteration_duration));
+   metrics_text_header(&text, "coroutine_resumed_total", "counter", "Coroutine resumes.");
+   metrics_text_value(&text, "coroutine_resumed_total", server_label, NULL, metrics->resumed);
+   metrics_text_header(&text, "coroutine_loop_last_resumed", "gauge", "Coroutines resumed by the last iteration.");
+   metrics_text_value(&text, "coroutine_loop_last_resumed", server_label, NULL, metrics->last_resumed);
+   metrics_text_header(&text, "coroutine_live", "gauge", "Live coroutines after the last iteration.");
+   metrics_text_value(&text, "coroutine_live", server_label, NULL, metrics->live_coroutines);
+   metrics_text_header(&text, "coroutine_allocations_total", "counter", "Heap allocations of the loop.");
+   metrics_text_value(&text, "coroutine_allocations_total", server_label, NULL, metrics->allocations);
+   metrics_text_header(&text, "coroutine_scratch_high_water_bytes", "gauge", "Most bytes of the per-iteration request arena used by one iteration.");
+   metrics_text_value(&text, "coroutine_scratch_high_water_bytes", server_label, NULL, metrics->scratch_high_water_bytes);
+   metrics_text_header(&text, "coroutine_stack_bytes_copied_total", "counter", "Bytes copied between the shared stack and the saved stacks.");
+   metrics_text_value(&text, "coroutine_stack_bytes_copied_total", server_label, "direction=\"save\"", metrics->stack_bytes_saved);
+   metrics_text_value(&text, "coroutine_stack_bytes_copied_total", server_label, "direction=\"restore\"", metrics->stack_bytes_restored);
+
+   metrics_text_header(&text, "coroutine_requests_submitted_total", "counter", "Requests submitted to the services.");
+   for (int type = 1; type < CoroRequestsNum; type++)
+   {
+      snprintf(labels, sizeof(labels), "type=\"%s\"", server_request_type_name((enum CoroRequests)type));
+      metrics_text_value(&text, "coroutine_requests_submitted_total", server_label, labels, metrics->requests_submitted[type]);
+   }
+   metrics_text_header(&text, "coroutine_requests_pending", "gauge", "Requests waiting for a response.");
+   for (int type = 1; type < CoroRequestsNum; type++)
+   {
+      snprintf(labels, sizeof(labels), "type=\"%s\"", server_request_type_name((enum CoroRequests)type));
+      metrics_text_value(&text, "coroutine_requests_pending", server_label, labels, metrics->requests_pending[type]);
+   }
+   metrics_text_header(&text, "coroutine_requests_shed_total", "counter", "Requests completed as overloaded by the admission control.");
+   for (int type = 1; type < CoroRequestsNum; type++)
+   {
+      snprintf(labels, sizeof(labels), "type=\"%s\"", server_request_type_name((enum CoroRequests)type));
+      metrics_text_value(&text, "coroutine_requests_shed_total", server_label, labels, metrics->requests_shed[type]);
+   }
+   metrics_text_header(&text, "coroutine_registrations_rejected_total", "counter", "Coroutines refused by the live coroutine limit.");
+   metrics_text_value(&text, "coroutine_registrations_rejected_total", server_label, NULL, metrics->coroutines_rejected);
+   metrics_text_header(&text, "coroutine_requests_timed_out_total", "counter", "Requests completed as timed out.");
+   metrics_text_value(&text, "coroutine_requests_timed_out_total", server_label, NULL, metrics->requests_timed_out);
+   metrics_text_header(&text, "coroutines_cancelled_total", "counter", "Coroutines cancelled by server_cancel_coro().");
+   metrics_text_value(&text, "coroutines_cancelled_total", server_label, NULL, metrics->coroutines_cancelled);
+   metrics_text_header(&text, "coroutine_requests_coalesced_total", "counter", "Requests which shared the response of an identical request in flight.");
+   metrics_text_value(&text, "coroutine_requests_coalesced_total", server_label, NULL, metrics->requests_coalesced);
+   metrics_text_header(&text, "coroutine_cache_hits_total", "counter", "Cache lookups which found a live entry.");
+   metrics_text_value(&text, "coroutine_cache_hits_total", server_label, NULL, metrics->cache_hits);
+   metrics_text_header(&text, "coroutine_cache_misses_total", "counter", "Cache lookups which found nothing.");
+   metrics_text_value(&text, "coroutine_cache_misses_total", server_label, NULL, metrics->cache_misses);
+   metrics_text_header(&text, "coroutine_cache_evictions_total", "counter", "Cache entries evicted by the byte budget.");
+   metrics_text_value(&text, "coroutine_cache_evictions_total", server_label, NULL, metrics->cache_evictions);
+   metrics_text_header(&text, "coroutine_cache_expirations_total", "counter", "Cache entries dropped after their TTL.");
+   metrics_text_value(&text, "coroutine_cache_expirations_total", server_label, NULL, metrics->cache_expirations);
+   metrics_text_header(&text, "coroutine_cache_bytes", "gauge", "Bytes held by the cache entries.");
+   metrics_text_value(&text, "coroutine_cache_bytes", server_label, NULL, metrics->cache_bytes);
+   metrics_text_header(&text, "coroutine_request_latency_seconds", "histogram", "Time from a request to its response.");
+   for (int type = 1; type < CoroRequestsNum; type++)
+   {
+      if (!metrics->request_latency[type].count)
+      {
+         continue;
+      }
+      snprintf(labels, sizeof(labels), "type=\"%s\"", server_request_type_name((enum CoroRequests)type));
+      metrics_text_histogram(&text, "coroutine_request_latency_seconds", server_label, labels, &(metrics->request_latency[type]));
+   }
+   free(metrics);
+   return text.len;
+}
@@ -0,0 +1,198 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#ifndef C_SERVER_METRICS_H
+#define C_SERVER_METRICS_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "scheduler.h"
+
+#if defined COROUTINE_HAVE_STDATOMIC
+   #include <stdatomic.h>
+#endif
+
+// Counters of a ServerData. A pipelined loop bumps some of them (e.g. allocations) from the loop thread
+// and from the companion thread at once, so additions are atomic; all of the accesses are relaxed and
+// snapshots may be taken from any thread without locks.
+
+#if defined COROUTINE_HAVE_STDATOMIC
+typedef atomic_ullong metric_t;
+
+static inline unsigned long long metric_read(metric_t *metric)
+{
+   return atomic_load_explicit(metric, memory_order_relaxed);
+}
+
+static inline void metric_set(metric_t *metric, unsigned long long value)
+{
+   atomic_store_explicit(metric, value, memory_order_relaxed);
+}
+
+static inline void metric_add(metric_t *metric, unsigned long long value)
+{
+   atomic_fetch_add_explicit(metric, value, memory_order_relaxed);
+}
+
+static inline void metric_max(metric_t *metric, unsigned long long value)
+{
+   unsigned long long current = atomic_load_explicit(metric, memory_order_relaxed);
+   while ((value > current)
+          && !atomic_compare_exchange_weak_explicit(metric, &current, value, memory_order_relaxed, memory_order_relaxed));
+}
+#else
+// Without atomics the counters are only exact while the services run on the loop thread
+typedef volatile unsigned long long metric_t;
+
+static inline unsigned long long metric_read(metric_t *metric)
+{
+   return *metric;
+}
+
+static inline void metric_set(metric_t *metric, unsigned long long value)
+{
+   *metric = value;
+}
+
+static inline void metric_add(metric_t *metric, unsigned long long value)
+{
+   *metric += value;
+}
+
+static inline void metric_max(metric_t *metric, unsigned long long value)
+{
+   if (value > *metric)
+   {
+      *metric = value;
+   }
+}
+#endif
+
+// HDR-style log-linear buckets over cycle_clock ticks: values below 2^SUB_BUCKET_BITS are exact,
+// every further power of two is split into 2^SUB_BUCKET_BITS buckets (12.5% precision).
+// Values of MAX_BITS bits and more go to the last bucket.
+#define LATENCY_HISTOGRAM_SUB_BUCKET_BITS 3
+#define LATENCY_HISTOGRAM_MAX_BITS 40
+#define LATENCY_HISTOGRAM_BUCKETS ((LATENCY_HISTOGRAM_MAX_BITS - LATENCY_HISTOGRAM_SUB_BUCKET_BITS + 1) << LATENCY_HISTOGRAM_SUB_BUCKET_BITS)
+
+struct LatencyHistogram
+{
+   metric_t count;
+   metric_t sum_ticks;
+   metric_t max_ticks;
+   metric_t buckets[LATENCY_HISTOGRAM_BUCKETS];
+};
+
+static inline int latency_histogram_index(unsigned long long ticks)
+{
+   const int sub_bits = LATENCY_HISTOGRAM_SUB_BUCKET_BITS;
+   if (ticks < (1ULL << sub_bits))
+   {
+      return (int)ticks;
+   }
+   if (ticks >= (1ULL << LATENCY_HISTOGRAM_MAX_BITS))
+   {
+      return LATENCY_HISTOGRAM_BUCKETS - 1;
+   }
+#if defined __GNUC__
+   int msb = 63 - __builtin_clzll(ticks);
+#else
+   int msb = 0;
+   while (ticks >> (msb + 1))
+   {
+      msb++;
+   }
+#endif
+   return ((msb - sub_bits + 1) << sub_bits) + (int)((ticks >> (msb - sub_bits)) & ((1ULL << sub_bits) - 1));
+}
+
+static inline void latency_histogram_record(struct LatencyHistogram *histogram, unsigned long long ticks)
+{
+   metric_add(&(histogram->count), 1);
+   metric_add(&(histogram->sum_ticks), ticks);
+   metric_max(&(histogram->max_ticks), ticks);
+   metric_add(&(histogram->buckets[latency_histogram_index(ticks)]), 1);
+}
+
+struct ServerMetricsState
+{
+   metric_t iterations;
+   metric_t last_iteration_ticks;
+   metric_t resumed;
+   metric_t last_resumed;
+   metric_t live_coroutines;
+   metric_t allocations;
+   metric_t scratch_high_water_bytes;
+   metric_t stack_bytes_saved;
+   metric_t stack_bytes_restored;
+   metric_t requests_submitted[CoroRequestsNum];
+   metric_t requests_completed[CoroRequestsNum];
+   metric_t requests_shed[CoroRequestsNum];
+   metric_t coroutines_rejected;
+   metric_t requests_timed_out;
+   metric_t coroutines_cancelled;
+   metric_t requests_coalesced;
+   metric_t cache_hits; // published by the loop once per iteration, see coro_cache.h
+   metric_t cache_misses;
+   metric_t cache_evictions;
+   metric_t cache_expirations;
+   metric_t cache_bytes;
+   struct LatencyHistogram iteration_duration;
+   struct LatencyHistogram request_latency[CoroRequestsNum]; // from the yield of the request to server_complete()
+};
+
+struct LatencyHistogramSnapshot
+{
+   unsigned long long count;
+   unsigned long long sum_ns;
+   unsigned long long max_ns;
+   double ns_per_tick;
+   unsigned long long buckets[LATENCY_HISTOGRAM_BUCKETS]; // bounds: latency_histogram_bucket_upper_ns()
+};
+
+struct ServerMetrics
+{
+   unsigned long long iterations;
+   unsigned long long last_iteration_ns;
+   unsigned long long resumed; // coroutine resumes
+   unsigned long long last_resumed; // during the last iteration
+   unsigned long long live_coroutines;
+   unsigned long long allocations; // request records, coroutine arguments, responses and saved stacks
+   unsigned long long scratch_high_water_bytes; // of the per-iteration request arena so far
+   unsigned long long stack_bytes_saved;
+   unsigned long long stack_bytes_restored;
+   unsigned long long requests_submitted[CoroRequestsNum];
+   unsigned long long requests_completed[CoroRequestsNum];
+   unsigned long long requests_pending[CoroRequestsNum];
+   unsigned long long requests_shed[CoroRequestsNum]; // completed with RequestStatusOverloaded
+   unsigned long long coroutines_rejected; // by server_set_max_live_coroutines()
+   unsigned long long requests_timed_out; // completed with RequestStatusTimedOut
+   unsigned long long coroutines_cancelled; // by server_cancel_coro()
+   unsigned long long requests_coalesced; // joined a request in flight instead of reaching the service
+   unsigned long long cache_hits;
+   unsigned long long cache_misses;
+   unsigned long long cache_evictions; // by the byte budget
+   unsigned long long cache_expirations;
+   unsigned long long cache_bytes;
+   struct LatencyHistogramSnapshot iteration_duration;
+   struct LatencyHistogramSnapshot request_latency[CoroRequestsNum];
+};
+
+#ifdef __cplusplus
+extern "C"{
+#endif 
+struct ServerMetricsState *server_metrics_create(void);
+void server_metrics_free(struct ServerMetricsState *metrics);
+const char *server_request_type_name(enum CoroRequests coro_request_type);
+unsigned long long latency_histogram_bucket_upper_ns(const struct LatencyHistogramSnapshot *snapshot, int bucket);
+unsigned long long latency_histogram_percentile_ns(const struct LatencyHistogramSnapshot *snapshot, double percentile);
+
+bool server_metrics_snapshot(struct ServerData *server_data, struct ServerMetrics *metrics);
+size_t server_metrics_prometheus(struct ServerData *server_data, const char *server_label, char *buffer, size_t buffer_size);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
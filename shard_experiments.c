@@ -0,0 +1,101 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "scheduler.h"
+#include "shards.h"
+
+struct bench_payload {
+   int shards_num;
+   int requests_num;
+   bool cross_shard;
+   atomic_int finished;
+};
+
+static void bench_coroutine(void* coro_payload, struct ServerData *server_data)
+{
+   struct bench_payload *payload = (struct bench_payload *)coro_payload;
+   int home = shard_current_index();
+   int target = payload->cross_shard ? ((home + 1) % payload->shards_num) : home;
+   for (int i = 0; i < payload->requests_num; i++)
+   {
+      int request = i;
+      int response = 0;
+      if (payload->cross_shard)
+      {
+         shard_request(server_data, target, CoroRequestRevertSign, &request, &response);
+      }
+      else
+      {
+         server_request_inplace(server_data, CoroRequestRevertSign, &request, &response);
+      }
+      if (response != -request)
+      {
+         printf("SC >> WRONG RESPONSE %d FOR %d\n", response, request);
+      }
+   }
+   atomic_fetch_add(&payload->finished, 1);
+}
+
+static void run_benchmark(int shards_num, int coro_per_shard, int requests_num, bool cross_shard)
+{
+   struct ShardRuntime *runtime = shards_create(shards_num, true);
+   if (!runtime)
+   {
+      printf("S >> FAILED TO CREATE %d SHARDS\n", shards_num);
+      return;
+   }
+   struct bench_payload payload;
+   payload.shards_num = shards_num;
+   payload.requests_num = requests_num;
+   payload.cross_shard = cross_shard;
+   atomic_init(&payload.finished, 0);
+   int coro_num = shards_num * coro_per_shard;
+   unsigned long long start_ns = server_monotonic_ns();
+   shards_start(runtime);
+   for (int i = 0; i < coro_num; i++)
+   {
+      shards_spawn(runtime, i % shards_num, bench_coroutine, &payload);
+   }
+   struct timespec pause = {0, 100000};
+   while (atomic_load(&payload.finished) < coro_num)
+   {
+      nanosleep(&pause, NULL);
+   }
+   unsigned long long elapsed_ns = server_monotonic_ns() - start_ns;
+   shards_stop(runtime);
+   unsigned long long requests_total = (unsigned long long)coro_num * requests_num;
+   printf("S >> %s SHARDS: %d; REQUESTS: %llu; TIME: %.3f ms; THROUGHPUT: %.0f requests/s; PER SHARD: %.0f requests/s\n",
+          cross_shard ? "CROSS-SHARD" : "LOCAL", shards_num, requests_total, elapsed_ns / 1e6,
+          requests_total * 1e9 / elapsed_ns, requests_total * 1e9 / elapsed_ns / shards_num);
+   for (int i = 0; i < shards_num; i++)
+   {
+      struct ShardStats stats;
+      shards_stats(runtime, i, &stats);
+      printf("S >>    SHARD %d: iterations %llu; calls sent %llu; calls served %llu\n",
+             i, stats.iterations, stats.calls_sent, stats.calls_served);
+   }
+   shards_free(runtime);
+}
+
+int main(int argc, char **argv)
+{
+   int max_shards = (1 < argc) ? atoi(argv[1]) : 4;
+   int coro_per_shard = 256;
+   int requests_num = 1000;
+   printf("S >> SERVER START\n");
+   for (int shards_num = 1; shards_num <= max_shards; shards_num *= 2)
+   {
+      run_benchmark(shards_num, coro_per_shard, requests_num, false);
+      run_benchmark(shards_num, coro_per_shard, requests_num, true);
+   }
+   printf("S >> SERVER END\n");
+   return 0;
+}
@@ -0,0 +1,471 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#if defined COROUTINE_HAVE_SCHED_SETAFFINITY && !defined _GNU_SOURCE
+   #define _GNU_SOURCE
+#endif
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "scheduler.h"
+#include "server_inbox.h"
+#include "shards.h"
+
+#if defined COROUTINE_HAVE_PTHREAD
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#if defined COROUTINE_HAVE_SCHED_SETAFFINITY
+   #include <sched.h>
+#endif
+
+#include "spsc_ring.h"
+#include "aligned_memory.h"
+
+#define SHARDS_RING_CAPACITY 1024
+
+struct Shard
+{
+   struct ShardRuntime *runtime;
+   int index;
+   struct ServerData *server_data;
+   pthread_t thread;
+   bool thread_started;
+   atomic_bool notified;
+   struct ShardCall **overflow_heads; // per target shard; touched by the owner thread only
+   struct ShardCall **overflow_tails;
+   unsigned long long overflow_num;
+   atomic_ullong iterations;
+   atomic_ullong calls_sent;
+   atomic_ullong calls_served;
+   atomic_ullong responses_received;
+};
+
+struct ShardRuntime
+{
+   int shards_num;
+   bool pin_to_cores;
+   struct Shard *shards;
+   // calls[from * shards_num + to] carries requests, replies[from * shards_num + to] carries responses
+   struct SpscRing *calls;
+   struct SpscRing *replies;
+   atomic_bool stop;
+};
+
+static _Thread_local struct Shard *shard_current = NULL;
+
+static void shard_notify(struct Shard *shard)
+{
+   if (!atomic_exchange(&shard->notified, true))
+   {
+      server_wakeup(shard->server_data);
+   }
+}
+
+static void shard_push_overflow(struct Shard *shard, int target, struct ShardCall *call)
+{
+   call->next_overflow = NULL;
+   if (shard->overflow_tails[target])
+   {
+      shard->overflow_tails[target]->next_overflow = call;
+   }
+   else
+   {
+      shard->overflow_heads[target] = call;
+   }
+   shard->overflow_tails[target] = call;
+   shard->overflow_num++;
+}
+
+// Requests and responses to a shard share the overflow list
+static bool shard_send(struct Shard *shard, int target, struct ShardCall *call)
+{
+   struct ShardRuntime *runtime = shard->runtime;
+   size_t ring_index = (size_t)shard->index * runtime->shards_num + target;
+   struct SpscRing *ring = call->answered ? &runtime->replies[ring_index] : &runtime->calls[ring_index];
+   if (!spsc_ring_push(ring, call))
+   {
+      return false;
+   }
+   shard_notify(&runtime->shards[target]);
+   return true;
+}
+
+static void shard_send_or_overflow(struct Shard *shard, int target, struct ShardCall *call)
+{
+   if (shard->overflow_heads[target] || !shard_send(shard, target, call))
+   {
+      shard_push_overflow(shard, target, call);
+   }
+}
+
+static void shard_flush_overflow(struct Shard *shard)
+{
+   if (!shard->overflow_num)
+   {
+      return;
+   }
+   for (int target = 0; target < shard->runtime->shards_num; target++)
+   {
+      struct ShardCall *call;
+      while ((call = shard->overflow_heads[target]))
+      {
+         struct ShardCall *next = call->next_overflow;
+         if (!shard_send(shard, target, call))
+         {
+            break;
+         }
+         shard->overflow_heads[target] = next;
+         if (!next)
+         {
+            shard->overflow_tails[target] = NULL;
+         }
+         shard->overflow_num--;
+      }
+   }
+}
+
+// Runs on the target shard when its service answers a foreign request
+static void shard_call_completed(struct ServerData *server_data, struct RequestData *request_data, void *response)
+{
+   struct ShardCall *call = (struct ShardCall *)request_data->on_complete_arg;
+   // The response was written to the caller's buffer: the call is in-place on both sides
+   call->answered = true;
+   shard_send_or_overflow(shard_current, call->from_shard, call);
+}
+
+static void shard_poll(struct Shard *shard)
+{
+   struct ShardRuntime *runtime = shard->runtime;
+   atomic_store(&shard->notified, false);
+   for (int from = 0; from < runtime->shards_num; from++)
+   {
+      size_t ring_index = (size_t)from * runtime->shards_num + shard->index;
+      struct ShardCall *call;
+      while ((call = (struct ShardCall *)spsc_ring_pop(&runtime->calls[ring_index])))
+      {
+         atomic_fetch_add_explicit(&shard->calls_served, 1, memory_order_relaxed);
+         call->foreign.on_complete = shard_call_completed;
+         call->foreign.on_complete_arg = call;
+         server_dispatch_request(shard->server_data, &call->foreign);
+      }
+      while ((call = (struct ShardCall *)spsc_ring_pop(&runtime->replies[ring_index])))
+      {
+         atomic_fetch_add_explicit(&shard->responses_received, 1, memory_order_relaxed);
+         if (RequestStatusOk == call->foreign.status)
+         {
+            server_complete(shard->server_data, call->handle, NULL);
+         }
+         else
+         {
+            // Refused or timed out by the target shard: the response was never written
+            server_complete_failed(shard->server_data, call->handle, call->foreign.status);
+         }
+      }
+   }
+   shard_flush_overflow(shard);
+}
+
+static void *shard_main(void *arg)
+{
+   struct Shard *shard = (struct Shard *)arg;
+   struct ShardRuntime *runtime = shard->runtime;
+#if defined COROUTINE_HAVE_SCHED_SETAFFINITY
+   if (runtime->pin_to_cores)
+   {
+      long cpus_num = sysconf(_SC_NPROCESSORS_ONLN);
+      if (0 < cpus_num)
+      {
+         cpu_set_t cpu_set;
+         CPU_ZERO(&cpu_set);
+         CPU_SET(shard->index % cpus_num, &cpu_set);
+         sched_setaffinity(0, sizeof(cpu_set), &cpu_set);
+      }
+   }
+#endif
+   shard_current = shard;
+   server_set_keep_alive(shard->server_data, true);
+   while (!atomic_load(&runtime->stop))
+   {
+      shard_poll(shard);
+      server_loop_iteration(shard->server_data);
+      atomic_fetch_add_explicit(&shard->iterations, 1, memory_order_relaxed);
+   }
+   shard_current = NULL;
+   return NULL;
+}
+
+struct ShardRuntime *shards_create(int shards_num, bool pin_to_cores)
+{
+   if (0 >= shards_num)
+   {
+      return NULL;
+   }
+   struct ShardRuntime *runtime = (struct ShardRuntime *)calloc(1, sizeof(*runtime));
+   if (!runtime)
+   {
+      return NULL;
+   }
+   runtime->pin_to_cores = pin_to_cores;
+   atomic_init(&runtime->stop, false);
+   size_t rings_num = (size_t)shards_num * shards_num;
+   runtime->shards = (struct Shard *)calloc(shards_num, sizeof(*runtime->shards));
+   // The ring heads and tails are on cache lines of their own
+   runtime->calls = (struct SpscRing *)aligned_calloc(_Alignof(struct SpscRing), rings_num, sizeof(*runtime->calls));
+   runtime->replies = (struct SpscRing *)aligned_calloc(_Alignof(struct SpscRing), rings_num, sizeof(*runtime->replies));
+   if (!runtime->shards || !runtime->calls || !runtime->replies)
+   {
+      free(runtime->shards);
+      aligned_free(runtime->calls);
+      aligned_free(runtime->replies);
+      free(runtime);
+      return NULL;
+   }
+   runtime->shards_num = shards_num;
+   bool ok = true;
+   for (size_t i = 0; i < rings_num; i++)
+   {
+      ok = ok && spsc_ring_init(&runtime->calls[i], SHARDS_RING_CAPACITY);
+      ok = ok && spsc_ring_init(&runtime->replies[i], SHARDS_RING_CAPACITY);
+   }
+   for (int i = 0; i < shards_num; i++)
+   {
+      struct Shard *shard = &runtime->shards[i];
+      shard->runtime = runtime;
+      shard->index = i;
+      atomic_init(&shard->notified, false);
+      atomic_init(&shard->iterations, 0);
+      atomic_init(&shard->calls_sent, 0);
+      atomic_init(&shard->calls_served, 0);
+      atomic_init(&shard->responses_received, 0);
+      shard->overflow_heads = (struct ShardCall **)calloc(shards_num, sizeof(*shard->overflow_heads));
+      shard->overflow_tails = (struct ShardCall **)calloc(shards_num, sizeof(*shard->overflow_tails));
+      shard->server_data = server_create();
+      ok = ok && shard->overflow_heads && shard->overflow_tails && shard->server_data;
+   }
+   if (!ok)
+   {
+      shards_free(runtime);
+      return NULL;
+   }
+   return runtime;
+}
+
+int shards_num(struct ShardRuntime *runtime)
+{
+   return runtime ? runtime->shards_num : 0;
+}
+
+struct ServerData *shards_server(struct ShardRuntime *runtime, int shard_index)
+{
+   if (!runtime || (0 > shard_index) || (shard_index >= runtime->shards_num))
+   {
+      return NULL;
+   }
+   return runtime->shards[shard_index].server_data;
+}
+
+// Thread safe
+bool shards_spawn(struct ShardRuntime *runtime, int shard_index, coroutine_callable coroutine_body, void *coro_payload)
+{
+   return server_submit_coro_threadsafe(shards_server(runtime, shard_index), coroutine_body, coro_payload);
+}
+
+bool shards_start(struct ShardRuntime *runtime)
+{
+   if (!runtime)
+   {
+      return false;
+   }
+   atomic_store(&runtime->stop, false);
+   bool ok = true;
+   for (int i = 0; i < runtime->shards_num; i++)
+   {
+      struct Shard *shard = &runtime->shards[i];
+      if (!shard->thread_started)
+      {
+         shard->thread_started = (0 == pthread_create(&shard->thread, NULL, shard_main, shard));
+         ok = ok && shard->thread_started;
+      }
+   }
+   return ok;
+}
+
+// Stops every shard after its current iteration. Unfinished coroutines stay in their shards.
+void shards_stop(struct ShardRuntime *runtime)
+{
+   if (!runtime)
+   {
+      return;
+   }
+   atomic_store(&runtime->stop, true);
+   for (int i = 0; i < runtime->shards_num; i++)
+   {
+      server_wakeup(runtime->shards[i].server_data);
+   }
+   for (int i = 0; i < runtime->shards_num; i++)
+   {
+      struct Shard *shard = &runtime->shards[i];
+      if (shard->thread_started)
+      {
+         pthread_join(shard->thread, NULL);
+         shard->thread_started = false;
+      }
+   }
+}
+
+bool shards_stats(struct ShardRuntime *runtime, int shard_index, struct ShardStats *stats)
+{
+   if (!runtime || !stats || (0 > shard_index) || (shard_index >= runtime->shards_num))
+   {
+      return false;
+   }
+   struct Shard *shard = &runtime->shards[shard_index];
+   stats->iterations = atomic_load(&shard->iterations);
+   stats->calls_sent = atomic_load(&shard->calls_sent);
+   stats->calls_served = atomic_load(&shard->calls_served);
+   stats->responses_received = atomic_load(&shard->responses_received);
+   return true;
+}
+
+void shards_free(struct ShardRuntime *runtime)
+{
+   if (!runtime)
+   {
+      return;
+   }
+   shards_stop(runtime);
+   // Foreign requests point into the saved stacks of the other shards' coroutines:
+   // forget all of them while every shard is still alive
+   for (int i = 0; i < runtime->shards_num; i++)
+   {
+      struct ServerData *server_data = runtime->shards[i].server_data;
+      if (!server_data)
+      {
+         continue;
+      }
+      struct RequestData *request_data = server_data->held_requests;
+      while (request_data)
+      {
+         struct RequestData *next = request_data->next_held;
+         if (shard_call_completed == request_data->on_complete)
+         {
+            server_abandon_request(server_data, request_data);
+         }
+         request_data = next;
+      }
+   }
+   for (int i = 0; i < runtime->shards_num; i++)
+   {
+      struct Shard *shard = &runtime->shards[i];
+      server_free(shard->server_data);
+      free(shard->overflow_heads);
+      free(shard->overflow_tails);
+   }
+   size_t rings_num = (size_t)runtime->shards_num * runtime->shards_num;
+   for (size_t i = 0; i < rings_num; i++)
+   {
+      spsc_ring_free(&runtime->calls[i]);
+      spsc_ring_free(&runtime->replies[i]);
+   }
+   aligned_free(runtime->calls);
+   aligned_free(runtime->replies);
+   free(runtime->shards);
+   free(runtime);
+}
+
+int shard_current_index(void)
+{
+   return shard_current ? shard_current->index : -1;
+}
+
+// Called by the CoroRequestCrossShard service of the calling shard
+bool shards_route_request(struct ServerData *server_data, struct RequestData *request_data)
+{
+   struct Shard *shard = shard_current;
+   struct ShardCall *call = (struct ShardCall *)request_data->request;
+   if (!shard || (shard->server_data != server_data) || !call
+       || (0 > call->to_shard) || (call->to_shard >= shard->runtime->shards_num))
+   {
+      return false;
+   }
+   call->foreign.request = coroutine_saved_address(request_data->coro, call->foreign.request);
+   call->foreign.response = coroutine_saved_address(request_data->coro, call->foreign.response);
+   call->from_shard = shard->index;
+   call->handle = server_hold_request(server_data, request_data);
+   atomic_fetch_add_explicit(&shard->calls_sent, 1, memory_order_relaxed);
+   shard_send_or_overflow(shard, call->to_shard, call);
+   return true;
+}
+
+#else
+
+struct ShardRuntime *shards_create(int shards_num, bool pin_to_cores)
+{
+   return NULL;
+}
+
+int shards_num(struct ShardRuntime *runtime)
+{
+   return 0;
+}
+
+struct ServerData *shards_server(struct ShardRuntime *runtime, int shard_index)
+{
+   return NULL;
+}
+
+bool shards_spawn(struct ShardRuntime *runtime, int shard_index, coroutine_callable coroutine_body, void *coro_payload)
+{
+   return false;
+}
+
+bool shards_start(struct ShardRuntime *runtime)
+{
+   return false;
+}
+
+void shards_stop(struct ShardRuntime *runtime)
+{
+}
+
+bool shards_stats(struct ShardRuntime *runtime, int shard_index, struct ShardStats *stats)
+{
+   return false;
+}
+
+void shards_free(struct ShardRuntime *runtime)
+{
+}
+
+int shard_current_index(void)
+{
+   return -1;
+}
+
+bool shards_route_request(struct ServerData *server_data, struct RequestData *request_data)
+{
+   return false;
+}
+
+#endif
+
+// Sends a request to a service of another shard (or of this one) and waits for the response.
+// Like server_request_inplace() the request and the response may live in the coroutine's frame.
+bool shard_request(struct ServerData *server_data, int target_shard,
+                   enum CoroRequests coro_request_type, void *request, void *response)
+{
+   struct ShardCall call;
+   server_request_data_init(&call.foreign, coro_request_type, request, response, true);
+   call.handle = NULL;
+   call.from_shard = -1;
+   call.to_shard = target_shard;
+   call.answered = false;
+   call.next_overflow = NULL;
+   return server_request_inplace(server_data, CoroRequestCrossShard, &call, NULL);
+}
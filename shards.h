@@ -0,0 +1,57 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#ifndef C_SHARDS_H
+#define C_SHARDS_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "scheduler.h"
+
+// Share-nothing runtime: N independent ServerData instances, each on its own thread pinned to a core,
+// with its own shared stack and tables. A coroutine reaches a service of another shard with
+// shard_request(); requests and responses travel through lock-free SPSC rings between every pair of shards.
+
+struct ShardRuntime;
+
+struct ShardCall
+{
+   struct RequestData foreign; // the request as the target shard sees it
+   request_handle_t handle; // the request of the calling coroutine on its home shard
+   int from_shard;
+   int to_shard;
+   bool answered; // travels back to from_shard
+   struct ShardCall *next_overflow; // calls which did not fit into a full ring
+};
+
+struct ShardStats
+{
+   unsigned long long iterations;
+   unsigned long long calls_sent;
+   unsigned long long calls_served;
+   unsigned long long responses_received;
+};
+
+#ifdef __cplusplus
+extern "C"{
+#endif 
+struct ShardRuntime *shards_create(int shards_num, bool pin_to_cores);
+int shards_num(struct ShardRuntime *runtime);
+struct ServerData *shards_server(struct ShardRuntime *runtime, int shard_index);
+bool shards_spawn(struct ShardRuntime *runtime, int shard_index, coroutine_callable coroutine_body, void *coro_payload);
+bool shards_start(struct ShardRuntime *runtime);
+void shards_stop(struct ShardRuntime *runtime);
+bool shards_stats(struct ShardRuntime *runtime, int shard_index, struct ShardStats *stats);
+void shards_free(struct ShardRuntime *runtime);
+
+int shard_current_index(void);
+bool shard_request(struct ServerData *server_data, int target_shard,
+                   enum CoroRequests coro_request_type, void *request, void *response);
+bool shards_route_request(struct ServerData *server_data, struct RequestData *request_data);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
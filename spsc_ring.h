@@ -0,0 +1,80 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#ifndef C_SPSC_RING_H
+#define C_SPSC_RING_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#define SPSC_RING_CACHE_LINE 64
+
+// Bounded lock-free ring of pointers with a single producer and a single consumer
+struct SpscRing
+{
+   _Alignas(SPSC_RING_CACHE_LINE) atomic_size_t head; // consumer position
+   _Alignas(SPSC_RING_CACHE_LINE) atomic_size_t tail; // producer position
+   size_t mask;
+   void **slots;
+};
+
+static inline bool spsc_ring_init(struct SpscRing *ring, size_t capacity)
+{
+   size_t real_capacity = 1;
+   while (real_capacity < capacity)
+   {
+      real_capacity <<= 1;
+   }
+   ring->slots = (void **)malloc(sizeof(*ring->slots) * real_capacity);
+   if (!ring->slots)
+   {
+      return false;
+   }
+   ring->mask = real_capacity - 1;
+   atomic_init(&ring->head, 0);
+   atomic_init(&ring->tail, 0);
+   return true;
+}
+
+static inline void spsc_ring_free(struct SpscRing *ring)
+{
+   free(ring->slots);
+   ring->slots = NULL;
+}
+
+static inline bool spsc_ring_push(struct SpscRing *ring, void *item)
+{
+   size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+   size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+   if ((tail - head) > ring->mask)
+   {
+      return false;
+   }
+   ring->slots[tail & ring->mask] = item;
+   // seq_cst lets a producer check a "consumer is sleeping" flag right after the push
+   atomic_store_explicit(&ring->tail, tail + 1, memory_order_seq_cst);
+   return true;
+}
+
+static inline void *spsc_ring_pop(struct SpscRing *ring)
+{
+   size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+   size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+   if (head == tail)
+   {
+      return NULL;
+   }
+   void *item = ring->slots[head & ring->mask];
+   atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+   return item;
+}
+
+static inline size_t spsc_ring_depth(struct SpscRing *ring)
+{
+   return atomic_load_explicit(&ring->tail, memory_order_acquire) - atomic_load_explicit(&ring->head, memory_order_acquire);
+}
+
+#endif
@@ -0,0 +1,321 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "scheduler.h"
+#include "coro_sync.h"
+
+#define WAITERS_NUM 5
+#define BENCH_LOCKS_PER_CORO 100
+
+// Primitives must not live on the shared coroutine stack
+struct sync_payload {
+   struct CoroMutex mutex;
+   struct CoroSemaphore semaphore;
+   struct CoroCondition condition;
+   struct CoroWaitGroup waitgroup;
+   int next_index;
+   int order[WAITERS_NUM]; // indices of the waiters in the order they got through
+   int order_num;
+   bool handed_over; // the mutex was still locked right after the unlock
+   int woken;
+   bool ready;
+   int rejected;
+   unsigned long long counter;
+};
+
+static int failed_checks = 0;
+
+static void check(bool condition, const char *what)
+{
+   if (!condition)
+   {
+      printf("Y >> CHECK FAILED: %s\n", what);
+      failed_checks++;
+   }
+}
+
+static void yield(struct ServerData *server_data)
+{
+   server_request_inplace(server_data, CoroRequestYield, NULL, NULL);
+}
+
+// The park service may run on the companion thread of a pipelined loop
+static int queued_num(struct ServerData *server_data, struct CoroWaitQueue *queue)
+{
+   server_services_enter(server_data);
+   int waiters_num = queue->waiters_num;
+   server_services_leave(server_data);
+   return waiters_num;
+}
+
+static void wait_for_queued(struct ServerData *server_data, struct CoroWaitQueue *queue, int waiters_num)
+{
+   while (queued_num(server_data, queue) < waiters_num)
+   {
+      yield(server_data);
+   }
+}
+
+static struct ServerData *create_server(bool pipelined)
+{
+   struct ServerData *server_data = server_create();
+   if (pipelined)
+   {
+      server_pipeline_start(server_data);
+   }
+   return server_data;
+}
+
+static void mutex_waiter(void* coro_payload, struct ServerData *server_data)
+{
+   struct sync_payload *payload = (struct sync_payload *)coro_payload;
+   int index = payload->next_index++;
+   coro_mutex_lock(server_data, &(payload->mutex));
+   payload->order[payload->order_num++] = index;
+   yield(server_data);
+   coro_mutex_unlock(server_data, &(payload->mutex));
+}
+
+static void mutex_holder(void* coro_payload, struct ServerData *server_data)
+{
+   struct sync_payload *payload = (struct sync_payload *)coro_payload;
+   coro_mutex_lock(server_data, &(payload->mutex));
+   for (int i = 0; i < WAITERS_NUM; i++)
+   {
+      server_register_coro(server_data, mutex_waiter, payload);
+   }
+   wait_for_queued(server_data, &(payload->mutex.waiters), WAITERS_NUM);
+   coro_mutex_unlock(server_data, &(payload->mutex));
+   // The first waiter owns the mutex now, although it has not run yet
+   payload->handed_over = !coro_mutex_try_lock(server_data, &(payload->mutex));
+}
+
+// unlock() hands the mutex over to the first waiter instead of releasing it, in arrival order
+static void check_mutex(bool pipelined)
+{
+   struct ServerData *server_data = create_server(pipelined);
+   struct sync_payload payload = {0};
+   coro_mutex_init(&(payload.mutex));
+   server_register_coro(server_data, mutex_holder, &payload);
+   while (server_loop_iteration(server_data));
+   check(payload.handed_over, "an unlock with waiters hands the mutex over");
+   bool in_order = (WAITERS_NUM == payload.order_num);
+   for (int i = 0; i < payload.order_num; i++)
+   {
+      in_order = in_order && (i == payload.order[i]);
+   }
+   check(in_order, "mutex waiters get the mutex in arrival order");
+   check(!payload.mutex.locked && !payload.mutex.waiters.waiters_num, "the last unlock releases the mutex");
+   server_free(server_data);
+}
+
+static void semaphore_waiter(void* coro_payload, struct ServerData *server_data)
+{
+   struct sync_payload *payload = (struct sync_payload *)coro_payload;
+   int index = payload->next_index++;
+   if (coro_semaphore_acquire(server_data, &(payload->semaphore)))
+   {
+      payload->order[payload->order_num++] = index;
+   }
+}
+
+static void semaphore_releaser(void* coro_payload, struct ServerData *server_data)
+{
+   struct sync_payload *payload = (struct sync_payload *)coro_payload;
+   for (int i = 0; i < WAITERS_NUM; i++)
+   {
+      server_register_coro(server_data, semaphore_waiter, payload);
+   }
+   wait_for_queued(server_data, &(payload->semaphore.waiters), WAITERS_NUM);
+   coro_semaphore_release(server_data, &(payload->semaphore), 2);
+   check(0 == payload->semaphore.permits && WAITERS_NUM - 2 == queued_num(server_data, &(payload->semaphore.waiters)),
+         "released permits go to the waiters, not to the semaphore");
+   while (2 > payload->order_num)
+   {
+      yield(server_data);
+   }
+   coro_semaphore_release(server_data, &(payload->semaphore), WAITERS_NUM);
+   check(2 == payload->semaphore.permits, "permits left over by the waiters stay with the semaphore");
+}
+
+static void check_semaphore(bool pipelined)
+{
+   struct ServerData *server_data = create_server(pipelined);
+   struct sync_payload payload = {0};
+   coro_semaphore_init(&(payload.semaphore), 0);
+   server_register_coro(server_data, semaphore_releaser, &payload);
+   while (server_loop_iteration(server_data));
+   bool in_order = (WAITERS_NUM == payload.order_num);
+   for (int i = 0; i < payload.order_num; i++)
+   {
+      in_order = in_order && (i == payload.order[i]);
+   }
+   check(in_order, "semaphore permits go to the waiters in arrival order");
+   server_free(server_data);
+}
+
+static void condition_waiter(void* coro_payload, struct ServerData *server_data)
+{
+   struct sync_payload *payload = (struct sync_payload *)coro_payload;
+   coro_mutex_lock(server_data, &(payload->mutex));
+   while (!payload->ready)
+   {
+      coro_condition_wait(server_data, &(payload->condition), &(payload->mutex));
+      payload->woken++;
+   }
+   coro_mutex_unlock(server_data, &(payload->mutex));
+}
+
+// Runs right after condition_waiter in the same iteration: the waiter has taken its ticket but its park
+// request has not reached the service yet
+static void early_signaller(void* coro_payload, struct ServerData *server_data)
+{
+   struct sync_payload *payload = (struct sync_payload *)coro_payload;
+   coro_mutex_lock(server_data, &(payload->mutex));
+   payload->ready = true;
+   coro_condition_signal(server_data, &(payload->condition));
+   coro_mutex_unlock(server_data, &(payload->mutex));
+}
+
+// A signal sent while the waiter is on its way to the park service is not lost
+static void check_condition_in_flight(bool pipelined)
+{
+   struct ServerData *server_data = create_server(pipelined);
+   struct sync_payload payload = {0};
+   coro_mutex_init(&(payload.mutex));
+   coro_condition_init(&(payload.condition));
+   server_register_coro(server_data, condition_waiter, &payload);
+   server_register_coro(server_data, early_signaller, &payload);
+   while (server_loop_iteration(server_data));
+   check(1 == payload.woken && 1 == payload.condition.signals, "a signal in flight wakes the waiter through its ticket");
+   server_free(server_data);
+}
+
+static void condition_signaller(void* coro_payload, struct ServerData *server_data)
+{
+   struct sync_payload *payload = (struct sync_payload *)coro_payload;
+   for (int i = 0; i < WAITERS_NUM; i++)
+   {
+      server_register_coro(server_data, condition_waiter, payload);
+   }
+   wait_for_queued(server_data, &(payload->condition.waiters), WAITERS_NUM);
+   coro_condition_signal(server_data, &(payload->condition));
+   for (int i = 0; i < 3; i++)
+   {
+      yield(server_data);
+   }
+   // The woken waiter finds the predicate false and queues up again
+   check(1 == payload->woken, "a signal wakes one waiter");
+   wait_for_queued(server_data, &(payload->condition.waiters), WAITERS_NUM);
+   coro_mutex_lock(server_data, &(payload->mutex));
+   payload->ready = true;
+   coro_condition_broadcast(server_data, &(payload->condition));
+   coro_mutex_unlock(server_data, &(payload->mutex));
+}
+
+static void check_condition_wakeups(bool pipelined)
+{
+   struct ServerData *server_data = create_server(pipelined);
+   struct sync_payload payload = {0};
+   coro_mutex_init(&(payload.mutex));
+   coro_condition_init(&(payload.condition));
+   server_register_coro(server_data, condition_signaller, &payload);
+   while (server_loop_iteration(server_data));
+   check(1 + WAITERS_NUM == payload.woken, "a broadcast wakes all of the waiters");
+   check(0 == payload.condition.waiters.waiters_num && !payload.mutex.locked, "nobody is left on the condition");
+   server_free(server_data);
+}
+
+static void waitgroup_worker(void* coro_payload, struct ServerData *server_data)
+{
+   struct sync_payload *payload = (struct sync_payload *)coro_payload;
+   double seconds = 0.001;
+   server_request_inplace(server_data, CoroRequestSleep, &seconds, NULL);
+   payload->counter++;
+   coro_waitgroup_done(server_data, &(payload->waitgroup));
+}
+
+static void waitgroup_waiter(void* coro_payload, struct ServerData *server_data)
+{
+   struct sync_payload *payload = (struct sync_payload *)coro_payload;
+   check(coro_waitgroup_add(server_data, &(payload->waitgroup), WAITERS_NUM), "a wait group takes a positive count");
+   check(!coro_waitgroup_add(server_data, &(payload->waitgroup), -(WAITERS_NUM + 1)) &&
+         WAITERS_NUM == payload->waitgroup.count, "a wait group refuses to go below zero and keeps its count");
+   for (int i = 0; i < WAITERS_NUM; i++)
+   {
+      server_register_coro(server_data, waitgroup_worker, payload);
+   }
+   coro_waitgroup_wait(server_data, &(payload->waitgroup));
+   payload->woken++;
+   check(WAITERS_NUM == payload->counter, "a wait group waiter wakes after the last done()");
+   payload->rejected += coro_waitgroup_done(server_data, &(payload->waitgroup)) ? 0 : 1;
+   check(coro_waitgroup_wait(server_data, &(payload->waitgroup)), "waiting on a zero count returns right away");
+}
+
+static void check_waitgroup(bool pipelined)
+{
+   struct ServerData *server_data = create_server(pipelined);
+   struct sync_payload payload = {0};
+   coro_waitgroup_init(&(payload.waitgroup));
+   server_register_coro(server_data, waitgroup_waiter, &payload);
+   while (server_loop_iteration(server_data));
+   check(1 == payload.woken, "the wait group waiter finished");
+   check(1 == payload.rejected && 0 == payload.waitgroup.count, "an extra done() is refused");
+   server_free(server_data);
+}
+
+static void bench_coroutine(void* coro_payload, struct ServerData *server_data)
+{
+   struct sync_payload *payload = (struct sync_payload *)coro_payload;
+   for (int i = 0; i < BENCH_LOCKS_PER_CORO; i++)
+   {
+      coro_mutex_lock(server_data, &(payload->mutex));
+      unsigned long long counter = payload->counter;
+      // Every other coroutine queues up behind the owner meanwhile
+      yield(server_data);
+      payload->counter = counter + 1;
+      coro_mutex_unlock(server_data, &(payload->mutex));
+   }
+}
+
+static void run_benchmark(int coro_num, bool pipelined)
+{
+   struct ServerData *server_data = create_server(pipelined);
+   struct sync_payload payload = {0};
+   coro_mutex_init(&(payload.mutex));
+   unsigned long long start_ns = server_monotonic_ns();
+   for (int i = 0; i < coro_num; i++)
+   {
+      server_register_coro(server_data, bench_coroutine, &payload);
+   }
+   while (server_loop_iteration(server_data));
+   unsigned long long elapsed_ns = server_monotonic_ns() - start_ns;
+   unsigned long long locks_num = (unsigned long long)coro_num * BENCH_LOCKS_PER_CORO;
+   check(locks_num == payload.counter, "the contended mutex keeps the counter exact");
+   printf("Y >> %s: CONTENDED LOCKS: %d x %d; TIME: %.3f ms; PER LOCK: %.0f ns\n", pipelined ? "PIPELINED" : "SEQUENTIAL",
+          coro_num, BENCH_LOCKS_PER_CORO, elapsed_ns / 1e6, (double)elapsed_ns / locks_num);
+   server_free(server_data);
+}
+
+int main(int argc, char **argv)
+{
+   int coro_num = (1 < argc) ? atoi(argv[1]) : 1000;
+   printf("Y >> START\n");
+   for (int pipelined = 0; pipelined < 2; pipelined++)
+   {
+      check_mutex(pipelined);
+      check_semaphore(pipelined);
+      check_condition_in_flight(pipelined);
+      check_condition_wakeups(pipelined);
+      check_waitgroup(pipelined);
+      run_benchmark(coro_num, pipelined);
+   }
+   printf("Y >> END; FAILED CHECKS: %d\n", failed_checks);
+   return failed_checks ? 1 : 0;
+}
@@ -0,0 +1,129 @@
+// Copyright © 2018-2023 ButenkoMS. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "scheduler.h"
+
+struct promoted_payload {
+   int entered; // times the body was called, as a task and as a coroutine
+   int side_effects; // must stay at one per body whatever way it ran
+   bool started; // progress recorded before the promotion
+   int after_wait;
+   bool request_failed_in_task;
+};
+
+static volatile unsigned long long sink = 0;
+
+static void trivial_body(void* coro_payload, struct ServerData *server_data)
+{
+   sink++;
+}
+
+// Checks whether it has to wait before its first side effect
+static void promote_first_body(void* coro_payload, struct ServerData *server_data)
+{
+   struct promoted_payload *payload = (struct promoted_payload *)coro_payload;
+   payload->entered++;
+   if (server_in_task(server_data))
+   {
+      server_promote_task(server_data);
+      return;
+   }
+   payload->side_effects++;
+   double seconds = 0.001;
+   server_request_inplace(server_data, CoroRequestSleep, &seconds, NULL);
+   payload->after_wait++;
+}
+
+// Has a side effect before it finds out that it has to wait, so it records its progress in the payload
+static void promote_later_body(void* coro_payload, struct ServerData *server_data)
+{
+   struct promoted_payload *payload = (struct promoted_payload *)coro_payload;
+   payload->entered++;
+   if (!payload->started)
+   {
+      payload->started = true;
+      payload->side_effects++;
+   }
+   if (server_in_task(server_data))
+   {
+      double seconds = 0.001;
+      payload->request_failed_in_task = !server_request_inplace(server_data, CoroRequestSleep, &seconds, NULL);
+      server_promote_task(server_data);
+      return;
+   }
+   double seconds = 0.001;
+   server_request_inplace(server_data, CoroRequestSleep, &seconds, NULL);
+   payload->after_wait++;
+}
+
+static int failed_checks = 0;
+
+static void check(bool condition, const char *what)
+{
+   if (!condition)
+   {
+      printf("T >> CHECK FAILED: %s\n", what);
+      failed_checks++;
+   }
+}
+
+static void check_promotion(bool pipelined)
+{
+   struct ServerData *server_data = server_create();
+   if (pipelined)
+   {
+      server_pipeline_start(server_data);
+   }
+   struct promoted_payload first = {0, 0, false, 0, false};
+   struct promoted_payload later = {0, 0, false, 0, false};
+   server_register_task(server_data, promote_first_body, &first);
+   server_register_task(server_data, promote_later_body, &later);
+   while (server_loop_iteration(server_data));
+   check(2 == first.entered && 1 == first.side_effects && 1 == first.after_wait,
+         "a task promoted before its first side effect has it once");
+   check(2 == later.entered && 1 == later.side_effects && 1 == later.after_wait,
+         "a task promoted after a side effect recorded in its payload has it once");
+   check(later.request_failed_in_task, "server_request_inplace() fails inside of a task");
+   check(2 == server_data->tasks_run_num && 2 == server_data->tasks_promoted_num, "both tasks are counted as promoted");
+   server_free(server_data);
+}
+
+static void run_benchmark(int bodies_num, bool as_tasks)
+{
+   struct ServerData *server_data = server_create();
+   unsigned long long start_ns = server_monotonic_ns();
+   for (int i = 0; i < bodies_num; i++)
+   {
+      if (as_tasks)
+      {
+         server_register_task(server_data, trivial_body, NULL);
+      }
+      else
+      {
+         server_register_coro(server_data, trivial_body, NULL);
+      }
+   }
+   while (server_loop_iteration(server_data));
+   unsigned long long elapsed_ns = server_monotonic_ns() - start_ns;
+   printf("T >> %s: %d; TIME: %.3f ms; PER BODY: %.1f ns\n", as_tasks ? "TASKS" : "COROUTINES", bodies_num,
+          elapsed_ns / 1e6, (double)elapsed_ns / bodies_num);
+   server_free(server_data);
+}
+
+int main(int argc, char **argv)
+{
+   int bodies_num = (1 < argc) ? atoi(argv[1]) : 100000;
+   printf("T >> START\n");
+   check_promotion(false);
+   check_promotion(true);
+   run_benchmark(bodies_num, true);
+   run_benchmark(bodies_num, false);
+   printf("T >> END; FAILED CHECKS: %d\n", failed_checks);
+   return failed_checks ? 1 : 0;
+}